@@ -17,6 +17,7 @@ struct NamespaceDefinition {
 
 enum class FlowType {
     SYNTHETIC,
+    TRACE,
 };
 
 enum class RequestSizeDistribution {
@@ -29,10 +30,22 @@ enum class AddressDistribution {
     ZIPFIAN,
 };
 
+enum class TraceFormat {
+    BLKPARSE,
+    BINARY,
+};
+
+enum class ReplayMode {
+    TIMESTAMP,
+    AFAP,
+    SCALED,
+};
+
 struct FlowDefinition {
     std::string name;
     FlowType type;
     unsigned int nsid;
+    std::string trace_file;
 
     union {
         struct {
@@ -50,6 +63,14 @@ struct FlowDefinition {
 
             unsigned int average_enqueued_requests;
         } synthetic;
+
+        struct {
+            TraceFormat format;
+            ReplayMode replay_mode;
+            double rate_scale;
+            size_t request_count;
+            unsigned int max_inflight_requests;
+        } trace;
     };
 };
 
@@ -7,15 +7,18 @@
 #include "libunvme/nvme_driver.h"
 
 #include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <string>
 #include <thread>
 
 class IOThread {
 public:
     struct Stats {
         int thread_id;
+        std::string name;
 
         size_t request_count;
         size_t read_request_count;
@@ -31,9 +34,12 @@ public:
 
         Histogram device_response_time_hist;
         Histogram e2e_latency_hist;
+        Histogram read_latency_hist;
+        Histogram write_latency_hist;
 
         Stats()
-            : device_response_time_hist(10000000), e2e_latency_hist(10000000)
+            : device_response_time_hist(10000000), e2e_latency_hist(10000000),
+              read_latency_hist(10000000), write_latency_hist(10000000)
         {}
     };
 
@@ -61,6 +67,10 @@ protected:
 
     void wait_for_completed_requests();
 
+    /* Returns false if no request completed before the deadline. */
+    bool wait_for_completed_requests(
+        std::chrono::steady_clock::time_point deadline);
+
     virtual void on_request_completed() = 0;
 
     size_t request_count;
@@ -107,6 +117,8 @@ private:
     void notify_request_completion(IORequest* req);
 
     void process_completed_request(IORequest* req);
+
+    void drain_completed_requests(std::unique_lock<std::mutex>& lock);
 };
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef _IO_THREAD_TRACE_H_
+#define _IO_THREAD_TRACE_H_
+
+#include "io_thread.h"
+#include "trace_reader.h"
+
+#include <chrono>
+
+class IOThreadTrace : public IOThread {
+public:
+    /* request_count = 0 replays the whole trace. max_inflight_requests = 0
+     * limits as-fast-as-possible replay to the queue depth and leaves timed
+     * replay unbounded so that the arrival pattern is preserved. */
+    IOThreadTrace(NVMeDriver* driver, MemorySpace* memory_space, int thread_id,
+                  unsigned int nsid, unsigned int queue_depth,
+                  unsigned int sector_size, size_t max_lsa,
+                  std::unique_ptr<TraceReader> reader, ReplayMode replay_mode,
+                  double rate_scale, size_t request_count,
+                  unsigned int max_inflight_requests);
+
+private:
+    static const unsigned int TRACE_SECTOR_SIZE = 512;
+    static const unsigned int DEVICE_BLOCK_SIZE = 4096;
+
+    unsigned int nsid;
+    unsigned int sector_size;
+    size_t max_lsa;
+    std::unique_ptr<TraceReader> reader;
+
+    ReplayMode replay_mode;
+    double rate_scale;
+    unsigned int max_inflight_requests;
+
+    TraceRecord next_record;
+    bool has_next_record;
+    uint64_t first_timestamp_ns;
+    std::chrono::steady_clock::time_point start_time;
+
+    bool fetch_record();
+
+    std::chrono::steady_clock::time_point get_due_time(const TraceRecord& rec);
+
+    bool map_request(const TraceRecord& rec, loff_t& pos, size_t& size);
+
+    virtual void run_impl();
+
+    virtual void on_request_completed();
+};
+
+#endif
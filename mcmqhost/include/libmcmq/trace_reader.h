@@ -0,0 +1,73 @@
+#ifndef _TRACE_READER_H_
+#define _TRACE_READER_H_
+
+#include "config_reader.h"
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+struct TraceRecord {
+    uint64_t timestamp_ns;
+    bool do_write;
+    uint64_t sector; /* In 512-byte sectors. */
+    uint32_t nr_sectors;
+};
+
+/* Binary trace layout (little-endian): a BinaryTraceHeader followed by
+ * BinaryTraceRecord entries until EOF. Timestamps are relative to the start
+ * of the trace. */
+struct BinaryTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct BinaryTraceRecord {
+    uint64_t timestamp_ns;
+    uint64_t sector;
+    uint32_t nr_sectors;
+    uint32_t flags;
+};
+
+#define BINARY_TRACE_MAGIC   "MCMQTRCE"
+#define BINARY_TRACE_VERSION 1
+
+#define BINARY_TRACE_WRITE 0x1
+
+class TraceReader {
+public:
+    virtual ~TraceReader() {}
+
+    static std::unique_ptr<TraceReader> open(const std::string& filename,
+                                             TraceFormat format);
+
+    /* Read the next I/O record. Returns false at the end of the trace. */
+    virtual bool next(TraceRecord& rec) = 0;
+
+protected:
+    std::ifstream is;
+};
+
+class BlkparseTraceReader : public TraceReader {
+public:
+    explicit BlkparseTraceReader(const std::string& filename);
+
+    virtual bool next(TraceRecord& rec);
+
+private:
+    std::string line;
+    char replay_action;
+
+    bool parse_line(TraceRecord& rec);
+};
+
+class BinaryTraceReader : public TraceReader {
+public:
+    explicit BinaryTraceReader(const std::string& filename);
+
+    virtual bool next(TraceRecord& rec);
+};
+
+#endif
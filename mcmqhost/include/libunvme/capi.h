@@ -6,10 +6,14 @@
 typedef uint64_t storpu_handle_t;
 #define INVALID_STORPU_HANDLE ((storpu_handle_t)-1)
 
+struct storpu_scan_pipeline;
+
 struct storpu_tablescan {
     storpu_handle_t handle;
     unsigned long buf;
     size_t buf_size;
+
+    struct storpu_scan_pipeline* pipeline;
 };
 
 struct storpu_scankey;
@@ -33,11 +37,22 @@ extern "C"
     storpu_handle_t storpu_open_relation(int relid);
     void storpu_close_relation(storpu_handle_t rel);
 
-    struct storpu_tablescan* storpu_table_beginscan(storpu_handle_t rel,
-                                                    struct storpu_scankey* skey,
-                                                    int num_skeys);
+    /* If num_proj_attrs > 0, getnext returns compact tuples with only the
+     * projected attributes (see storpu_table_beginscan_arg). */
+    struct storpu_tablescan*
+    storpu_table_beginscan(storpu_handle_t rel, struct storpu_scankey* skey,
+                           int num_skeys, const uint16_t* proj_attrs,
+                           int num_proj_attrs);
     size_t storpu_table_getnext(struct storpu_tablescan* scan, char* buf,
                                 size_t buf_size);
+    /* Pipelined getnext: keeps several getnext invocations in flight so that
+     * the device fills the next buffers while the caller consumes the
+     * current one. Returns the number of bytes at *bufp, which stays valid
+     * until the next call, or 0 at the end of the scan. Buffer size and
+     * pipeline depth are adjusted to the observed output rate of the scan.
+     * Do not mix with storpu_table_getnext() on the same scan. */
+    size_t storpu_table_getnext_pipelined(struct storpu_tablescan* scan,
+                                          const char** bufp);
     void storpu_table_endscan(struct storpu_tablescan* scan);
 
 #ifdef __cplusplus
@@ -3,8 +3,10 @@
 
 #include <array>
 #include <filesystem>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 class MemorySpace {
 public:
@@ -16,6 +18,11 @@ public:
 
     virtual ~MemorySpace();
 
+    /* Allocations of 4KB to 256KB are served from per-thread magazines of
+     * power-of-two size classes and only fall back to the shared hole list
+     * when a magazine runs empty or overflows. Spaces without magazines always
+     * use the hole list. free() must be called with the same length that was
+     * passed to allocate(). */
     Address allocate(size_t len, size_t align = 1);
     Address allocate_pages(size_t len);
     void free(Address addr, size_t len);
@@ -36,11 +43,41 @@ protected:
     size_t map_size;
     Address iova_base;
 
-    MemorySpace(Address iova_base = 0);
+    MemorySpace(Address iova_base = 0, bool use_magazines = true);
+
+    /* Bypass the per-thread caches. Used to seed the hole list. */
+    Address allocate_hole(size_t len, size_t align);
+    void free_hole(Address addr, size_t len);
 
 private:
     static constexpr size_t NR_HOLES = 512;
 
+    static constexpr unsigned int CACHE_MIN_SHIFT = 12;
+    static constexpr unsigned int CACHE_MAX_SHIFT = 18;
+    static constexpr unsigned int NR_SIZE_CLASSES =
+        CACHE_MAX_SHIFT - CACHE_MIN_SHIFT + 1;
+    static constexpr size_t MAGAZINE_BYTES = 64 << 10;
+    static constexpr unsigned int MAGAZINE_MAX_ROUNDS =
+        MAGAZINE_BYTES >> CACHE_MIN_SHIFT;
+
+    struct Magazine {
+        unsigned int count;
+        Address rounds[MAGAZINE_MAX_ROUNDS];
+    };
+
+    struct ThreadCache {
+        MemorySpace* space;
+        uint64_t space_id;
+        unsigned int generation;
+        Magazine mags[NR_SIZE_CLASSES];
+    };
+
+    struct ThreadCacheList {
+        std::vector<std::unique_ptr<ThreadCache>> caches;
+
+        ~ThreadCacheList();
+    };
+
     struct hole {
         struct hole* h_next;
         Address h_base;
@@ -53,8 +90,21 @@ private:
     struct hole* hole_head;
     struct hole* free_slots;
 
+    uint64_t space_id;
+    bool use_magazines;
+
     void delete_slot(struct hole* prev_ptr, struct hole* hp);
     void merge_hole(struct hole* hp);
+
+    bool allocate_locked(size_t len, size_t align, Address& addr);
+    void free_locked(Address addr, size_t len);
+
+    static int size_class(size_t len);
+    static unsigned int magazine_capacity(unsigned int cls);
+
+    ThreadCache* get_thread_cache();
+    void refill_magazine(Magazine& mag, unsigned int cls);
+    void drain_magazine(Magazine& mag, unsigned int cls, unsigned int count);
 };
 
 class SharedMemorySpace : public MemorySpace {
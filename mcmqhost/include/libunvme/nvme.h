@@ -284,6 +284,7 @@ enum nvme_opcode {
     nvme_cmd_resv_acquire = 0x11,
     nvme_cmd_resv_release = 0x15,
     nvme_cmd_storpu_invoke = 0xa0,
+    nvme_cmd_storpu_invoke_batch = 0xa1,
 };
 
 struct nvme_common_command {
@@ -333,6 +334,34 @@ struct nvme_storpu_invoke_command {
     __le64 rsvd15;
 };
 
+/* The descriptors (struct storpu_invoke_desc) are staged in the scratchpad at
+ * prp1. */
+struct nvme_storpu_invoke_batch_command {
+    __u8 opcode;
+    __u8 flags;
+    __u16 command_id;
+    __le32 nsid;
+    __u64 rsvd2;
+    __le64 metadata;
+    union nvme_data_ptr dptr;
+    __le32 cid;
+    __le32 nr_descs;
+    __le32 rsvd12[4];
+};
+
+/* Must match struct storpu_invoke_desc on the device. */
+#define STORPU_INVOKE_ARG_RESULT   0x1
+#define STORPU_INVOKE_STOP_IF_ZERO 0x2
+#define STORPU_INVOKE_BATCH_MAX    256
+
+struct storpu_invoke_desc {
+    __le64 entry;
+    __le64 arg;
+    __le32 flags;
+    __le32 dep;
+    __le64 result;
+};
+
 /* Admin commands */
 
 enum nvme_admin_opcode {
@@ -365,6 +394,8 @@ enum nvme_admin_opcode {
     nvme_admin_get_lba_status = 0x86,
     nvme_admin_storpu_create_context = 0xa0,
     nvme_admin_storpu_delete_context = 0xa1,
+    nvme_admin_storpu_register_ring = 0xa2,
+    nvme_admin_storpu_unregister_ring = 0xa3,
 };
 
 enum {
@@ -496,6 +527,7 @@ struct nvme_command {
         struct nvme_create_sq create_sq;
         struct nvme_delete_queue delete_queue;
         struct nvme_storpu_invoke_command storpu_invoke;
+        struct nvme_storpu_invoke_batch_command storpu_invoke_batch;
     };
 };
 
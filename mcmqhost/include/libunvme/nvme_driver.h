@@ -5,6 +5,7 @@
 #include "nvme.h"
 #include "pcie_link.h"
 
+#include <atomic>
 #include <filesystem>
 #include <memory>
 #include <mutex>
@@ -36,7 +37,9 @@ public:
     using AsyncCommandCallback =
         std::function<void(NVMeStatus, const NVMeResult&)>;
 
-    class AsyncCommand {
+    /* Command slots are cache-line aligned so that completions on one queue
+     * never contend with submissions on another. */
+    class alignas(64) AsyncCommand {
         friend class NVMeDriver;
 
     public:
@@ -61,7 +64,9 @@ public:
         NVMeDriver* driver;
         MemorySpace* space;
 
-        uint16_t id;
+        uint16_t id;  /* Slot index within the queue, used as command ID. */
+        uint16_t qid; /* Queue that owns this slot. */
+        std::atomic<uint16_t> next_free;
         NVMeStatus status;
         NVMeResult result;
         bool completed;
@@ -69,6 +74,99 @@ public:
         std::vector<MemorySpace::Address> prp_lists;
     };
 
+    /* Batch of StorPU invocations that the device runs in order with a
+     * single command and completion. */
+    class InvokeBatch {
+        friend class NVMeDriver;
+
+    public:
+        /* Add an invocation and return its index in the batch. If
+         * stop_if_zero is set, the batch stops after this entry if it
+         * returns 0. */
+        unsigned int add(MemorySpace::Address entry, unsigned long arg,
+                         bool stop_if_zero = false);
+        /* Same as above but the argument is arg plus the result of the
+         * earlier entry dep. */
+        unsigned int add_chained(MemorySpace::Address entry, unsigned int dep,
+                                 unsigned long arg = 0,
+                                 bool stop_if_zero = false);
+
+        size_t size() const { return descs.size(); }
+        void clear() { descs.clear(); }
+
+        /* Valid after the batch completes, for the entries that ran. */
+        unsigned long result(unsigned int idx) const;
+
+    private:
+        std::vector<struct storpu_invoke_desc> descs;
+
+        unsigned int add_desc(MemorySpace::Address entry, unsigned long arg,
+                              uint32_t flags, unsigned int dep);
+    };
+
+    /* Ring in host memory that a StorPU context streams result records into.
+     * Device threads append records and advance the producer offset by DMA
+     * and the host consumes them by polling, without a command per batch.
+     * The layout must match storpu/result_ring.h in the device SDK. */
+    class ResultRing {
+    public:
+        /* size is the size of the data area and must be a power of two. */
+        ResultRing(NVMeDriver* driver, unsigned int cid, size_t size);
+        ~ResultRing();
+
+        ResultRing(const ResultRing&) = delete;
+        ResultRing& operator=(const ResultRing&) = delete;
+
+        /* Passed to the function that produces the results. */
+        unsigned int get_id() const { return id; }
+
+        /* Copy the next record to buf. Returns false if no record is
+         * available yet or the device has closed the ring. */
+        bool poll(std::vector<uint8_t>& buf);
+        /* Poll until the next record arrives. Returns false at the end of the
+         * stream. */
+        bool wait(std::vector<uint8_t>& buf);
+
+        bool closed() const { return eos; }
+
+    private:
+        static constexpr size_t HEAD_OFFSET = 0;
+        static constexpr size_t TAIL_OFFSET = 64;
+        static constexpr size_t DATA_OFFSET = 128;
+        static constexpr size_t RECORD_HEADER_SIZE = 8;
+        static constexpr size_t RECORD_ALIGN = 8;
+        static constexpr uint32_t RECORD_PAD = 0x1;
+        static constexpr uint32_t RECORD_EOS = 0x2;
+
+        NVMeDriver* driver;
+        MemorySpace* space;
+        unsigned int cid;
+        unsigned int id;
+        size_t size;
+        MemorySpace::Address addr;
+
+        /* Producer offset last read from the ring and consumer offset. */
+        uint64_t head;
+        uint64_t tail;
+        bool eos;
+    };
+
+    /* Allocator statistics of a StorPU context. The layout must match
+     * storpu/malloc.h in libstorpu. */
+    struct MallocStats {
+        uint64_t system_bytes;
+        uint64_t central_in_use;
+        uint64_t arena_cached;
+        uint64_t thread_cached;
+
+        uint64_t nr_malloc;
+        uint64_t nr_free;
+        uint64_t nr_large;
+
+        uint64_t nr_arena_transfers;
+        uint64_t nr_central_transfers;
+    };
+
     explicit NVMeDriver(unsigned ncpus, unsigned int io_queue_depth,
                         PCIeLink* link, MemorySpace* memory_space,
                         bool use_dbbuf = false);
@@ -125,6 +223,20 @@ public:
         (void)submit_invoke_command(cid, entry, arg, std::move(callback));
     }
 
+    /* Both return the number of entries that completed. For the
+     * async version, the batch must stay alive until the callback. */
+    unsigned int invoke_batch(unsigned int cid, InvokeBatch& batch);
+
+    void invoke_batch_async(unsigned int cid, InvokeBatch& batch,
+                            AsyncCommandCallback&& callback);
+
+    unsigned int register_result_ring(unsigned int cid,
+                                      MemorySpace::Address ring, size_t size);
+    void unregister_result_ring(unsigned int cid, unsigned int ring_id);
+
+    /* entry is spu_malloc_stats in the library of the context. */
+    MallocStats get_malloc_stats(unsigned int cid, MemorySpace::Address entry);
+
     unsigned int create_namespace(size_t size_bytes);
     void delete_namespace(unsigned int nsid);
     void attach_namespace(unsigned int nsid);
@@ -132,6 +244,7 @@ public:
 
 private:
     static constexpr unsigned AQ_DEPTH = 32;
+    static constexpr uint16_t NO_COMMAND = 0xffff;
 
 #ifdef ENABLE_INTERPROCESS
     using MutexType = boost::interprocess::interprocess_mutex;
@@ -141,7 +254,17 @@ private:
     using CondType = std::condition_variable;
 #endif
 
-    struct NVMeQueue {
+    struct NVMeQueue;
+
+#ifdef ENABLE_INTERPROCESS
+    using PAsyncCommand = boost::interprocess::offset_ptr<AsyncCommand>;
+    using PNVMeQueue = boost::interprocess::offset_ptr<NVMeQueue>;
+#else
+    using PAsyncCommand = AsyncCommand*;
+    using PNVMeQueue = NVMeQueue*;
+#endif
+
+    struct alignas(64) NVMeQueue {
         MutexType mutex;
 
         MemorySpace::Address sq_dma_addr;
@@ -157,6 +280,13 @@ private:
         uint8_t cq_phase;
         uint32_t q_db;
 
+        /* Preallocated command slots indexed by command ID. Free slots are
+         * kept on a lock-free stack whose head packs the top slot index in
+         * the low 16 bits and an ABA tag in the high 16 bits. */
+        PAsyncCommand commands = nullptr;
+        unsigned int nr_commands = 0;
+        alignas(64) std::atomic<uint32_t> free_head;
+
         inline void update_cq_head()
         {
             uint16_t tmp = cq_head + 1;
@@ -202,9 +332,6 @@ private:
                 std::forward<Args>(args)...),
             segment);
     }
-
-    using PAsyncCommand = boost::interprocess::offset_ptr<AsyncCommand>;
-    using PNVMeQueue = boost::interprocess::offset_ptr<NVMeQueue>;
 #else
     template <typename T> using Allocator = std::allocator<T>;
 
@@ -215,9 +342,6 @@ private:
     {
         return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
     }
-
-    using PAsyncCommand = AsyncCommand*;
-    using PNVMeQueue = NVMeQueue*;
 #endif
 
 #ifdef ENABLE_INTERPROCESS
@@ -231,14 +355,6 @@ private:
     std::vector<UniquePtrType<NVMeQueue>>* queues;
 
     size_t queue_count, online_queues;
-    MutexType* command_mutex;
-    std::atomic<uint16_t>* command_id_counter;
-
-    using CommandMapType = std::unordered_map<
-        uint16_t, UniquePtrType<AsyncCommand>, std::hash<uint16_t>,
-        std::equal_to<uint16_t>,
-        Allocator<std::pair<uint16_t, UniquePtrType<AsyncCommand>>>>;
-    CommandMapType* command_map;
 
     static thread_local PNVMeQueue thread_io_queue;
 
@@ -257,14 +373,17 @@ private:
     void check_status(int status);
 
     void allocate_queue(unsigned qid, unsigned depth);
+    void allocate_commands(PNVMeQueue nvmeq, unsigned int count);
+    void free_commands(PNVMeQueue nvmeq);
     void init_queue(unsigned qid);
 
     void disable_controller();
     void enable_controller();
     void wait_ready(bool enabled);
 
-    PAsyncCommand setup_async_command(AsyncCommandCallback&& callback);
-    void remove_async_command(uint16_t command_id);
+    PAsyncCommand setup_async_command(PNVMeQueue nvmeq,
+                                      AsyncCommandCallback&& callback);
+    void remove_async_command(PAsyncCommand cmd);
 
     void setup_buffer(PAsyncCommand acmd, struct nvme_command* cmd,
                       MemorySpace::Address buf, size_t buflen);
@@ -321,6 +440,13 @@ private:
                                         unsigned long arg,
                                         AsyncCommandCallback&& callback);
 
+    MemorySpace::Address stage_invoke_batch(const InvokeBatch& batch);
+    void unstage_invoke_batch(InvokeBatch& batch, MemorySpace::Address buf);
+    PAsyncCommand submit_invoke_batch_command(unsigned int cid,
+                                              MemorySpace::Address buf,
+                                              unsigned int nr_descs,
+                                              AsyncCommandCallback&& callback);
+
     NVMeStatus submit_ns_mgmt(unsigned int nsid, int sel,
                               MemorySpace::Address buffer, size_t size,
                               union nvme_completion::nvme_result* res);
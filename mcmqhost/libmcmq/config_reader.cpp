@@ -1,5 +1,6 @@
 #include "libmcmq/config_reader.h"
 
+#include "spdlog/spdlog.h"
 #include <yaml-cpp/yaml.h>
 
 static mcmq::PlaneAllocateScheme
@@ -182,7 +183,7 @@ bool ConfigReader::load_ssd_config(const std::string& filename,
     return true;
 }
 
-static void load_workload_flow(YAML::Node flow_node, HostConfig& config)
+static bool load_workload_flow(YAML::Node flow_node, HostConfig& config)
 {
     config.flows.push_back({});
     auto& flow = config.flows.back();
@@ -190,6 +191,8 @@ static void load_workload_flow(YAML::Node flow_node, HostConfig& config)
     auto ns = flow_node["namespace"].as<uint32_t>(0);
     flow.nsid = ns;
 
+    flow.name = flow_node["name"].as<std::string>("");
+
     auto type = flow_node["type"].as<std::string>("synthetic");
     if (type == "synthetic") {
         flow.type = FlowType::SYNTHETIC;
@@ -232,7 +235,44 @@ static void load_workload_flow(YAML::Node flow_node, HostConfig& config)
 
         flow.synthetic.average_enqueued_requests =
             flow_node["average_enqueued_requests"].as<unsigned int>(1);
+    } else if (type == "trace") {
+        flow.type = FlowType::TRACE;
+
+        flow.trace_file = flow_node["trace_file"].as<std::string>();
+        if (flow.name.empty()) flow.name = flow.trace_file;
+
+        auto format = flow_node["trace_format"].as<std::string>("blkparse");
+        if (format == "blkparse")
+            flow.trace.format = TraceFormat::BLKPARSE;
+        else if (format == "binary")
+            flow.trace.format = TraceFormat::BINARY;
+        else {
+            spdlog::error("Unknown trace format {}", format);
+            return false;
+        }
+
+        auto replay_mode =
+            flow_node["replay_mode"].as<std::string>("timestamp");
+        if (replay_mode == "timestamp")
+            flow.trace.replay_mode = ReplayMode::TIMESTAMP;
+        else if (replay_mode == "afap")
+            flow.trace.replay_mode = ReplayMode::AFAP;
+        else if (replay_mode == "scaled")
+            flow.trace.replay_mode = ReplayMode::SCALED;
+        else {
+            spdlog::error("Unknown replay mode {}", replay_mode);
+            return false;
+        }
+
+        flow.trace.rate_scale = flow_node["rate_scale"].as<double>(1.0);
+
+        flow.trace.request_count = flow_node["request_count"].as<size_t>(0);
+
+        flow.trace.max_inflight_requests =
+            flow_node["max_inflight_requests"].as<unsigned int>(0);
     }
+
+    return true;
 }
 
 bool ConfigReader::load_host_config(const std::string& filename,
@@ -268,7 +308,7 @@ bool ConfigReader::load_host_config(const std::string& filename,
     auto flows = root["flows"];
     for (int i = 0; i < flows.size(); i++) {
         YAML::Node flow = flows[i];
-        load_workload_flow(flow, config);
+        if (!load_workload_flow(flow, config)) return false;
     }
 
     return true;
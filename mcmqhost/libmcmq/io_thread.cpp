@@ -1,5 +1,6 @@
 #include "libmcmq/io_thread.h"
 #include "libmcmq/io_thread_synthetic.h"
+#include "libmcmq/io_thread_trace.h"
 
 #include "spdlog/spdlog.h"
 
@@ -21,9 +22,11 @@ IOThread::create_thread(NVMeDriver* driver, MemorySpace* memory_space,
                         size_t sector_size, size_t max_lsa,
                         const FlowDefinition& def)
 {
+    std::unique_ptr<IOThread> thread;
+
     switch (def.type) {
     case FlowType::SYNTHETIC:
-        return std::make_unique<IOThreadSynthetic>(
+        thread = std::make_unique<IOThreadSynthetic>(
             driver, memory_space, thread_id, def.nsid, queue_depth, sector_size,
             max_lsa, def.synthetic.seed, def.synthetic.request_count,
             def.synthetic.read_ratio, def.synthetic.request_size_distribution,
@@ -32,9 +35,24 @@ IOThread::create_thread(NVMeDriver* driver, MemorySpace* memory_space,
             def.synthetic.address_distribution, def.synthetic.zipfian_alpha,
             def.synthetic.address_alignment,
             def.synthetic.average_enqueued_requests);
+        break;
+    case FlowType::TRACE: {
+        auto reader = TraceReader::open(def.trace_file, def.trace.format);
+        if (!reader) return nullptr;
+
+        thread = std::make_unique<IOThreadTrace>(
+            driver, memory_space, thread_id, def.nsid, queue_depth, sector_size,
+            max_lsa, std::move(reader), def.trace.replay_mode,
+            def.trace.rate_scale, def.trace.request_count,
+            def.trace.max_inflight_requests);
+        break;
+    }
     default:
         return nullptr;
     }
+
+    thread->stats.name = def.name;
+    return thread;
 }
 
 void IOThread::run()
@@ -147,25 +165,49 @@ void IOThread::notify_request_completion(IORequest* req)
     hdr_record_value(stats.device_response_time_hist.get(),
                      device_response_time_us);
     hdr_record_value(stats.e2e_latency_hist.get(), e2e_latency_us);
+    hdr_record_value(req->do_write ? stats.write_latency_hist.get()
+                                   : stats.read_latency_hist.get(),
+                     e2e_latency_us);
 }
 
 void IOThread::wait_for_completed_requests()
 {
-    std::vector<IORequest*> reqs;
+    std::unique_lock<std::mutex> lock(completion_mutex);
+
+    while (completed_requests.empty())
+        completion_cv.wait(lock);
 
-    {
-        std::unique_lock<std::mutex> lock(completion_mutex);
+    drain_completed_requests(lock);
+}
 
-        while (completed_requests.empty())
-            completion_cv.wait(lock);
+bool IOThread::wait_for_completed_requests(
+    std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock(completion_mutex);
 
-        while (!completed_requests.empty()) {
-            auto req = completed_requests.front();
-            completed_requests.pop();
-            reqs.push_back(req);
-        }
+    while (completed_requests.empty()) {
+        if (completion_cv.wait_until(lock, deadline) ==
+                std::cv_status::timeout &&
+            completed_requests.empty())
+            return false;
     }
 
+    drain_completed_requests(lock);
+    return true;
+}
+
+void IOThread::drain_completed_requests(std::unique_lock<std::mutex>& lock)
+{
+    std::vector<IORequest*> reqs;
+
+    while (!completed_requests.empty()) {
+        auto req = completed_requests.front();
+        completed_requests.pop();
+        reqs.push_back(req);
+    }
+
+    lock.unlock();
+
     for (auto&& req : reqs)
         process_completed_request(req);
 }
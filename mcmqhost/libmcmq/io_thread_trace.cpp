@@ -0,0 +1,115 @@
+#include "libmcmq/io_thread_trace.h"
+
+#include "spdlog/spdlog.h"
+
+IOThreadTrace::IOThreadTrace(NVMeDriver* driver, MemorySpace* memory_space,
+                             int thread_id, unsigned int nsid,
+                             unsigned int queue_depth, unsigned int sector_size,
+                             size_t max_lsa,
+                             std::unique_ptr<TraceReader> reader,
+                             ReplayMode replay_mode, double rate_scale,
+                             size_t request_count,
+                             unsigned int max_inflight_requests)
+    : IOThread(driver, memory_space, thread_id, queue_depth, request_count),
+      nsid(nsid), sector_size(sector_size), max_lsa(max_lsa),
+      reader(std::move(reader)), replay_mode(replay_mode),
+      rate_scale(rate_scale), max_inflight_requests(max_inflight_requests),
+      has_next_record(false), first_timestamp_ns(0)
+{
+    if (replay_mode != ReplayMode::SCALED || this->rate_scale <= 0)
+        this->rate_scale = 1.0;
+
+    if (!max_inflight_requests && replay_mode == ReplayMode::AFAP)
+        this->max_inflight_requests = queue_depth;
+}
+
+bool IOThreadTrace::fetch_record()
+{
+    if (request_count && nr_submitted_requests >= request_count) return false;
+
+    has_next_record = reader->next(next_record);
+    return has_next_record;
+}
+
+std::chrono::steady_clock::time_point
+IOThreadTrace::get_due_time(const TraceRecord& rec)
+{
+    uint64_t offset_ns = rec.timestamp_ns > first_timestamp_ns
+                             ? rec.timestamp_ns - first_timestamp_ns
+                             : 0;
+
+    return start_time + std::chrono::nanoseconds(
+                            (std::chrono::nanoseconds::rep)(offset_ns /
+                                                            rate_scale));
+}
+
+bool IOThreadTrace::map_request(const TraceRecord& rec, loff_t& pos,
+                                size_t& size)
+{
+    /* The trace may come from a larger device than the namespace. Wrap the
+     * request into the namespace and widen it to whole device blocks. */
+    uint64_t capacity = (uint64_t)max_lsa * sector_size;
+    uint64_t start = rec.sector * TRACE_SECTOR_SIZE;
+    uint64_t end = start + (uint64_t)rec.nr_sectors * TRACE_SECTOR_SIZE;
+
+    capacity -= capacity % DEVICE_BLOCK_SIZE;
+    if (!capacity) return false;
+
+    start -= start % DEVICE_BLOCK_SIZE;
+    end = (end + DEVICE_BLOCK_SIZE - 1) / DEVICE_BLOCK_SIZE * DEVICE_BLOCK_SIZE;
+
+    size = std::min(end - start, capacity);
+    start %= capacity;
+    if (start + size > capacity) start = capacity - size;
+
+    pos = (loff_t)start;
+    return true;
+}
+
+void IOThreadTrace::on_request_completed() {}
+
+void IOThreadTrace::run_impl()
+{
+    start_time = std::chrono::steady_clock::now();
+
+    if (fetch_record()) first_timestamp_ns = next_record.timestamp_ns;
+
+    while (has_next_record) {
+        if (replay_mode != ReplayMode::AFAP) {
+            auto due = get_due_time(next_record);
+
+            if (std::chrono::steady_clock::now() < due) {
+                /* Reap completions while waiting for the next arrival. */
+                wait_for_completed_requests(due);
+                continue;
+            }
+        }
+
+        if (max_inflight_requests &&
+            nr_submitted_requests - nr_completed_requests >=
+                max_inflight_requests) {
+            wait_for_completed_requests();
+            continue;
+        }
+
+        loff_t pos;
+        size_t size;
+
+        if (!map_request(next_record, pos, size)) {
+            spdlog::error("Thread {} namespace {} is too small for the trace",
+                          stats.thread_id, nsid);
+            break;
+        }
+
+        submit_io_request(next_record.do_write, nsid, pos, size);
+
+        fetch_record();
+    }
+
+    spdlog::info("Thread {} trace replay finished, {} requests submitted",
+                 stats.thread_id, nr_submitted_requests);
+
+    while (nr_completed_requests < nr_submitted_requests) {
+        wait_for_completed_requests();
+    }
+}
@@ -185,6 +185,7 @@ static json export_thread_stats(const IOThread::Stats& stats)
     json root = json::object();
 
     root["id"] = stats.thread_id;
+    root["name"] = stats.name;
 
     root["total_requests"] = stats.request_count;
     root["read_requests"] = stats.read_request_count;
@@ -216,6 +217,17 @@ static json export_thread_stats(const IOThread::Stats& stats)
     root["max_end_to_end_request_latency"] =
         hdr_max(stats.e2e_latency_hist.get());
 
+    root["read_request_latency_histogram"] =
+        export_histogram(stats.read_latency_hist.get());
+    root["read_request_latency_mean"] = hdr_mean(stats.read_latency_hist.get());
+    root["max_read_request_latency"] = hdr_max(stats.read_latency_hist.get());
+
+    root["write_request_latency_histogram"] =
+        export_histogram(stats.write_latency_hist.get());
+    root["write_request_latency_mean"] =
+        hdr_mean(stats.write_latency_hist.get());
+    root["max_write_request_latency"] = hdr_max(stats.write_latency_hist.get());
+
     return root;
 }
 
@@ -0,0 +1,125 @@
+#include "libmcmq/trace_reader.h"
+
+#include "spdlog/spdlog.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+std::unique_ptr<TraceReader> TraceReader::open(const std::string& filename,
+                                               TraceFormat format)
+{
+    std::unique_ptr<TraceReader> reader;
+
+    switch (format) {
+    case TraceFormat::BLKPARSE:
+        reader = std::make_unique<BlkparseTraceReader>(filename);
+        break;
+    case TraceFormat::BINARY:
+        reader = std::make_unique<BinaryTraceReader>(filename);
+        break;
+    }
+
+    if (!reader || !reader->is) {
+        spdlog::error("Failed to open trace file {}", filename);
+        return nullptr;
+    }
+
+    return reader;
+}
+
+BlkparseTraceReader::BlkparseTraceReader(const std::string& filename)
+    : replay_action(0)
+{
+    is.open(filename);
+}
+
+bool BlkparseTraceReader::next(TraceRecord& rec)
+{
+    while (std::getline(is, line)) {
+        if (parse_line(rec)) return true;
+    }
+
+    return false;
+}
+
+/* Parse one line of the default blkparse output:
+ *
+ *   8,0  3  1  0.000000000  4162  Q  WS 3417048 + 8 [jbd2/sda1-8]
+ *
+ * Traces usually carry both queue (Q) and issue (D) events for every request.
+ * Only the first of the two seen in the trace is replayed so that each
+ * request is submitted once. Lines without a read or write payload (flushes,
+ * discards, per-CPU summaries) are skipped. */
+bool BlkparseTraceReader::parse_line(TraceRecord& rec)
+{
+    std::istringstream ss(line);
+    std::string dev, time, action, rwbs, plus;
+    unsigned int cpu, pid;
+    unsigned long seq;
+    uint64_t sector;
+    uint32_t nr_sectors;
+
+    if (!(ss >> dev >> cpu >> seq >> time >> pid >> action >> rwbs >> sector >>
+          plus >> nr_sectors))
+        return false;
+
+    if (plus != "+" || nr_sectors == 0) return false;
+    if (action != "Q" && action != "D") return false;
+
+    if (!replay_action) replay_action = action[0];
+    if (action[0] != replay_action) return false;
+
+    bool is_read = rwbs.find('R') != std::string::npos;
+    bool is_write = rwbs.find('W') != std::string::npos;
+    if (is_read == is_write) return false;
+
+    auto dot = time.find('.');
+    uint64_t secs = strtoull(time.substr(0, dot).c_str(), nullptr, 10);
+    uint64_t nsecs = 0;
+
+    if (dot != std::string::npos) {
+        std::string frac = time.substr(dot + 1, 9);
+        frac.resize(9, '0');
+        nsecs = strtoull(frac.c_str(), nullptr, 10);
+    }
+
+    rec.timestamp_ns = secs * 1000000000ULL + nsecs;
+    rec.do_write = is_write;
+    rec.sector = sector;
+    rec.nr_sectors = nr_sectors;
+
+    return true;
+}
+
+BinaryTraceReader::BinaryTraceReader(const std::string& filename)
+{
+    BinaryTraceHeader header;
+
+    is.open(filename, std::ios::binary);
+    if (!is) return;
+
+    if (!is.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        memcmp(header.magic, BINARY_TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != BINARY_TRACE_VERSION) {
+        spdlog::error("Bad binary trace header in {}", filename);
+        is.close();
+    }
+}
+
+bool BinaryTraceReader::next(TraceRecord& rec)
+{
+    BinaryTraceRecord raw;
+
+    /* Skip records without a payload like the blkparse reader does. */
+    do {
+        if (!is.read(reinterpret_cast<char*>(&raw), sizeof(raw))) return false;
+    } while (raw.nr_sectors == 0);
+
+    rec.timestamp_ns = raw.timestamp_ns;
+    rec.do_write = !!(raw.flags & BINARY_TRACE_WRITE);
+    rec.sector = raw.sector;
+    rec.nr_sectors = raw.nr_sectors;
+
+    return true;
+}
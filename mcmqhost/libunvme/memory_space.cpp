@@ -2,15 +2,32 @@
 
 #include "spdlog/spdlog.h"
 
+#include <atomic>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <unordered_map>
 
 namespace fs = std::filesystem;
 
 #define roundup(x, align) \
     (((x) % align == 0) ? (x) : (((x) + align) - ((x) % align)))
 
-MemorySpace::MemorySpace(Address iova_base) : iova_base(iova_base)
+/* Memory spaces that are still alive. Thread caches are flushed back to their
+ * memory space on thread exit only if it is still in this table. */
+static std::mutex registry_mutex;
+static std::unordered_map<const MemorySpace*, uint64_t> live_spaces;
+static std::atomic<uint64_t> next_space_id{1};
+
+/* The hole list lives in shared memory and survives fork() but thread caches
+ * are copied into the child. Bump the generation in the child so that the
+ * copied magazines are dropped instead of handing out the parent's blocks. */
+static std::atomic<unsigned int> fork_generation{0};
+static std::once_flag atfork_once;
+
+static void memory_space_atfork_child() { fork_generation++; }
+
+MemorySpace::MemorySpace(Address iova_base, bool use_magazines)
+    : iova_base(iova_base), use_magazines(use_magazines)
 {
     struct hole* hp;
 
@@ -35,13 +52,45 @@ MemorySpace::MemorySpace(Address iova_base) : iova_base(iova_base)
     hole[NR_HOLES - 1].h_next = NULL;
     hole_head = NULL;
     free_slots = &hole[0];
+
+    std::call_once(atfork_once, [] {
+        pthread_atfork(nullptr, nullptr, memory_space_atfork_child);
+    });
+
+    space_id = next_space_id++;
+
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    live_spaces[this] = space_id;
 }
 
 MemorySpace::~MemorySpace()
 {
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        live_spaces.erase(this);
+    }
+
     if (hole) munmap(hole, sizeof(struct hole) * NR_HOLES);
 }
 
+MemorySpace::ThreadCacheList::~ThreadCacheList()
+{
+    std::lock_guard<std::mutex> guard(registry_mutex);
+
+    for (auto&& tc : caches) {
+        auto it = live_spaces.find(tc->space);
+
+        if (it == live_spaces.end() || it->second != tc->space_id ||
+            tc->generation != fork_generation.load())
+            continue;
+
+        for (unsigned int cls = 0; cls < NR_SIZE_CLASSES; cls++) {
+            auto& mag = tc->mags[cls];
+            tc->space->drain_magazine(mag, cls, mag.count);
+        }
+    }
+}
+
 void MemorySpace::delete_slot(struct hole* prev_ptr, struct hole* hp)
 {
     if (hp == hole_head)
@@ -73,13 +122,11 @@ void MemorySpace::merge_hole(struct hole* hp)
     }
 }
 
-MemorySpace::Address MemorySpace::allocate(size_t len, size_t align)
+bool MemorySpace::allocate_locked(size_t len, size_t align, Address& addr)
 {
     struct hole *hp, *prev_ptr;
     Address old_base;
 
-    pthread_mutex_lock(alloc_mutex);
-
     prev_ptr = NULL;
     hp = hole_head;
     while (hp != NULL) {
@@ -87,6 +134,25 @@ MemorySpace::Address MemorySpace::allocate(size_t len, size_t align)
         if (hp->h_base % align != 0) alignment = align - (hp->h_base % align);
         if (hp->h_len >= len + alignment) {
             old_base = hp->h_base + alignment;
+
+            if (alignment && free_slots) {
+                /* Keep the alignment gap as a hole and split off whatever is
+                 * left after the allocated block. */
+                struct hole* tail = free_slots;
+                free_slots = tail->h_next;
+
+                tail->h_base = old_base + len;
+                tail->h_len = hp->h_len - (len + alignment);
+                tail->h_next = hp->h_next;
+                hp->h_next = tail;
+                hp->h_len = alignment;
+
+                if (tail->h_len == 0) delete_slot(hp, tail);
+
+                addr = old_base;
+                return true;
+            }
+
             hp->h_base += len + alignment;
             hp->h_len -= (len + alignment);
             if (prev_ptr && prev_ptr->h_base + prev_ptr->h_len == old_base)
@@ -94,33 +160,35 @@ MemorySpace::Address MemorySpace::allocate(size_t len, size_t align)
 
             if (hp->h_len == 0) delete_slot(prev_ptr, hp);
 
-            pthread_mutex_unlock(alloc_mutex);
-            return old_base;
+            addr = old_base;
+            return true;
         }
 
         prev_ptr = hp;
         hp = hp->h_next;
     }
 
-    pthread_mutex_unlock(alloc_mutex);
-    throw MemoryNotAvailable();
+    return false;
 }
 
-MemorySpace::Address MemorySpace::allocate_pages(size_t len)
+MemorySpace::Address MemorySpace::allocate_hole(size_t len, size_t align)
 {
-    return allocate(roundup(len, 0x1000), 0x1000);
+    Address addr;
+    bool found;
+
+    pthread_mutex_lock(alloc_mutex);
+    found = allocate_locked(len, align, addr);
+    pthread_mutex_unlock(alloc_mutex);
+
+    if (!found) throw MemoryNotAvailable();
+    return addr;
 }
 
-void MemorySpace::free(Address addr, size_t len)
+void MemorySpace::free_locked(Address addr, size_t len)
 {
     struct hole *hp, *new_ptr, *prev_ptr;
 
-    if (len == 0) return;
-
-    pthread_mutex_lock(alloc_mutex);
-
     if ((new_ptr = free_slots) == NULL) {
-        pthread_mutex_unlock(alloc_mutex);
         spdlog::error("Memory space hole table full");
         abort();
     }
@@ -134,7 +202,6 @@ void MemorySpace::free(Address addr, size_t len)
         new_ptr->h_next = hp;
         hole_head = new_ptr;
         merge_hole(new_ptr);
-        pthread_mutex_unlock(alloc_mutex);
         return;
     }
 
@@ -147,7 +214,135 @@ void MemorySpace::free(Address addr, size_t len)
     new_ptr->h_next = prev_ptr->h_next;
     prev_ptr->h_next = new_ptr;
     merge_hole(prev_ptr);
+}
+
+void MemorySpace::free_hole(Address addr, size_t len)
+{
+    if (len == 0) return;
+
+    pthread_mutex_lock(alloc_mutex);
+    free_locked(addr, len);
+    pthread_mutex_unlock(alloc_mutex);
+}
+
+/* Size class for an allocation of len bytes or -1 if it is not cached. Class
+ * i holds blocks of (4KB << i) bytes aligned to their size. */
+int MemorySpace::size_class(size_t len)
+{
+    unsigned int shift;
+
+    if (len < (1UL << CACHE_MIN_SHIFT)) return -1;
+
+    shift = 64 - __builtin_clzl(len - 1);
+    if (shift > CACHE_MAX_SHIFT) return -1;
+
+    return shift - CACHE_MIN_SHIFT;
+}
+
+unsigned int MemorySpace::magazine_capacity(unsigned int cls)
+{
+    return std::max(1UL, MAGAZINE_BYTES >> (cls + CACHE_MIN_SHIFT));
+}
+
+MemorySpace::ThreadCache* MemorySpace::get_thread_cache()
+{
+    static thread_local ThreadCacheList thread_caches;
+    unsigned int generation = fork_generation.load(std::memory_order_relaxed);
+    ThreadCache* tc = nullptr;
+
+    for (auto&& p : thread_caches.caches) {
+        if (p->space == this) {
+            tc = p.get();
+            break;
+        }
+    }
+
+    if (!tc) {
+        thread_caches.caches.emplace_back(std::make_unique<ThreadCache>());
+        tc = thread_caches.caches.back().get();
+        tc->space = this;
+        tc->space_id = 0;
+    }
+
+    if (tc->space_id != space_id || tc->generation != generation) {
+        /* Fresh cache, a memory space reusing the address of a destroyed one,
+         * or a cache inherited across fork(). Forget whatever it holds. */
+        tc->space_id = space_id;
+        tc->generation = generation;
+        for (auto&& mag : tc->mags)
+            mag.count = 0;
+    }
+
+    return tc;
+}
+
+void MemorySpace::refill_magazine(Magazine& mag, unsigned int cls)
+{
+    size_t size = 1UL << (cls + CACHE_MIN_SHIFT);
+    unsigned int target = std::max(1U, magazine_capacity(cls) / 2);
+    Address addr;
+
+    pthread_mutex_lock(alloc_mutex);
+    while (mag.count < target && allocate_locked(size, size, addr))
+        mag.rounds[mag.count++] = addr;
     pthread_mutex_unlock(alloc_mutex);
+
+    if (mag.count == 0) throw MemoryNotAvailable();
+}
+
+void MemorySpace::drain_magazine(Magazine& mag, unsigned int cls,
+                                 unsigned int count)
+{
+    size_t size = 1UL << (cls + CACHE_MIN_SHIFT);
+
+    if (count == 0) return;
+
+    pthread_mutex_lock(alloc_mutex);
+    while (count-- > 0 && mag.count > 0)
+        free_locked(mag.rounds[--mag.count], size);
+    pthread_mutex_unlock(alloc_mutex);
+}
+
+MemorySpace::Address MemorySpace::allocate(size_t len, size_t align)
+{
+    int cls = size_class(len);
+    size_t size;
+
+    if (cls < 0 || !use_magazines) return allocate_hole(len, align);
+
+    /* Cached blocks are only aligned to their size. */
+    size = 1UL << (cls + CACHE_MIN_SHIFT);
+    if (align > size) return allocate_hole(size, align);
+
+    auto& mag = get_thread_cache()->mags[cls];
+    if (mag.count == 0) refill_magazine(mag, cls);
+
+    return mag.rounds[--mag.count];
+}
+
+MemorySpace::Address MemorySpace::allocate_pages(size_t len)
+{
+    return allocate(roundup(len, 0x1000), 0x1000);
+}
+
+void MemorySpace::free(Address addr, size_t len)
+{
+    int cls = size_class(len);
+    unsigned int capacity;
+
+    if (cls < 0 || !use_magazines) {
+        free_hole(addr, len);
+        return;
+    }
+
+    auto& mag = get_thread_cache()->mags[cls];
+    capacity = magazine_capacity(cls);
+
+    /* Return half of a full magazine so that a thread which only frees (e.g.
+     * the completion thread) does not bounce on every call. */
+    if (mag.count == capacity) drain_magazine(mag, cls, (capacity + 1) / 2);
+
+    mag.rounds[mag.count++] = addr;
 }
 
 void MemorySpace::free_pages(Address addr, size_t len)
@@ -240,7 +435,7 @@ SharedMemorySpace::SharedMemorySpace(const fs::path& filename)
     spdlog::info("Mapped shared memory file base={} size={}MB", map_base,
                  map_size >> 20);
 
-    free(0x1000, file_size - 0x1000);
+    free_hole(0x1000, file_size - 0x1000);
 }
 
 VfioMemorySpace::VfioMemorySpace(Address iova_base, size_t size)
@@ -260,10 +455,13 @@ VfioMemorySpace::VfioMemorySpace(Address iova_base, size_t size)
     spdlog::info("Mapped DMA memory base={} size={}MB", map_base,
                  map_size >> 20);
 
-    free(iova_base, iova_base + map_size);
+    free_hole(iova_base, iova_base + map_size);
 }
 
-BARMemorySpace::BARMemorySpace(void* base, size_t size) : MemorySpace(0)
+/* The BAR window is small and shared with the device, so blocks are not
+ * parked in per-thread magazines where other threads cannot reach them. */
+BARMemorySpace::BARMemorySpace(void* base, size_t size)
+    : MemorySpace(0, false)
 {
     map_base = base;
     map_size = size;
@@ -271,7 +469,7 @@ BARMemorySpace::BARMemorySpace(void* base, size_t size) : MemorySpace(0)
     spdlog::info("Mapped BAR memory base={} size={}MB", map_base,
                  map_size >> 20);
 
-    free(0, map_size);
+    free_hole(0, map_size);
 }
 
 void BARMemorySpace::read(Address addr, void* buf, size_t len)
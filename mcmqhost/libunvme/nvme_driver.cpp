@@ -5,6 +5,7 @@
 #include <boost/endian/conversion.hpp>
 
 #include <fstream>
+#include <thread>
 
 namespace endian = boost::endian;
 
@@ -39,7 +40,7 @@ NVMeDriver::NVMeStatus NVMeDriver::AsyncCommand::wait(NVMeResult* resp)
         out_status = status;
     }
 
-    driver->remove_async_command(id);
+    driver->remove_async_command(this);
     return out_status;
 }
 
@@ -65,18 +66,8 @@ NVMeDriver::NVMeDriver(unsigned ncpus, unsigned int io_queue_depth,
 #ifdef ENABLE_INTERPROCESS
     queues = segment.construct<std::vector<UniquePtrType<NVMeQueue>>>(
         boost::interprocess::anonymous_instance)();
-    command_mutex =
-        segment.construct<MutexType>(boost::interprocess::anonymous_instance)();
-    command_map = segment.construct<CommandMapType>(
-        boost::interprocess::anonymous_instance)(10,
-                                                 segment.get_segment_manager());
-    command_id_counter = segment.construct<std::atomic<uint16_t>>(
-        boost::interprocess::anonymous_instance)();
 #else
     queues = new std::vector<UniquePtrType<NVMeQueue>>();
-    command_mutex = new MutexType();
-    command_map = new CommandMapType();
-    command_id_counter = new std::atomic<uint16_t>();
 #endif
 }
 
@@ -84,16 +75,13 @@ NVMeDriver::~NVMeDriver()
 {
     delete bar4_mem;
 
+    for (auto&& nvmeq : *queues)
+        free_commands(nvmeq.get());
+
 #ifdef ENABLE_INTERPROCESS
     segment.destroy_ptr(queues);
-    segment.destroy_ptr(command_mutex);
-    segment.destroy_ptr(command_map);
-    segment.destroy_ptr(command_id_counter);
 #else
     delete queues;
-    delete command_mutex;
-    delete command_map;
-    delete command_id_counter;
 #endif
 }
 
@@ -135,6 +123,10 @@ void NVMeDriver::allocate_queue(unsigned qid, unsigned depth)
     nvmeq->cq_head = 0;
     queue_count++;
 
+    /* A queue of depth N holds at most N - 1 commands so never hand out more
+     * slots than that. This also keeps the SQ from overflowing. */
+    allocate_commands(nvmeq.get(), depth - 1);
+
     spdlog::info("Allocate NVMe queue {} sq_addr={:#x} cq_addr={:#x} depth={}",
                  qid, nvmeq->sq_dma_addr, nvmeq->cq_dma_addr, depth);
 }
@@ -248,27 +240,99 @@ void NVMeDriver::enable_controller()
     wait_ready(true);
 }
 
+void NVMeDriver::allocate_commands(PNVMeQueue nvmeq, unsigned int count)
+{
+    free_commands(nvmeq);
+
+    assert(count < NO_COMMAND);
+
+#ifdef ENABLE_INTERPROCESS
+    nvmeq->commands = segment.construct<AsyncCommand>(
+        boost::interprocess::anonymous_instance)[count]();
+#else
+    nvmeq->commands = new AsyncCommand[count];
+#endif
+    nvmeq->nr_commands = count;
+
+    for (unsigned int i = 0; i < count; i++) {
+        auto& cmd = nvmeq->commands[i];
+
+        cmd.driver = this;
+        cmd.space = memory_space;
+        cmd.id = i;
+        cmd.qid = nvmeq->qid;
+        cmd.next_free.store(i + 1 < count ? i + 1 : NO_COMMAND,
+                            std::memory_order_relaxed);
+    }
+
+    nvmeq->free_head.store(count ? 0 : NO_COMMAND, std::memory_order_release);
+}
+
+void NVMeDriver::free_commands(PNVMeQueue nvmeq)
+{
+    if (!nvmeq->commands) return;
+
+#ifdef ENABLE_INTERPROCESS
+    segment.destroy_ptr(nvmeq->commands.get());
+#else
+    delete[] nvmeq->commands;
+#endif
+    nvmeq->commands = nullptr;
+    nvmeq->nr_commands = 0;
+}
+
 NVMeDriver::PAsyncCommand
-NVMeDriver::setup_async_command(AsyncCommandCallback&& callback)
+NVMeDriver::setup_async_command(PNVMeQueue nvmeq,
+                                AsyncCommandCallback&& callback)
 {
-    std::lock_guard<MutexType> guard(*command_mutex);
-    auto id = command_id_counter->fetch_add(1);
+    uint32_t head, next;
+    PAsyncCommand cmd;
+
+    head = nvmeq->free_head.load(std::memory_order_acquire);
+
+    for (;;) {
+        uint16_t id = head & 0xffff;
+
+        if (id == NO_COMMAND) {
+            /* All slots are in flight. Wait for a completion to recycle one. */
+            std::this_thread::yield();
+            head = nvmeq->free_head.load(std::memory_order_acquire);
+            continue;
+        }
+
+        cmd = &nvmeq->commands[id];
+        next = ((head + 0x10000) & 0xffff0000) |
+               cmd->next_free.load(std::memory_order_relaxed);
+
+        if (nvmeq->free_head.compare_exchange_weak(head, next,
+                                                   std::memory_order_acquire,
+                                                   std::memory_order_acquire))
+            break;
+    }
 
-    auto it = command_map->emplace(id, make_unique<AsyncCommand>()).first;
-    auto& cmd = it->second;
-    cmd->driver = this;
-    cmd->space = memory_space;
-    cmd->id = id;
     cmd->completed = false;
-    cmd->callback = callback;
+    cmd->callback = std::move(callback);
 
-    return it->second.get();
+    return cmd;
 }
 
-void NVMeDriver::remove_async_command(uint16_t command_id)
+void NVMeDriver::remove_async_command(PAsyncCommand cmd)
 {
-    std::lock_guard<MutexType> guard(*command_mutex);
-    command_map->erase(command_id);
+    auto nvmeq = (*queues)[cmd->qid].get();
+    uint32_t head, next;
+
+    for (auto&& prp : cmd->prp_lists)
+        memory_space->free(prp, 0x1000);
+    cmd->prp_lists.clear();
+    cmd->callback = nullptr;
+
+    head = nvmeq->free_head.load(std::memory_order_relaxed);
+
+    do {
+        cmd->next_free.store(head & 0xffff, std::memory_order_relaxed);
+        next = ((head + 0x10000) & 0xffff0000) | cmd->id;
+    } while (!nvmeq->free_head.compare_exchange_weak(
+        head, next, std::memory_order_release, std::memory_order_relaxed));
 }
 
 void NVMeDriver::setup_buffer(PAsyncCommand acmd, struct nvme_command* cmd,
@@ -378,7 +442,7 @@ NVMeDriver::submit_sync_command(PNVMeQueue nvmeq, struct nvme_command* cmd,
                                 MemorySpace::Address buf, size_t buflen,
                                 union nvme_completion::nvme_result* result)
 {
-    auto acmd = setup_async_command({});
+    auto acmd = setup_async_command(nvmeq, {});
 
     cmd->common.command_id = acmd->id;
 
@@ -396,7 +460,7 @@ NVMeDriver::submit_async_command(PNVMeQueue nvmeq, struct nvme_command* cmd,
                                  MemorySpace::Address buf, size_t buflen,
                                  AsyncCommandCallback&& callback)
 {
-    auto acmd = setup_async_command(std::move(callback));
+    auto acmd = setup_async_command(nvmeq, std::move(callback));
 
     cmd->common.command_id = acmd->id;
 
@@ -604,35 +668,30 @@ void NVMeDriver::handle_cqe(PNVMeQueue nvmeq, uint16_t idx)
 
     bool release_cmd = false;
 
-    {
-        std::lock_guard<MutexType> guard(*command_mutex);
-        auto it = command_map->find(command_id);
-
-        if (it == command_map->end()) {
-            spdlog::error("Completion queue entry without command id={}",
-                          command_id);
-            return;
-        }
+    if (command_id >= nvmeq->nr_commands) {
+        spdlog::error("Completion queue entry without command qid={} id={}",
+                      nvmeq->qid, command_id);
+        return;
+    }
 
-        auto& cmd = it->second;
-        {
-            std::unique_lock<AsyncCommand::MutexType> lock(cmd->mutex);
-
-            auto status = endian::little_to_native(cqe.status) >> 1;
-            if (cmd->callback) {
-                cmd->callback(status, cqe.result);
-                release_cmd = true;
-            } else {
-                cmd->status = status;
-                cmd->result = cqe.result;
-                cmd->completed = true;
-
-                cmd->cv.notify_all();
-            }
+    PAsyncCommand cmd = &nvmeq->commands[command_id];
+    {
+        std::unique_lock<AsyncCommand::MutexType> lock(cmd->mutex);
+
+        auto status = endian::little_to_native(cqe.status) >> 1;
+        if (cmd->callback) {
+            cmd->callback(status, cqe.result);
+            release_cmd = true;
+        } else {
+            cmd->status = status;
+            cmd->result = cqe.result;
+            cmd->completed = true;
+
+            cmd->cv.notify_all();
         }
     }
 
-    if (release_cmd) remove_async_command(command_id);
+    if (release_cmd) remove_async_command(cmd);
 }
 
 void NVMeDriver::nvme_irq(PNVMeQueue nvmeq)
@@ -768,6 +827,145 @@ void NVMeDriver::delete_context(unsigned int cid)
         throw DeviceIOError("Delete context error");
 }
 
+unsigned int NVMeDriver::register_result_ring(unsigned int cid,
+                                              MemorySpace::Address ring,
+                                              size_t size)
+{
+    struct nvme_command c = {0};
+    union nvme_completion::nvme_result res;
+    auto& adminq = queues->front();
+
+    memset(&c, 0, sizeof(c));
+    c.common.opcode = nvme_admin_storpu_register_ring;
+    c.common.dptr.prp1 = endian::native_to_little((uint64_t)ring);
+    c.common.cdw10 = cid;
+    c.common.cdw11 = size;
+
+    auto status = submit_sync_command(adminq.get(), &c, 0, 0, &res);
+
+    if ((status & 0x7ff) != NVME_SC_SUCCESS)
+        throw DeviceIOError("Register result ring error");
+
+    return endian::little_to_native(res.u32);
+}
+
+void NVMeDriver::unregister_result_ring(unsigned int cid, unsigned int ring_id)
+{
+    struct nvme_command c = {0};
+    union nvme_completion::nvme_result res;
+    auto& adminq = queues->front();
+
+    memset(&c, 0, sizeof(c));
+    c.common.opcode = nvme_admin_storpu_unregister_ring;
+    c.common.cdw10 = cid;
+    c.common.cdw11 = ring_id;
+
+    auto status = submit_sync_command(adminq.get(), &c, 0, 0, &res);
+
+    if ((status & 0x7ff) != NVME_SC_SUCCESS)
+        throw DeviceIOError("Unregister result ring error");
+}
+
+NVMeDriver::MallocStats NVMeDriver::get_malloc_stats(unsigned int cid,
+                                                     MemorySpace::Address entry)
+{
+    MallocStats stats;
+    auto buf = bar4_mem->allocate(sizeof(stats));
+
+    auto r = invoke_function(cid, entry, buf);
+    if (r == 0) bar4_mem->read(buf, &stats, sizeof(stats));
+
+    bar4_mem->free(buf, sizeof(stats));
+
+    if (r != 0) throw DeviceIOError("Get malloc stats error");
+
+    for (auto* p : {&stats.system_bytes, &stats.central_in_use,
+                    &stats.arena_cached, &stats.thread_cached,
+                    &stats.nr_malloc, &stats.nr_free, &stats.nr_large,
+                    &stats.nr_arena_transfers, &stats.nr_central_transfers})
+        *p = endian::little_to_native(*p);
+
+    return stats;
+}
+
+NVMeDriver::ResultRing::ResultRing(NVMeDriver* driver, unsigned int cid,
+                                   size_t size)
+    : driver(driver), space(driver->get_dma_space()), cid(cid), size(size),
+      head(0), tail(0), eos(false)
+{
+    addr = space->allocate(DATA_OFFSET + size, 0x1000);
+    space->memset(addr, 0, DATA_OFFSET);
+
+    try {
+        id = driver->register_result_ring(cid, addr, size);
+    } catch (...) {
+        space->free(addr, DATA_OFFSET + size);
+        throw;
+    }
+}
+
+NVMeDriver::ResultRing::~ResultRing()
+{
+    try {
+        driver->unregister_result_ring(cid, id);
+    } catch (const DeviceIOError&) {
+    }
+
+    space->free(addr, DATA_OFFSET + size);
+}
+
+bool NVMeDriver::ResultRing::poll(std::vector<uint8_t>& buf)
+{
+    while (!eos) {
+        if (tail == head) {
+            space->read(addr + HEAD_OFFSET, &head, sizeof(head));
+            head = endian::little_to_native(head);
+            if (tail == head) return false;
+
+            /* Records are written before the producer offset. */
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+
+        MemorySpace::Address rec = addr + DATA_OFFSET + (tail & (size - 1));
+        uint32_t hdr[2];
+
+        space->read(rec, hdr, sizeof(hdr));
+        uint32_t len = endian::little_to_native(hdr[0]);
+        uint32_t flags = endian::little_to_native(hdr[1]);
+        bool has_data = !(flags & RECORD_PAD);
+
+        if (has_data) {
+            buf.resize(len);
+            if (len) space->read(rec + RECORD_HEADER_SIZE, buf.data(), len);
+        }
+
+        tail += (RECORD_HEADER_SIZE + len + RECORD_ALIGN - 1) &
+                ~(RECORD_ALIGN - 1);
+
+        uint64_t tail_le = endian::native_to_little(tail);
+        space->write(addr + TAIL_OFFSET, &tail_le, sizeof(tail_le));
+
+        if (flags & RECORD_EOS) {
+            eos = true;
+            break;
+        }
+
+        if (has_data) return true;
+    }
+
+    return false;
+}
+
+bool NVMeDriver::ResultRing::wait(std::vector<uint8_t>& buf)
+{
+    while (!poll(buf)) {
+        if (eos) return false;
+        std::this_thread::yield();
+    }
+
+    return true;
+}
+
 NVMeDriver::PAsyncCommand
 NVMeDriver::submit_invoke_command(unsigned int cid, MemorySpace::Address entry,
                                   unsigned long arg,
@@ -803,6 +1001,126 @@ unsigned long NVMeDriver::invoke_function(unsigned int cid,
     return (unsigned long)endian::little_to_native(res.u64);
 }
 
+unsigned int NVMeDriver::InvokeBatch::add_desc(MemorySpace::Address entry,
+                                               unsigned long arg,
+                                               uint32_t flags, unsigned int dep)
+{
+    struct storpu_invoke_desc desc;
+
+    if (descs.size() >= STORPU_INVOKE_BATCH_MAX)
+        throw std::length_error("Invoke batch is full");
+
+    memset(&desc, 0, sizeof(desc));
+    desc.entry = endian::native_to_little((uint64_t)entry);
+    desc.arg = endian::native_to_little((uint64_t)arg);
+    desc.flags = endian::native_to_little(flags);
+    desc.dep = endian::native_to_little((uint32_t)dep);
+
+    descs.push_back(desc);
+    return descs.size() - 1;
+}
+
+unsigned int NVMeDriver::InvokeBatch::add(MemorySpace::Address entry,
+                                          unsigned long arg, bool stop_if_zero)
+{
+    return add_desc(entry, arg, stop_if_zero ? STORPU_INVOKE_STOP_IF_ZERO : 0,
+                    0);
+}
+
+unsigned int NVMeDriver::InvokeBatch::add_chained(MemorySpace::Address entry,
+                                                  unsigned int dep,
+                                                  unsigned long arg,
+                                                  bool stop_if_zero)
+{
+    uint32_t flags = STORPU_INVOKE_ARG_RESULT;
+
+    if (dep >= descs.size())
+        throw std::out_of_range("Invoke batch dependency out of range");
+
+    if (stop_if_zero) flags |= STORPU_INVOKE_STOP_IF_ZERO;
+
+    return add_desc(entry, arg, flags, dep);
+}
+
+unsigned long NVMeDriver::InvokeBatch::result(unsigned int idx) const
+{
+    return (unsigned long)endian::little_to_native(descs.at(idx).result);
+}
+
+MemorySpace::Address NVMeDriver::stage_invoke_batch(const InvokeBatch& batch)
+{
+    size_t size = batch.descs.size() * sizeof(struct storpu_invoke_desc);
+    auto buf = bar4_mem->allocate(size, 8);
+
+    bar4_mem->write(buf, batch.descs.data(), size);
+
+    return buf;
+}
+
+void NVMeDriver::unstage_invoke_batch(InvokeBatch& batch,
+                                      MemorySpace::Address buf)
+{
+    size_t size = batch.descs.size() * sizeof(struct storpu_invoke_desc);
+
+    bar4_mem->read(buf, batch.descs.data(), size);
+    bar4_mem->free(buf, size);
+}
+
+NVMeDriver::PAsyncCommand NVMeDriver::submit_invoke_batch_command(
+    unsigned int cid, MemorySpace::Address buf, unsigned int nr_descs,
+    AsyncCommandCallback&& callback)
+{
+    struct nvme_command cmd;
+
+    spdlog::trace("Submitting invoke batch command cid={} nr={}", cid,
+                  nr_descs);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.storpu_invoke_batch.opcode = nvme_cmd_storpu_invoke_batch;
+    cmd.storpu_invoke_batch.nsid = endian::native_to_little(0);
+    cmd.storpu_invoke_batch.dptr.prp1 =
+        endian::native_to_little((uint64_t)buf);
+    cmd.storpu_invoke_batch.cid = endian::native_to_little((uint32_t)cid);
+    cmd.storpu_invoke_batch.nr_descs =
+        endian::native_to_little((uint32_t)nr_descs);
+
+    return submit_async_command(thread_io_queue, &cmd, 0, 0,
+                                std::move(callback));
+}
+
+unsigned int NVMeDriver::invoke_batch(unsigned int cid, InvokeBatch& batch)
+{
+    if (batch.size() == 0) return 0;
+
+    auto buf = stage_invoke_batch(batch);
+    auto cmd = submit_invoke_batch_command(cid, buf, batch.size(), {});
+    union nvme_completion::nvme_result res;
+    auto status = cmd->wait(&res);
+
+    unstage_invoke_batch(batch, buf);
+
+    if ((status & 0x7ff) != NVME_SC_SUCCESS)
+        throw DeviceIOError("Invoke batch command error");
+
+    return (unsigned int)endian::little_to_native(res.u64);
+}
+
+void NVMeDriver::invoke_batch_async(unsigned int cid, InvokeBatch& batch,
+                                    AsyncCommandCallback&& callback)
+{
+    if (batch.size() == 0) throw std::invalid_argument("Empty invoke batch");
+
+    auto buf = stage_invoke_batch(batch);
+
+    (void)submit_invoke_batch_command(
+        cid, buf, batch.size(),
+        [this, &batch, buf, callback = std::move(callback)](
+            NVMeStatus status, const NVMeResult& res) {
+            unstage_invoke_batch(batch, buf);
+            if (callback) callback(status, res);
+        });
+}
+
 NVMeDriver::NVMeStatus
 NVMeDriver::submit_ns_mgmt(unsigned int nsid, int sel,
                            MemorySpace::Address buffer, size_t size,
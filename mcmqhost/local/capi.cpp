@@ -14,15 +14,213 @@
 
 #include <libtest_symbols.h>
 
+#include <boost/endian/conversion.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace endian = boost::endian;
+
 #define roundup(x, align) \
     (((x) % align == 0) ? (x) : (((x) + align) - ((x) % align)))
 
+/* The device serializes getnext calls on a scan so more in-flight buffers only
+ * help while the host is the bottleneck. */
+#define SCAN_PIPELINE_MIN_DEPTH 2
+#define SCAN_PIPELINE_MAX_DEPTH 4
+
+#define SCAN_PIPELINE_MIN_BUFSIZE  (16UL << 10)
+#define SCAN_PIPELINE_INIT_BUFSIZE (64UL << 10)
+#define SCAN_PIPELINE_MAX_BUFSIZE  (1UL << 20)
+
+/* Size buffers so that the device takes about this long to fill one. Selective
+ * scans produce output slowly and get small buffers so that the first tuples
+ * arrive early; unselective scans get large buffers to amortize the invocation
+ * overhead. */
+#define SCAN_PIPELINE_TARGET_LATENCY_US 1000
+
+using Clock = std::chrono::steady_clock;
+
+struct ScanBuffer {
+    MemorySpace::Address dma_buf;
+    size_t dma_size;
+    MemorySpace::Address argbuf;
+    size_t buf_size;
+
+    Clock::time_point submit_time;
+    bool completed;
+    bool error;
+    size_t count;
+};
+
+struct storpu_scan_pipeline {
+    /* Protects the completion state of the buffers and the rate estimate. */
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<std::unique_ptr<ScanBuffer>> buffers;
+    std::deque<ScanBuffer*> inflight;
+    std::vector<ScanBuffer*> free_list;
+
+    unsigned int depth;
+    size_t buf_size;
+    double rate; /* Output bytes per microsecond of device time */
+    Clock::time_point last_complete;
+    bool eof;
+
+    std::vector<char> host_buf;
+};
+
 static NVMeDriver* g_nvme_driver;
 static MemorySpace* g_memory_space;
 static PCIeLink* g_pcie_link;
 
 static unsigned int g_storpu_context;
 
+static void pipeline_complete(struct storpu_scan_pipeline* pipe,
+                              ScanBuffer* sb, NVMeDriver::NVMeStatus status,
+                              const NVMeDriver::NVMeResult& res)
+{
+    std::lock_guard<std::mutex> lock(pipe->mutex);
+    auto now = Clock::now();
+
+    if ((status & 0x7ff) != NVME_SC_SUCCESS) {
+        sb->error = true;
+    } else {
+        sb->count = (size_t)endian::little_to_native(res.u64);
+
+        if (sb->count > 0 && sb->count <= sb->buf_size) {
+            /* Calls are serialized on the device so the service time
+             * starts when the previous one completed. */
+            auto start = std::max(sb->submit_time, pipe->last_complete);
+            double us =
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - start)
+                    .count();
+            double sample = (double)sb->count / std::max(us, 1.0);
+
+            if (pipe->rate == 0)
+                pipe->rate = sample;
+            else
+                pipe->rate = (3 * pipe->rate + sample) / 4;
+        }
+    }
+
+    pipe->last_complete = now;
+    sb->completed = true;
+    pipe->cv.notify_all();
+}
+
+static void pipeline_submit(struct storpu_tablescan* scan)
+{
+    auto* pipe = scan->pipeline;
+    auto* scratchpad = g_nvme_driver->get_scratchpad();
+    struct storpu_table_getnext_arg arg;
+    ScanBuffer* sb;
+
+    if (pipe->free_list.empty()) {
+        pipe->buffers.emplace_back(std::make_unique<ScanBuffer>());
+        sb = pipe->buffers.back().get();
+        sb->dma_size = 0;
+        sb->argbuf = scratchpad->allocate(sizeof(arg));
+    } else {
+        sb = pipe->free_list.back();
+        pipe->free_list.pop_back();
+    }
+
+    if (sb->dma_size != pipe->buf_size) {
+        if (sb->dma_size != 0) g_memory_space->free(sb->dma_buf, sb->dma_size);
+
+        sb->dma_buf = g_memory_space->allocate_pages(pipe->buf_size);
+        sb->dma_size = pipe->buf_size;
+    }
+    sb->buf_size = pipe->buf_size;
+
+    arg.scan_state = (void*)scan->handle;
+    arg.buf = (unsigned long)sb->dma_buf;
+    arg.buf_size = sb->buf_size;
+    scratchpad->write(sb->argbuf, &arg, sizeof(arg));
+
+    {
+        std::lock_guard<std::mutex> lock(pipe->mutex);
+        sb->completed = false;
+        sb->error = false;
+        sb->count = 0;
+        sb->submit_time = Clock::now();
+    }
+
+    pipe->inflight.push_back(sb);
+
+    g_nvme_driver->invoke_function_async(
+        g_storpu_context, ENTRY_storpu_table_getnext, sb->argbuf,
+        [pipe, sb](NVMeDriver::NVMeStatus status,
+                   const NVMeDriver::NVMeResult& res) {
+            pipeline_complete(pipe, sb, status, res);
+        });
+}
+
+static void pipeline_wait(struct storpu_scan_pipeline* pipe,
+                          ScanBuffer* sb, bool* waited)
+{
+    std::unique_lock<std::mutex> lock(pipe->mutex);
+
+    *waited = !sb->completed;
+    while (!sb->completed)
+        pipe->cv.wait(lock);
+}
+
+static void pipeline_adapt(struct storpu_scan_pipeline* pipe, bool waited)
+{
+    double rate;
+
+    /* If the next buffer is always ready, the device can run further
+     * ahead of us. Otherwise the device is the bottleneck and extra
+     * buffers would only be wasted when the scan is stopped early. */
+    if (waited) {
+        if (pipe->depth > SCAN_PIPELINE_MIN_DEPTH) pipe->depth--;
+    } else {
+        if (pipe->depth < SCAN_PIPELINE_MAX_DEPTH) pipe->depth++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pipe->mutex);
+        rate = pipe->rate;
+    }
+
+    if (rate > 0) {
+        size_t size = (size_t)(rate * SCAN_PIPELINE_TARGET_LATENCY_US);
+
+        size = std::max(size, SCAN_PIPELINE_MIN_BUFSIZE);
+        size = std::min(size, SCAN_PIPELINE_MAX_BUFSIZE);
+        pipe->buf_size = roundup(size, 0x1000UL);
+    }
+}
+
+static void pipeline_fill(struct storpu_tablescan* scan)
+{
+    auto* pipe = scan->pipeline;
+
+    if (pipe->eof) return;
+
+    while (pipe->inflight.size() < pipe->depth)
+        pipeline_submit(scan);
+}
+
+static void pipeline_drain(struct storpu_scan_pipeline* pipe)
+{
+    bool waited;
+
+    while (!pipe->inflight.empty()) {
+        pipeline_wait(pipe, pipe->inflight.front(), &waited);
+        pipe->free_list.push_back(pipe->inflight.front());
+        pipe->inflight.pop_front();
+    }
+}
+
 extern "C"
 {
 
@@ -122,20 +320,27 @@ extern "C"
             g_storpu_context, ENTRY_storpu_close_relation, (unsigned long)rel);
     }
 
-    struct storpu_tablescan* storpu_table_beginscan(storpu_handle_t rel,
-                                                    struct storpu_scankey* skey,
-                                                    int num_skeys)
+    struct storpu_tablescan*
+    storpu_table_beginscan(storpu_handle_t rel, struct storpu_scankey* skey,
+                           int num_skeys, const uint16_t* proj_attrs,
+                           int num_proj_attrs)
     {
         struct storpu_table_beginscan_arg* arg;
         auto* scratchpad = g_nvme_driver->get_scratchpad();
+        size_t skey_size = num_skeys * sizeof(struct storpu_scankey);
         size_t argsize =
-            sizeof(*arg) + num_skeys * sizeof(struct storpu_scankey);
+            sizeof(*arg) + skey_size + num_proj_attrs * sizeof(uint16_t);
         auto argbuf = scratchpad->allocate(argsize);
 
         arg = (struct storpu_table_beginscan_arg*)malloc(argsize);
 
         arg->relation = (void*)rel;
+        arg->num_proj_attrs = num_proj_attrs;
         arg->num_scankeys = num_skeys;
+        if (num_proj_attrs > 0)
+            memcpy((char*)arg->scankey + skey_size, proj_attrs,
+                   num_proj_attrs * sizeof(uint16_t));
+
         if (num_skeys > 0) {
             for (int i = 0; i < num_skeys; i++) {
                 arg->scankey[i].attr_num = skey[i].attr_num;
@@ -191,6 +396,7 @@ extern "C"
         scan->handle = handle;
         scan->buf = 0;
         scan->buf_size = 0;
+        scan->pipeline = nullptr;
 
         return scan;
     }
@@ -227,10 +433,88 @@ extern "C"
         return count;
     }
 
+    size_t storpu_table_getnext_pipelined(struct storpu_tablescan* scan,
+                                          const char** bufp)
+    {
+        auto* pipe = scan->pipeline;
+
+        if (!pipe) {
+            pipe = new storpu_scan_pipeline();
+            pipe->depth = SCAN_PIPELINE_MIN_DEPTH;
+            pipe->buf_size = SCAN_PIPELINE_INIT_BUFSIZE;
+            pipe->rate = 0;
+            pipe->eof = false;
+            scan->pipeline = pipe;
+        }
+
+        while (true) {
+            pipeline_fill(scan);
+
+            if (pipe->inflight.empty()) return 0;
+
+            ScanBuffer* sb = pipe->inflight.front();
+            bool waited;
+
+            pipeline_wait(pipe, sb, &waited);
+            pipe->inflight.pop_front();
+
+            if (sb->error) {
+                pipe->free_list.push_back(sb);
+                pipe->eof = true;
+                pipeline_drain(pipe);
+                return (size_t)-1;
+            }
+
+            /* The call that hits the end of the scan returns 0 and so do all
+             * calls after it, but calls submitted earlier can be served later
+             * and still carry tuples. */
+            if (sb->count == 0 || sb->count > sb->buf_size) {
+                pipe->free_list.push_back(sb);
+                pipe->eof = true;
+                continue;
+            }
+
+            if (!pipe->eof) pipeline_adapt(pipe, waited);
+
+            if (pipe->host_buf.size() < sb->count)
+                pipe->host_buf.resize(sb->count);
+            g_memory_space->read(sb->dma_buf, pipe->host_buf.data(),
+                                 sb->count);
+
+            size_t count = sb->count;
+            pipe->free_list.push_back(sb);
+
+            /* Let the device work on the next buffers while the caller parses
+             * this one. */
+            pipeline_fill(scan);
+
+            *bufp = pipe->host_buf.data();
+            return count;
+        }
+    }
+
     void storpu_table_endscan(struct storpu_tablescan* scan)
     {
         spdlog::debug("Close StorPU seqscan, handle: {:#x}", scan->handle);
 
+        if (scan->pipeline) {
+            auto* pipe = scan->pipeline;
+            auto* scratchpad = g_nvme_driver->get_scratchpad();
+
+            /* The device must be done with the buffers before the scan state
+             * goes away. */
+            pipeline_drain(pipe);
+
+            for (auto&& sb : pipe->buffers) {
+                if (sb->dma_size != 0)
+                    g_memory_space->free(sb->dma_buf, sb->dma_size);
+                scratchpad->free(sb->argbuf,
+                                 sizeof(struct storpu_table_getnext_arg));
+            }
+
+            delete pipe;
+        }
+
         g_nvme_driver->invoke_function(g_storpu_context,
                                        ENTRY_storpu_table_endscan,
                                        (unsigned long)scan->handle);
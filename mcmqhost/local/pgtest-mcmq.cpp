@@ -280,6 +280,8 @@ int main(int argc, char* argv[])
                 // printf("%ld\n", (int64_t)slot->tts_values[0]);
             }
 
+            if (agg->error) spdlog::error("Aggregation failed: {}", agg->error);
+
             t2 = high_resolution_clock::now();
 
             agg_end(agg);
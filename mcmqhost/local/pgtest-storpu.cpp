@@ -89,6 +89,7 @@ DeviceHandle storpu_table_beginscan(NVMeDriver& driver, unsigned int ctx,
     arg = (struct storpu_table_beginscan_arg*)malloc(argsize);
 
     arg->relation = (void*)rel;
+    arg->num_proj_attrs = 0;
     arg->num_scankeys = num_skeys;
     if (num_skeys > 0) {
         for (int i = 0; i < num_skeys; i++) {
@@ -170,11 +171,15 @@ void storpu_table_endscan(NVMeDriver& driver, unsigned int ctx,
 
 DeviceHandle storpu_aggregate_init(NVMeDriver& driver, unsigned int ctx,
                                    DeviceHandle scan, size_t group_size,
-                                   struct storpu_aggdesc* aggdesc, int num_aggs)
+                                   struct storpu_aggdesc* aggdesc, int num_aggs,
+                                   const uint16_t* group_cols = nullptr,
+                                   int num_group_cols = 0)
 {
     struct storpu_agg_init_arg* arg;
     auto* scratchpad = driver.get_scratchpad();
-    size_t argsize = sizeof(*arg) + num_aggs * sizeof(struct storpu_aggdesc);
+    size_t aggdesc_size = num_aggs * sizeof(struct storpu_aggdesc);
+    size_t argsize =
+        sizeof(*arg) + aggdesc_size + num_group_cols * sizeof(uint16_t);
     auto argbuf = scratchpad->allocate(argsize);
 
     arg = (struct storpu_agg_init_arg*)malloc(argsize);
@@ -182,7 +187,12 @@ DeviceHandle storpu_aggregate_init(NVMeDriver& driver, unsigned int ctx,
     arg->scan_state = (void*)scan;
     arg->group_size = group_size;
     arg->num_aggs = num_aggs;
-    memcpy(arg->aggdesc, aggdesc, num_aggs * sizeof(struct storpu_aggdesc));
+    arg->num_group_cols = num_group_cols;
+    arg->__rsvd0 = 0;
+    memcpy(arg->aggdesc, aggdesc, aggdesc_size);
+    if (num_group_cols > 0)
+        memcpy((char*)arg->aggdesc + aggdesc_size, group_cols,
+               num_group_cols * sizeof(uint16_t));
 
     scratchpad->write(argbuf, arg, argsize);
 
@@ -518,6 +528,10 @@ int main(int argc, char* argv[])
                 auto count =
                     storpu_aggregate_getnext(driver, ctx, agg, buf, buf_size);
 
+                if (count == STORPU_AGG_ERROR) {
+                    spdlog::error("Aggregation failed");
+                    break;
+                }
                 if (count == 0) break;
             }
 
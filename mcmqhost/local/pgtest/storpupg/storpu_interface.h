@@ -14,10 +14,14 @@ struct storpu_scankey {
 #define SSK_VARLEN_ARG 0x1000
 #define SSK_REF_ARG    0x2000
 
+/* Followed by num_proj_attrs uint16_t attribute numbers. If there is any,
+ * getnext returns compact tuples with only these attributes instead of heap
+ * tuples. Each compact tuple is a null bitmap for the projected attributes
+ * followed by the unaligned data of the non-null ones. */
 struct storpu_table_beginscan_arg {
     void* relation;
 
-    int __rsvd0;
+    int num_proj_attrs;
     int num_scankeys;
     struct storpu_scankey scankey[];
 } __attribute__((packed));
@@ -34,11 +38,15 @@ struct storpu_aggdesc {
     uint32_t aggid;
 } __attribute__((packed));
 
+/* Followed by num_group_cols uint16_t grouping attribute numbers. If there
+ * are grouping columns, one tuple is returned per group and group_size is
+ * ignored. */
 struct storpu_agg_init_arg {
     void* scan_state;
     size_t group_size;
     unsigned int num_aggs;
-    uint32_t __rsvd0;
+    uint16_t num_group_cols;
+    uint16_t __rsvd0;
     struct storpu_aggdesc aggdesc[];
 };
 
@@ -48,6 +56,10 @@ struct storpu_agg_getnext_arg {
     size_t buf_size;
 } __attribute__((packed));
 
+/* Returned by aggregate getnext instead of a byte count if the aggregation
+ * failed. */
+#define STORPU_AGG_ERROR ((size_t)-1)
+
 struct storpu_index_beginscan_arg {
     void* heap_relation;
     void* index_relation;
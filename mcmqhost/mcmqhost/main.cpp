@@ -140,9 +140,15 @@ int main(int argc, char* argv[])
 
         const auto& ns = it->second;
 
-        io_threads.emplace_back(IOThread::create_thread(
+        auto thread = IOThread::create_thread(
             &driver, memory_space.get(), thread_id, host_config.io_queue_depth,
-            host_config.sector_size, ns.capacity_sects, flow));
+            host_config.sector_size, ns.capacity_sects, flow);
+        if (!thread) {
+            spdlog::error("Failed to create thread for flow {}", thread_id);
+            return EXIT_FAILURE;
+        }
+
+        io_threads.emplace_back(std::move(thread));
 
         thread_id++;
     }
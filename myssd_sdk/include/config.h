@@ -41,9 +41,13 @@
 
 #define CONFIG_NVME_IO_QUEUE_MAX 16
 
-#define NR_WORKER_THREADS 16
-#define NR_FLUSHERS       8
-#define NR_FTL_THREADS    (NR_WORKER_THREADS + NR_FLUSHERS)
+#define NR_WORKER_THREADS    16
+#define NR_FLUSHERS          8
+#define NR_GC_THREADS        4
+#define NR_READAHEAD_THREADS 4
+#define NR_FTL_THREADS                                 \
+    (NR_WORKER_THREADS + NR_FLUSHERS + NR_GC_THREADS + \
+     NR_READAHEAD_THREADS + 1 /* checkpoint thread */)
 
 #define CONFIG_STORAGE_CAPACITY_BYTES (512ULL << 30) /* 512 GiB */
 
@@ -53,13 +57,67 @@
 #define MAX_DATA_TRANSFER_SIZE 8 /* 256 pages */
 
 #define CONFIG_DATA_CACHE_CAPACITY (512UL << 20) /* 512MB */
+/* Data cache capacity reserved for each namespace. 0 splits the capacity
+ * evenly among the attached namespaces. */
+#define CONFIG_DATA_CACHE_NS_CAPACITY 0
+/* The data cache of a namespace is split into shards by LPA hash. Each shard
+ * has its own index and LRU list. */
+#define DATA_CACHE_SHARDS 8
+/* Data cache pages left to each namespace without a reserved capacity. */
+#define DATA_CACHE_NS_MIN_PAGES (DATA_CACHE_SHARDS * 16)
+
+/* Read ahead sequential read streams into the data cache. Requires the write
+ * cache because writes must go through the cache to keep prefetched pages
+ * coherent. */
+#define USE_READAHEAD (USE_WRITE_CACHE && 1)
+/* Sequential read streams tracked per namespace. */
+#define DATA_CACHE_RA_STREAMS 8
+/* Readahead window in flash pages. The window of a stream starts at the
+ * minimum, doubles on readahead hits and collapses back on misses. */
+#define DATA_CACHE_RA_MIN_PAGES 8
+#define DATA_CACHE_RA_MAX_PAGES 128
 
 #define CONFIG_MAPPING_TABLE_CAPACITY (1UL << 30) /* 1GB */
 
 #define DEFAULT_PLANE_ALLOCATE_SCHEME PAS_CWDP
 
+/* Garbage collection victim selection policies. */
+#define GC_POLICY_GREEDY       0
+#define GC_POLICY_COST_BENEFIT 1
+
+#define GC_VICTIM_POLICY GC_POLICY_COST_BENEFIT
+
+/* Background GC starts on a plane when its free blocks drop below this
+ * watermark. */
+#define GC_FREE_BLOCKS_LOW 32
+/* Foreground writes to a plane are throttled until GC brings its free blocks
+ * back above this watermark. */
+#define GC_FREE_BLOCKS_MIN 8
+
+/* Static wear leveling migrates cold data off the least worn block of a plane
+ * once its erase count falls this far behind the most worn block. */
+#define WL_ERASE_COUNT_THRESHOLD 100
+
+/* The mapping journal of a namespace is checkpointed (translation pages,
+ * directory and block manager state saved) once it grows to this many flash
+ * pages. Bounds recovery time after an unclean shutdown. */
+#define MAPPING_JOURNAL_CHECKPOINT_PAGES 512
+
 #define NAMESPACE_MAX 32
 
+/* StorPU invocations of a context run on a pool of persistent worker threads.
+ * The pool grows on demand up to the maximum and retires workers idle for
+ * longer than the timeout down to the minimum. */
+#define STORPU_POOL_MIN_THREADS     1
+#define STORPU_POOL_MAX_THREADS     8
+#define STORPU_POOL_IDLE_TIMEOUT_MS 1000
+/* CPUs the pool workers are spread over. */
+#define STORPU_POOL_CPU_MASK (1UL << STORPU_CPU_ID)
+
+/* CPUs that run StorPU application threads. Runnable threads are balanced
+ * among them by work stealing. */
+#define STORPU_SCHED_CPU_MASK (((1UL << NR_CPUS) - 1) & ~(1UL << FTL_CPU_ID))
+
 #define FILE_MAX 1
 
 #endif
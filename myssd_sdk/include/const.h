@@ -53,6 +53,7 @@
 #define IOREQ_FLUSH_DATA   4
 #define IOREQ_SYNC         5
 #define IOREQ_WRITE_ZEROES 6
+#define IOREQ_DEALLOCATE   7
 
 /* Default stack size */
 #define K_STACK_SIZE 0x1000
@@ -33,6 +33,10 @@ struct fil_task {
     uint64_t err_bitmap;    /* 128 */
 } __attribute__((packed));
 
+/* Task slots in the RPU TCM: one per FTL thread, one for dump requests and
+ * FIL_BATCH_MAX for batched submissions. */
+#define FIL_BATCH_MAX 64
+
 void fil_init(void);
 
 #endif
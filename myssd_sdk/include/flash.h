@@ -91,6 +91,8 @@ struct flash_transaction {
     struct flash_address addr;
     page_bitmap_t bitmap;
     int ppa_ready;
+    /* Writes a translation or journal page. */
+    int for_mapping;
     void* opaque;
 
     uint8_t* data;
@@ -112,6 +114,22 @@ struct page_metadata {
     lpa_t lpa;
 };
 
+/* Reverse mapping stamped into the metadata area (FLASH_PG_META_SIZE bytes
+ * after the user data) of every page programmed by the FTL. seq increases
+ * with every program so that the latest copy of a logical page can be found
+ * by scanning the flash. */
+#define PAGE_OOB_MAGIC 0x424f4f50 /* "POOB" */
+
+#define POF_MAPPING 0x1
+
+struct page_oob {
+    uint32_t magic;
+    uint32_t nsid;
+    uint32_t lpa;
+    uint32_t flags;
+    uint64_t seq;
+};
+
 enum flash_command_code {
     FCMD_READ_PAGE,
     FCMD_READ_PAGE_MULTIPLANE,
@@ -6,6 +6,9 @@
 #define FLASH_PG_SHIFT    14U
 #define FLASH_PG_SIZE     (1U << FLASH_PG_SHIFT)
 #define FLASH_PG_OOB_SIZE (1872)
+/* Metadata programmed as one extra ECC step after the user data. The rest of
+ * the spare area holds the ECC codes. */
+#define FLASH_PG_META_SIZE 512
 /* Full page size (user data + spare), rounded up to memory page size. */
 #define FLASH_PG_BUFFER_SIZE \
     (roundup(FLASH_PG_SIZE + FLASH_PG_OOB_SIZE, 0x1000))
@@ -35,8 +38,16 @@
 #define CHANNEL_ENABLE_MASK       0b11111111
 #define CHIPS_ENABLED_PER_CHANNEL CHIPS_PER_CHANNEL
 
+/* Pack commands to the same page of different planes into multi-plane
+ * commands. Requires an NFC that implements the multi-plane confirm commands
+ * (NFC_CMD_*_MULTIPLANE). */
 /* #define ENABLE_MULTIPLANE */
 
+/* Suspend an executing program/erase command when a host or mapping read
+ * targets the same die. Requires an NFC that implements NFC_CMD_SUSPEND and
+ * NFC_CMD_RESUME. */
+/* #define ENABLE_PE_SUSPEND */
+
 /* clang-format off */
 
 #if CHIPS_PER_CHANNEL == 4
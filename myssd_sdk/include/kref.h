@@ -12,6 +12,20 @@ static inline void kref_get(struct kref* kref)
     __sync_add_and_fetch(&kref->refcount, 1);
 }
 
+/* Returns 0 if the object is already being released. */
+static inline int kref_get_unless_zero(struct kref* kref)
+{
+    int old = kref->refcount;
+
+    while (old != 0) {
+        int prev = __sync_val_compare_and_swap(&kref->refcount, old, old + 1);
+        if (prev == old) return 1;
+        old = prev;
+    }
+
+    return 0;
+}
+
 static inline int kref_put(struct kref* kref,
                            void (*release)(struct kref* kref))
 {
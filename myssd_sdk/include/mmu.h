@@ -1,6 +1,8 @@
 #ifndef _MMU_H_
 #define _MMU_H_
 
+#include <barrier.h>
+
 static inline void flush_tlb(void)
 {
     dsb(nshst);
@@ -9,4 +11,13 @@ static inline void flush_tlb(void)
     isb();
 }
 
+/* Invalidate the TLB entries on all CPUs in the inner shareable domain. */
+static inline void flush_tlb_all(void)
+{
+    dsb(ishst);
+    asm("tlbi vmalle1is\n" ::);
+    dsb(ish);
+    isb();
+}
+
 #endif
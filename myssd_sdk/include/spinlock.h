@@ -26,6 +26,11 @@ static inline void spin_lock(spinlock_t* lock)
 #endif
 }
 
+static inline int spin_trylock(spinlock_t* lock)
+{
+    return !__sync_lock_test_and_set(&lock->lock, 1);
+}
+
 static inline void spin_unlock(spinlock_t* lock)
 {
     __sync_lock_release(&lock->lock);
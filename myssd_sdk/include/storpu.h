@@ -5,9 +5,28 @@
 
 /* FTL -> StorPU task */
 
-#define SPU_TYPE_CREATE_CONTEXT 1
-#define SPU_TYPE_DELETE_CONTEXT 2
-#define SPU_TYPE_INVOKE         3
+#define SPU_TYPE_CREATE_CONTEXT  1
+#define SPU_TYPE_DELETE_CONTEXT  2
+#define SPU_TYPE_INVOKE          3
+#define SPU_TYPE_REGISTER_RING   4
+#define SPU_TYPE_UNREGISTER_RING 5
+#define SPU_TYPE_INVOKE_BATCH    6
+
+/* Batch invocation descriptor, staged in the scratchpad by the host. Entries
+ * run in order. With STORPU_INVOKE_ARG_RESULT, the result of the earlier entry
+ * dep is added to arg. With STORPU_INVOKE_STOP_IF_ZERO, the batch stops after
+ * the entry if it returns 0. */
+#define STORPU_INVOKE_ARG_RESULT   0x1
+#define STORPU_INVOKE_STOP_IF_ZERO 0x2
+#define STORPU_INVOKE_BATCH_MAX    256
+
+struct storpu_invoke_desc {
+    u64 entry;
+    u64 arg;
+    u32 flags;
+    u32 dep;
+    u64 result;
+};
 
 struct storpu_task {
     struct llist_node llist;
@@ -29,7 +48,19 @@ struct storpu_task {
             unsigned long entry;
             unsigned long arg;
             unsigned long result;
+            /* SPU_TYPE_INVOKE_BATCH only. The result is the number of
+             * entries that completed, which excludes an entry that
+             * faulted. */
+            struct storpu_invoke_desc* descs;
+            unsigned int nr_descs;
         } invoke;
+
+        struct {
+            u32 cid;
+            unsigned long host_addr;
+            size_t size;
+            u32 ring_id;
+        } result_ring;
     };
 
     void* opaque;
@@ -72,10 +103,15 @@ struct storpu_ftl_task {
     unsigned long addr;
     size_t count;
 
+    /* Called on the source CPU when the task completes. If not set, opaque is
+     * the thread blocked on this task and it will be woken up. */
+    void (*complete)(struct storpu_ftl_task* task);
     void* opaque;
 };
 
 void enqueue_storpu_ftl_task(struct storpu_ftl_task* task);
+void enqueue_storpu_ftl_tasks(struct storpu_ftl_task* first,
+                              struct storpu_ftl_task* last);
 struct storpu_ftl_task* dequeue_storpu_ftl_task(void);
 void enqueue_storpu_ftl_completion(struct storpu_ftl_task* task);
 
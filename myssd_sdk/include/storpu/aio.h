@@ -0,0 +1,42 @@
+#ifndef _STORPU_AIO_H_
+#define _STORPU_AIO_H_
+
+#include <sys/types.h>
+
+#define SPU_AIO_READ      0
+#define SPU_AIO_WRITE     1
+#define SPU_AIO_FSYNC     2
+#define SPU_AIO_FDATASYNC 3
+
+#define SPU_AIO_MAX_EVENTS 1024
+
+typedef unsigned int spu_aio_context_t;
+
+struct spu_iocb {
+    void* data; /* Returned in the completion event as-is. */
+    int opcode;
+    int fd;
+    void* buf;
+    size_t count;
+    unsigned long offset;
+};
+
+struct spu_io_event {
+    void* data;
+    struct spu_iocb* obj;
+    long res; /* Bytes transferred or -errno. */
+};
+
+struct vm_context;
+
+void aio_init(void);
+void aio_destroy_context(struct vm_context* ctx);
+
+int sys_aio_setup(unsigned int nr_events, spu_aio_context_t* ctxp);
+int sys_aio_destroy(spu_aio_context_t ctx_id);
+long sys_aio_submit(spu_aio_context_t ctx_id, long nr,
+                    struct spu_iocb** iocbpp);
+long sys_aio_getevents(spu_aio_context_t ctx_id, long min_nr, long nr,
+                       struct spu_io_event* events);
+
+#endif
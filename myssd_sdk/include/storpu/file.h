@@ -2,10 +2,24 @@
 #define _STORPU_FILE_H_
 
 #include <sys/types.h>
+#include <types.h>
 
 #define FD_HOST_MEM   (-2)
 #define FD_SCRATCHPAD (-3)
 
+struct storpu_ftl_task;
+
+int file_init_task(struct storpu_ftl_task* task, int fd, void* buf,
+                   size_t count, unsigned long offset, int do_write);
+/* Same as above for a physically contiguous kernel buffer. */
+void file_init_task_phys(struct storpu_ftl_task* task, int fd,
+                         phys_addr_t buf_phys, size_t count,
+                         unsigned long offset, int do_write);
+
+/* Blocking transfer to/from a physically contiguous kernel buffer. */
+ssize_t file_readwrite_phys(int fd, phys_addr_t buf_phys, size_t count,
+                            unsigned long offset, int do_write);
+
 ssize_t spu_read(int fd, void* buf, size_t count, unsigned long offset);
 ssize_t spu_write(int fd, const void* buf, size_t count, unsigned long offset);
 
@@ -0,0 +1,49 @@
+#ifndef _STORPU_RESULT_RING_H_
+#define _STORPU_RESULT_RING_H_
+
+#include <sys/types.h>
+#include <types.h>
+
+/* Host memory layout of a result ring. Must match libunvme. The header is
+ * followed by a data area of power-of-two size. Offsets increase
+ * monotonically and are taken modulo the data area size. */
+struct spu_result_ring_header {
+    u64 head; /* Producer offset, written by the device. */
+    u8 __pad0[56];
+    u64 tail; /* Consumer offset, written by the host. */
+    u8 __pad1[56];
+};
+
+#define SPU_RESULT_RING_DATA_OFFSET sizeof(struct spu_result_ring_header)
+
+#define SPU_RESULT_RING_MIN_SIZE (4UL << 10)
+#define SPU_RESULT_RING_MAX_SIZE (64UL << 20)
+
+/* Records are 8-byte aligned and never wrap around the data area. */
+struct spu_result_record {
+    u32 len;
+    u32 flags;
+};
+
+#define SPU_RESULT_RECORD_ALIGN 8
+
+#define SPU_RESULT_PAD 0x1 /* Skip to the start of the data area. */
+#define SPU_RESULT_EOS 0x2 /* Last record of the stream. */
+
+typedef unsigned int spu_result_ring_t;
+
+struct vm_context;
+
+void result_ring_init(void);
+
+int result_ring_register(struct vm_context* ctx, unsigned long host_addr,
+                         size_t size, spu_result_ring_t* ringp);
+int result_ring_unregister(struct vm_context* ctx, spu_result_ring_t ring_id);
+void result_ring_destroy_context(struct vm_context* ctx);
+
+int sys_result_ring_append(spu_result_ring_t ring_id, const void* buf,
+                           size_t len);
+int sys_result_ring_flush(spu_result_ring_t ring_id);
+int sys_result_ring_close(spu_result_ring_t ring_id);
+
+#endif
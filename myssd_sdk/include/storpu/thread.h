@@ -11,6 +11,7 @@
 #include <storpu/condvar.h>
 
 struct vm_context;
+struct pool_worker;
 
 #define THREAD_RUNNING  0x000
 #define THREAD_BLOCKED  0x001
@@ -53,6 +54,8 @@ struct thread {
     unsigned long result;
 
     void* task;
+    /* Set if the thread is a worker of a context thread pool. */
+    struct pool_worker* pool_worker;
 
     spinlock_t pi_lock;
     unsigned int cpu;
@@ -67,6 +70,8 @@ struct thread {
     cpumask_t cpus_mask;
 
     void* migration_pending;
+
+    int exit_hook_called;
 };
 
 #define MAIN_THREAD ((thread_id_t)-1)
@@ -150,5 +155,7 @@ void sys_thread_exit(unsigned long result) __attribute__((noreturn));
 
 int sys_sched_setaffinity(thread_id_t tid, size_t cpusetsize,
                           const unsigned long* mask);
+int sys_sched_getcpu(void);
+
 
 #endif
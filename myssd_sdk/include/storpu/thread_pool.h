@@ -0,0 +1,15 @@
+#ifndef _STORPU_THREAD_POOL_H_
+#define _STORPU_THREAD_POOL_H_
+
+struct vm_context;
+struct storpu_task;
+struct thread;
+
+int thread_pool_submit(struct vm_context* ctx, struct storpu_task* req);
+void thread_pool_destroy(struct vm_context* ctx);
+void thread_pool_reap_idle(void);
+
+void thread_pool_worker_exiting(struct thread* thread);
+void thread_pool_worker_exit(struct thread* thread);
+
+#endif
@@ -73,6 +73,7 @@ struct vumap_phys {
 
 struct stackframe;
 struct so_info;
+struct thread_pool;
 
 struct vm_context {
     unsigned int cid;
@@ -93,6 +94,16 @@ struct vm_context {
     size_t tls_static_space;
 
     size_t vm_total;
+
+    /* Page cache pages (in ARCH_PG_SIZE units) brought in by this context. */
+    unsigned long cache_pages;
+    unsigned long cache_limit;
+
+    /* Workers that run the invocations of this context. */
+    struct thread_pool* pool;
+
+    /* Run by user threads of this context before they exit. */
+    void (*thread_exit_hook)(void);
 };
 
 void vm_init(void);
@@ -115,7 +126,10 @@ int vm_unmap(struct vm_context* ctx, void* addr, size_t length);
 int vm_exec(struct vm_context* ctx, void* elf_base);
 
 struct tls_tcb;
-int ldso_init_context(struct vm_context* ctx);
+void ldso_init(void);
+int ldso_init_context(struct vm_context* ctx, int relocated);
+void ldso_start_context(struct vm_context* ctx);
+int ldso_can_share_image(struct vm_context* ctx);
 int ldso_allocate_tls(struct vm_context* ctx, struct tls_tcb** tcbp);
 
 int sys_brk(void* addr);
@@ -123,5 +137,6 @@ int sys_munmap(void* addr, size_t length);
 int sys_mmap(void* addr, size_t length, int prot, int flags, int fd,
              unsigned long offset, void** out_addr);
 int sys_msync(void* addr, size_t length, int flags);
+int sys_thread_set_exit_hook(void (*hook)(void));
 
 #endif
@@ -30,6 +30,12 @@
 #define TRAINING_BLOCK 12
 #define TRAINING_PAGE  1
 
+/* Do not suspend a command that is about to finish anyway. */
+#define SUSPEND_MIN_REMAINING_US 100
+/* Maximum number of times a command can be suspended before it is allowed to
+ * run to completion. */
+#define SUSPEND_MAX_COUNT 4
+
 struct chip_data;
 struct channel_data;
 
@@ -58,8 +64,21 @@ struct die_data {
     struct chip_data* chip;
 
     struct fil_task* active_xfer;
+    /* Transaction whose data is being transferred into the page register for
+     * a program command. The planes of a multi-plane program are transferred
+     * one at a time. */
+    struct fil_task* data_in_txn;
 
     u64 exec_start_cycle;
+
+    /* Program/erase command suspended to let reads through. The die accepts
+     * read commands only until it is resumed. */
+    int suspended;
+    struct flash_command suspended_cmd;
+    struct list_head suspended_txns;
+    u64 suspended_remaining_cycles;
+    unsigned int nr_suspends;
+    unsigned int total_suspends;
 };
 
 enum chip_status {
@@ -191,9 +210,10 @@ static inline u32 get_command_latency_us(struct chip_data* chip,
 }
 
 int fil_is_die_busy(unsigned int channel_nr, unsigned int chip_nr,
-                    unsigned int die_nr, int is_program)
+                    unsigned int die_nr, int txn_type)
 {
     struct chip_data* chip;
+    int i;
 
     /* Two rules for submitting multi-LUN (interleaved) operations:
      *
@@ -214,9 +234,15 @@ int fil_is_die_busy(unsigned int channel_nr, unsigned int chip_nr,
 
     chip = &channel_data[channel_nr].chips[chip_nr];
 
-    if (is_program) {
-        int i;
+    /* While a program/erase is suspended, only reads can be issued to the
+     * chip. */
+    if (txn_type != TXN_READ) {
+        for (i = 0; i < DIES_PER_CHIP; i++) {
+            if (chip->dies[i].suspended) return TRUE;
+        }
+    }
 
+    if (txn_type == TXN_WRITE) {
         for (i = 0; i < DIES_PER_CHIP; i++) {
             struct die_data* die = &chip->dies[i];
 
@@ -320,6 +346,11 @@ static void init_die(struct die_data* die)
 {
     INIT_LIST_HEAD(&die->active_txns);
     die->active_cmd = NULL;
+    die->data_in_txn = NULL;
+
+    die->suspended = FALSE;
+    INIT_LIST_HEAD(&die->suspended_txns);
+    die->total_suspends = 0;
 }
 
 static void init_chip(struct chip_data* chip, int ce_pin)
@@ -743,6 +774,19 @@ static int start_data_out_transfer(struct channel_data* channel)
     return TRUE;
 }
 
+static inline int is_pe_command(struct flash_command* cmd)
+{
+    switch (cmd->cmd_code) {
+    case FCMD_PROGRAM_PAGE:
+    case FCMD_PROGRAM_PAGE_MULTIPLANE:
+    case FCMD_ERASE_BLOCK:
+    case FCMD_ERASE_BLOCK_MULTIPLANE:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
 static int start_die_command(struct chip_data* chip, struct flash_command* cmd)
 {
     struct die_data* die = &chip->dies[cmd->addrs[0].die];
@@ -755,12 +799,17 @@ static int start_die_command(struct chip_data* chip, struct flash_command* cmd)
     die->cmd_finish_time = now + timer_us_to_cycles(cmd_latency_us);
     die->current_cmd = cmd;
     die->cmd_error = FALSE;
+    /* Reads issued while a program/erase is suspended must not reset its
+     * count. */
+    if (is_pe_command(cmd)) die->nr_suspends = 0;
 
     switch (cmd->cmd_code) {
     case FCMD_READ_PAGE:
+    case FCMD_READ_PAGE_MULTIPLANE:
         nfc_cmd_read_page(&chip->channel->nfc);
         break;
     case FCMD_PROGRAM_PAGE:
+    case FCMD_PROGRAM_PAGE_MULTIPLANE:
         nfc_cmd_program_page(&chip->channel->nfc);
         break;
     default:
@@ -775,13 +824,41 @@ static int start_die_command(struct chip_data* chip, struct flash_command* cmd)
     return TRUE;
 }
 
+/* Wait for tDBSY after a multi-plane confirm cycle before the next plane is
+ * addressed. */
+static void wait_plane_ready(struct nf_controller* nfc, struct fil_task* txn)
+{
+    int ready, error = FALSE;
+
+    do {
+        ready = nfc_is_ready(nfc, txn->addr.die, txn->addr.plane, &error);
+    } while (!(ready || error));
+}
+
+static inline int is_last_plane(struct die_data* die, struct fil_task* txn)
+{
+    return txn->queue.next == &die->active_txns;
+}
+
+static void start_program_transfer(struct nf_controller* nfc,
+                                   struct fil_task* txn)
+{
+    unsigned int start_step = txn->offset / nfc->step_size;
+    size_t nr_steps = (txn->length + nfc->step_size - 1) / nfc->step_size;
+
+    nfc_cmd_program_transfer(nfc, txn->addr.die, txn->addr.plane,
+                             txn->addr.block, txn->addr.page,
+                             start_step * (nfc->step_size + nfc->code_size),
+                             txn->data + start_step * nfc->step_size,
+                             nr_steps * nfc->step_size);
+}
+
 static int start_cmd_data_transfer(struct chip_data* chip)
 {
     struct die_data* die;
-    struct fil_task* head;
+    struct fil_task *head, *txn;
     struct nf_controller* nfc;
     unsigned int start_step;
-    size_t nr_steps;
     int completed = FALSE;
     u64 now = timer_get_cycles();
 
@@ -795,39 +872,58 @@ static int start_cmd_data_transfer(struct chip_data* chip)
     set_chip_status(chip, CS_CMD_DATA_IN);
     chip->current_xfer = die;
 
-    /* TODO: handle multi-plane commands */
     head = list_entry(die->active_txns.next, struct fil_task, queue);
 
     select_volume(chip, TRUE);
 
     chip->last_xfer_start = now;
 
-    start_step = head->offset / nfc->step_size;
-    nr_steps = (head->length + nfc->step_size - 1) / nfc->step_size;
-
     switch (die->active_cmd->cmd_code) {
     case FCMD_READ_PAGE:
-        /* If code is requested, we re-adjust the offset to point to the
-         * real beginning of the ECC block. Otherwise the raw offset is
-         * used. */
-        nfc_cmd_read_page_addr(
-            nfc, head->addr.die, head->addr.plane, head->addr.block,
-            head->addr.page,
-            (head->code_length > 0)
-                ? (start_step * (nfc->step_size + nfc->code_size))
-                : head->offset);
+    case FCMD_READ_PAGE_MULTIPLANE:
+        /* Address every plane. All but the last one are confirmed with READ
+         * PAGE MULTI-PLANE here and the last one with READ PAGE when the
+         * command starts. */
+        list_for_each_entry(txn, &die->active_txns, queue)
+        {
+            /* If code is requested, we re-adjust the offset to point to the
+             * real beginning of the ECC block. Otherwise the raw offset is
+             * used. */
+            start_step = txn->offset / nfc->step_size;
+            nfc_cmd_read_page_addr(
+                nfc, txn->addr.die, txn->addr.plane, txn->addr.block,
+                txn->addr.page,
+                (txn->code_length > 0)
+                    ? (start_step * (nfc->step_size + nfc->code_size))
+                    : txn->offset);
+
+            if (!is_last_plane(die, txn)) {
+                nfc_cmd_read_page_multiplane(nfc);
+                wait_plane_ready(nfc, txn);
+            }
+        }
         completed = TRUE;
         break;
     case FCMD_PROGRAM_PAGE:
-        nfc_cmd_program_transfer(nfc, head->addr.die, head->addr.plane,
-                                 head->addr.block, head->addr.page,
-                                 start_step * (nfc->step_size + nfc->code_size),
-                                 head->data + start_step * nfc->step_size,
-                                 nr_steps * nfc->step_size);
+    case FCMD_PROGRAM_PAGE_MULTIPLANE:
+        /* The remaining planes are transferred in complete_chip_transfer(). */
+        die->data_in_txn = head;
+        start_program_transfer(nfc, head);
         break;
     case FCMD_ERASE_BLOCK:
-        nfc_cmd_erase_block(&chip->channel->nfc, head->addr.die,
-                            head->addr.plane, head->addr.block);
+    case FCMD_ERASE_BLOCK_MULTIPLANE:
+        list_for_each_entry(txn, &die->active_txns, queue)
+        {
+            if (is_last_plane(die, txn)) {
+                nfc_cmd_erase_block(nfc, txn->addr.die, txn->addr.plane,
+                                    txn->addr.block);
+            } else {
+                nfc_cmd_erase_block_multiplane(nfc, txn->addr.die,
+                                               txn->addr.plane,
+                                               txn->addr.block);
+                wait_plane_ready(nfc, txn);
+            }
+        }
         completed = TRUE;
         break;
     default:
@@ -853,6 +949,28 @@ static void complete_chip_transfer(struct chip_data* chip, u64 timestamp)
     struct fil_task* txn;
     unsigned int xfer_time;
 
+    if (die->data_in_txn) {
+        txn = die->data_in_txn;
+
+        if (!is_last_plane(die, txn)) {
+            struct nf_controller* nfc = &channel->nfc;
+
+            /* Confirm this plane with PROGRAM PAGE MULTI-PLANE and move on
+             * to the data of the next plane. */
+            nfc_cmd_program_page_multiplane(nfc);
+            wait_plane_ready(nfc, txn);
+
+            txn = list_entry(txn->queue.next, struct fil_task, queue);
+            die->data_in_txn = txn;
+            start_program_transfer(nfc, txn);
+
+            list_add_tail(&chip->completion, &chip_in_transfer_list);
+            return;
+        }
+
+        die->data_in_txn = NULL;
+    }
+
     xfer_time = timestamp - chip->last_xfer_start;
 
     Xil_AssertVoid(!list_empty(&die->active_txns));
@@ -892,6 +1010,105 @@ static void complete_chip_transfer(struct chip_data* chip, u64 timestamp)
     tsu_notify_channel_idle(channel->index);
 }
 
+int fil_suspend_die(struct fil_task* read_txn)
+{
+    struct channel_data* channel = &channel_data[read_txn->addr.channel];
+    struct chip_data* chip = &channel->chips[read_txn->addr.chip];
+    struct die_data* die = &chip->dies[read_txn->addr.die];
+    struct flash_command* cmd = die->current_cmd;
+    struct fil_task* txn;
+    u64 now = timer_get_cycles();
+    int ready, error = FALSE;
+
+    if (get_channel_status(channel) != BUS_IDLE) return FALSE;
+
+    /* Only a program/erase that has entered the array operation phase can be
+     * suspended. */
+    if (!cmd || die->suspended || !is_pe_command(cmd)) return FALSE;
+    if (die->nr_suspends >= SUSPEND_MAX_COUNT) return FALSE;
+    if (die->cmd_finish_time <
+        now + timer_us_to_cycles(SUSPEND_MIN_REMAINING_US))
+        return FALSE;
+
+    /* The read cannot be served from a block that is being modified. */
+    list_for_each_entry(txn, &die->active_txns, queue)
+    {
+        if (txn->addr.plane == read_txn->addr.plane &&
+            txn->addr.block == read_txn->addr.block)
+            return FALSE;
+    }
+
+    select_volume(chip, TRUE);
+    nfc_cmd_suspend(&channel->nfc, die->index, cmd->addrs[0].plane);
+    do {
+        ready = nfc_is_ready(&channel->nfc, die->index, cmd->addrs[0].plane,
+                             &error);
+    } while (!(ready || error));
+    select_volume(chip, FALSE);
+
+    now = timer_get_cycles();
+    avl_erase(&die->avl, &die_command_avl);
+
+    list_for_each_entry(txn, &die->active_txns, queue)
+    {
+        txn->total_exec_us += now - die->exec_start_cycle;
+    }
+
+    die->suspended = TRUE;
+    die->suspended_cmd = *cmd;
+    die->suspended_remaining_cycles =
+        die->cmd_finish_time > now ? die->cmd_finish_time - now : 0;
+    list_splice_init(&die->active_txns, &die->suspended_txns);
+    die->nr_suspends++;
+    die->total_suspends++;
+
+    die->current_cmd = NULL;
+    die->active_cmd = NULL;
+    die->cmd_finish_time = UINT64_MAX;
+
+    chip->active_dies--;
+    if (!chip->active_dies && !chip->nr_waiting_read_xfers)
+        set_chip_status(chip, CS_IDLE);
+
+    return TRUE;
+}
+
+/* Resume the suspended program/erase once the reads on the die are done and
+ * the channel is free for the resume command. */
+static void resume_die(struct chip_data* chip, struct die_data* die)
+{
+    struct flash_command* cmd = &die->cmd_buf;
+    int is_program;
+    u64 now;
+
+    if (!die->suspended || die->active_cmd) return;
+    if (get_channel_status(chip->channel) != BUS_IDLE) return;
+
+    *cmd = die->suspended_cmd;
+    is_program = cmd->cmd_code == FCMD_PROGRAM_PAGE ||
+                 cmd->cmd_code == FCMD_PROGRAM_PAGE_MULTIPLANE;
+
+    select_volume(chip, TRUE);
+    nfc_cmd_resume(&chip->channel->nfc, die->index, cmd->addrs[0].plane);
+    select_volume(chip, FALSE);
+
+    now = timer_get_cycles();
+    die->suspended = FALSE;
+    list_splice_init(&die->suspended_txns, &die->active_txns);
+
+    die->active_cmd = cmd;
+    die->current_cmd = cmd;
+    die->cmd_error = FALSE;
+    die->exec_start_cycle = now;
+    die->cmd_finish_time = now + die->suspended_remaining_cycles;
+    avl_insert(&die->avl, &die_command_avl);
+
+    chip->active_dies++;
+
+    if (chip->status == CS_IDLE)
+        set_chip_status(chip, is_program ? CS_WRITING : CS_ERASING);
+}
+
 static void complete_die_command(struct chip_data* chip, struct die_data* die,
                                  int error, u64 timestamp)
 {
@@ -944,6 +1161,8 @@ static void complete_die_command(struct chip_data* chip, struct die_data* die,
         if (!chip->active_dies) set_chip_status(chip, CS_IDLE);
     }
 
+    resume_die(chip, die);
+
     if (get_channel_status(chip->channel) == BUS_IDLE)
         tsu_notify_channel_idle(chip->channel->index);
     if (chip->status == CS_IDLE)
@@ -991,6 +1210,7 @@ static void complete_data_out_transfer(struct chip_data* chip,
     }
 
     set_channel_status(chip->channel, BUS_IDLE);
+    resume_die(chip, die);
     tsu_notify_channel_idle(chip->channel->index);
 }
 
@@ -1181,6 +1401,14 @@ static void check_completion(void)
 
     for (i = 0; i < NR_CHANNELS; i++) {
         struct channel_data* channel = &channel_data[i];
+        int j, k;
+
+        /* Resume the suspended dies whose resume was deferred because the
+         * channel was busy. */
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++)
+                resume_die(&channel->chips[j], &channel->chips[j].dies[k]);
+        }
 
         start_data_out_transfer(channel);
         if (get_channel_status(channel) == BUS_IDLE) tsu_notify_channel_idle(i);
@@ -1257,6 +1485,19 @@ void fil_report_stats(void)
                         addr->page);
                 }
 
+                if (die_data->suspended) {
+                    struct flash_address* addr =
+                        &die_data->suspended_cmd.addrs[0];
+
+                    xil_printf(
+                        "      Suspended command: (t%d ch%d w%d d%d pl%d b%d p%d)\n",
+                        die_data->suspended_cmd.cmd_code, addr->channel,
+                        addr->chip, addr->die, addr->plane, addr->block,
+                        addr->page);
+                }
+
+                xil_printf("      Suspensions: %u\n", die_data->total_suspends);
+
                 if (die_data->active_xfer) {
                     struct fil_task* txn = die_data->active_xfer;
 
@@ -15,7 +15,8 @@ enum channel_status {
 void fil_init(void);
 /* int fil_is_channel_busy(unsigned int channel); */
 int fil_is_die_busy(unsigned int channel, unsigned int chip, unsigned int die,
-                    int is_program);
+                    int txn_type);
+int fil_suspend_die(struct fil_task* read_txn);
 void fil_dispatch(struct list_head* txn_list);
 void fil_tick(void);
 void fil_report_stats(void);
@@ -308,6 +308,13 @@ int nfc_cmd_read_page(struct nf_controller* nfc)
     return 0;
 }
 
+int nfc_cmd_read_page_multiplane(struct nf_controller* nfc)
+{
+    nfc_writel(nfc, NFC_COMMAND_REG, NFC_CMD_READ_PAGE_MULTIPLANE);
+    wait_cmd(nfc);
+    return 0;
+}
+
 int nfc_cmd_read_transfer(struct nf_controller* nfc, unsigned int die,
                           unsigned int plane, u64 buf, size_t len, u64 code_buf)
 {
@@ -353,6 +360,13 @@ int nfc_cmd_program_page(struct nf_controller* nfc)
     return 0;
 }
 
+int nfc_cmd_program_page_multiplane(struct nf_controller* nfc)
+{
+    nfc_writel(nfc, NFC_COMMAND_REG, NFC_CMD_PROGRAM_PAGE_MULTIPLANE);
+    wait_cmd(nfc);
+    return 0;
+}
+
 int nfc_cmd_erase_block(struct nf_controller* nfc, unsigned int die,
                         unsigned int plane, unsigned int block)
 {
@@ -362,6 +376,33 @@ int nfc_cmd_erase_block(struct nf_controller* nfc, unsigned int die,
     return 0;
 }
 
+int nfc_cmd_erase_block_multiplane(struct nf_controller* nfc, unsigned int die,
+                                   unsigned int plane, unsigned int block)
+{
+    setup_address(nfc, die, plane, block, 0, 0);
+    nfc_writel(nfc, NFC_COMMAND_REG, NFC_CMD_ERASE_BLOCK_MULTIPLANE);
+    wait_cmd(nfc);
+    return 0;
+}
+
+int nfc_cmd_suspend(struct nf_controller* nfc, unsigned int die,
+                    unsigned int plane)
+{
+    setup_address(nfc, die, plane, 0, 0, 0);
+    nfc_writel(nfc, NFC_COMMAND_REG, NFC_CMD_SUSPEND);
+    wait_cmd(nfc);
+    return 0;
+}
+
+int nfc_cmd_resume(struct nf_controller* nfc, unsigned int die,
+                   unsigned int plane)
+{
+    setup_address(nfc, die, plane, 0, 0, 0);
+    nfc_writel(nfc, NFC_COMMAND_REG, NFC_CMD_RESUME);
+    wait_cmd(nfc);
+    return 0;
+}
+
 int nfc_cmd_get_delay(struct nf_controller* nfc, int select)
 {
     int delay_val;
@@ -71,6 +71,14 @@ struct nf_controller {
 #define NFC_CMD_SET_FEATURE_LUN 14
 #define NFC_CMD_VOLUME_SELECT   15
 #define NFC_CMD_ODT_CONFIGURE   16
+/* Multi-plane confirm cycles (32h, 11h and 60h-D1h). All planes but the last
+ * one of a multi-plane operation are confirmed with these. */
+#define NFC_CMD_READ_PAGE_MULTIPLANE    17
+#define NFC_CMD_PROGRAM_PAGE_MULTIPLANE 18
+#define NFC_CMD_ERASE_BLOCK_MULTIPLANE  19
+/* Program/erase suspend and resume of the addressed LUN. */
+#define NFC_CMD_SUSPEND 20
+#define NFC_CMD_RESUME  21
 
 /* Transfer direction */
 #define NFC_FROM_NAND 0
@@ -97,6 +105,7 @@ int nfc_cmd_read_page_addr(struct nf_controller* nfc, unsigned int die,
                            unsigned int plane, unsigned int block,
                            unsigned int page, unsigned int col);
 int nfc_cmd_read_page(struct nf_controller* nfc);
+int nfc_cmd_read_page_multiplane(struct nf_controller* nfc);
 int nfc_cmd_read_transfer(struct nf_controller* nfc, unsigned int die,
                           unsigned int plane, u64 buf, size_t len,
                           u64 code_buf);
@@ -106,9 +115,17 @@ int nfc_cmd_program_transfer(struct nf_controller* nfc, unsigned int die,
                              unsigned int page, unsigned int col, u64 buf,
                              size_t len);
 int nfc_cmd_program_page(struct nf_controller* nfc);
+int nfc_cmd_program_page_multiplane(struct nf_controller* nfc);
 
 int nfc_cmd_erase_block(struct nf_controller* nfc, unsigned int die,
                         unsigned int plane, unsigned int block);
+int nfc_cmd_erase_block_multiplane(struct nf_controller* nfc, unsigned int die,
+                                   unsigned int plane, unsigned int block);
+
+int nfc_cmd_suspend(struct nf_controller* nfc, unsigned int die,
+                    unsigned int plane);
+int nfc_cmd_resume(struct nf_controller* nfc, unsigned int die,
+                   unsigned int plane);
 
 int nfc_transfer_done(struct nf_controller* nfc, int dir);
 int nfc_complete_transfer(struct nf_controller* nfc, int dir, size_t len,
@@ -5,8 +5,13 @@
 
 #include <flash_config.h>
 #include <flash.h>
+#include <proto.h>
 #include "fil.h"
 
+/* Reads are scheduled before programs and erases. Once a program/erase has
+ * been kept waiting by reads for this long, it goes first. */
+#define PE_AGING_US 1000
+
 struct txn_queues {
     struct list_head read_queue;
     struct list_head write_queue;
@@ -19,6 +24,7 @@ struct txn_queues {
 
 struct queue_stats {
     unsigned int enqueued_requests;
+    unsigned int aged_dispatches;
 };
 
 static struct txn_queues chip_queues[NR_CHANNELS][CHIPS_ENABLED_PER_CHANNEL];
@@ -29,6 +35,10 @@ static struct queue_stats queue_stats[NR_CHANNELS][CHIPS_ENABLED_PER_CHANNEL];
 /* Which chip should be processed next following round-robin order. */
 static unsigned int channel_rr_index[NR_CHANNELS];
 
+/* When reads first took precedence over the pending programs/erases of a chip
+ * (0 if none is waiting). */
+static u64 pe_wait_start[NR_CHANNELS][CHIPS_ENABLED_PER_CHANNEL];
+
 void tsu_process_task(struct fil_task* txn)
 {
     struct txn_queues* chip = &chip_queues[txn->addr.channel][txn->addr.chip];
@@ -100,6 +110,18 @@ void tsu_init(void)
 
 static inline int task_ready(struct fil_task* txn) { return TRUE; }
 
+/* Suspend the program/erase executing on the target die of a host or mapping
+ * read so that the read does not wait for it. */
+static inline int try_suspend(struct fil_task* txn)
+{
+#ifdef ENABLE_PE_SUSPEND
+    return txn->type == TXN_READ && txn->source != TS_GC &&
+           fil_suspend_die(txn);
+#else
+    return FALSE;
+#endif
+}
+
 static int dispatch_queue_request(struct list_head* q_prim,
                                   struct list_head* q_sec, enum txn_type type)
 {
@@ -125,7 +147,8 @@ static int dispatch_queue_request(struct list_head* q_prim,
         if (die_bitmap & (1UL << txn->addr.die)) continue;
 
         if (!fil_is_die_busy(txn->addr.channel, txn->addr.chip, txn->addr.die,
-                             txn->type == TXN_WRITE)) {
+                             txn->type) ||
+            try_suspend(txn)) {
             head[txn->addr.die] = txn;
 
             /* Admitting a write transaction immediately makes the channel busy
@@ -152,11 +175,11 @@ static int dispatch_queue_request(struct list_head* q_prim,
         /* Die is idle at first but becomes busy after previous commands in the
          * same chip are submitted. */
         if (fil_is_die_busy(head[die]->addr.channel, head[die]->addr.chip, die,
-                            head[die]->type == TXN_WRITE))
+                            head[die]->type))
             continue;
 
         INIT_LIST_HEAD(&dispatch_list);
-        page = head[die]->addr.page;
+        page = 0;
 
         list_for_each_entry_safe(txn, tmp, q_prim, queue)
         {
@@ -169,6 +192,8 @@ static int dispatch_queue_request(struct list_head* q_prim,
             if (task_ready(txn) && txn->addr.die == die &&
                 !(plane_bitmap & (1 << txn->addr.plane)) &&
                 (!plane_bitmap || txn->addr.page == page)) {
+                /* The first picked command sets the page for the rest. */
+                if (!plane_bitmap) page = txn->addr.page;
                 found_die++;
                 plane_bitmap |= 1 << txn->addr.plane;
                 list_del(&txn->queue);
@@ -184,6 +209,7 @@ static int dispatch_queue_request(struct list_head* q_prim,
                 if (task_ready(txn) && txn->addr.die == die &&
                     !(plane_bitmap & (1 << txn->addr.plane)) &&
                     (!plane_bitmap || txn->addr.page == page)) {
+                    if (!plane_bitmap) page = txn->addr.page;
                     plane_bitmap |= 1 << txn->addr.plane;
                     found_die++;
                     list_del(&txn->queue);
@@ -286,11 +312,47 @@ static int dispatch_erase_request(unsigned int channel, unsigned int chip)
     return found > 0;
 }
 
+static inline int has_pe_request(unsigned int channel, unsigned int chip)
+{
+    struct txn_queues* queues = &chip_queues[channel][chip];
+
+    return !list_empty(&queues->write_queue) ||
+           !list_empty(&queues->mapping_write_queue) ||
+           !list_empty(&queues->gc_write_queue) ||
+           !list_empty(&queues->gc_erase_queue);
+}
+
+static int dispatch_pe_request(unsigned int channel, unsigned int chip)
+{
+    if (!dispatch_write_request(channel, chip) &&
+        !dispatch_erase_request(channel, chip))
+        return FALSE;
+
+    /* Restart the aging window for the programs/erases still queued. */
+    pe_wait_start[channel][chip] =
+        has_pe_request(channel, chip) ? timer_get_cycles() : 0;
+    return TRUE;
+}
+
 static void dispatch_request(unsigned int channel, unsigned int chip)
 {
-    if (dispatch_read_request(channel, chip)) return;
-    if (dispatch_write_request(channel, chip)) return;
-    dispatch_erase_request(channel, chip);
+    u64 wait_start = pe_wait_start[channel][chip];
+
+    if (wait_start &&
+        timer_get_cycles() - wait_start >= timer_us_to_cycles(PE_AGING_US)) {
+        if (dispatch_pe_request(channel, chip)) {
+            queue_stats[channel][chip].aged_dispatches++;
+            return;
+        }
+    }
+
+    if (dispatch_read_request(channel, chip)) {
+        if (!wait_start && has_pe_request(channel, chip))
+            pe_wait_start[channel][chip] = timer_get_cycles();
+        return;
+    }
+
+    dispatch_pe_request(channel, chip);
 }
 
 static void tsu_flush_channel(unsigned int channel)
@@ -362,6 +424,8 @@ void tsu_report_stats(void)
             xil_printf("  Chip %d\n", chip);
             xil_printf("    Enqueued request: %u\n",
                        queue_stats[channel][chip].enqueued_requests);
+            xil_printf("    Aged P/E dispatches: %u\n",
+                       queue_stats[channel][chip].aged_dispatches);
 
             print_txn_queues("    [RD]", &queues->read_queue);
             print_txn_queues("    [WR]", &queues->write_queue);
@@ -22,6 +22,7 @@ static struct console_command command_list[] = {
     {"sync", sync_command},
     {"mark_bad", bm_command_mark_bad},
     {"save_bad", bm_command_save_bad},
+    {"dc_capacity", dc_command_set_capacity},
 };
 
 static struct console_command* get_command(const char* name)
@@ -6,12 +6,13 @@
 #include <flash_config.h>
 #include <list.h>
 #include <flash.h>
+#include <fil.h>
 #include <types.h>
 #include <utils.h>
 #include "../proto.h"
 #include <const.h>
-#include <avl.h>
 #include "../thread.h"
+#include "../tls.h"
 #include <page.h>
 #include <timer.h>
 #include <memalloc.h>
@@ -26,7 +27,13 @@
 
 #define NAME "[AMU]"
 
-#define GTD_FILENAME "gtd_ns%d.bin"
+#define GTD_FILENAME     "gtd_ns%d.bin"
+#define JOURNAL_FILENAME "jnl_ns%d.bin"
+/* Upper bound of the program sequence numbers handed out so far. */
+#define PROGRAM_SEQ_FILENAME "pgseq.bin"
+
+/* Program sequence numbers reserved by each update of the sequence file. */
+#define PROGRAM_SEQ_RESERVE (1ULL << 20)
 
 #define PAGES_PER_PLANE   (PAGES_PER_BLOCK * BLOCKS_PER_PLANE)
 #define PAGES_PER_DIE     (PAGES_PER_PLANE * PLANES_PER_DIE)
@@ -73,17 +80,118 @@ struct xlate_page {
     struct xlate_entry* entries;
     int dirty;
     mutex_t mutex;
-    struct avl_node avl;
-    struct list_head lru;
     unsigned int pin_count;
+    int referenced; /* CLOCK reference bit. */
+    int indexed;    /* Reachable through the hash index. */
 };
 
-/* Translation page cache. Capacity = max # of xlate_page in the cache. */
+/* Translation page cache. Capacity = max # of xlate_page in the cache.
+ *
+ * Cached pages are found through an open-addressed hash table keyed by mvpn
+ * (linear probing, kept at most half full) and replaced with CLOCK over the
+ * frame array. Frames are allocated on demand up to the capacity and are only
+ * released when the cache is freed. */
 struct xlate_pcache {
     size_t capacity;
-    size_t size;
-    struct avl_root root;
-    struct list_head lru_list;
+    size_t size; /* # of indexed pages */
+
+    struct xlate_page** index;
+    unsigned int index_shift;
+    size_t index_mask;
+    size_t index_alloc_size;
+
+    struct xlate_page** frames;
+    size_t nr_frames;
+    size_t frames_alloc_size;
+    size_t clock_hand;
+
+    struct {
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+    } stats;
+};
+
+/* Translation page last used by a worker. */
+struct xpc_last_page {
+    struct xlate_pcache* xpc;
+    struct xlate_page* xpg;
+};
+
+static DEFINE_TLS(struct xpc_last_page, xpc_last_page);
+
+/* Mapping journal
+ *
+ * Every mapping change (LPA -> PPA and translation page -> MPPN) is appended
+ * to a per-namespace journal so that translation pages only need to be written
+ * back on eviction or at checkpoints. The journal is kept in flash pages
+ * allocated from mapping blocks. A journal page is committed when it is full
+ * or when the host issues a flush. The PPAs of committed pages are recorded in
+ * a small index file. On attach, the journal is replayed on top of the last
+ * checkpointed GTD and then truncated. */
+#define JOURNAL_MAGIC     0x4c4e4a4d /* "MJNL" */
+#define JOURNAL_MAX_PAGES (2 * MAPPING_JOURNAL_CHECKPOINT_PAGES)
+/* Checkpoints are taken in the background. Writes only wait for them once the
+ * journal grows past this, leaving room for the writes already admitted. */
+#define JOURNAL_THROTTLE_PAGES (JOURNAL_MAX_PAGES - JOURNAL_MAX_PAGES / 8)
+
+/* Journal pages are tagged in the reverse mapping of their blocks so that GC
+ * can tell them apart from translation pages. */
+#define JOURNAL_RMAP_TAG 0x80000000UL
+/* Record key flag. Set if the record updates the GTD (key = MVPN) instead of
+ * a translation entry (key = LPA). */
+#define JOURNAL_REC_GTD 0x80000000UL
+
+struct journal_record {
+    uint32_t key;
+    uint32_t ppa;
+};
+
+struct journal_page_header {
+    uint32_t magic;
+    uint32_t nsid;
+    uint32_t seq;
+    uint32_t nr_records;
+};
+
+#define JOURNAL_RECORDS_PER_PAGE                            \
+    ((FLASH_PG_SIZE - sizeof(struct journal_page_header)) / \
+     sizeof(struct journal_record))
+
+struct journal_index_header {
+    uint32_t magic;
+    uint32_t first_seq;
+    uint32_t nr_pages;
+};
+
+struct mapping_journal {
+    mutex_t mutex;
+    /* Serializes checkpoints. A checkpoint truncates the pages it covers by
+     * their count, so the next one must not start before that. */
+    mutex_t checkpoint_mutex;
+
+    /* Page being filled. DMA buffer of FLASH_PG_BUFFER_SIZE bytes. */
+    struct journal_page_header* buf;
+    struct journal_record* records;
+
+    /* Translation pages superseded by GTD records in the buffer. They are
+     * invalidated only after the records are committed so that replay never
+     * finds a reclaimed translation page. */
+    mppn_t* stale_mppns;
+    unsigned int nr_stale_mppns;
+
+    /* Committed journal pages since the last checkpoint. pages[i] has
+     * sequence number first_seq + i. Sequence numbers keep increasing across
+     * checkpoints so that a page truncated by one is never mistaken for a
+     * page committed after it. */
+    ppa_t* pages;
+    unsigned int first_seq;
+    unsigned int nr_pages;
+
+    int replay_pending;
+    /* Queued for or being checkpointed by the checkpoint thread. Protected by
+     * checkpoint_queue_mutex. */
+    int checkpointing;
 };
 
 /* Per-namespace address mapping domain. */
@@ -101,16 +209,41 @@ struct am_domain {
 
     /* Translation page cache */
     struct xlate_pcache pcache;
+
+    struct mapping_journal journal;
+
+    /* The checkpoint could not be loaded. The mapping is rebuilt from the
+     * page metadata. */
+    int stale;
 };
 
 static struct am_domain* active_domains[NAMESPACE_MAX];
 
+/* Domains waiting for the checkpoint thread. A domain is queued at most once
+ * at a time so the queue never holds more than NAMESPACE_MAX entries. */
+static struct am_domain* checkpoint_queue[NAMESPACE_MAX];
+static unsigned int checkpoint_queue_head, checkpoint_queue_tail;
+static mutex_t checkpoint_queue_mutex;
+static cond_t checkpoint_queue_cond;
+static cond_t checkpoint_done_cond;
+
+/* Sequence number stamped into the next programmed page. Numbers below
+ * program_seq_limit are reserved in the sequence file so that they are never
+ * reused after a restart. */
+static uint64_t program_seq;
+static uint64_t program_seq_limit;
+
+/* Domains that fail to load their checkpoint are rebuilt from the page
+ * metadata instead. Only allowed until the initial rebuild is done. */
+static int rebuild_allowed = TRUE;
+
 static void assign_plane(struct am_domain* domain,
                          struct flash_transaction* txn);
 static int alloc_page_for_mapping(struct am_domain* domain,
                                   struct flash_transaction* txn, mvpn_t mvpn,
                                   int for_gc);
 static void domain_free(struct kref* kref);
+static void maybe_checkpoint_domain(struct am_domain* domain);
 
 static inline struct am_domain* domain_get_by_nsid(unsigned int nsid)
 {
@@ -169,19 +302,99 @@ ppa_t address_to_ppa(struct flash_address* addr)
            PAGES_PER_BLOCK * addr->block + addr->page;
 }
 
-int amu_submit_transaction(struct flash_transaction* txn)
+static int save_program_seq(uint64_t limit)
 {
-    int r;
+    FIL fil;
+    UINT bw;
+    int rc;
+
+    rc = f_open(&fil, PROGRAM_SEQ_FILENAME, FA_CREATE_ALWAYS | FA_WRITE);
+    if (rc) return EIO;
+
+    rc = f_write(&fil, &limit, sizeof(limit), &bw);
+    if (rc || bw != sizeof(limit)) {
+        f_close(&fil);
+        return EIO;
+    }
+
+    rc = f_close(&fil);
+    return rc > 0 ? EIO : 0;
+}
+
+static int restore_program_seq(void)
+{
+    FIL fil;
+    UINT br;
+    uint64_t limit;
+    int rc;
+
+    rc = f_open(&fil, PROGRAM_SEQ_FILENAME, FA_READ);
+    if (rc) return EIO;
+
+    rc = f_read(&fil, &limit, sizeof(limit), &br);
+    f_close(&fil);
+    if (rc || br != sizeof(limit)) return EIO;
+
+    /* Numbers below the saved limit may have been used before the restart. */
+    program_seq = program_seq_limit = limit;
+    return 0;
+}
+
+static uint64_t next_program_seq(void)
+{
+    uint64_t seq = program_seq++;
+
+    /* Extend the reservation well before it runs out so that no page is
+     * stamped with a number beyond the saved limit. */
+    if (program_seq + PROGRAM_SEQ_RESERVE / 2 >= program_seq_limit) {
+        program_seq_limit = program_seq + PROGRAM_SEQ_RESERVE;
+        if (save_program_seq(program_seq_limit))
+            xil_printf(NAME " Failed to save program sequence number\n");
+    }
+
+    return seq;
+}
+
+/* Stamp the reverse mapping of a full page write into the metadata area
+ * following the user data. The page buffer must be FLASH_PG_BUFFER_SIZE
+ * bytes. Pages that do not belong to a namespace (e.g. bad block scans) are
+ * not stamped. */
+static void stamp_page_oob(struct flash_transaction* txn)
+{
+    struct page_oob* oob;
+
+    if (txn->nsid == 0 || txn->offset != 0 || txn->length != FLASH_PG_SIZE)
+        return;
 
+    oob = (struct page_oob*)(txn->data + FLASH_PG_SIZE);
+    memset(oob, 0, FLASH_PG_META_SIZE);
+    oob->magic = PAGE_OOB_MAGIC;
+    oob->nsid = txn->nsid;
+    oob->lpa = (uint32_t)txn->lpa;
+    oob->flags = txn->for_mapping ? POF_MAPPING : 0;
+    oob->seq = next_program_seq();
+    dma_sync_single_for_device(oob, FLASH_PG_META_SIZE, DMA_TO_DEVICE);
+
+    txn->length += FLASH_PG_META_SIZE;
+}
+
+static void prepare_transaction(struct flash_transaction* txn)
+{
     txn->stats.amu_submit_time = timer_get_cycles();
 
-    if (txn->type == TXN_READ && txn->data) {
-        txn->code_buf = txn->data + FLASH_PG_SIZE;
-        txn->code_length = FLASH_PG_OOB_SIZE;
+    if (!txn->data) return;
+
+    if (txn->type == TXN_READ) {
+        txn->code_buf = txn->data + FLASH_PG_SIZE + FLASH_PG_META_SIZE;
+        txn->code_length = FLASH_PG_OOB_SIZE - FLASH_PG_META_SIZE;
+    } else if (txn->type == TXN_WRITE) {
+        stamp_page_oob(txn);
     }
+}
 
-    r = submit_flash_transaction(txn);
-    if (r) return r;
+static int complete_transaction(struct flash_transaction* txn)
+{
+    int r;
 
     if (txn->req) {
         switch (txn->type) {
@@ -210,8 +423,8 @@ int amu_submit_transaction(struct flash_transaction* txn)
         }
 
         /* Correction. */
-        r = ecc_correct(txn->data, FLASH_PG_SIZE, txn->data + FLASH_PG_SIZE,
-                        FLASH_PG_OOB_SIZE, txn->err_bitmap);
+        r = ecc_correct(txn->data, FLASH_PG_SIZE + FLASH_PG_META_SIZE,
+                        txn->code_buf, txn->code_length, txn->err_bitmap);
 
         WARN(
             r == -EBADMSG,
@@ -226,109 +439,184 @@ int amu_submit_transaction(struct flash_transaction* txn)
     return 0;
 }
 
-static int xpc_key_node_comp(void* key, struct avl_node* node)
+int amu_submit_transaction(struct flash_transaction* txn)
 {
-    struct xlate_page* r1 = (struct xlate_page*)key;
-    struct xlate_page* r2 = avl_entry(node, struct xlate_page, avl);
+    int r;
 
-    if (r1->mvpn < r2->mvpn)
-        return -1;
-    else if (r1->mvpn > r2->mvpn)
-        return 1;
-    return 0;
+    prepare_transaction(txn);
+
+    r = submit_flash_transaction(txn);
+    if (r) return r;
+
+    return complete_transaction(txn);
 }
 
-static int xpc_node_node_comp(struct avl_node* node1, struct avl_node* node2)
+/* Submit a batch of independent transactions to the FIL at once. The result of
+ * each transaction is returned in @status. */
+int amu_submit_transaction_batch(struct flash_transaction** txns,
+                                 unsigned int count, int* status)
 {
-    struct xlate_page* r1 = avl_entry(node1, struct xlate_page, avl);
-    struct xlate_page* r2 = avl_entry(node2, struct xlate_page, avl);
+    unsigned int i;
+    int r;
+
+    for (i = 0; i < count; i++)
+        prepare_transaction(txns[i]);
+
+    r = submit_flash_transaction_batch(txns, count, status);
+    if (r) return r;
+
+    for (i = 0; i < count; i++) {
+        if (status[i] == 0) status[i] = complete_transaction(txns[i]);
+    }
 
-    if (r1->mvpn < r2->mvpn)
-        return -1;
-    else if (r1->mvpn > r2->mvpn)
-        return 1;
     return 0;
 }
 
-static inline void xpc_avl_start_iter(struct xlate_pcache* xpc,
-                                      struct avl_iter* iter, void* key,
-                                      int flags)
+static inline size_t xpc_hash(struct xlate_pcache* xpc, mvpn_t mvpn)
+{
+    return (size_t)(((uint64_t)mvpn * 0x9E3779B97F4A7C15ULL) >>
+                    xpc->index_shift);
+}
+
+static struct xlate_page* xpc_find(struct xlate_pcache* xpc, mvpn_t mvpn)
 {
-    avl_start_iter(&xpc->root, iter, key, flags);
+    size_t i = xpc_hash(xpc, mvpn);
+    struct xlate_page* xpg;
+
+    while ((xpg = xpc->index[i]) != NULL) {
+        if (xpg->mvpn == mvpn) return xpg;
+        i = (i + 1) & xpc->index_mask;
+    }
+
+    return NULL;
 }
 
-static inline struct xlate_page* xpc_avl_get_iter(struct avl_iter* iter)
+static void xpc_insert(struct xlate_pcache* xpc, struct xlate_page* xpg)
 {
-    struct avl_node* node = avl_get_iter(iter);
-    if (!node) return NULL;
-    return avl_entry(node, struct xlate_page, avl);
+    size_t i = xpc_hash(xpc, xpg->mvpn);
+
+    Xil_AssertVoid(!xpg->indexed);
+
+    while (xpc->index[i])
+        i = (i + 1) & xpc->index_mask;
+
+    xpc->index[i] = xpg;
+    xpg->indexed = TRUE;
+    xpc->size++;
 }
 
-static struct xlate_page* xpc_find(struct xlate_pcache* xpc, mvpn_t mvpn)
+static void xpc_remove(struct xlate_pcache* xpc, struct xlate_page* xpg)
 {
-    struct avl_node* node = xpc->root.node;
-    struct xlate_page* xpg = NULL;
+    size_t i = xpc_hash(xpc, xpg->mvpn);
+    size_t j, home;
+
+    Xil_AssertVoid(xpg->indexed);
+
+    while (xpc->index[i] != xpg)
+        i = (i + 1) & xpc->index_mask;
 
-    while (node) {
-        xpg = avl_entry(node, struct xlate_page, avl);
+    /* Backward-shift deletion: move later entries of the probe sequence into
+     * the hole unless that would put them before their home slot. */
+    for (j = (i + 1) & xpc->index_mask; xpc->index[j];
+         j = (j + 1) & xpc->index_mask) {
+        home = xpc_hash(xpc, xpc->index[j]->mvpn);
 
-        if (xpg->mvpn == mvpn) {
-            return xpg;
-        } else if (mvpn < xpg->mvpn)
-            node = node->left;
-        else if (mvpn > xpg->mvpn)
-            node = node->right;
+        if (((j - home) & xpc->index_mask) >= ((j - i) & xpc->index_mask)) {
+            xpc->index[i] = xpc->index[j];
+            i = j;
+        }
     }
 
-    return NULL;
+    xpc->index[i] = NULL;
+    xpg->indexed = FALSE;
+    xpc->size--;
 }
 
-static void xpc_init(struct xlate_pcache* xpc, size_t capacity)
+static int xpc_init(struct xlate_pcache* xpc, size_t capacity)
 {
+    size_t nr_slots = 2;
+    unsigned int bits = 1;
+
+    memset(xpc, 0, sizeof(*xpc));
     xpc->capacity = capacity;
-    xpc->size = 0;
-    INIT_LIST_HEAD(&xpc->lru_list);
-    INIT_AVL_ROOT(&xpc->root, xpc_key_node_comp, xpc_node_node_comp);
+
+    while (nr_slots < capacity * 2) {
+        nr_slots <<= 1;
+        bits++;
+    }
+
+    xpc->index_shift = 64 - bits;
+    xpc->index_mask = nr_slots - 1;
+    xpc->index_alloc_size =
+        roundup(nr_slots * sizeof(struct xlate_page*), ARCH_PG_SIZE);
+    xpc->frames_alloc_size =
+        roundup(capacity * sizeof(struct xlate_page*), ARCH_PG_SIZE);
+
+    xpc->index = alloc_vmpages(xpc->index_alloc_size >> ARCH_PG_SHIFT,
+                               ZONE_PS_DDR);
+    if (!xpc->index) return ENOMEM;
+
+    xpc->frames = alloc_vmpages(xpc->frames_alloc_size >> ARCH_PG_SHIFT,
+                                ZONE_PS_DDR);
+    if (!xpc->frames) {
+        free_mem(__pa(xpc->index), xpc->index_alloc_size);
+        xpc->index = NULL;
+        return ENOMEM;
+    }
+
+    memset(xpc->index, 0, xpc->index_alloc_size);
+    return 0;
 }
 
 static void xpc_free(struct xlate_pcache* xpc)
 {
-    struct avl_node* node;
-    struct xlate_page* xpg = NULL;
+    struct xlate_page* xpg;
+    int i;
+
+    if (!xpc->index) return;
+
+    /* Forget this cache in the per-worker fast path. */
+    for (i = 0; i < NR_FTL_THREADS; i++) {
+        struct xpc_last_page* last = get_tls_var_ptr(i, xpc_last_page);
+        if (last->xpc == xpc) {
+            last->xpc = NULL;
+            last->xpg = NULL;
+        }
+    }
 
-    /* Takes longer time (O(nlogn)) but less stack space than recursion. */
-    while ((node = xpc->root.node) != NULL) {
-        xpg = avl_entry(node, struct xlate_page, avl);
+    while (xpc->nr_frames > 0) {
+        xpg = xpc->frames[--xpc->nr_frames];
 
         /* No one should be using this page anymore. */
         Xil_AssertVoid(xpg->pin_count == 0);
 
-        avl_erase(node, &xpc->root);
-        list_del(&xpg->lru);
-
         free_mem(__pa(xpg->entries), XLATE_PG_SIZE);
         SLABFREE(xpg);
     }
+
+    free_mem(__pa(xpc->frames), xpc->frames_alloc_size);
+    free_mem(__pa(xpc->index), xpc->index_alloc_size);
+    xpc->frames = NULL;
+    xpc->index = NULL;
+    xpc->size = 0;
 }
 
-static int xpc_add(struct xlate_pcache* xpc, mvpn_t mvpn,
-                   struct xlate_page** xpgpp)
+/* Allocate a new frame. The page is returned pinned and not indexed. */
+static int xpc_add(struct xlate_pcache* xpc, struct xlate_page** xpgpp)
 {
     struct xlate_page* xpg;
     mutexattr_t mutex_attr = {
         .tag = LKT_AMU,
     };
 
-    if (xpc->size >= xpc->capacity) return ENOSPC;
+    if (xpc->nr_frames >= xpc->capacity) return ENOSPC;
 
     SLABALLOC(xpg);
-    if (!xpc) return ENOMEM;
+    if (!xpg) return ENOMEM;
 
     memset(xpg, 0, sizeof(*xpg));
-    xpg->mvpn = mvpn;
     xpg->dirty = FALSE;
     xpg->pin_count = 1;
-    INIT_LIST_HEAD(&xpg->lru);
     mutex_init(&xpg->mutex, &mutex_attr);
 
     /* Allocate buffer for the translation page. Prefer PS DDR. */
@@ -338,32 +626,47 @@ static int xpc_add(struct xlate_pcache* xpc, mvpn_t mvpn,
         return ENOMEM;
     }
 
-    avl_insert(&xpg->avl, &xpc->root);
-    xpc->size++;
+    xpc->frames[xpc->nr_frames++] = xpg;
     *xpgpp = xpg;
 
     return 0;
 }
 
-static inline void xpc_add_lru(struct xlate_pcache* xpc, struct xlate_page* xpg)
-{
-    list_add(&xpg->lru, &xpc->lru_list);
-}
+static inline void xpc_pin(struct xlate_page* xpg) { xpg->pin_count++; }
 
-static inline void xpc_remove_lru(struct xlate_page* xpg)
+static inline void xpc_unpin(struct xlate_pcache* xpc, struct xlate_page* xpg)
 {
-    list_del(&xpg->lru);
+    Xil_AssertVoid(xpg->pin_count > 0);
+    if (--xpg->pin_count == 0) xpg->referenced = TRUE;
 }
 
-static inline void xpc_pin(struct xlate_page* xpg)
+/* Pick a victim frame with CLOCK. The page is returned pinned and still
+ * indexed under its old mvpn so that lookups wait for the write back instead
+ * of reading a stale copy from flash. */
+static int xpc_evict(struct xlate_pcache* xpc, struct xlate_page** xpgpp)
 {
-    if (xpg->pin_count++ == 0) xpc_remove_lru(xpg);
-}
+    struct xlate_page* xpg;
+    size_t scanned;
 
-static inline void xpc_unpin(struct xlate_pcache* xpc, struct xlate_page* xpg)
-{
-    Xil_AssertVoid(xpg->pin_count > 0);
-    if (--xpg->pin_count == 0) xpc_add_lru(xpc, xpg);
+    /* Two sweeps are enough to clear every reference bit once. */
+    for (scanned = 0; scanned < 2 * xpc->nr_frames; scanned++) {
+        xpg = xpc->frames[xpc->clock_hand];
+        if (++xpc->clock_hand >= xpc->nr_frames) xpc->clock_hand = 0;
+
+        /* Pinned page should NEVER be evicted. */
+        if (xpg->pin_count) continue;
+
+        if (xpg->referenced) {
+            xpg->referenced = FALSE;
+            continue;
+        }
+
+        xpc_pin(xpg);
+        *xpgpp = xpg;
+        return 0;
+    }
+
+    return ENOMEM;
 }
 
 static inline void xpc_update_mapping(struct xlate_page* xpg, unsigned int slot,
@@ -374,181 +677,494 @@ static inline void xpc_update_mapping(struct xlate_page* xpg, unsigned int slot,
     xpg->dirty = TRUE;
 }
 
-static int xpc_read_page(struct am_domain* domain, struct xlate_page* xpg)
+#define STALE_MPPNS_SIZE \
+    roundup(JOURNAL_RECORDS_PER_PAGE * sizeof(mppn_t), ARCH_PG_SIZE)
+#define JOURNAL_INDEX_SIZE \
+    roundup(JOURNAL_MAX_PAGES * sizeof(ppa_t), ARCH_PG_SIZE)
+
+static int journal_init(struct mapping_journal* jnl)
 {
-    mvpn_t mvpn = xpg->mvpn;
-    mppn_t mppn = domain->gtd[mvpn];
-    struct flash_transaction txn;
-    struct xlate_entry_disk* buf;
-    int r;
+    if (mutex_init(&jnl->mutex, NULL) != 0) return ENOMEM;
+    if (mutex_init(&jnl->checkpoint_mutex, NULL) != 0) return ENOMEM;
 
-    Xil_AssertNonvoid(!xpg->dirty);
+    jnl->buf =
+        alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
+    if (!jnl->buf) return ENOMEM;
+    memset(jnl->buf, 0, FLASH_PG_BUFFER_SIZE);
+    jnl->records = (struct journal_record*)(jnl->buf + 1);
 
-    buf = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
-    if (!buf) return ENOMEM;
+    jnl->stale_mppns =
+        alloc_vmpages(STALE_MPPNS_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!jnl->stale_mppns) goto fail_free_buf;
 
-    flash_transaction_init(&txn);
-    txn.type = TXN_READ;
-    txn.source = TS_MAPPING;
-    txn.nsid = domain->nsid;
-    txn.lpa = mvpn;
-    txn.ppa = mppn;
-    txn.data = (u8*)buf;
-    txn.offset = 0;
-    txn.length = FLASH_PG_SIZE;
-    txn.bitmap = (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1;
-    ppa_to_address(txn.ppa, &txn.addr);
+    jnl->pages =
+        alloc_vmpages(JOURNAL_INDEX_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!jnl->pages) goto fail_free_stale;
 
-    dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
-    r = amu_submit_transaction(&txn);
-    dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
+    jnl->nr_stale_mppns = 0;
+    jnl->first_seq = 0;
+    jnl->nr_pages = 0;
+    jnl->replay_pending = FALSE;
+    jnl->checkpointing = FALSE;
 
-    WARN(r != 0, "Read translation page failed\n");
+    return 0;
 
-    if (r == 0) {
-        int i;
-        for (i = 0; i < domain->xlate_ents_per_page; i++) {
-            xpg->entries[i].ppa = buf[i].ppa;
-            xpg->entries[i].bitmap = (1UL << SECTORS_PER_FLASH_PG) - 1;
-        }
+fail_free_stale:
+    free_mem(__pa(jnl->stale_mppns), STALE_MPPNS_SIZE);
+fail_free_buf:
+    free_mem(__pa(jnl->buf), FLASH_PG_BUFFER_SIZE);
+    jnl->buf = NULL;
+    return ENOMEM;
+}
+
+static inline unsigned int journal_page_seq(struct mapping_journal* jnl,
+                                            unsigned int index)
+{
+    return (jnl->first_seq + index) & ~JOURNAL_RMAP_TAG;
+}
+
+static void journal_free(struct mapping_journal* jnl)
+{
+    if (!jnl->buf) return;
+
+    free_mem(__pa(jnl->pages), JOURNAL_INDEX_SIZE);
+    free_mem(__pa(jnl->stale_mppns), STALE_MPPNS_SIZE);
+    free_mem(__pa(jnl->buf), FLASH_PG_BUFFER_SIZE);
+    jnl->buf = NULL;
+}
+
+static int journal_save_index(struct am_domain* domain)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    struct journal_index_header hdr;
+    char filename[20];
+    size_t write_size;
+    FIL fil;
+    UINT bw;
+    int rc;
+
+    snprintf(filename, sizeof(filename), JOURNAL_FILENAME, domain->nsid);
+
+    hdr.magic = JOURNAL_MAGIC;
+    hdr.first_seq = jnl->first_seq;
+    hdr.nr_pages = jnl->nr_pages;
+    write_size = jnl->nr_pages * sizeof(ppa_t);
+
+    rc = f_open(&fil, filename, FA_CREATE_ALWAYS | FA_WRITE);
+    if (rc) return EIO;
+
+    rc = f_write(&fil, &hdr, sizeof(hdr), &bw);
+    if (rc || bw != sizeof(hdr)) goto fail_close;
+
+    if (write_size) {
+        rc = f_write(&fil, jnl->pages, write_size, &bw);
+        if (rc || bw != write_size) goto fail_close;
     }
 
-    free_mem(__pa(buf), FLASH_PG_BUFFER_SIZE);
-    return r;
+    rc = f_close(&fil);
+    return rc > 0 ? EIO : 0;
+
+fail_close:
+    f_close(&fil);
+    return EIO;
 }
 
-static int xpc_flush_page(struct am_domain* domain, struct xlate_page* xpg)
+static int journal_restore_index(struct am_domain* domain)
 {
-    mvpn_t mvpn = xpg->mvpn;
+    struct mapping_journal* jnl = &domain->journal;
+    struct journal_index_header hdr;
+    char filename[20];
+    size_t read_size;
+    FILINFO fno;
+    FIL fil;
+    UINT br;
+    int rc;
+
+    snprintf(filename, sizeof(filename), JOURNAL_FILENAME, domain->nsid);
+
+    jnl->first_seq = 0;
+    jnl->nr_pages = 0;
+    if (f_stat(filename, &fno) != 0) return 0;
+
+    rc = f_open(&fil, filename, FA_READ);
+    if (rc) return EIO;
+
+    rc = f_read(&fil, &hdr, sizeof(hdr), &br);
+    if (rc || br != sizeof(hdr) || hdr.magic != JOURNAL_MAGIC ||
+        hdr.nr_pages > JOURNAL_MAX_PAGES)
+        goto fail_close;
+
+    read_size = hdr.nr_pages * sizeof(ppa_t);
+    if (read_size) {
+        rc = f_read(&fil, jnl->pages, read_size, &br);
+        if (rc || br != read_size) goto fail_close;
+    }
+
+    jnl->first_seq = hdr.first_seq;
+    jnl->nr_pages = hdr.nr_pages;
+
+    rc = f_close(&fil);
+    return rc > 0 ? EIO : 0;
+
+fail_close:
+    f_close(&fil);
+    return EIO;
+}
+
+/* Write the journal buffer to flash. Must be called with the journal mutex
+ * held. */
+static int journal_commit_locked(struct am_domain* domain)
+{
+    struct mapping_journal* jnl = &domain->journal;
     struct flash_transaction txn;
-    struct xlate_entry_disk* buf;
+    struct flash_address addr;
+    unsigned int index = jnl->nr_pages;
+    unsigned int seq = journal_page_seq(jnl, index);
     int i, r;
 
-    if (!xpg->dirty) return 0;
-
-    buf = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
-    if (!buf) return ENOMEM;
+    if (!jnl->buf->nr_records) return 0;
 
-    for (i = 0; i < domain->xlate_ents_per_page; i++) {
-        buf[i].ppa = xpg->entries[i].ppa;
+    /* The journal should have been checkpointed long before this. */
+    if (index >= JOURNAL_MAX_PAGES) {
+        WARN(TRUE, "Mapping journal of namespace %d is full\n", domain->nsid);
+        return ENOSPC;
     }
 
+    jnl->buf->magic = JOURNAL_MAGIC;
+    jnl->buf->nsid = domain->nsid;
+    jnl->buf->seq = seq;
+
     flash_transaction_init(&txn);
     txn.type = TXN_WRITE;
     txn.source = TS_MAPPING;
     txn.nsid = domain->nsid;
-    txn.lpa = mvpn;
+    txn.lpa = seq;
     txn.ppa = NO_PPA;
-    txn.data = (u8*)buf;
+    txn.for_mapping = TRUE;
+    txn.data = (u8*)jnl->buf;
     txn.offset = 0;
     txn.length = FLASH_PG_SIZE;
     txn.bitmap = (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1;
 
+    /* Spread consecutive journal pages over the planes. */
     assign_plane(domain, &txn);
-    alloc_page_for_mapping(domain, &txn, mvpn, FALSE);
+    bm_alloc_page(domain->nsid, JOURNAL_RMAP_TAG | seq, &txn.addr, FALSE,
+                  TRUE /* for_mapping */);
+    txn.ppa = address_to_ppa(&txn.addr);
 
-    dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
+    dma_sync_single_for_device(jnl->buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
     r = amu_submit_transaction(&txn);
-    dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
-    if (r) goto out;
-
-    xpg->dirty = FALSE;
-    domain->gtd[mvpn] = txn.ppa;
+    dma_sync_single_for_cpu(jnl->buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
+    if (r) goto fail;
 
-    r = 0;
+    jnl->pages[index] = txn.ppa;
+    jnl->nr_pages++;
 
-out:
+    r = journal_save_index(domain);
     if (r) {
-        bm_invalidate_page(&txn.addr);
+        jnl->nr_pages--;
+        goto fail;
     }
 
-    free_mem(__pa(buf), FLASH_PG_BUFFER_SIZE);
+    /* The records are durable now. Release the translation pages they
+     * supersede. */
+    for (i = 0; i < jnl->nr_stale_mppns; i++) {
+        ppa_to_address((ppa_t)jnl->stale_mppns[i], &addr);
+        bm_invalidate_page(&addr);
+    }
+
+    jnl->nr_stale_mppns = 0;
+    jnl->buf->nr_records = 0;
+
+    return 0;
+
+fail:
+    bm_invalidate_page(&txn.addr);
     return r;
 }
 
-static int xpc_evict(struct xlate_pcache* xpc, struct xlate_page** xpgpp)
+static int journal_commit(struct am_domain* domain)
 {
-    struct xlate_page* xpg;
+    int r;
 
-    if (list_empty(&xpc->lru_list)) return ENOMEM;
+    mutex_lock(&domain->journal.mutex);
+    r = journal_commit_locked(domain);
+    mutex_unlock(&domain->journal.mutex);
 
-    xpg = list_entry(xpc->lru_list.prev, struct xlate_page, lru);
+    return r;
+}
 
-    /* Pinned page should NEVER be evicted. */
-    Xil_AssertNonvoid(xpg->pin_count == 0);
+/* Append a record to the journal buffer. @stale_mppn (if not NO_MPPN) is
+ * invalidated once the record is committed. */
+static int journal_log(struct am_domain* domain, uint32_t key, uint32_t ppa,
+                       mppn_t stale_mppn)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    struct journal_record* rec;
+    int r = 0;
 
-    list_del(&xpg->lru);
-    avl_erase(&xpg->avl, &xpc->root);
-    xpc->size--;
+    mutex_lock(&jnl->mutex);
 
-    *xpgpp = xpg;
-    return 0;
-}
+    if (jnl->buf->nr_records >= JOURNAL_RECORDS_PER_PAGE) {
+        r = journal_commit_locked(domain);
+        if (r) goto out;
+    }
 
-/* Get the translation page referenced by mvpn from the page cache. Return
- * the page exclusively locked and detached from LRU. */
-static int get_translation_page(struct am_domain* domain, mvpn_t mvpn,
-                                struct xlate_page** xpgpp)
-{
-    struct xlate_page* xpg;
-    struct xlate_pcache* xpc = &domain->pcache;
-    int r;
+    rec = &jnl->records[jnl->buf->nr_records++];
+    rec->key = key;
+    rec->ppa = ppa;
 
-    xpg = xpc_find(xpc, mvpn);
+    if (stale_mppn != NO_MPPN)
+        jnl->stale_mppns[jnl->nr_stale_mppns++] = stale_mppn;
+
+out:
+    mutex_unlock(&jnl->mutex);
+    return r;
+}
+
+/* Invalidate a translation page that is no longer referenced by the GTD. If
+ * the record superseding it is still in the journal buffer, commit the
+ * buffer first (which invalidates the page). */
+static void journal_release_mppn(struct am_domain* domain,
+                                 struct flash_address* addr)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    mppn_t mppn = (mppn_t)address_to_ppa(addr);
+    int i;
+
+    mutex_lock(&jnl->mutex);
+
+    for (i = 0; i < jnl->nr_stale_mppns; i++) {
+        if (jnl->stale_mppns[i] == mppn) break;
+    }
+
+    if (i == jnl->nr_stale_mppns)
+        bm_invalidate_page(addr);
+    else
+        journal_commit_locked(domain);
+
+    mutex_unlock(&jnl->mutex);
+}
+
+/* Drop the first @nr_pages committed journal pages. Only called after a
+ * checkpoint has made them redundant. Pages committed while the checkpoint
+ * was taken are kept. */
+static int journal_truncate(struct am_domain* domain, unsigned int nr_pages)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    struct flash_address addr;
+    int i, r;
+
+    mutex_lock(&jnl->mutex);
+
+    if (nr_pages > jnl->nr_pages) nr_pages = jnl->nr_pages;
+
+    for (i = 0; i < nr_pages; i++) {
+        ppa_to_address(jnl->pages[i], &addr);
+        bm_invalidate_page(&addr);
+    }
+
+    memmove(jnl->pages, &jnl->pages[nr_pages],
+            (jnl->nr_pages - nr_pages) * sizeof(ppa_t));
+    jnl->first_seq = journal_page_seq(jnl, nr_pages);
+    jnl->nr_pages -= nr_pages;
+
+    r = journal_save_index(domain);
+
+    mutex_unlock(&jnl->mutex);
+    return r;
+}
+
+/* Point the GTD entry of @mvpn at a new translation page. */
+static int set_gtd(struct am_domain* domain, mvpn_t mvpn, mppn_t mppn)
+{
+    mppn_t old_mppn = domain->gtd[mvpn];
+
+    domain->gtd[mvpn] = mppn;
+    return journal_log(domain, JOURNAL_REC_GTD | mvpn, mppn, old_mppn);
+}
+
+static int xpc_read_page(struct am_domain* domain, struct xlate_page* xpg)
+{
+    mvpn_t mvpn = xpg->mvpn;
+    mppn_t mppn = domain->gtd[mvpn];
+    struct flash_transaction txn;
+    struct xlate_entry_disk* buf;
+    int r;
+
+    Xil_AssertNonvoid(!xpg->dirty);
+
+    buf = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
+    if (!buf) return ENOMEM;
+
+    flash_transaction_init(&txn);
+    txn.type = TXN_READ;
+    txn.source = TS_MAPPING;
+    txn.nsid = domain->nsid;
+    txn.lpa = mvpn;
+    txn.ppa = mppn;
+    txn.data = (u8*)buf;
+    txn.offset = 0;
+    txn.length = FLASH_PG_SIZE;
+    txn.bitmap = (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1;
+    ppa_to_address(txn.ppa, &txn.addr);
+
+    dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
+    r = amu_submit_transaction(&txn);
+    dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
+
+    WARN(r != 0, "Read translation page failed\n");
+
+    if (r == 0) {
+        int i;
+        for (i = 0; i < domain->xlate_ents_per_page; i++) {
+            xpg->entries[i].ppa = buf[i].ppa;
+            xpg->entries[i].bitmap = (1UL << SECTORS_PER_FLASH_PG) - 1;
+        }
+    }
+
+    free_mem(__pa(buf), FLASH_PG_BUFFER_SIZE);
+    return r;
+}
+
+static int xpc_flush_page(struct am_domain* domain, struct xlate_page* xpg)
+{
+    mvpn_t mvpn = xpg->mvpn;
+    struct flash_transaction txn;
+    struct xlate_entry_disk* buf;
+    int i, r;
+
+    if (!xpg->dirty) return 0;
+
+    buf = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
+    if (!buf) return ENOMEM;
+
+    for (i = 0; i < domain->xlate_ents_per_page; i++) {
+        buf[i].ppa = xpg->entries[i].ppa;
+    }
+
+    flash_transaction_init(&txn);
+    txn.type = TXN_WRITE;
+    txn.source = TS_MAPPING;
+    txn.nsid = domain->nsid;
+    txn.lpa = mvpn;
+    txn.ppa = NO_PPA;
+    txn.for_mapping = TRUE;
+    txn.data = (u8*)buf;
+    txn.offset = 0;
+    txn.length = FLASH_PG_SIZE;
+    txn.bitmap = (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1;
+
+    assign_plane(domain, &txn);
+    alloc_page_for_mapping(domain, &txn, mvpn, FALSE);
+
+    dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
+    r = amu_submit_transaction(&txn);
+    dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
+    if (r) {
+        bm_invalidate_page(&txn.addr);
+        goto out;
+    }
+
+    xpg->dirty = FALSE;
+    r = set_gtd(domain, mvpn, txn.ppa);
+
+out:
+    free_mem(__pa(buf), FLASH_PG_BUFFER_SIZE);
+    return r;
+}
+
+/* Get the translation page referenced by mvpn from the page cache. Return
+ * the page exclusively locked and pinned. */
+static int get_translation_page(struct am_domain* domain, mvpn_t mvpn,
+                                struct xlate_page** xpgpp)
+{
+    struct xlate_pcache* xpc = &domain->pcache;
+    struct xpc_last_page* last = get_local_var_ptr(xpc_last_page);
+    struct xlate_page* xpg;
+    int r;
+
+retry:
+    /* Sequential LPAs from one worker usually fall into the translation page
+     * it used last. Check that before probing the index. */
+    if (last->xpc == xpc && last->xpg->indexed && last->xpg->mvpn == mvpn)
+        xpg = last->xpg;
+    else
+        xpg = xpc_find(xpc, mvpn);
 
     if (xpg) {
         /* Cache hit. */
         xpc_pin(xpg);
         mutex_lock(&xpg->mutex);
-    } else {
-        /* Try to add a new translation page. */
-        r = xpc_add(xpc, mvpn, &xpg);
 
-        if (unlikely(r == ENOSPC)) {
-            /* Cache is full. */
-            r = xpc_evict(xpc, &xpg);
-            if (r) return r;
+        /* The page is dropped if reading it fails. */
+        if (unlikely(!xpg->indexed || xpg->mvpn != mvpn)) {
+            mutex_unlock(&xpg->mutex);
+            xpc_unpin(xpc, xpg);
+            goto retry;
+        }
+
+        xpc->stats.hits++;
+        goto out;
+    }
 
-            if (xpg->dirty) {
-                xpc_flush_page(domain, xpg);
-            }
+    /* Try to add a new translation page. */
+    r = xpc_add(xpc, &xpg);
 
-            xpg->mvpn = mvpn;
-            avl_insert(&xpg->avl, &xpc->root);
-            xpc->size++;
+    if (unlikely(r == ENOSPC)) {
+        /* Cache is full. */
+        r = xpc_evict(xpc, &xpg);
+    }
 
-            xpc_pin(xpg);
-            mutex_lock(&xpg->mutex);
-        } else if (unlikely(r != 0)) {
-            /* Error. */
-            return r;
-        } else {
-            /* Ok. */
-            Xil_AssertNonvoid(xpg->pin_count == 1);
-            mutex_lock(&xpg->mutex);
+    if (unlikely(r != 0)) return r;
 
-            /* If there is no physical page for this translation page then
-             * populate it with invalid PPAs. Otherwise issue a flash
-             * transaction to read it from NAND flash. */
-            if (domain->gtd[mvpn] == NO_MPPN) {
-                int i;
-                for (i = 0; i < domain->xlate_ents_per_page; i++) {
-                    xpg->entries[i].ppa = NO_PPA;
-                    xpg->entries[i].bitmap = 0;
-                }
-                xpg->dirty = TRUE;
-            } else {
-                r = xpc_read_page(domain, xpg);
-
-                if (r) {
-                    mutex_unlock(&xpg->mutex);
-                    avl_erase(&xpg->avl, &xpc->root);
-                    xpc_unpin(&domain->pcache, xpg);
-                }
-            }
+    mutex_lock(&xpg->mutex);
+
+    if (xpg->indexed) {
+        int flushed = xpg->dirty;
+
+        if (flushed) xpc_flush_page(domain, xpg);
+
+        xpc_remove(xpc, xpg);
+        xpc->stats.evictions++;
+
+        /* Another thread may have loaded the page during the write back. */
+        if (flushed && unlikely(xpc_find(xpc, mvpn) != NULL)) {
+            mutex_unlock(&xpg->mutex);
+            xpc_unpin(xpc, xpg);
+            goto retry;
+        }
+    }
+
+    xpc->stats.misses++;
+    xpg->mvpn = mvpn;
+    xpc_insert(xpc, xpg);
+
+    /* If there is no physical page for this translation page then populate it
+     * with invalid PPAs. Otherwise issue a flash transaction to read it from
+     * NAND flash. */
+    if (domain->gtd[mvpn] == NO_MPPN) {
+        int i;
+        for (i = 0; i < domain->xlate_ents_per_page; i++) {
+            xpg->entries[i].ppa = NO_PPA;
+            xpg->entries[i].bitmap = 0;
+        }
+        xpg->dirty = TRUE;
+    } else {
+        r = xpc_read_page(domain, xpg);
+
+        if (r) {
+            xpc_remove(xpc, xpg);
+            mutex_unlock(&xpg->mutex);
+            xpc_unpin(xpc, xpg);
+            return r;
         }
     }
 
+out:
+    last->xpc = xpc;
+    last->xpg = xpg;
+
     *xpgpp = xpg;
     return 0;
 }
@@ -808,10 +1424,13 @@ static int alloc_page_for_write(struct am_domain* domain,
     }
 
     /* Allocate a new PP and update the mapping. */
-    bm_alloc_page(txn->nsid, &txn->addr, for_gc, FALSE /* for_mapping */);
+    bm_alloc_page(txn->nsid, txn->lpa, &txn->addr, for_gc,
+                  FALSE /* for_mapping */);
     txn->ppa = address_to_ppa(&txn->addr);
     xpc_update_mapping(xpg, slot, txn->ppa, txn->bitmap);
 
+    r = journal_log(domain, txn->lpa, txn->ppa, NO_MPPN);
+
 out_unlock:
     mutex_unlock(&xpg->mutex);
     xpc_unpin(&domain->pcache, xpg);
@@ -823,20 +1442,28 @@ static int alloc_page_for_mapping(struct am_domain* domain,
                                   struct flash_transaction* txn, mvpn_t mvpn,
                                   int for_gc)
 {
-    mppn_t mppn = domain->gtd[mvpn];
-
-    if (mppn != NO_MPPN) {
-        struct flash_address addr;
-        ppa_to_address((ppa_t)mppn, &addr);
-        bm_invalidate_page(&addr);
-    }
-
-    bm_alloc_page(txn->nsid, &txn->addr, for_gc, TRUE /* for_mapping */);
+    /* The old translation page is invalidated by the journal once the new
+     * GTD entry is committed. */
+    bm_alloc_page(txn->nsid, mvpn, &txn->addr, for_gc, TRUE /* for_mapping */);
     txn->ppa = address_to_ppa(&txn->addr);
 
     return 0;
 }
 
+/* The translation page of @lpa is written back to the plane assign_plane()
+ * picks for its MVPN. Wait for GC on that plane too so that translation page
+ * write backs cannot use up its free blocks either. */
+static void throttle_mapping_write(struct am_domain* domain, lpa_t lpa)
+{
+    struct flash_transaction txn;
+
+    flash_transaction_init(&txn);
+    txn.lpa = get_mvpn(domain, lpa);
+    assign_plane(domain, &txn);
+
+    bm_throttle_write(&txn.addr);
+}
+
 /* Translate an LPA into PPA. Allocate a new physical page if not mapped. */
 static int translate_lpa(struct flash_transaction* txn)
 {
@@ -852,17 +1479,29 @@ static int translate_lpa(struct flash_transaction* txn)
         if (r != 0) goto out;
 
         if (ppa == NO_PPA) {
-            /* Read an LP that has not been written. Just allocate a PP for
-             * it without initialization. */
-            assign_plane(domain, txn);
-            r = alloc_page_for_write(domain, txn, FALSE);
-            if (r != 0) goto out;
+            /* Read an LP that has not been written or has been deallocated.
+             * It reads back as zeroes without touching NAND flash. */
+            if (txn->data) {
+                memset(txn->data + txn->offset, 0, txn->length);
+                dma_sync_single_for_device(txn->data + txn->offset,
+                                           txn->length, DMA_TO_DEVICE);
+            }
+            goto out;
         } else {
             txn->ppa = ppa;
             ppa_to_address(txn->ppa, &txn->addr);
         }
     } else {
         assign_plane(domain, txn);
+        bm_steer_plane(&txn->addr);
+
+        /* Wait for GC if the data or translation page plane is running out
+         * of free blocks and for the checkpoint if the journal is nearly
+         * full. These must be done before the translation page is locked. */
+        bm_throttle_write(&txn->addr);
+        throttle_mapping_write(domain, txn->lpa);
+        maybe_checkpoint_domain(domain);
+
         r = alloc_page_for_write(domain, txn, FALSE);
         if (r != 0) goto out;
     }
@@ -921,79 +1560,575 @@ cleanup:
     return r;
 }
 
-static int save_gtd(struct am_domain* domain, const char* filename)
+/* Translate a batch of independent reads and submit them to the FIL at once so
+ * that they are spread over the dies instead of being issued one by one. Reads
+ * past the end of the namespace fail with EINVAL. The result of each
+ * transaction is returned in @status. */
+int amu_read_batch(struct flash_transaction** txns, unsigned int count,
+                   int* status)
 {
-    FIL fil;
-    size_t write_size;
-    UINT bw;
-    int rc;
+    struct flash_transaction* ready[FIL_BATCH_MAX];
+    int ready_status[FIL_BATCH_MAX];
+    unsigned int ready_idx[FIL_BATCH_MAX];
+    unsigned int i, nr_ready = 0;
+    timestamp_t now = timer_get_cycles();
+    int r;
 
-    write_size = domain->total_xlate_pages * sizeof(mppn_t);
+    Xil_AssertNonvoid(count <= FIL_BATCH_MAX);
 
-    rc = f_open(&fil, filename, FA_CREATE_ALWAYS | FA_WRITE);
-    if (rc) return EIO;
+    for (i = 0; i < count; i++) {
+        struct flash_transaction* txn = txns[i];
+        struct am_domain* domain = domain_get(txn);
 
-    rc = f_write(&fil, domain->gtd, write_size, &bw);
-    if (rc || bw != write_size) return EIO;
+        Xil_AssertNonvoid(txn->type == TXN_READ);
 
-    rc = f_close(&fil);
-    return rc > 0 ? EIO : 0;
-}
+        status[i] = EINVAL;
+        if (!domain) continue;
 
-static int restore_gtd(struct am_domain* domain, const char* filename)
-{
-    FIL fil;
-    size_t read_size;
-    UINT br;
-    int rc;
+        if (txn->lpa < domain->total_logical_pages) {
+            txn->stats.amu_begin_service_time = now;
+            status[i] = translate_lpa(txn);
+        }
 
-    read_size = domain->total_xlate_pages * sizeof(mppn_t);
+        domain_put(domain);
 
-    rc = f_open(&fil, filename, FA_READ);
-    if (rc) return EIO;
+        if (status[i] == 0 && txn->ppa_ready) {
+            ready_idx[nr_ready] = i;
+            ready[nr_ready++] = txn;
+        }
+    }
 
-    rc = f_read(&fil, domain->gtd, read_size, &br);
-    if (rc || br != read_size) return EIO;
+    if (!nr_ready) return 0;
 
-    rc = f_close(&fil);
-    return rc > 0 ? EIO : 0;
+    r = amu_submit_transaction_batch(ready, nr_ready, ready_status);
+    if (r) return r;
+
+    for (i = 0; i < nr_ready; i++)
+        status[ready_idx[i]] = ready_status[i];
+
+    return 0;
 }
 
-static int domain_init(struct am_domain* domain, unsigned int nsid,
-                       size_t capacity, size_t total_logical_pages,
-                       enum plane_allocate_scheme pa_scheme, int reset)
+static int gc_read_page(struct am_domain* domain, lpa_t lpa, ppa_t ppa,
+                        void* buf)
 {
-    char gtd_filename[20];
-    size_t xlate_ents_per_page =
-        FLASH_PG_SIZE / sizeof(struct xlate_entry_disk);
-    size_t total_xlate_pages =
-        (total_logical_pages + xlate_ents_per_page - 1) / xlate_ents_per_page;
-    size_t gtd_size;
-    FILINFO fno;
-    int i, r = 0;
+    struct flash_transaction txn;
+    int r;
 
-    memset(domain, 0, sizeof(*domain));
-    kref_init(&domain->kref);
-    domain->nsid = nsid;
-    domain->total_logical_pages = total_logical_pages;
-    domain->xlate_ents_per_page = xlate_ents_per_page;
-    domain->total_xlate_pages = total_xlate_pages;
-    domain->pa_scheme = pa_scheme;
+    flash_transaction_init(&txn);
+    txn.type = TXN_READ;
+    txn.source = TS_GC;
+    txn.nsid = domain->nsid;
+    txn.lpa = lpa;
+    txn.ppa = ppa;
+    txn.data = buf;
+    txn.offset = 0;
+    txn.length = FLASH_PG_SIZE;
+    txn.bitmap = (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1;
+    ppa_to_address(txn.ppa, &txn.addr);
 
-    xpc_init(&domain->pcache, capacity);
+    dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
+    r = amu_submit_transaction(&txn);
+    dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
 
-    gtd_size = total_xlate_pages * sizeof(mppn_t);
-    gtd_size = roundup(gtd_size, ARCH_PG_SIZE);
+    return r;
+}
 
-    domain->gtd = alloc_vmpages(gtd_size >> ARCH_PG_SHIFT, ZONE_PS_DDR);
-    if (!domain->gtd) goto fail_free_xpc;
-    domain->gtd_size = gtd_size;
+/* Write a relocated page to the GC write frontier of the plane in txn->addr. */
+static int gc_write_page(struct am_domain* domain, struct flash_transaction* txn,
+                         lpa_t lpa, int for_mapping, page_bitmap_t bitmap,
+                         void* buf)
+{
+    int r;
 
-    snprintf(gtd_filename, sizeof(gtd_filename), GTD_FILENAME, domain->nsid);
+    txn->type = TXN_WRITE;
+    txn->source = TS_GC;
+    txn->nsid = domain->nsid;
+    txn->lpa = lpa;
+    txn->for_mapping = for_mapping;
+    txn->data = buf;
+    txn->offset = 0;
+    txn->length = FLASH_PG_SIZE;
+    txn->bitmap = bitmap;
+
+    bm_alloc_page(domain->nsid, lpa, &txn->addr, TRUE /* for_gc */,
+                  for_mapping);
+    txn->ppa = address_to_ppa(&txn->addr);
 
-    if (f_stat(gtd_filename, &fno) != 0 || reset) {
-        xil_printf(
-            NAME
+    dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
+    r = amu_submit_transaction(txn);
+    dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE, DMA_TO_DEVICE);
+
+    if (r) bm_invalidate_page(&txn->addr);
+
+    return r;
+}
+
+static int relocate_data_page(struct am_domain* domain, lpa_t lpa,
+                              struct flash_address* addr, void* buf)
+{
+    mvpn_t mvpn = get_mvpn(domain, lpa);
+    unsigned int slot = get_mvpn_slot(domain, lpa);
+    ppa_t old_ppa = address_to_ppa(addr);
+    struct flash_transaction txn;
+    struct xlate_page* xpg;
+    ppa_t ppa;
+    int r;
+
+    r = get_ppa(domain, lpa, &ppa, NULL);
+    if (r) return r;
+
+    if (ppa != old_ppa) {
+        /* Stale page. */
+        bm_invalidate_page(addr);
+        return 0;
+    }
+
+    r = gc_read_page(domain, lpa, old_ppa, buf);
+    /* Pages allocated for reads of unwritten LPAs are never programmed and
+     * cannot be decoded. Move them anyway so that the block can be
+     * reclaimed. */
+    if (r == EBADMSG)
+        r = 0;
+    else if (r)
+        return r;
+
+    r = get_translation_page(domain, mvpn, &xpg);
+    if (r) return r;
+
+    /* The LPA may have been overwritten while we were reading the page. */
+    if (xpg->entries[slot].ppa != old_ppa) {
+        bm_invalidate_page(addr);
+        goto out_unlock;
+    }
+
+    flash_transaction_init(&txn);
+    txn.addr = *addr;
+    r = gc_write_page(domain, &txn, lpa, FALSE, xpg->entries[slot].bitmap,
+                      buf);
+    if (r) goto out_unlock;
+
+    xpc_update_mapping(xpg, slot, txn.ppa, 0);
+    bm_invalidate_page(addr);
+
+    r = journal_log(domain, lpa, txn.ppa, NO_MPPN);
+
+out_unlock:
+    mutex_unlock(&xpg->mutex);
+    xpc_unpin(&domain->pcache, xpg);
+
+    return r;
+}
+
+static int relocate_journal_page(struct am_domain* domain, unsigned int seq,
+                                 struct flash_address* addr, void* buf)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    ppa_t old_ppa = address_to_ppa(addr);
+    struct flash_transaction txn;
+    unsigned int index;
+    int r;
+
+    mutex_lock(&jnl->mutex);
+
+    index = (seq - jnl->first_seq) & ~JOURNAL_RMAP_TAG;
+    if (index >= jnl->nr_pages || jnl->pages[index] != old_ppa) {
+        /* Truncated. */
+        bm_invalidate_page(addr);
+        r = 0;
+        goto out;
+    }
+
+    r = gc_read_page(domain, JOURNAL_RMAP_TAG | seq, old_ppa, buf);
+    if (r) goto out;
+
+    flash_transaction_init(&txn);
+    txn.addr = *addr;
+    r = gc_write_page(domain, &txn, JOURNAL_RMAP_TAG | seq, TRUE,
+                      (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1, buf);
+    if (r) goto out;
+
+    jnl->pages[index] = txn.ppa;
+    r = journal_save_index(domain);
+    if (r) {
+        jnl->pages[index] = old_ppa;
+        bm_invalidate_page(&txn.addr);
+        goto out;
+    }
+
+    bm_invalidate_page(addr);
+
+out:
+    mutex_unlock(&jnl->mutex);
+    return r;
+}
+
+static int relocate_mapping_page(struct am_domain* domain, mvpn_t mvpn,
+                                 struct flash_address* addr, void* buf)
+{
+    ppa_t old_ppa = address_to_ppa(addr);
+    struct flash_transaction txn;
+    int r;
+
+    if (mvpn & JOURNAL_RMAP_TAG)
+        return relocate_journal_page(domain, mvpn & ~JOURNAL_RMAP_TAG, addr,
+                                     buf);
+
+    if (mvpn >= domain->total_xlate_pages || domain->gtd[mvpn] != old_ppa) {
+        journal_release_mppn(domain, addr);
+        return 0;
+    }
+
+    r = gc_read_page(domain, mvpn, old_ppa, buf);
+    if (r) return r;
+
+    flash_transaction_init(&txn);
+    txn.addr = *addr;
+    r = gc_write_page(domain, &txn, mvpn, TRUE,
+                      (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1, buf);
+    if (r) return r;
+
+    if (domain->gtd[mvpn] != old_ppa) {
+        /* The translation page was flushed while we were copying it. Drop our
+         * copy. */
+        bm_invalidate_page(&txn.addr);
+        journal_release_mppn(domain, addr);
+        return 0;
+    }
+
+    /* The old page is invalidated when the new GTD entry is committed. */
+    return set_gtd(domain, mvpn, txn.ppa);
+}
+
+/* Move a valid page out of a GC victim block. The page at @addr holds @lpa of
+ * namespace @nsid, or translation page @lpa if @for_mapping is set. @buf must
+ * be a DMA buffer of FLASH_PG_BUFFER_SIZE bytes. */
+int amu_relocate_page(unsigned int nsid, lpa_t lpa, int for_mapping,
+                      struct flash_address* addr, void* buf)
+{
+    struct am_domain* domain;
+    int r;
+
+    if (nsid <= 0 || nsid > NAMESPACE_MAX) return EINVAL;
+
+    domain = domain_get_by_nsid(nsid);
+    if (!domain) return ESRCH;
+
+    /* The mapping is not up to date until the journal is replayed. */
+    if (domain->journal.replay_pending) {
+        domain_put(domain);
+        return EAGAIN;
+    }
+
+    if (for_mapping)
+        r = relocate_mapping_page(domain, (mvpn_t)lpa, addr, buf);
+    else
+        r = relocate_data_page(domain, lpa, addr, buf);
+
+    domain_put(domain);
+    return r;
+}
+
+/* Unmap slots [first, last) of translation page mvpn. */
+static int unmap_translation_page(struct am_domain* domain, mvpn_t mvpn,
+                                  unsigned int first, unsigned int last)
+{
+    int whole = (first == 0) && (last == domain->xlate_ents_per_page);
+    lpa_t base = (lpa_t)mvpn * domain->xlate_ents_per_page;
+    struct flash_address addr;
+    struct xlate_page* xpg;
+    unsigned int slot;
+    int r;
+
+    /* Never written. Nothing to unmap. */
+    if (domain->gtd[mvpn] == NO_MPPN && !xpc_find(&domain->pcache, mvpn))
+        return 0;
+
+    r = get_translation_page(domain, mvpn, &xpg);
+    if (r) return r;
+
+    for (slot = first; slot < last; slot++) {
+        ppa_t ppa = xpg->entries[slot].ppa;
+
+        if (ppa == NO_PPA) continue;
+
+        ppa_to_address(ppa, &addr);
+        bm_invalidate_page(&addr);
+
+        xpg->entries[slot].ppa = NO_PPA;
+        xpg->entries[slot].bitmap = 0;
+        xpg->dirty = TRUE;
+
+        r = journal_log(domain, base + slot, NO_PPA, NO_MPPN);
+        if (r) goto out_unlock;
+    }
+
+    if (whole) {
+        /* The translation page is empty now. Release its flash page instead
+         * of writing back a page full of NO_PPA. */
+        if (domain->gtd[mvpn] != NO_MPPN) {
+            r = set_gtd(domain, mvpn, NO_MPPN);
+            if (r) goto out_unlock;
+        }
+
+        xpg->dirty = FALSE;
+    }
+
+out_unlock:
+    mutex_unlock(&xpg->mutex);
+    xpc_unpin(&domain->pcache, xpg);
+
+    return r;
+}
+
+/* Unmap LPAs [start, end) of namespace @nsid. The physical pages are
+ * invalidated so that GC reclaims them without relocation and subsequent
+ * reads return zeroes. */
+int amu_unmap_range(unsigned int nsid, lpa_t start, lpa_t end)
+{
+    struct am_domain* domain;
+    int r = 0;
+
+    if (nsid <= 0 || nsid > NAMESPACE_MAX) return EINVAL;
+
+    domain = domain_get_by_nsid(nsid);
+    if (!domain) return ESRCH;
+
+    if (start > end || end > domain->total_logical_pages) {
+        r = EINVAL;
+        goto out;
+    }
+
+    while (start < end) {
+        mvpn_t mvpn = get_mvpn(domain, start);
+        lpa_t base = (lpa_t)mvpn * domain->xlate_ents_per_page;
+        unsigned int first = start - base;
+        unsigned int last = min(end - base, domain->xlate_ents_per_page);
+
+        r = unmap_translation_page(domain, mvpn, first, last);
+        if (r) break;
+
+        start = base + last;
+    }
+
+out:
+    domain_put(domain);
+    return r;
+}
+
+static int save_gtd(struct am_domain* domain, const char* filename)
+{
+    FIL fil;
+    size_t write_size;
+    UINT bw;
+    int rc;
+
+    write_size = domain->total_xlate_pages * sizeof(mppn_t);
+
+    rc = f_open(&fil, filename, FA_CREATE_ALWAYS | FA_WRITE);
+    if (rc) return EIO;
+
+    rc = f_write(&fil, domain->gtd, write_size, &bw);
+    if (rc || bw != write_size) return EIO;
+
+    rc = f_close(&fil);
+    return rc > 0 ? EIO : 0;
+}
+
+static int restore_gtd(struct am_domain* domain, const char* filename)
+{
+    FIL fil;
+    size_t read_size;
+    UINT br;
+    int rc;
+
+    read_size = domain->total_xlate_pages * sizeof(mppn_t);
+
+    rc = f_open(&fil, filename, FA_READ);
+    if (rc) return EIO;
+
+    rc = f_read(&fil, domain->gtd, read_size, &br);
+    if (rc || br != read_size) return EIO;
+
+    rc = f_close(&fil);
+    return rc > 0 ? EIO : 0;
+}
+
+static int journal_read_page(struct am_domain* domain, unsigned int index,
+                             struct journal_page_header* buf)
+{
+    unsigned int seq = journal_page_seq(&domain->journal, index);
+    struct flash_transaction txn;
+    int r;
+
+    flash_transaction_init(&txn);
+    txn.type = TXN_READ;
+    txn.source = TS_MAPPING;
+    txn.nsid = domain->nsid;
+    txn.lpa = JOURNAL_RMAP_TAG | seq;
+    txn.ppa = domain->journal.pages[index];
+    txn.data = (u8*)buf;
+    txn.offset = 0;
+    txn.length = FLASH_PG_SIZE;
+    txn.bitmap = (1UL << (FLASH_PG_SIZE >> SECTOR_SHIFT)) - 1;
+    ppa_to_address(txn.ppa, &txn.addr);
+
+    dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
+    r = amu_submit_transaction(&txn);
+    dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE, DMA_FROM_DEVICE);
+    if (r) return r;
+
+    if (buf->magic != JOURNAL_MAGIC || buf->nsid != domain->nsid ||
+        buf->seq != seq || buf->nr_records > JOURNAL_RECORDS_PER_PAGE)
+        return EBADMSG;
+
+    return 0;
+}
+
+/* Bring the block manager up to date with the pages referenced by the
+ * journal. The saved block state may still list their blocks as free, so this
+ * must be done for every namespace before anything is allocated. Superseded
+ * pages are recovered too and left to GC, which finds them stale. */
+static int journal_recover_pages(struct am_domain* domain)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    struct journal_page_header* hdr;
+    struct journal_record* rec;
+    struct flash_address addr;
+    unsigned int index;
+    int i, r;
+
+    hdr = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
+    if (!hdr) return ENOMEM;
+    rec = (struct journal_record*)(hdr + 1);
+
+    for (index = 0; index < jnl->nr_pages; index++) {
+        r = journal_read_page(domain, index, hdr);
+        if (r) {
+            xil_printf(NAME " Mapping journal of namespace %d ends at page %u "
+                            "(%d)\n",
+                       domain->nsid, journal_page_seq(jnl, index), r);
+            jnl->nr_pages = index;
+            break;
+        }
+
+        ppa_to_address(jnl->pages[index], &addr);
+        bm_recover_page(domain->nsid,
+                        JOURNAL_RMAP_TAG | journal_page_seq(jnl, index), &addr,
+                        TRUE);
+
+        for (i = 0; i < hdr->nr_records; i++) {
+            if (rec[i].ppa == NO_PPA) continue;
+
+            ppa_to_address(rec[i].ppa, &addr);
+            if (rec[i].key & JOURNAL_REC_GTD)
+                bm_recover_page(domain->nsid, rec[i].key & ~JOURNAL_REC_GTD,
+                                &addr, TRUE);
+            else
+                bm_recover_page(domain->nsid, rec[i].key, &addr, FALSE);
+        }
+    }
+
+    free_mem(__pa(hdr), FLASH_PG_BUFFER_SIZE);
+    return 0;
+}
+
+static void journal_replay_lpa(struct am_domain* domain, lpa_t lpa, ppa_t ppa)
+{
+    unsigned int slot = get_mvpn_slot(domain, lpa);
+    struct xlate_page* xpg;
+
+    if (lpa >= domain->total_logical_pages) return;
+    if (get_translation_page(domain, get_mvpn(domain, lpa), &xpg)) return;
+
+    xpg->entries[slot].ppa = ppa;
+    xpg->entries[slot].bitmap =
+        ppa == NO_PPA ? 0 : (1UL << SECTORS_PER_FLASH_PG) - 1;
+    xpg->dirty = TRUE;
+
+    mutex_unlock(&xpg->mutex);
+    xpc_unpin(&domain->pcache, xpg);
+}
+
+/* Apply the journal on top of the checkpointed GTD. GTD records are applied
+ * first so that translation pages are only read from their final locations;
+ * translation pages superseded after the checkpoint may already have been
+ * erased. LPA records are then applied in order on top of those pages. */
+static int journal_replay(struct am_domain* domain)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    unsigned int nr_pages = jnl->nr_pages;
+    struct journal_page_header* hdr;
+    struct journal_record* rec;
+    unsigned int index;
+    int pass, i, r = 0;
+
+    hdr = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
+    if (!hdr) return ENOMEM;
+    rec = (struct journal_record*)(hdr + 1);
+
+    for (pass = 0; pass < 2 && !r; pass++) {
+        for (index = 0; index < nr_pages; index++) {
+            r = journal_read_page(domain, index, hdr);
+            if (r) break;
+
+            for (i = 0; i < hdr->nr_records; i++) {
+                uint32_t key = rec[i].key;
+
+                if (pass == 0 && (key & JOURNAL_REC_GTD)) {
+                    key &= ~JOURNAL_REC_GTD;
+                    if (key < domain->total_xlate_pages)
+                        domain->gtd[key] = rec[i].ppa;
+                } else if (pass == 1 && !(key & JOURNAL_REC_GTD)) {
+                    journal_replay_lpa(domain, key, rec[i].ppa);
+                }
+            }
+        }
+    }
+
+    free_mem(__pa(hdr), FLASH_PG_BUFFER_SIZE);
+    return r;
+}
+
+static int domain_init(struct am_domain* domain, unsigned int nsid,
+                       size_t capacity, size_t total_logical_pages,
+                       enum plane_allocate_scheme pa_scheme, int reset)
+{
+    char gtd_filename[20];
+    size_t xlate_ents_per_page =
+        FLASH_PG_SIZE / sizeof(struct xlate_entry_disk);
+    size_t total_xlate_pages =
+        (total_logical_pages + xlate_ents_per_page - 1) / xlate_ents_per_page;
+    size_t gtd_size;
+    FILINFO fno;
+    int i, r = 0;
+
+    memset(domain, 0, sizeof(*domain));
+    kref_init(&domain->kref);
+    domain->nsid = nsid;
+    domain->total_logical_pages = total_logical_pages;
+    domain->xlate_ents_per_page = xlate_ents_per_page;
+    domain->total_xlate_pages = total_xlate_pages;
+    domain->pa_scheme = pa_scheme;
+
+    r = xpc_init(&domain->pcache, capacity);
+    if (r) return r;
+
+    gtd_size = total_xlate_pages * sizeof(mppn_t);
+    gtd_size = roundup(gtd_size, ARCH_PG_SIZE);
+
+    domain->gtd = alloc_vmpages(gtd_size >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!domain->gtd) {
+        r = ENOMEM;
+        goto fail_free_xpc;
+    }
+    domain->gtd_size = gtd_size;
+
+    snprintf(gtd_filename, sizeof(gtd_filename), GTD_FILENAME, domain->nsid);
+
+    if (f_stat(gtd_filename, &fno) != 0 || reset) {
+        xil_printf(
+            NAME
             " Initializing new global translation directory for namespace %d ...",
             nsid);
 
@@ -1022,14 +2157,54 @@ static int domain_init(struct am_domain* domain, unsigned int nsid,
 
     if (r != 0) {
         xil_printf("FAILED (%d)\n", r);
-        goto fail_free_gtd;
+        if (!rebuild_allowed) goto fail_free_gtd;
+
+        for (i = 0; i < total_xlate_pages; i++) {
+            domain->gtd[i] = NO_MPPN;
+        }
+        domain->stale = TRUE;
+        r = 0;
+    }
+
+    r = journal_init(&domain->journal);
+    if (r) goto fail_free_gtd;
+
+    if (reset) {
+        /* Pages of the old journal are reclaimed with the old mapping. */
+        r = journal_save_index(domain);
+    } else if (!domain->stale) {
+        r = journal_restore_index(domain);
+        if (r == 0 && domain->journal.nr_pages > 0) {
+            xil_printf(NAME " Recovering %u mapping journal pages for "
+                            "namespace %d\n",
+                       domain->journal.nr_pages, nsid);
+            r = journal_recover_pages(domain);
+            domain->journal.replay_pending = TRUE;
+        }
+    }
+
+    if (r != 0) {
+        xil_printf(NAME " Failed to load mapping journal for namespace %d "
+                        "(%d)\n",
+                   nsid, r);
+        if (!rebuild_allowed) goto fail_free_journal;
+
+        domain->journal.nr_pages = 0;
+        domain->journal.replay_pending = FALSE;
+        domain->stale = TRUE;
+        r = 0;
     }
 
+    if (domain->stale)
+        xil_printf(NAME " Mapping of namespace %d will be rebuilt\n", nsid);
+
     xil_printf(NAME " Initialized namespace %d with %lu logical pages\n", nsid,
                total_logical_pages);
 
     return 0;
 
+fail_free_journal:
+    journal_free(&domain->journal);
 fail_free_gtd:
     free_mem(__pa(domain->gtd), domain->gtd_size);
 fail_free_xpc:
@@ -1067,36 +2242,124 @@ out_free:
 
 static void flush_domain(struct am_domain* domain)
 {
-    struct xlate_page start_key, *xpg;
-    struct avl_iter iter;
+    struct xlate_pcache* xpc = &domain->pcache;
+    struct xlate_page* xpg;
+    size_t i;
+
+    for (i = 0; i < xpc->nr_frames; i++) {
+        xpg = xpc->frames[i];
 
-    start_key.mvpn = 0;
-    xpc_avl_start_iter(&domain->pcache, &iter, &start_key, AVL_GREATER_EQUAL);
-    for (xpg = xpc_avl_get_iter(&iter); xpg;) {
-        if (xpg->dirty) {
+        if (xpg->indexed && xpg->dirty) {
             xpc_pin(xpg);
             mutex_lock(&xpg->mutex);
 
-            xpc_flush_page(domain, xpg);
+            if (xpg->indexed && xpg->dirty) xpc_flush_page(domain, xpg);
 
             mutex_unlock(&xpg->mutex);
-            xpc_unpin(&domain->pcache, xpg);
+            xpc_unpin(xpc, xpg);
         }
-
-        avl_inc_iter(&iter);
-        xpg = xpc_avl_get_iter(&iter);
     }
 }
 
 static int save_domain(struct am_domain* domain)
 {
     char gtd_filename[20];
+    int r;
+
     snprintf(gtd_filename, sizeof(gtd_filename), GTD_FILENAME, domain->nsid);
 
     flush_domain(domain);
+
+    r = journal_commit(domain);
+    if (r) return r;
+
     return save_gtd(domain, gtd_filename);
 }
 
+/* Save translation pages, the GTD and the block manager state so that the
+ * journal can be truncated. Other threads keep updating the mapping while the
+ * checkpoint is taken, so only the journal pages committed before it starts
+ * are covered by it. Later pages are kept and replayed on top of it. */
+static int checkpoint_domain(struct am_domain* domain)
+{
+    struct mapping_journal* jnl = &domain->journal;
+    unsigned int nr_pages;
+    int r;
+
+    mutex_lock(&jnl->checkpoint_mutex);
+
+    mutex_lock(&jnl->mutex);
+    r = journal_commit_locked(domain);
+    nr_pages = jnl->nr_pages;
+    mutex_unlock(&jnl->mutex);
+    if (r) goto out;
+
+    r = save_domain(domain);
+    if (r) goto out;
+
+    r = bm_save_state();
+    if (r) goto out;
+
+    r = journal_truncate(domain, nr_pages);
+
+out:
+    mutex_unlock(&jnl->checkpoint_mutex);
+    return r;
+}
+
+/* Hand the domain to the checkpoint thread if its journal has grown too long.
+ * The caller only waits for the checkpoint if the journal is nearly full. */
+static void maybe_checkpoint_domain(struct am_domain* domain)
+{
+    struct mapping_journal* jnl = &domain->journal;
+
+    if (jnl->nr_pages < MAPPING_JOURNAL_CHECKPOINT_PAGES) return;
+
+    mutex_lock(&checkpoint_queue_mutex);
+
+    if (!jnl->checkpointing) {
+        jnl->checkpointing = TRUE;
+        kref_get(&domain->kref);
+        checkpoint_queue[checkpoint_queue_tail++ % NAMESPACE_MAX] = domain;
+        cond_signal(&checkpoint_queue_cond);
+    }
+
+    while (jnl->checkpointing && jnl->nr_pages >= JOURNAL_THROTTLE_PAGES)
+        cond_wait(&checkpoint_done_cond, &checkpoint_queue_mutex);
+
+    mutex_unlock(&checkpoint_queue_mutex);
+}
+
+void checkpoint_main(void)
+{
+    struct am_domain* domain;
+    int r;
+
+    local_irq_enable();
+
+    for (;;) {
+        mutex_lock(&checkpoint_queue_mutex);
+        while (checkpoint_queue_head == checkpoint_queue_tail)
+            cond_wait(&checkpoint_queue_cond, &checkpoint_queue_mutex);
+        domain = checkpoint_queue[checkpoint_queue_head++ % NAMESPACE_MAX];
+        mutex_unlock(&checkpoint_queue_mutex);
+
+        /* A detached domain has been checkpointed on detach. */
+        if (active_domains[NSID2IDX(domain->nsid)] == domain) {
+            r = checkpoint_domain(domain);
+            WARN(r != 0, "Failed to checkpoint namespace %d (%d)\n",
+                 domain->nsid, r);
+        }
+
+        mutex_lock(&checkpoint_queue_mutex);
+        domain->journal.checkpointing = FALSE;
+        cond_broadcast(&checkpoint_done_cond);
+        mutex_unlock(&checkpoint_queue_mutex);
+
+        domain_put(domain);
+    }
+}
+
 int amu_save_domain(unsigned int nsid)
 {
     struct am_domain* domain = domain_get_by_nsid(nsid);
@@ -1109,11 +2372,192 @@ int amu_save_domain(unsigned int nsid)
     return r;
 }
 
+/* Make all mapping changes of namespace @nsid so far durable. */
+int amu_commit_journal(unsigned int nsid)
+{
+    struct am_domain* domain = domain_get_by_nsid(nsid);
+    int r;
+
+    if (!domain) return EINVAL;
+
+    r = journal_commit(domain);
+    domain_put(domain);
+    return r;
+}
+
+/* Save the mapping of namespace @nsid and truncate the journal pages the
+ * checkpoint covers. Pages committed by other threads meanwhile are kept. */
+int amu_checkpoint_domain(unsigned int nsid)
+{
+    struct am_domain* domain = domain_get_by_nsid(nsid);
+    int r;
+
+    if (!domain) return EINVAL;
+
+    r = checkpoint_domain(domain);
+    domain_put(domain);
+    return r;
+}
+
+/* Replay the mapping journals of all attached namespaces. Called once all
+ * namespaces are attached so that no page is allocated before every journal
+ * has been scanned. */
+void amu_replay_journals(void)
+{
+    struct am_domain* domain;
+    int i, r;
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        domain = active_domains[i];
+        if (!domain || !domain->journal.replay_pending) continue;
+
+        xil_printf(NAME " Replaying mapping journal for namespace %d ...",
+                   domain->nsid);
+
+        r = journal_replay(domain);
+        if (r == 0) r = checkpoint_domain(domain);
+
+        domain->journal.replay_pending = FALSE;
+        xil_printf(r ? "FAILED (%d)\n" : "OK\n", r);
+    }
+}
+
+/* Restore the program sequence number. Must be called before any page is
+ * programmed. */
+void amu_init(void)
+{
+    if (mutex_init(&checkpoint_queue_mutex, NULL) != 0) {
+        panic("failed to initialize checkpoint queue mutex");
+    }
+    if (cond_init(&checkpoint_queue_cond, NULL) != 0) {
+        panic("failed to initialize checkpoint queue condvar");
+    }
+    if (cond_init(&checkpoint_done_cond, NULL) != 0) {
+        panic("failed to initialize checkpoint condvar");
+    }
+
+    if (restore_program_seq() == 0) return;
+
+    xil_printf(NAME " Program sequence number not found, starting from 0\n");
+    program_seq = program_seq_limit = 0;
+}
+
+/* Account for a valid page found by bm_rebuild(). The block information has
+ * been rebuilt at this point so superseded pages can be invalidated and
+ * translation pages can be written back. */
+void amu_rebuild_page(unsigned int nsid, lpa_t lpa, int for_mapping,
+                      struct flash_address* addr, uint64_t seq)
+{
+    struct am_domain* domain;
+    struct xlate_page* xpg;
+    struct xlate_entry* entry;
+    struct flash_address old_addr;
+
+    if (nsid == 0 || nsid > NAMESPACE_MAX) {
+        bm_invalidate_page(addr);
+        return;
+    }
+
+    /* Pages of detached namespaces are left alone. Their mapping is restored
+     * from their own checkpoint on attach. */
+    domain = active_domains[NSID2IDX(nsid)];
+    if (!domain) return;
+
+    /* Translation and journal pages are superseded by the rebuilt mapping. */
+    if (for_mapping || lpa >= domain->total_logical_pages) {
+        bm_invalidate_page(addr);
+        return;
+    }
+
+    if (get_translation_page(domain, get_mvpn(domain, lpa), &xpg)) return;
+    entry = &xpg->entries[get_mvpn_slot(domain, lpa)];
+
+    if (entry->ppa != NO_PPA) {
+        ppa_to_address(entry->ppa, &old_addr);
+
+        if (bm_get_page_seq(&old_addr) > seq) {
+            bm_invalidate_page(addr);
+            goto out;
+        }
+
+        bm_invalidate_page(&old_addr);
+    }
+
+    entry->ppa = address_to_ppa(addr);
+    entry->bitmap = (1UL << SECTORS_PER_FLASH_PG) - 1;
+    xpg->dirty = TRUE;
+
+out:
+    mutex_unlock(&xpg->mutex);
+    xpc_unpin(&domain->pcache, xpg);
+}
+
+/* Rebuild the mapping of all attached namespaces from the page metadata if
+ * @force is set or the checkpoint of any namespace could not be loaded. Called
+ * once all namespaces are attached and before anything is written. */
+void amu_rebuild_mappings(int force)
+{
+    struct am_domain* domain;
+    uint64_t max_seq;
+    int rebuild = force;
+    int i, r;
+
+    rebuild_allowed = FALSE;
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        domain = active_domains[i];
+        if (domain && domain->stale) rebuild = TRUE;
+    }
+
+    if (!rebuild) return;
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        struct mapping_journal* jnl;
+        int j;
+
+        domain = active_domains[i];
+        if (!domain) continue;
+
+        /* Start from an empty mapping. */
+        for (j = 0; j < domain->total_xlate_pages; j++) {
+            domain->gtd[j] = NO_MPPN;
+        }
+
+        jnl = &domain->journal;
+        jnl->nr_pages = 0;
+        jnl->nr_stale_mppns = 0;
+        jnl->buf->nr_records = 0;
+        jnl->replay_pending = FALSE;
+    }
+
+    r = bm_rebuild(&max_seq);
+    if (r) panic(NAME " Failed to rebuild mapping tables (%d)\n", r);
+
+    if (max_seq >= program_seq) {
+        program_seq = max_seq + 1;
+        program_seq_limit = program_seq + PROGRAM_SEQ_RESERVE;
+        save_program_seq(program_seq_limit);
+    }
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        domain = active_domains[i];
+        if (!domain) continue;
+
+        xil_printf(NAME " Saving rebuilt mapping of namespace %d ...",
+                   domain->nsid);
+
+        r = checkpoint_domain(domain);
+        domain->stale = FALSE;
+        xil_printf(r ? "FAILED (%d)\n" : "OK\n", r);
+    }
+}
+
 static void domain_free(struct kref* kref)
 {
     struct am_domain* domain = list_entry(kref, struct am_domain, kref);
 
     xpc_free(&domain->pcache);
+    journal_free(&domain->journal);
 
     if (domain->gtd_size > 0) {
         free_mem(__pa(domain->gtd), domain->gtd_size);
@@ -1135,7 +2579,7 @@ int amu_detach_domain(unsigned int nsid)
 
     active_domains[NSID2IDX(nsid)] = NULL;
 
-    save_domain(domain);
+    checkpoint_domain(domain);
     domain_put(domain);
     return 0;
 }
@@ -1143,11 +2587,16 @@ int amu_detach_domain(unsigned int nsid)
 int amu_delete_domain(unsigned int nsid)
 {
     char gtd_filename[20];
+    char journal_filename[20];
     FILINFO fno;
     int r;
 
     if (nsid <= 0 || nsid > NAMESPACE_MAX) return EINVAL;
 
+    snprintf(journal_filename, sizeof(journal_filename), JOURNAL_FILENAME,
+             nsid);
+    if (f_stat(journal_filename, &fno) == FR_OK) f_unlink(journal_filename);
+
     snprintf(gtd_filename, sizeof(gtd_filename), GTD_FILENAME, nsid);
 
     r = f_stat(gtd_filename, &fno);
@@ -1161,3 +2610,32 @@ int amu_delete_domain(unsigned int nsid)
 
     return 0;
 }
+
+void amu_report_stats(void)
+{
+    int i;
+
+    xil_printf("======= Translation page cache ===========\n");
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        struct am_domain* domain = active_domains[i];
+        struct xlate_pcache* xpc;
+        unsigned long hits, misses;
+
+        if (!domain) continue;
+
+        xpc = &domain->pcache;
+        hits = xpc->stats.hits;
+        misses = xpc->stats.misses;
+
+        xil_printf("Namespace %d:\n", i + 1);
+        xil_printf("  Cached pages: %lu / %lu\n", xpc->size, xpc->capacity);
+        xil_printf("  Hits: %lu\n", hits);
+        xil_printf("  Misses: %lu\n", misses);
+        xil_printf("  Evictions: %lu\n", xpc->stats.evictions);
+        if (hits + misses)
+            xil_printf("  Hit ratio: %lu%%\n", hits * 100 / (hits + misses));
+    }
+
+    xil_printf("==========================================\n");
+}
@@ -3,6 +3,7 @@
 
 #include <flash_config.h>
 #include <flash.h>
+#include <fil.h>
 #include <bitmap.h>
 #include <list.h>
 #include <utils.h>
@@ -11,8 +12,11 @@
 #include <page.h>
 #include <memalloc.h>
 #include <dma.h>
+#include <timer.h>
+#include "../thread.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdlib.h>
 
@@ -21,37 +25,120 @@
 /* Bitmap containing all free blocks in the planes. */
 #define PLANE_INFO_FILE "planes.bin"
 #define BAD_BLOCKS_FILE "badblks.bin"
+/* Per-block erase counters. */
+#define ERASE_COUNT_FILE "erasecnt.bin"
+/* Per-block valid page information and reverse mappings. */
+#define BLOCK_INFO_FILE "blocks.bin"
 
 #define BF_BAD     0x1
 #define BF_MAPPING 0x2
+/* Reverse mappings of the block are unknown so it cannot be garbage
+ * collected. */
+#define BF_NO_RMAP 0x4
+/* The block may have been programmed after the plane information was saved
+ * and must be erased before it is reused. */
+#define BF_NEED_ERASE 0x8
+/* Valid pages of the block were found by a metadata scan and have not been
+ * handed to the address mapping unit yet. */
+#define BF_SCANNED 0x10
+
+/* Only LSB pages are allocated in a block. */
+#define USABLE_PAGES_PER_BLOCK (PAGES_PER_BLOCK / 2)
+
+#define NO_RMAP_LPA UINT32_MAX
+
+/* Reverse mapping of a programmed page. For data pages, lpa is the logical
+ * page address. For translation pages, lpa is the mapping virtual page
+ * number. */
+struct page_rmap {
+    uint32_t nsid;
+    uint32_t lpa;
+};
 
 struct block_data {
     struct list_head list;
     unsigned short block_id;
     unsigned int nr_invalid_pages;
+    unsigned int nr_valid_pages;
     unsigned short page_write_index;
     unsigned int nsid;
     int flags;
+    unsigned int erase_count;
+    /* Last time a page in this block is written or invalidated. */
+    timestamp_t mtime;
+    bitchunk_t invalid_page_bitmap[BITCHUNKS(PAGES_PER_BLOCK)];
+    /* Indexed by allocation order (see page_idx_map). */
+    struct page_rmap* rmap;
+};
+
+/* On-disk format of block information. */
+struct block_info_disk {
+    uint16_t page_write_index;
+    uint16_t nr_valid_pages;
+    uint16_t nr_invalid_pages;
+    uint16_t flags;
     bitchunk_t invalid_page_bitmap[BITCHUNKS(PAGES_PER_BLOCK)];
 };
 
 struct plane_allocator {
+    struct flash_address addr;
     struct block_data* blocks;
     struct list_head free_list;
     unsigned int free_list_size;
+    /* Blocks that are fully programmed and can be selected as GC victims. */
+    struct list_head used_list;
     struct block_data* data_wf;
     struct block_data* gc_wf;
     struct block_data* mapping_wf;
+
+    /* Highest erase count of all blocks in the plane. */
+    unsigned int max_erase_count;
+    /* The erase count spread may have exceeded the static wear leveling
+     * threshold. */
+    int wl_pending;
+
+    int gc_active;
+    /* No victim can be reclaimed from this plane until more pages are
+     * invalidated. */
+    int gc_blocked;
 };
 
 static struct plane_allocator**** planes;
 
+static struct page_rmap* rmap_table;
+static size_t rmap_table_size;
+
+/* Program sequence numbers of the pages found by bm_rebuild(). Laid out like
+ * rmap_table. Only allocated during the rebuild. */
+static uint64_t* page_seq_table;
+static size_t page_seq_table_size;
+
+static struct {
+    mutex_t mutex;
+    /* Wakes up GC threads. */
+    cond_t gc_cond;
+    /* Wakes up writers throttled on free blocks. */
+    cond_t free_cond;
+} gc;
+
+static struct {
+    unsigned long collected_blocks;
+    unsigned long relocated_pages;
+    unsigned long erase_failures;
+    unsigned long throttled_writes;
+    unsigned long wl_migrated_blocks;
+} gc_stats;
+
 static bitchunk_t lsb_bitmap[BITCHUNKS(PAGES_PER_BLOCK)] = {LSB_BITMAP};
 
 /* page_idx_map[i] = the page number that should be returned on the i-th
  * allocation for a block. Always allocate LSB pages first before giving out MSB
  * pages. */
 static int page_idx_map[PAGES_PER_BLOCK];
+/* Inverse of page_idx_map. */
+static int page_order_map[PAGES_PER_BLOCK];
+
+static int save_bad_blocks(void);
 
 static inline struct plane_allocator* get_plane(struct flash_address* addr)
 {
@@ -69,46 +156,116 @@ static inline struct block_data* get_block_data(struct plane_allocator* plane,
     return &plane->blocks[block_id];
 }
 
+static void note_block_erased(struct plane_allocator* plane,
+                              struct block_data* block)
+{
+    block->erase_count++;
+    if (block->erase_count > plane->max_erase_count)
+        plane->max_erase_count = block->erase_count;
+}
+
+/* Retire a block that failed to erase. The bad block table is saved right
+ * away because nothing else records the failure across a restart. */
+static void retire_block(struct block_data* block)
+{
+    block->flags |= BF_BAD;
+    gc_stats.erase_failures++;
+
+    save_bad_blocks();
+}
+
+static int erase_free_block(struct plane_allocator* plane,
+                            struct block_data* block)
+{
+    struct flash_transaction txn;
+    int r;
+
+    flash_transaction_init(&txn);
+    txn.type = TXN_ERASE;
+    txn.source = TS_GC;
+    txn.addr = plane->addr;
+    txn.addr.block = block->block_id;
+    txn.addr.page = 0;
+
+    r = amu_submit_transaction(&txn);
+    if (r) return r;
+
+    block->flags &= ~BF_NEED_ERASE;
+    note_block_erased(plane, block);
+    return 0;
+}
+
+/* Dynamic wear leveling: hot data goes to the least worn free block while
+ * cold data relocated by GC goes to the most worn one. */
 static struct block_data* get_free_block(struct plane_allocator* plane,
-                                         unsigned int nsid, int for_mapping)
+                                         unsigned int nsid, int for_mapping,
+                                         int cold)
 {
-    struct block_data* block;
+    struct block_data *block, *cur;
 
-    if (list_empty(&plane->free_list)) return NULL;
+    for (;;) {
+        if (list_empty(&plane->free_list)) return NULL;
+
+        block = NULL;
+        list_for_each_entry(cur, &plane->free_list, list)
+        {
+            if (!block || (cold ? cur->erase_count > block->erase_count
+                                : cur->erase_count < block->erase_count))
+                block = cur;
+        }
+
+        list_del(&block->list);
+        plane->free_list_size--;
+
+        if (!(block->flags & BF_NEED_ERASE) ||
+            erase_free_block(plane, block) == 0)
+            break;
+
+        retire_block(block);
+    }
 
-    block = list_entry(plane->free_list.next, struct block_data, list);
-    list_del(&block->list);
-    plane->free_list_size--;
     block->nsid = nsid;
     block->flags |= for_mapping ? BF_MAPPING : 0;
 
     return block;
 }
 
+static void reset_block(struct block_data* block)
+{
+    block->nr_invalid_pages = 0;
+    block->nr_valid_pages = 0;
+    block->page_write_index = 0;
+    block->flags &= BF_BAD;
+    block->mtime = 0;
+    memset(&block->invalid_page_bitmap, 0, sizeof(block->invalid_page_bitmap));
+    memset(block->rmap, 0xff, sizeof(struct page_rmap) * USABLE_PAGES_PER_BLOCK);
+}
+
 static void init_plane(struct plane_allocator* plane)
 {
     int i;
 
     INIT_LIST_HEAD(&plane->free_list);
+    INIT_LIST_HEAD(&plane->used_list);
 
     for (i = 0; i < BLOCKS_PER_PLANE; i++) {
         struct block_data* block = get_block_data(plane, i);
 
-        block->nr_invalid_pages = 0;
         block->block_id = i;
-        block->page_write_index = 0;
         block->flags = 0;
+        block->erase_count = 0;
         INIT_LIST_HEAD(&block->list);
-        memset(&block->invalid_page_bitmap, 0,
-               sizeof(block->invalid_page_bitmap));
+        reset_block(block);
     }
 }
 
 static void init_plane_wf(struct plane_allocator* plane)
 {
-    plane->data_wf = get_free_block(plane, 1, FALSE);
-    plane->gc_wf = get_free_block(plane, 1, FALSE);
-    plane->mapping_wf = get_free_block(plane, 1, TRUE);
+    if (!plane->data_wf)
+        plane->data_wf = get_free_block(plane, 1, FALSE, FALSE);
+    if (!plane->gc_wf) plane->gc_wf = get_free_block(plane, 1, FALSE, TRUE);
+    if (!plane->mapping_wf)
+        plane->mapping_wf = get_free_block(plane, 1, TRUE, FALSE);
 }
 
 static void alloc_planes(void)
@@ -118,13 +275,20 @@ static void alloc_planes(void)
     void** cur_ptr;
     struct plane_allocator* cur_plane;
     struct block_data* cur_block;
-    int i, j, k, l;
+    struct page_rmap* cur_rmap;
+    int i, j, k, l, b;
 
     nr_planes =
         NR_CHANNELS * CHIPS_PER_CHANNEL * DIES_PER_CHIP * PLANES_PER_DIE;
 
     nr_blocks = nr_planes * BLOCKS_PER_PLANE;
 
+    rmap_table_size = nr_blocks * USABLE_PAGES_PER_BLOCK *
+                      sizeof(struct page_rmap);
+    rmap_table_size = roundup(rmap_table_size, ARCH_PG_SIZE);
+    rmap_table = alloc_vmpages(rmap_table_size >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    Xil_AssertVoid(rmap_table != NULL);
+
     nr_ptrs =
         NR_CHANNELS + NR_CHANNELS * CHIPS_PER_CHANNEL * (1 + DIES_PER_CHIP);
 
@@ -142,6 +306,8 @@ static void alloc_planes(void)
         (struct block_data*)(buf + nr_ptrs * sizeof(void*) +
                              nr_planes * sizeof(struct plane_allocator));
 
+    cur_rmap = rmap_table;
+
     planes = (struct plane_allocator****)cur_ptr;
     cur_ptr += NR_CHANNELS;
 
@@ -161,9 +327,19 @@ static void alloc_planes(void)
                     struct plane_allocator* plane = &planes[i][j][k][l];
                     memset(plane, 0, sizeof(struct plane_allocator));
 
+                    plane->addr.channel = i;
+                    plane->addr.chip = j;
+                    plane->addr.die = k;
+                    plane->addr.plane = l;
+
                     plane->blocks = cur_block;
                     cur_block += BLOCKS_PER_PLANE;
 
+                    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+                        plane->blocks[b].rmap = cur_rmap;
+                        cur_rmap += USABLE_PAGES_PER_BLOCK;
+                    }
+
                     init_plane(&planes[i][j][k][l]);
                 }
             }
@@ -250,152 +426,971 @@ static int save_plane_info(void)
                         SET_BIT(block_map, plane->gc_wf->block_id);
                     }
 
-                    if (count == planes_per_page) {
-                        rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
-                        if (rc || bw != ARCH_PG_SIZE) goto out;
+                    if (count == planes_per_page) {
+                        rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
+                        if (rc || bw != ARCH_PG_SIZE) goto out;
+
+                        wptr = buf;
+                        count = 0;
+                    }
+
+                    memcpy(wptr, block_map, sizeof(block_map));
+                    wptr += sizeof(block_map);
+                    count++;
+                }
+            }
+        }
+    }
+
+    if (wptr != buf) {
+        rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
+        if (rc || bw != ARCH_PG_SIZE) goto out;
+    }
+
+    rc = f_close(&fil);
+    if (rc) goto out;
+
+    r = 0;
+out:
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+
+    return r;
+}
+
+static int restore_plane_info(void)
+{
+    FIL fil;
+    u8 *buf, *rptr;
+    int planes_per_page, count;
+    UINT br;
+    int i, j, k, l;
+    int rc, r = EIO;
+
+    planes_per_page =
+        ARCH_PG_SIZE / (BITCHUNKS(BLOCKS_PER_PLANE) * sizeof(bitchunk_t));
+
+    rc = f_open(&fil, PLANE_INFO_FILE, FA_READ);
+    if (!rc) rc = f_lseek(&fil, 0);
+    if (rc) return EIO;
+
+    buf = alloc_vmpages(1, ZONE_PS_DDR);
+
+    rc = f_read(&fil, buf, ARCH_PG_SIZE, &br);
+    if (rc || br != ARCH_PG_SIZE) goto out;
+
+    rptr = buf;
+    count = 0;
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+                    bitchunk_t block_map[BITCHUNKS(BLOCKS_PER_PLANE)];
+                    struct block_data* block;
+                    int idx;
+
+                    if (count == planes_per_page) {
+                        rc = f_read(&fil, buf, ARCH_PG_SIZE, &br);
+                        if (rc || br != ARCH_PG_SIZE) goto out;
+
+                        rptr = buf;
+                        count = 0;
+                    }
+
+                    memcpy(block_map, rptr, sizeof(block_map));
+
+                    for (idx = 0; idx < BLOCKS_PER_PLANE; idx++) {
+                        if (GET_BIT(block_map, idx)) {
+                            block = get_block_data(plane, idx);
+                            list_add_tail(&block->list, &plane->free_list);
+                            plane->free_list_size++;
+                        }
+                    }
+
+                    rptr += sizeof(block_map);
+                    count++;
+                }
+            }
+        }
+    }
+
+    rc = f_close(&fil);
+    if (rc) goto out;
+
+    r = 0;
+out:
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+
+    return r;
+}
+
+static int save_block_info(void)
+{
+    FIL fil;
+    struct block_info_disk *buf, *wptr;
+    int infos_per_page, count;
+    UINT bw;
+    int i, j, k, l, b;
+    int rc;
+
+    infos_per_page = ARCH_PG_SIZE / sizeof(struct block_info_disk);
+
+    rc = f_open(&fil, BLOCK_INFO_FILE, FA_CREATE_ALWAYS | FA_WRITE);
+    if (rc) return EIO;
+
+    rc = f_lseek(&fil, 0);
+    if (rc) {
+        f_close(&fil);
+        return EIO;
+    }
+
+    buf = alloc_vmpages(1, ZONE_PS_DDR);
+
+    wptr = buf;
+    count = 0;
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
+                    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+                        struct block_data* block = get_block_data(plane, b);
+
+                        if (count == infos_per_page) {
+                            rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
+                            if (rc || bw != ARCH_PG_SIZE) goto fail_close;
+
+                            wptr = buf;
+                            count = 0;
+                        }
+
+                        wptr->page_write_index = block->page_write_index;
+                        wptr->nr_valid_pages = block->nr_valid_pages;
+                        wptr->nr_invalid_pages = block->nr_invalid_pages;
+                        wptr->flags = block->flags & (BF_MAPPING | BF_NO_RMAP);
+                        memcpy(wptr->invalid_page_bitmap,
+                               block->invalid_page_bitmap,
+                               sizeof(wptr->invalid_page_bitmap));
+                        wptr++;
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (wptr != buf) {
+        rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
+        if (rc || bw != ARCH_PG_SIZE) goto fail_close;
+    }
+
+    /* Reverse mappings are stored after all block information. */
+    rc = f_write(&fil, rmap_table, rmap_table_size, &bw);
+    if (rc || bw != rmap_table_size) goto fail_close;
+
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+
+    rc = f_close(&fil);
+    return rc ? EIO : 0;
+
+fail_close:
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+    f_close(&fil);
+    return EIO;
+}
+
+static int restore_block_info(void)
+{
+    FIL fil;
+    struct block_info_disk *buf, *rptr;
+    int infos_per_page, count;
+    UINT br;
+    int i, j, k, l, b;
+    int rc;
+
+    infos_per_page = ARCH_PG_SIZE / sizeof(struct block_info_disk);
+
+    rc = f_open(&fil, BLOCK_INFO_FILE, FA_READ);
+    if (rc) return EIO;
+
+    rc = f_lseek(&fil, 0);
+    if (rc) {
+        f_close(&fil);
+        return EIO;
+    }
+
+    buf = alloc_vmpages(1, ZONE_PS_DDR);
+
+    rptr = buf;
+    count = infos_per_page;
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
+                    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+                        struct block_data* block = get_block_data(plane, b);
+
+                        if (count == infos_per_page) {
+                            rc = f_read(&fil, buf, ARCH_PG_SIZE, &br);
+                            if (rc || br != ARCH_PG_SIZE) goto fail_close;
+
+                            rptr = buf;
+                            count = 0;
+                        }
+
+                        block->page_write_index = rptr->page_write_index;
+                        block->nr_valid_pages = rptr->nr_valid_pages;
+                        block->nr_invalid_pages = rptr->nr_invalid_pages;
+                        block->flags |= rptr->flags;
+                        memcpy(block->invalid_page_bitmap,
+                               rptr->invalid_page_bitmap,
+                               sizeof(block->invalid_page_bitmap));
+                        rptr++;
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+
+    rc = f_read(&fil, rmap_table, rmap_table_size, &br);
+    if (rc || br != rmap_table_size) goto fail_close;
+
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+
+    rc = f_close(&fil);
+    return rc ? EIO : 0;
+
+fail_close:
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+    f_close(&fil);
+    return EIO;
+}
+
+static int save_erase_counts(void)
+{
+    FIL fil;
+    uint32_t *buf, *wptr;
+    int counts_per_page, count;
+    UINT bw;
+    int i, j, k, l, b;
+    int rc;
+
+    counts_per_page = ARCH_PG_SIZE / sizeof(uint32_t);
+
+    rc = f_open(&fil, ERASE_COUNT_FILE, FA_CREATE_ALWAYS | FA_WRITE);
+    if (rc) return EIO;
+
+    rc = f_lseek(&fil, 0);
+    if (rc) {
+        f_close(&fil);
+        return EIO;
+    }
+
+    buf = alloc_vmpages(1, ZONE_PS_DDR);
+
+    wptr = buf;
+    count = 0;
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
+                    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+                        if (count == counts_per_page) {
+                            rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
+                            if (rc || bw != ARCH_PG_SIZE) goto fail_close;
+
+                            wptr = buf;
+                            count = 0;
+                        }
+
+                        *wptr++ = get_block_data(plane, b)->erase_count;
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (wptr != buf) {
+        rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
+        if (rc || bw != ARCH_PG_SIZE) goto fail_close;
+    }
+
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+
+    rc = f_close(&fil);
+    return rc ? EIO : 0;
+
+fail_close:
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+    f_close(&fil);
+    return EIO;
+}
+
+static int restore_erase_counts(void)
+{
+    FIL fil;
+    uint32_t *buf, *rptr;
+    int counts_per_page, count;
+    UINT br;
+    int i, j, k, l, b;
+    int rc;
+
+    counts_per_page = ARCH_PG_SIZE / sizeof(uint32_t);
+
+    rc = f_open(&fil, ERASE_COUNT_FILE, FA_READ);
+    if (rc) return EIO;
+
+    rc = f_lseek(&fil, 0);
+    if (rc) {
+        f_close(&fil);
+        return EIO;
+    }
+
+    buf = alloc_vmpages(1, ZONE_PS_DDR);
+
+    rptr = buf;
+    count = counts_per_page;
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
+                    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+                        struct block_data* block = get_block_data(plane, b);
+
+                        if (count == counts_per_page) {
+                            rc = f_read(&fil, buf, ARCH_PG_SIZE, &br);
+                            if (rc || br != ARCH_PG_SIZE) goto fail_close;
+
+                            rptr = buf;
+                            count = 0;
+                        }
+
+                        block->erase_count = *rptr++;
+                        count++;
+
+                        if (block->erase_count > plane->max_erase_count)
+                            plane->max_erase_count = block->erase_count;
+                    }
+
+                    /* Let GC threads check the spread once. */
+                    plane->wl_pending = TRUE;
+                }
+            }
+        }
+    }
+
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+
+    rc = f_close(&fil);
+    return rc ? EIO : 0;
+
+fail_close:
+    free_mem(__pa(buf), ARCH_PG_SIZE);
+    f_close(&fil);
+    return EIO;
+}
+
+/* Without block information, blocks in use have unknown contents. Treat them
+ * as fully valid and never collect them. */
+static void mark_used_blocks_unknown(struct plane_allocator* plane)
+{
+    int b;
+
+    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+        struct block_data* block = get_block_data(plane, b);
+
+        if (!list_empty(&block->list) || (block->flags & BF_BAD)) continue;
+
+        block->page_write_index = USABLE_PAGES_PER_BLOCK;
+        block->nr_valid_pages = USABLE_PAGES_PER_BLOCK;
+        block->flags |= BF_NO_RMAP;
+    }
+}
+
+static void build_used_list(struct plane_allocator* plane)
+{
+    int b;
+
+    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+        struct block_data* block = get_block_data(plane, b);
+
+        if (!list_empty(&block->list) || (block->flags & BF_BAD)) continue;
+
+        if (block->page_write_index == 0) {
+            /* Not programmed at all. */
+            reset_block(block);
+            list_add_tail(&block->list, &plane->free_list);
+            plane->free_list_size++;
+        } else {
+            list_add_tail(&block->list, &plane->used_list);
+        }
+    }
+}
+
+static void mark_free_blocks_need_erase(void)
+{
+    int i, j, k, l;
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+                    struct block_data* block;
+
+                    list_for_each_entry(block, &plane->free_list, list)
+                    {
+                        block->flags |= BF_NEED_ERASE;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void restore_used_blocks(int reset)
+{
+    FILINFO fno;
+    int i, j, k, l;
+    int restored = FALSE;
+
+    if (!reset && f_stat(BLOCK_INFO_FILE, &fno) == 0) {
+        xil_printf(NAME " Restoring block information (%lu bytes) ...",
+                   fno.fsize);
+        restored = restore_block_info() == 0;
+        xil_printf(restored ? "OK\n" : "FAILED\n");
+    }
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
+                    if (!restored && !reset) mark_used_blocks_unknown(plane);
+                    build_used_list(plane);
+                }
+            }
+        }
+    }
+}
+
+static void assign_wf(void)
+{
+    int i, j, k, l;
+
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    init_plane_wf(&planes[i][j][k][l]);
+                }
+            }
+        }
+    }
+}
+
+static void gc_wakeup(void)
+{
+    mutex_lock(&gc.mutex);
+    cond_broadcast(&gc.gc_cond);
+    mutex_unlock(&gc.mutex);
+}
+
+static inline struct block_data* get_frontier(struct plane_allocator* plane,
+                                              int for_gc, int for_mapping)
+{
+    return for_mapping ? plane->mapping_wf
+                       : (for_gc ? plane->gc_wf : plane->data_wf);
+}
+
+/* Multi-plane commands need the same page on every plane of the die. Steer a
+ * host data write to the plane whose frontier lags behind the others so that
+ * the frontiers advance in lockstep and consecutive writes to the die can be
+ * paired by the TSU. Must be called before bm_throttle_write() so that the
+ * writer waits for the plane it is going to be allocated on. */
+void bm_steer_plane(struct flash_address* addr)
+{
+#ifdef ENABLE_MULTIPLANE
+    struct plane_allocator* die_planes =
+        planes[addr->channel][addr->chip][addr->die];
+    struct block_data* block = die_planes[addr->plane].data_wf;
+    unsigned int min_index;
+    int i;
+
+    if (!block) return;
+    min_index = block->page_write_index;
+
+    for (i = 0; i < PLANES_PER_DIE; i++) {
+        block = die_planes[i].data_wf;
+
+        if (block && block->page_write_index < min_index) {
+            min_index = block->page_write_index;
+            addr->plane = i;
+        }
+    }
+#endif
+}
+
+void bm_alloc_page(unsigned int nsid, lpa_t lpa, struct flash_address* addr,
+                   int for_gc, int for_mapping)
+{
+    struct plane_allocator* plane;
+    struct block_data* block;
+    struct page_rmap* rmap;
+
+    plane = get_plane(addr);
+    block = get_frontier(plane, for_gc, for_mapping);
+
+    if (unlikely(!block))
+        panic(NAME " Out of free blocks on ch%d w%d d%d p%d\n", addr->channel,
+              addr->chip, addr->die, addr->plane);
+
+    Xil_AssertVoid(lpa < NO_RMAP_LPA);
+    rmap = &block->rmap[block->page_write_index];
+    rmap->nsid = nsid;
+    rmap->lpa = (uint32_t)lpa;
+
+    addr->block = block->block_id;
+    addr->page = page_idx_map[block->page_write_index++];
+    block->nr_valid_pages++;
+    block->mtime = timer_get_cycles();
+
+    if (block->page_write_index == USABLE_PAGES_PER_BLOCK) {
+        /* The block is full and becomes a GC candidate. */
+        list_add_tail(&block->list, &plane->used_list);
+
+        block = get_free_block(plane, nsid, for_mapping, for_gc);
+
+        if (for_mapping)
+            plane->mapping_wf = block;
+        else if (for_gc)
+            plane->gc_wf = block;
+        else
+            plane->data_wf = block;
+
+        if (plane->free_list_size < GC_FREE_BLOCKS_LOW) gc_wakeup();
+    }
+}
+
+void bm_invalidate_page(struct flash_address* addr)
+{
+    struct plane_allocator* plane = get_plane(addr);
+    struct block_data* block = get_block_data(plane, addr->block);
+
+    /* GC may find a stale page that has already been invalidated. */
+    if (GET_BIT(block->invalid_page_bitmap, addr->page)) return;
+
+    block->nr_invalid_pages++;
+    if (block->nr_valid_pages > 0) block->nr_valid_pages--;
+    block->mtime = timer_get_cycles();
+    SET_BIT(block->invalid_page_bitmap, addr->page);
+
+    plane->gc_blocked = FALSE;
+}
+
+static inline int is_write_frontier(struct plane_allocator* plane,
+                                    struct block_data* block)
+{
+    return block == plane->data_wf || block == plane->gc_wf ||
+           block == plane->mapping_wf;
+}
+
+/* Account for a page that mapping journal replay found to be programmed after
+ * the block information was last saved. The block is closed because pages
+ * after the recovered one may have been programmed too. Pages that are never
+ * recovered stay invalid. */
+void bm_recover_page(unsigned int nsid, lpa_t lpa, struct flash_address* addr,
+                     int for_mapping)
+{
+    struct plane_allocator* plane = get_plane(addr);
+    struct block_data* block = get_block_data(plane, addr->block);
+    struct page_rmap* rmap;
+    int on_used_list = FALSE;
+    int idx = page_order_map[addr->page];
+    int i;
+
+    if (block->flags & BF_BAD) return;
+    if (idx >= USABLE_PAGES_PER_BLOCK) return;
+
+    if (block->page_write_index < USABLE_PAGES_PER_BLOCK) {
+        if (is_write_frontier(plane, block)) {
+            struct block_data* wf;
+
+            wf = get_free_block(plane, block->nsid, block == plane->mapping_wf,
+                                block == plane->gc_wf);
+
+            if (block == plane->mapping_wf)
+                plane->mapping_wf = wf;
+            else if (block == plane->gc_wf)
+                plane->gc_wf = wf;
+            else
+                plane->data_wf = wf;
+        } else if (block->page_write_index > 0) {
+            /* Partially programmed block restored onto the used list. */
+            on_used_list = TRUE;
+        } else if (!list_empty(&block->list)) {
+            /* On the free list. */
+            list_del(&block->list);
+            plane->free_list_size--;
+            block->flags &= ~BF_NEED_ERASE;
+            block->flags |= for_mapping ? BF_MAPPING : 0;
+            block->nsid = nsid;
+        }
+
+        for (i = block->page_write_index; i < USABLE_PAGES_PER_BLOCK; i++) {
+            SET_BIT(block->invalid_page_bitmap, page_idx_map[i]);
+            block->nr_invalid_pages++;
+        }
+
+        block->page_write_index = USABLE_PAGES_PER_BLOCK;
+        if (!on_used_list) list_add_tail(&block->list, &plane->used_list);
+    }
+
+    rmap = &block->rmap[idx];
+    rmap->nsid = nsid;
+    rmap->lpa = (uint32_t)lpa;
+
+    if (GET_BIT(block->invalid_page_bitmap, addr->page)) {
+        UNSET_BIT(block->invalid_page_bitmap, addr->page);
+        block->nr_invalid_pages--;
+        block->nr_valid_pages++;
+    }
+
+    block->mtime = timer_get_cycles();
+    plane->gc_blocked = FALSE;
+}
+
+/* Program sequence number of a page found by bm_rebuild(). */
+uint64_t bm_get_page_seq(struct flash_address* addr)
+{
+    struct plane_allocator* plane = get_plane(addr);
+    struct block_data* block = get_block_data(plane, addr->block);
+    int idx = page_order_map[addr->page];
+
+    if (!page_seq_table || idx >= USABLE_PAGES_PER_BLOCK) return 0;
+
+    return page_seq_table[block->rmap - rmap_table + idx];
+}
+
+/* Metadata scan position in a plane. */
+struct scan_cursor {
+    struct plane_allocator* plane;
+    unsigned int block;
+    unsigned int idx;
+};
+
+static inline int is_erased_meta(const u8* meta)
+{
+    int i;
+
+    for (i = 0; i < FLASH_PG_META_SIZE; i++) {
+        if (meta[i] != 0xff) return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void skip_bad_blocks(struct scan_cursor* cursor)
+{
+    while (cursor->block < BLOCKS_PER_PLANE &&
+           (get_block_data(cursor->plane, cursor->block)->flags & BF_BAD))
+        cursor->block++;
+}
+
+/* Put a block on the used list if the scan found programmed pages in it or on
+ * the free list otherwise. Pages that are not stamped are left invalid. */
+static void finish_scanned_block(struct plane_allocator* plane,
+                                 struct block_data* block)
+{
+    if (block->page_write_index == 0) {
+        /* May be partially erased. */
+        reset_block(block);
+        block->flags |= BF_NEED_ERASE;
+        list_add_tail(&block->list, &plane->free_list);
+        plane->free_list_size++;
+        return;
+    }
 
-                        wptr = buf;
-                        count = 0;
-                    }
+    block->nr_invalid_pages = USABLE_PAGES_PER_BLOCK - block->nr_valid_pages;
+    block->page_write_index = USABLE_PAGES_PER_BLOCK;
+    block->flags |= BF_SCANNED;
+    block->mtime = timer_get_cycles();
+    list_add_tail(&block->list, &plane->used_list);
+}
 
-                    memcpy(wptr, block_map, sizeof(block_map));
-                    wptr += sizeof(block_map);
-                    count++;
-                }
-            }
-        }
+static void scan_page_done(struct scan_cursor* cursor, const u8* buf,
+                           int status, uint64_t* max_seq)
+{
+    struct block_data* block = get_block_data(cursor->plane, cursor->block);
+    const struct page_oob* oob = (const struct page_oob*)(buf + FLASH_PG_SIZE);
+    unsigned int idx = cursor->idx;
+
+    if (status == 0 && oob->magic == PAGE_OOB_MAGIC) {
+        block->rmap[idx].nsid = oob->nsid;
+        block->rmap[idx].lpa = oob->lpa;
+        page_seq_table[block->rmap - rmap_table + idx] = oob->seq;
+
+        block->nsid = oob->nsid;
+        if (oob->flags & POF_MAPPING) block->flags |= BF_MAPPING;
+
+        UNSET_BIT(block->invalid_page_bitmap, page_idx_map[idx]);
+        block->nr_valid_pages++;
+        block->page_write_index = idx + 1;
+
+        if (oob->seq > *max_seq) *max_seq = oob->seq;
+    } else if (is_erased_meta(buf + FLASH_PG_SIZE)) {
+        /* Pages are programmed in order so the rest of the block is
+         * erased. */
+        idx = USABLE_PAGES_PER_BLOCK;
+    } else {
+        /* Programmed but unreadable or written without metadata. */
+        block->page_write_index = idx + 1;
     }
 
-    if (wptr != buf) {
-        rc = f_write(&fil, buf, ARCH_PG_SIZE, &bw);
-        if (rc || bw != ARCH_PG_SIZE) goto out;
+    if (++idx < USABLE_PAGES_PER_BLOCK) {
+        cursor->idx = idx;
+        return;
     }
 
-    rc = f_close(&fil);
-    if (rc) goto out;
+    finish_scanned_block(cursor->plane, block);
 
-    r = 0;
-out:
-    free_mem(__pa(buf), ARCH_PG_SIZE);
+    cursor->block++;
+    cursor->idx = 0;
+    skip_bad_blocks(cursor);
+}
+
+/* Read the metadata of every programmed page with one page per plane in
+ * flight so that all dies are busy. */
+static int scan_page_metadata(struct scan_cursor* cursors, size_t nr_planes,
+                              uint64_t* max_seq)
+{
+    struct flash_transaction* txns;
+    struct flash_transaction* txn_ptrs[FIL_BATCH_MAX];
+    struct scan_cursor* slot_cursors[FIL_BATCH_MAX];
+    int status[FIL_BATCH_MAX];
+    size_t txns_size, bufs_size;
+    u8* bufs;
+    unsigned int next = 0, count, i;
+    size_t active;
+    int r = 0;
+
+    txns_size = roundup(FIL_BATCH_MAX * sizeof(*txns), ARCH_PG_SIZE);
+    txns = alloc_vmpages(txns_size >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!txns) return ENOMEM;
+
+    bufs_size = FIL_BATCH_MAX * FLASH_PG_BUFFER_SIZE;
+    bufs = alloc_vmpages(bufs_size >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
+    if (!bufs) {
+        free_mem(__pa(txns), txns_size);
+        return ENOMEM;
+    }
+
+    for (;;) {
+        count = 0;
+
+        /* Round-robin over the planes that still have pages to scan. */
+        for (active = 0; active < nr_planes && count < FIL_BATCH_MAX;
+             active++) {
+            struct scan_cursor* cursor = &cursors[next];
+            struct flash_transaction* txn = &txns[count];
+            u8* buf = bufs + count * FLASH_PG_BUFFER_SIZE;
+
+            next = (next + 1) % nr_planes;
+            if (cursor->block >= BLOCKS_PER_PLANE) continue;
+
+            flash_transaction_init(txn);
+            txn->type = TXN_READ;
+            txn->source = TS_MAPPING;
+            txn->addr = cursor->plane->addr;
+            txn->addr.block = cursor->block;
+            txn->addr.page = page_idx_map[cursor->idx];
+            txn->data = buf;
+            txn->offset = FLASH_PG_SIZE;
+            txn->length = FLASH_PG_META_SIZE;
+
+            /* Short reads of unwritten pages leave the buffer as is. */
+            memset(buf + FLASH_PG_SIZE, 0xff, FLASH_PG_META_SIZE);
+            dma_sync_single_for_device(buf, FLASH_PG_BUFFER_SIZE,
+                                       DMA_BIDIRECTIONAL);
+
+            slot_cursors[count] = cursor;
+            txn_ptrs[count++] = txn;
+        }
 
+        if (count == 0) break;
+
+        r = amu_submit_transaction_batch(txn_ptrs, count, status);
+        if (r) break;
+
+        for (i = 0; i < count; i++) {
+            u8* buf = bufs + i * FLASH_PG_BUFFER_SIZE;
+
+            dma_sync_single_for_cpu(buf, FLASH_PG_BUFFER_SIZE,
+                                    DMA_FROM_DEVICE);
+            scan_page_done(slot_cursors[i], buf, status[i], max_seq);
+        }
+    }
+
+    free_mem(__pa(bufs), bufs_size);
+    free_mem(__pa(txns), txns_size);
     return r;
 }
 
-static int restore_plane_info(void)
+/* Hand the pages found by the scan to the address mapping unit, which
+ * invalidates the superseded ones. */
+static void rebuild_mappings(struct plane_allocator* plane)
 {
-    FIL fil;
-    u8 *buf, *rptr;
-    int planes_per_page, count;
-    UINT br;
-    int i, j, k, l;
-    int rc, r = EIO;
+    struct flash_address addr = plane->addr;
+    int b, i;
 
-    planes_per_page =
-        ARCH_PG_SIZE / (BITCHUNKS(BLOCKS_PER_PLANE) * sizeof(bitchunk_t));
+    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+        struct block_data* block = get_block_data(plane, b);
 
-    rc = f_open(&fil, PLANE_INFO_FILE, FA_READ);
-    if (!rc) rc = f_lseek(&fil, 0);
-    if (rc) return EIO;
+        if (!(block->flags & BF_SCANNED)) continue;
 
-    buf = alloc_vmpages(1, ZONE_PS_DDR);
+        addr.block = b;
+        for (i = 0; i < USABLE_PAGES_PER_BLOCK && block->nr_valid_pages > 0;
+             i++) {
+            struct page_rmap* rmap = &block->rmap[i];
 
-    rc = f_read(&fil, buf, ARCH_PG_SIZE, &br);
-    if (rc || br != ARCH_PG_SIZE) goto out;
+            addr.page = page_idx_map[i];
+            if (GET_BIT(block->invalid_page_bitmap, addr.page)) continue;
 
-    rptr = buf;
-    count = 0;
+            amu_rebuild_page(rmap->nsid, rmap->lpa,
+                             !!(block->flags & BF_MAPPING), &addr,
+                             page_seq_table[block->rmap - rmap_table + i]);
+        }
+
+        block->flags &= ~BF_SCANNED;
+    }
+}
+
+/* Rebuild the block information from the metadata stamped into every
+ * programmed page and report each valid page to the address mapping unit
+ * through amu_rebuild_page(). Bad blocks and erase counts are kept. Must be
+ * called before any page is allocated. @max_seq is set to the highest program
+ * sequence number found. */
+int bm_rebuild(uint64_t* max_seq)
+{
+    struct scan_cursor *cursors, *cursor;
+    size_t nr_planes, cursors_size;
+    int i, j, k, l, b, r;
+
+    nr_planes =
+        NR_CHANNELS * CHIPS_PER_CHANNEL * DIES_PER_CHIP * PLANES_PER_DIE;
+
+    page_seq_table_size =
+        roundup(rmap_table_size / sizeof(struct page_rmap) * sizeof(uint64_t),
+                ARCH_PG_SIZE);
+    page_seq_table =
+        alloc_vmpages(page_seq_table_size >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!page_seq_table) return ENOMEM;
+
+    cursors_size = roundup(nr_planes * sizeof(*cursors), ARCH_PG_SIZE);
+    cursors = alloc_vmpages(cursors_size >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!cursors) {
+        r = ENOMEM;
+        goto out_free_seq;
+    }
+
+    *max_seq = 0;
+    cursor = cursors;
 
     for (i = 0; i < NR_CHANNELS; i++) {
         for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
             for (k = 0; k < DIES_PER_CHIP; k++) {
                 for (l = 0; l < PLANES_PER_DIE; l++) {
                     struct plane_allocator* plane = &planes[i][j][k][l];
-                    bitchunk_t block_map[BITCHUNKS(BLOCKS_PER_PLANE)];
-                    struct block_data* block;
-                    int idx;
 
-                    if (count == planes_per_page) {
-                        rc = f_read(&fil, buf, ARCH_PG_SIZE, &br);
-                        if (rc || br != ARCH_PG_SIZE) goto out;
+                    INIT_LIST_HEAD(&plane->free_list);
+                    INIT_LIST_HEAD(&plane->used_list);
+                    plane->free_list_size = 0;
+                    plane->data_wf = plane->gc_wf = plane->mapping_wf = NULL;
+                    plane->gc_blocked = FALSE;
 
-                        rptr = buf;
-                        count = 0;
-                    }
+                    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+                        struct block_data* block = get_block_data(plane, b);
+                        int idx;
 
-                    memcpy(block_map, rptr, sizeof(block_map));
+                        INIT_LIST_HEAD(&block->list);
+                        if (block->flags & BF_BAD) continue;
 
-                    for (idx = 0; idx < BLOCKS_PER_PLANE; idx++) {
-                        if (GET_BIT(block_map, idx)) {
-                            block = get_block_data(plane, idx);
-                            list_add_tail(&block->list, &plane->free_list);
-                            plane->free_list_size++;
-                        }
+                        reset_block(block);
+
+                        /* Pages stay invalid until the scan finds them. */
+                        for (idx = 0; idx < USABLE_PAGES_PER_BLOCK; idx++)
+                            SET_BIT(block->invalid_page_bitmap,
+                                    page_idx_map[idx]);
                     }
 
-                    rptr += sizeof(block_map);
-                    count++;
+                    cursor->plane = plane;
+                    cursor->block = 0;
+                    cursor->idx = 0;
+                    skip_bad_blocks(cursor);
+                    cursor++;
                 }
             }
         }
     }
 
-    rc = f_close(&fil);
-    if (rc) goto out;
-
-    r = 0;
-out:
-    free_mem(__pa(buf), ARCH_PG_SIZE);
-
-    return r;
-}
+    xil_printf(NAME " Scanning page metadata ...");
+    r = scan_page_metadata(cursors, nr_planes, max_seq);
+    xil_printf(r ? "FAILED (%d)\n" : "OK\n", r);
+    if (r) goto out_free_cursors;
 
-static void assign_wf(void)
-{
-    int i, j, k, l;
+    assign_wf();
 
     for (i = 0; i < NR_CHANNELS; i++) {
         for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
             for (k = 0; k < DIES_PER_CHIP; k++) {
                 for (l = 0; l < PLANES_PER_DIE; l++) {
-                    init_plane_wf(&planes[i][j][k][l]);
+                    rebuild_mappings(&planes[i][j][k][l]);
                 }
             }
         }
     }
+
+out_free_cursors:
+    free_mem(__pa(cursors), cursors_size);
+out_free_seq:
+    free_mem(__pa(page_seq_table), page_seq_table_size);
+    page_seq_table = NULL;
+    return r;
 }
 
-void bm_alloc_page(unsigned int nsid, struct flash_address* addr, int for_gc,
-                   int for_mapping)
+/* Block a foreground writer while the target plane is below the minimum free
+ * block watermark so that GC can catch up. Must be called without holding any
+ * translation page lock because GC needs them to relocate pages. */
+void bm_throttle_write(struct flash_address* addr)
 {
     struct plane_allocator* plane = get_plane(addr);
-    struct block_data* block;
-
-    block = for_mapping ? plane->mapping_wf
-                        : (for_gc ? plane->gc_wf : plane->data_wf);
-    addr->block = block->block_id;
-    addr->page = page_idx_map[block->page_write_index++];
 
-    if (block->page_write_index == PAGES_PER_BLOCK / 2) {
-        block = get_free_block(plane, nsid, for_mapping);
+    if (likely(plane->free_list_size >= GC_FREE_BLOCKS_MIN)) return;
 
-        if (for_mapping)
-            plane->mapping_wf = block;
-        else if (for_gc)
-            plane->gc_wf = block;
-        else
-            plane->data_wf = block;
+    mutex_lock(&gc.mutex);
+    gc_stats.throttled_writes++;
 
-        /* TODO: check for GC */
+    while (plane->free_list_size < GC_FREE_BLOCKS_MIN && !plane->gc_blocked) {
+        cond_broadcast(&gc.gc_cond);
+        cond_wait(&gc.free_cond, &gc.mutex);
     }
-}
-
-void bm_invalidate_page(struct flash_address* addr)
-{
-    struct plane_allocator* plane = get_plane(addr);
-    struct block_data* block = get_block_data(plane, addr->block);
 
-    block->nr_invalid_pages++;
-    SET_BIT(block->invalid_page_bitmap, addr->page);
+    mutex_unlock(&gc.mutex);
 }
 
 void bm_mark_bad(struct flash_address* addr)
@@ -658,10 +1653,13 @@ static void wipe_blocks(void)
             for (k = 0; k < DIES_PER_CHIP; k++) {
                 txn.addr.die = k;
                 for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
                     txn.addr.plane = l;
                     for (b = 0; b < BLOCKS_PER_PLANE; b++) {
                         txn.addr.block = b;
-                        submit_flash_transaction(&txn);
+                        if (submit_flash_transaction(&txn) == 0)
+                            note_block_erased(plane, get_block_data(plane, b));
                     }
                 }
             }
@@ -672,6 +1670,7 @@ static void wipe_blocks(void)
 void bm_init(int wipe, int full_scan)
 {
     FILINFO fno;
+    int reset_info = FALSE;
     int i, idx = 0, r;
 
     for (i = 0; i < PAGES_PER_BLOCK; i++) {
@@ -680,9 +1679,27 @@ void bm_init(int wipe, int full_scan)
     for (i = 0; i < PAGES_PER_BLOCK; i++) {
         if (!GET_BIT(lsb_bitmap, i)) page_idx_map[idx++] = i;
     }
+    for (i = 0; i < PAGES_PER_BLOCK; i++) {
+        page_order_map[page_idx_map[i]] = i;
+    }
 
     alloc_planes();
 
+    if (mutex_init(&gc.mutex, NULL) != 0) {
+        panic("failed to initialize GC mutex");
+    }
+    if (cond_init(&gc.gc_cond, NULL) != 0 ||
+        cond_init(&gc.free_cond, NULL) != 0) {
+        panic("failed to initialize GC condvar");
+    }
+
+    /* Erase counters survive wipes so restore them first. */
+    if (f_stat(ERASE_COUNT_FILE, &fno) == 0) {
+        xil_printf(NAME " Restoring erase counts (%lu bytes) ...", fno.fsize);
+        r = restore_erase_counts();
+        xil_printf(r ? "FAILED\n" : "OK\n");
+    }
+
     if (wipe) wipe_blocks();
 
     /* Recover free block information. */
@@ -691,6 +1708,7 @@ void bm_init(int wipe, int full_scan)
         reset_planes();
         save_plane_info();
         xil_printf("OK\n");
+        reset_info = TRUE;
     } else {
         xil_printf(NAME " Restoring planes (%d bytes) ...", fno.fsize);
         r = restore_plane_info();
@@ -725,14 +1743,42 @@ void bm_init(int wipe, int full_scan)
         xil_printf("OK\n");
     }
 
-    /* Assign write frontier blocks. */
-    assign_wf();
+    if (wipe || full_scan) save_erase_counts();
+
+    /* Recover valid page information and put programmed blocks on the used
+     * lists. */
+    restore_used_blocks(reset_info);
+
+    /* Blocks opened after the plane information was saved look free but may
+     * hold pages written before an unclean shutdown. */
+    if (!reset_info) mark_free_blocks_need_erase();
+
+    /* Write frontiers are assigned by bm_open_write_frontiers() after
+     * recovery because assigning them may erase free blocks. */
+}
+
+/* Assign write frontier blocks. Must be called once recovery is done and
+ * before any page is allocated. */
+void bm_open_write_frontiers(void) { assign_wf(); }
+
+/* Save the plane, block and erase count information. */
+int bm_save_state(void)
+{
+    int r;
+
+    r = save_plane_info();
+    if (r) return r;
+
+    r = save_block_info();
+    if (r) return r;
+
+    return save_erase_counts();
 }
 
 void bm_shutdown(void)
 {
     xil_printf(NAME " Saving planes ...");
-    save_plane_info();
+    bm_save_state();
     xil_printf("OK\n");
 }
 
@@ -766,6 +1812,52 @@ void bm_report_stats(void)
         }
     }
 
+    xil_printf("Free blocks: \n");
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
+                    xil_printf("ch%d w%d d%d p%d: %d%s\n", i, j, k, l,
+                               plane->free_list_size,
+                               plane->gc_blocked ? " (GC blocked)" : "");
+                }
+            }
+        }
+    }
+
+    xil_printf("Erase counts (min/max): \n");
+    for (i = 0; i < NR_CHANNELS; i++) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+                    unsigned int min_erase_count = UINT_MAX;
+
+                    for (b = 0; b < BLOCKS_PER_PLANE; b++) {
+                        struct block_data* block = get_block_data(plane, b);
+
+                        if (block->flags & BF_BAD) continue;
+                        if (block->erase_count < min_erase_count)
+                            min_erase_count = block->erase_count;
+                    }
+
+                    if (min_erase_count == UINT_MAX) min_erase_count = 0;
+
+                    xil_printf("ch%d w%d d%d p%d: %u/%u\n", i, j, k, l,
+                               min_erase_count, plane->max_erase_count);
+                }
+            }
+        }
+    }
+
+    xil_printf("GC collected blocks: %lu\n", gc_stats.collected_blocks);
+    xil_printf("GC relocated pages: %lu\n", gc_stats.relocated_pages);
+    xil_printf("GC erase failures: %lu\n", gc_stats.erase_failures);
+    xil_printf("Throttled writes: %lu\n", gc_stats.throttled_writes);
+    xil_printf("WL migrated blocks: %lu\n", gc_stats.wl_migrated_blocks);
+
     xil_printf("=============================================\n");
 }
 
@@ -795,3 +1887,234 @@ void bm_command_save_bad(int argc, const char** argv)
     save_bad_blocks();
     printk("OK\n");
 }
+
+/* Pick the plane with the fewest free blocks below the GC watermark among
+ * the channels served by GC thread @index. Otherwise pick a plane waiting for
+ * static wear leveling and set @wear_leveling. */
+static struct plane_allocator* gc_pick_plane(int index, int* wear_leveling)
+{
+    struct plane_allocator *target = NULL, *wl_target = NULL;
+    int i, j, k, l;
+
+    for (i = index; i < NR_CHANNELS; i += NR_GC_THREADS) {
+        for (j = 0; j < CHIPS_PER_CHANNEL; j++) {
+            for (k = 0; k < DIES_PER_CHIP; k++) {
+                for (l = 0; l < PLANES_PER_DIE; l++) {
+                    struct plane_allocator* plane = &planes[i][j][k][l];
+
+                    if (plane->gc_active || plane->gc_blocked) continue;
+                    if (list_empty(&plane->used_list)) continue;
+
+                    if (plane->free_list_size >= GC_FREE_BLOCKS_LOW) {
+                        if (plane->wl_pending && !wl_target) wl_target = plane;
+                        continue;
+                    }
+
+                    if (!target ||
+                        plane->free_list_size < target->free_list_size)
+                        target = plane;
+                }
+            }
+        }
+    }
+
+    *wear_leveling = !target && wl_target;
+    return target ? target : wl_target;
+}
+
+/* GC cannot be throttled like foreground writes because it is what frees
+ * blocks. Instead, a block is only collected if its valid pages fit into the
+ * frontier they are relocated to and the free blocks left on the plane so
+ * that relocation never runs the plane out of free blocks. */
+static int gc_can_relocate(struct plane_allocator* plane,
+                           struct block_data* block)
+{
+    struct block_data* wf =
+        get_frontier(plane, TRUE, !!(block->flags & BF_MAPPING));
+    unsigned int room = plane->free_list_size * USABLE_PAGES_PER_BLOCK;
+
+    if (wf) room += USABLE_PAGES_PER_BLOCK - wf->page_write_index;
+
+    return block->nr_valid_pages <= room;
+}
+
+static struct block_data* gc_select_victim(struct plane_allocator* plane)
+{
+    struct block_data *block, *victim = NULL;
+    u64 best_score = 0;
+#if GC_VICTIM_POLICY == GC_POLICY_COST_BENEFIT
+    u64 now = timer_get_cycles();
+#endif
+
+    list_for_each_entry(block, &plane->used_list, list)
+    {
+        unsigned int valid = block->nr_valid_pages;
+        unsigned int invalid = block->page_write_index - valid;
+        u64 score;
+
+        if (block->flags & BF_NO_RMAP) continue;
+        if (!invalid) continue;
+        if (!gc_can_relocate(plane, block)) continue;
+
+#if GC_VICTIM_POLICY == GC_POLICY_GREEDY
+        score = invalid;
+#else
+        /* Cost-benefit: (1 - u) * age / 2u, where u is the fraction of valid
+         * pages and 2u is the cost of reading and rewriting them. */
+        if (!valid) {
+            score = UINT64_MAX;
+        } else {
+            u64 age_ms = 1;
+
+            if (now > block->mtime)
+                age_ms += timer_cycles_to_ns(now - block->mtime) / 1000000UL;
+
+            score = (u64)invalid * age_ms / (2 * valid);
+        }
+#endif
+
+        if (!victim || score > best_score) {
+            victim = block;
+            best_score = score;
+        }
+    }
+
+    return victim;
+}
+
+/* Static wear leveling: the least worn programmed block likely holds cold
+ * data. Return it if its erase count lags too far behind the most worn block
+ * of the plane so that the data can be moved onto a worn block and the block
+ * itself is put back into rotation. */
+static struct block_data* wl_select_victim(struct plane_allocator* plane)
+{
+    struct block_data *block, *victim = NULL;
+
+    list_for_each_entry(block, &plane->used_list, list)
+    {
+        if (block->flags & BF_NO_RMAP) continue;
+        if (!gc_can_relocate(plane, block)) continue;
+
+        if (!victim || block->erase_count < victim->erase_count)
+            victim = block;
+    }
+
+    if (victim && plane->max_erase_count - victim->erase_count <=
+                      WL_ERASE_COUNT_THRESHOLD)
+        victim = NULL;
+
+    return victim;
+}
+
+/* Relocate all valid pages in the victim and erase it. */
+static int gc_collect_block(struct plane_allocator* plane,
+                            struct block_data* block, void* buf)
+{
+    struct flash_address addr = plane->addr;
+    struct flash_transaction txn;
+    int i, r;
+
+    addr.block = block->block_id;
+
+    for (i = 0; i < block->page_write_index && block->nr_valid_pages > 0;
+         i++) {
+        struct page_rmap* rmap = &block->rmap[i];
+
+        addr.page = page_idx_map[i];
+        if (GET_BIT(block->invalid_page_bitmap, addr.page)) continue;
+
+        r = amu_relocate_page(rmap->nsid, rmap->lpa,
+                              !!(block->flags & BF_MAPPING), &addr, buf);
+        if (r) return r;
+
+        gc_stats.relocated_pages++;
+    }
+
+    /* Moved translation pages stay valid until the mapping journal records
+     * their new locations. */
+    if ((block->flags & BF_MAPPING) && block->nr_valid_pages > 0) {
+        for (i = 0; i < block->page_write_index && block->nr_valid_pages > 0;
+             i++) {
+            addr.page = page_idx_map[i];
+            if (GET_BIT(block->invalid_page_bitmap, addr.page)) continue;
+
+            amu_commit_journal(block->rmap[i].nsid);
+        }
+    }
+
+    /* Every page must have been either moved or found stale by now. */
+    if (block->nr_valid_pages > 0) return EAGAIN;
+
+    flash_transaction_init(&txn);
+    txn.type = TXN_ERASE;
+    txn.source = TS_GC;
+    txn.addr = addr;
+    txn.addr.page = 0;
+
+    r = amu_submit_transaction(&txn);
+    if (r) {
+        retire_block(block);
+        return 0;
+    }
+
+    note_block_erased(plane, block);
+    if (block->erase_count == plane->max_erase_count)
+        plane->wl_pending = TRUE;
+
+    reset_block(block);
+    list_add_tail(&block->list, &plane->free_list);
+    plane->free_list_size++;
+    gc_stats.collected_blocks++;
+
+    return 0;
+}
+
+void gc_main(int index)
+{
+    struct plane_allocator* plane;
+    struct block_data* victim;
+    void* buf;
+    int wear_leveling;
+    int r;
+
+    buf = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT, ZONE_PS_DDR_LOW);
+    if (!buf) panic("failed to allocate GC buffer");
+
+    local_irq_enable();
+
+    for (;;) {
+        mutex_lock(&gc.mutex);
+        while ((plane = gc_pick_plane(index, &wear_leveling)) == NULL)
+            cond_wait(&gc.gc_cond, &gc.mutex);
+        plane->gc_active = TRUE;
+        mutex_unlock(&gc.mutex);
+
+        r = ENOENT;
+
+        if (wear_leveling) {
+            /* Migrations go through the GC path, which the TSU schedules
+             * behind user and mapping transactions. */
+            victim = wl_select_victim(plane);
+            if (!victim) plane->wl_pending = FALSE;
+        } else {
+            victim = gc_select_victim(plane);
+        }
+
+        if (victim) {
+            /* Take the victim off the used list so that it will not be
+             * selected again while we are relocating its pages. */
+            list_del(&victim->list);
+
+            r = gc_collect_block(plane, victim, buf);
+            if (r) list_add_tail(&victim->list, &plane->used_list);
+            if (!r && wear_leveling) gc_stats.wl_migrated_blocks++;
+        }
+
+        mutex_lock(&gc.mutex);
+        plane->gc_active = FALSE;
+        if (wear_leveling && r) plane->wl_pending = FALSE;
+        if (r && !wear_leveling) plane->gc_blocked = TRUE;
+        cond_broadcast(&gc.free_cond);
+        mutex_unlock(&gc.mutex);
+    }
+}
@@ -1,5 +1,6 @@
 #include <xil_assert.h>
 #include <errno.h>
+#include <stdlib.h>
 
 #include <config.h>
 #include <types.h>
@@ -24,12 +25,21 @@
 
 #define WB_BATCH_SIZE 16
 
+/* Pages read ahead in one FIL batch. Must fit in the FIL batch slots of one
+ * readahead thread (FIL_BATCH_MAX / NR_READAHEAD_THREADS). */
+#define RA_BATCH_SIZE 16
+#define RA_QUEUE_SIZE 64
+
 static DEFINE_TLS(struct iovec, req_iovecs[1 << MAX_DATA_TRANSFER_SIZE]);
 static DEFINE_TLS(struct flash_transaction, writeback_batch[WB_BATCH_SIZE]);
+static DEFINE_TLS(struct flash_transaction, readahead_batch[RA_BATCH_SIZE]);
 
 struct cache_stats {
     size_t total_read_hits;
     size_t total_read_misses;
+    size_t total_readahead_pages;
+    size_t total_readahead_hits;
+    size_t total_readahead_unused;
 };
 
 enum cache_entry_status {
@@ -52,8 +62,15 @@ struct cache_entry {
     unsigned int pin_count;
     mutex_t mutex;
     void* data;
+    /* Being read ahead from NAND flash. The entry is locked until the read
+     * completes. */
+    int prefetching;
+    /* Read ahead and not used by any request yet. */
+    int prefetched;
 };
 
+/* A shard of the data cache of a namespace. Each shard indexes and evicts its
+ * entries independently. */
 struct data_cache {
     size_t capacity_pages;
     size_t nr_pages;
@@ -62,11 +79,33 @@ struct data_cache {
     struct cache_stats stats;
 };
 
-static struct data_cache g_cache;
+/* A sequential read stream. Readahead has been queued for [next_lpa, ra_end)
+ * where next_lpa is the LPA expected from the next read of the stream. */
+struct ra_stream {
+    int valid;
+    lpa_t next_lpa;
+    lpa_t ra_end;
+    unsigned int window;
+    timestamp_t last_access;
+};
+
+/* Per-namespace data cache. The capacity is a partition of the total data
+ * cache capacity so that one namespace cannot evict the pages of another. */
+struct ns_cache {
+    int active;
+    /* Capacity set with dc_set_ns_capacity(). 0 = even share. */
+    size_t capacity_override;
+    size_t capacity_pages;
+    struct data_cache shards[DATA_CACHE_SHARDS];
+    struct ra_stream streams[DATA_CACHE_RA_STREAMS];
+};
+
+static size_t total_capacity_pages;
+static struct ns_cache ns_caches[NAMESPACE_MAX];
 
 struct flusher_control {
     struct worker_thread* flusher;
-    struct data_cache* cache;
+    struct ns_cache* cache;
     unsigned int nsid;
 };
 
@@ -75,16 +114,36 @@ static struct flusher_control flusher_control[NR_FLUSHERS];
 static mutex_t flusher_mutex;
 static cond_t flusher_cond;
 
-static inline struct data_cache* get_cache_for_ns(unsigned int nsid)
+struct ra_request {
+    unsigned int nsid;
+    lpa_t start;
+    lpa_t end;
+};
+
+/* Readahead requests waiting for the readahead threads. */
+static struct ra_request ra_queue[RA_QUEUE_SIZE];
+static unsigned int ra_queue_head, ra_queue_tail;
+static mutex_t ra_mutex;
+static cond_t ra_cond;
+
+static inline struct ns_cache* get_cache_for_ns(unsigned int nsid)
+{
+    Xil_AssertNonvoid(nsid > 0 && nsid <= NAMESPACE_MAX);
+    return &ns_caches[nsid - 1];
+}
+
+static inline struct data_cache* get_cache_shard(unsigned int nsid, lpa_t lpa)
 {
-    /* TODO: multiple namespaces */
-    return &g_cache;
+    /* Fibonacci hashing spreads both sequential and strided LPAs. */
+    uint64_t hash = (uint64_t)lpa * 0x9e3779b97f4a7c15ULL;
+
+    return &get_cache_for_ns(nsid)->shards[(hash >> 32) % DATA_CACHE_SHARDS];
 }
 
 static inline struct data_cache*
 get_cache_for_txn(struct flash_transaction* txn)
 {
-    return get_cache_for_ns(txn->nsid);
+    return get_cache_shard(txn->nsid, txn->lpa);
 }
 
 static int cache_cmp_key(struct cache_entry_key* k1, struct cache_entry_key* k2)
@@ -129,20 +188,13 @@ static inline struct cache_entry* cache_avl_get_iter(struct avl_iter* iter)
     return avl_entry(node, struct cache_entry, avl);
 }
 
-static void cache_init(struct data_cache* cache, size_t capacity_pages)
+static void cache_init(struct data_cache* cache)
 {
-    cache->capacity_pages = capacity_pages;
+    cache->capacity_pages = 0;
     cache->nr_pages = 0;
     INIT_LIST_HEAD(&cache->lru_list);
     INIT_AVL_ROOT(&cache->root, cache_key_node_comp, cache_node_node_comp);
     memset(&cache->stats, 0, sizeof(cache->stats));
-
-    if (mutex_init(&flusher_mutex, NULL) != 0) {
-        panic("failed to initialize flusher mutex");
-    }
-    if (cond_init(&flusher_cond, NULL) != 0) {
-        panic("failed to initialize flusher condvar");
-    }
 }
 
 static struct cache_entry* cache_find(struct data_cache* cache,
@@ -212,6 +264,29 @@ static void cache_touch_lru(struct data_cache* cache, struct cache_entry* entry)
     unpin_entry(cache, entry);
 }
 
+/* Release clean entries from the cold end of the LRU list until the shard is
+ * within its capacity again after its partition has been shrunk. Dirty
+ * entries are released once they are written back and evicted. */
+static void cache_shrink(struct data_cache* cache)
+{
+    struct cache_entry* entry;
+
+    while (cache->nr_pages > cache->capacity_pages &&
+           !list_empty(&cache->lru_list)) {
+        entry = list_entry(cache->lru_list.prev, struct cache_entry, lru);
+        if (entry->status == CES_DIRTY) break;
+
+        list_del(&entry->lru);
+        avl_erase(&entry->avl, &cache->root);
+        cache->nr_pages--;
+
+        if (entry->prefetched) cache->stats.total_readahead_unused++;
+
+        free_mem(__pa(entry->data), FLASH_PG_SIZE);
+        SLABFREE(entry);
+    }
+}
+
 static int cache_add(struct data_cache* cache, unsigned int nsid, lpa_t lpa,
                      page_bitmap_t bitmap, struct cache_entry** entrypp)
 {
@@ -220,7 +295,10 @@ static int cache_add(struct data_cache* cache, unsigned int nsid, lpa_t lpa,
         .tag = LKT_DATA_CACHE,
     };
 
-    if (cache->nr_pages >= cache->capacity_pages) return ENOSPC;
+    if (cache->nr_pages >= cache->capacity_pages) {
+        cache_shrink(cache);
+        return ENOSPC;
+    }
 
     SLABALLOC(entry);
     if (!entry) return ENOMEM;
@@ -266,6 +344,11 @@ static int cache_evict_entry(struct data_cache* cache,
     avl_erase(&entry->avl, &cache->root);
     cache->nr_pages--;
 
+    if (entry->prefetched) {
+        cache->stats.total_readahead_unused++;
+        entry->prefetched = FALSE;
+    }
+
     *entrypp = entry;
     return 0;
 }
@@ -507,6 +590,249 @@ cleanup:
     return r;
 }
 
+#if USE_READAHEAD
+
+/* Get a locked entry to read @lpa ahead into. Unlike cache_add(), a full shard
+ * only gives up its coldest entry if that is clean so that readahead never
+ * causes write backs. */
+static struct cache_entry* cache_add_readahead(struct data_cache* cache,
+                                               unsigned int nsid, lpa_t lpa)
+{
+    struct cache_entry* entry;
+    int r;
+
+    r = cache_add(cache, nsid, lpa, 0, &entry);
+
+    if (r == ENOSPC) {
+        if (list_empty(&cache->lru_list)) return NULL;
+
+        entry = list_entry(cache->lru_list.prev, struct cache_entry, lru);
+        if (entry->status == CES_DIRTY) return NULL;
+
+        r = cache_evict_entry(cache, &entry);
+        if (r) return NULL;
+
+        entry->key.nsid = nsid;
+        entry->key.lpa = lpa;
+        entry->bitmap = 0;
+        add_entry(cache, entry);
+
+        pin_entry(entry);
+    } else if (r != 0) {
+        return NULL;
+    }
+
+    entry->status = CES_CLEAN;
+    entry->prefetching = TRUE;
+    mutex_lock(&entry->mutex);
+
+    return entry;
+}
+
+/* Read LPAs [start, end) of a namespace into the data cache. Pages that are
+ * already cached are skipped. */
+static void do_readahead(unsigned int nsid, lpa_t start, lpa_t end)
+{
+    struct ns_cache* ns = get_cache_for_ns(nsid);
+    struct flash_transaction* batch = get_local_var(readahead_batch);
+    struct flash_transaction* txns[RA_BATCH_SIZE];
+    int status[RA_BATCH_SIZE];
+    unsigned int count;
+    lpa_t lpa = start;
+    int i, r;
+
+    while (lpa < end && ns->active) {
+        count = 0;
+
+        for (; lpa < end && count < RA_BATCH_SIZE; lpa++) {
+            struct data_cache* cache = get_cache_shard(nsid, lpa);
+            struct flash_transaction* txn = &batch[count];
+            struct cache_entry* entry;
+            void* data;
+
+            if (cache_find(cache, nsid, lpa)) continue;
+
+            data = alloc_vmpages(FLASH_PG_BUFFER_SIZE >> ARCH_PG_SHIFT,
+                                 ZONE_PS_DDR_LOW);
+            if (!data) break;
+
+            entry = cache_add_readahead(cache, nsid, lpa);
+            if (!entry) {
+                free_mem(__pa(data), FLASH_PG_BUFFER_SIZE);
+                continue;
+            }
+
+            /* See handle_cached_read() for cache maintenance. */
+            dma_sync_single_for_device(data, FLASH_PG_BUFFER_SIZE,
+                                       DMA_FROM_DEVICE);
+
+            flash_transaction_init(txn);
+            txn->type = TXN_READ;
+            txn->source = TS_USER_IO;
+            txn->nsid = nsid;
+            txn->lpa = lpa;
+            txn->ppa = NO_PPA;
+            txn->data = data;
+            txn->offset = 0;
+            txn->length = FLASH_PG_SIZE;
+            txn->bitmap = (1UL << SECTORS_PER_FLASH_PG) - 1;
+            txn->opaque = entry;
+
+            txns[count++] = txn;
+        }
+
+        if (!count) {
+            if (lpa < end) break; /* Out of memory. */
+            continue;
+        }
+
+        r = amu_read_batch(txns, count, status);
+
+        for (i = 0; i < count; i++) {
+            struct flash_transaction* txn = txns[i];
+            struct cache_entry* entry = (struct cache_entry*)txn->opaque;
+            struct data_cache* cache = get_cache_for_txn(txn);
+            struct iovec iov;
+            struct iov_iter iter;
+
+            if (!r && !status[i]) {
+                iov.iov_base = entry->data;
+                iov.iov_len = FLASH_PG_SIZE;
+                iov_iter_init(&iter, &iov, 1, FLASH_PG_SIZE);
+
+                if (zdma_iter_copy_to(&iter, txn->data, FLASH_PG_SIZE,
+                                      DATA_CACHE_USE_PS_DDR) < 0)
+                    status[i] = EIO;
+            }
+
+            if (!r && !status[i]) {
+                entry->bitmap = txn->bitmap;
+                entry->prefetched = TRUE;
+                cache->stats.total_readahead_pages++;
+            } else {
+                /* Leave an empty page that is reused first. */
+                entry->bitmap = 0;
+            }
+
+            entry->prefetching = FALSE;
+            mutex_unlock(&entry->mutex);
+
+            /* Unused pages read ahead go to the cold end of the LRU list so
+             * that they are evicted before pages that have been used. */
+            if (--entry->pin_count == 0)
+                list_add_tail(&entry->lru, &cache->lru_list);
+
+            if (cache->nr_pages > cache->capacity_pages) cache_shrink(cache);
+
+            free_mem(__pa(txn->data), FLASH_PG_BUFFER_SIZE);
+        }
+    }
+}
+
+/* Queue readahead of LPAs [start, end) in batches for the readahead threads.
+ * Return FALSE if the queue has no room for all of it. */
+static int queue_readahead(unsigned int nsid, lpa_t start, lpa_t end)
+{
+    unsigned int nr_batches = (end - start + RA_BATCH_SIZE - 1) / RA_BATCH_SIZE;
+    struct ra_request* ra;
+
+    mutex_lock(&ra_mutex);
+
+    if (RA_QUEUE_SIZE - (ra_queue_tail - ra_queue_head) < nr_batches) {
+        mutex_unlock(&ra_mutex);
+        return FALSE;
+    }
+
+    for (; start < end; start += RA_BATCH_SIZE) {
+        ra = &ra_queue[ra_queue_tail++ % RA_QUEUE_SIZE];
+        ra->nsid = nsid;
+        ra->start = start;
+        ra->end = min(start + RA_BATCH_SIZE, end);
+    }
+
+    cond_broadcast(&ra_cond);
+    mutex_unlock(&ra_mutex);
+
+    return TRUE;
+}
+
+/* Match a read of LPAs [start, end) against the sequential streams of the
+ * namespace and queue readahead for the stream it belongs to. @hits is the
+ * number of pages served from readahead and @misses the number of pages read
+ * from NAND flash by the request. */
+static void update_readahead(unsigned int nsid, lpa_t start, lpa_t end,
+                             unsigned int hits, unsigned int misses)
+{
+    struct ns_cache* ns = get_cache_for_ns(nsid);
+    struct ra_stream* stream = NULL;
+    timestamp_t now = timer_get_cycles();
+    lpa_t ra_end;
+    int i;
+
+    for (i = 0; i < DATA_CACHE_RA_STREAMS; i++) {
+        struct ra_stream* s = &ns->streams[i];
+        lpa_t slack = max(s->window, DATA_CACHE_RA_MIN_PAGES);
+
+        /* Requests of a stream may be served out of order by concurrent
+         * workers so allow some slack around the expected LPA. */
+        if (s->valid && start + slack >= s->next_lpa &&
+            start <= s->next_lpa + slack) {
+            stream = s;
+            break;
+        }
+    }
+
+    if (!stream) {
+        /* Start a new stream in place of the least recently used one. It
+         * is read ahead once the next read proves it sequential. */
+        stream = &ns->streams[0];
+        for (i = 1; i < DATA_CACHE_RA_STREAMS && stream->valid; i++) {
+            struct ra_stream* s = &ns->streams[i];
+            if (!s->valid || s->last_access < stream->last_access) stream = s;
+        }
+
+        stream->valid = TRUE;
+        stream->next_lpa = end;
+        stream->ra_end = end;
+        stream->window = 0;
+        stream->last_access = now;
+        return;
+    }
+
+    stream->last_access = now;
+    if (end > stream->next_lpa) stream->next_lpa = end;
+    if (stream->ra_end < stream->next_lpa) stream->ra_end = stream->next_lpa;
+
+    if (!stream->window || misses) {
+        /* The window should at least cover the next request. */
+        stream->window = max(end - start, DATA_CACHE_RA_MIN_PAGES);
+    } else if (hits) {
+        stream->window <<= 1;
+    }
+    stream->window = min(stream->window, DATA_CACHE_RA_MAX_PAGES);
+
+    /* Top up once half of the window has been consumed. */
+    if (stream->ra_end - stream->next_lpa > stream->window / 2) return;
+
+    ra_end = stream->next_lpa + stream->window;
+    if (queue_readahead(nsid, stream->ra_end, ra_end)) stream->ra_end = ra_end;
+}
+
+/* Wait until the readahead of @entry completes and look up the page again. */
+static struct cache_entry* wait_readahead(struct data_cache* cache,
+                                          struct cache_entry* entry,
+                                          unsigned int nsid, lpa_t lpa)
+{
+    pin_entry(entry);
+    mutex_lock(&entry->mutex);
+    mutex_unlock(&entry->mutex);
+    unpin_entry(cache, entry);
+
+    return cache_find(cache, nsid, lpa);
+}
+
+#endif
+
 static int handle_cached_read(struct user_request* req)
 {
     struct flash_transaction *txn, *tmp;
@@ -515,6 +841,10 @@ static int handle_cached_read(struct user_request* req)
     struct list_head hit_list;
     size_t count;
     timestamp_t now = timer_get_cycles();
+#if USE_READAHEAD
+    lpa_t ra_start = (lpa_t)-1, ra_end = 0;
+    unsigned int ra_hits = 0, ra_misses = 0;
+#endif
     int i, r;
 
     /* All flash transactions with a cache hit are moved to this list. */
@@ -531,6 +861,14 @@ static int handle_cached_read(struct user_request* req)
 
         txn->stats.dc_begin_service_time = now;
 
+#if USE_READAHEAD
+        if (entry && entry->prefetching)
+            entry = wait_readahead(cache, entry, txn->nsid, txn->lpa);
+
+        ra_start = min(ra_start, txn->lpa);
+        ra_end = max(ra_end, txn->lpa + 1);
+#endif
+
         if (entry) avail_sectors = entry->bitmap & txn->bitmap;
 
         if (entry && avail_sectors == txn->bitmap) {
@@ -544,6 +882,14 @@ static int handle_cached_read(struct user_request* req)
             list_add(&txn->list, &hit_list);
 
             cache->stats.total_read_hits++;
+
+#if USE_READAHEAD
+            if (entry->prefetched) {
+                entry->prefetched = FALSE;
+                cache->stats.total_readahead_hits++;
+                ra_hits++;
+            }
+#endif
         } else {
             /* Cache miss or some requested sectors are not present. In either
              * case, we need to do a flash read to get the missing sectors. */
@@ -585,6 +931,9 @@ static int handle_cached_read(struct user_request* req)
                                        DMA_FROM_DEVICE);
 
             cache->stats.total_read_misses++;
+#if USE_READAHEAD
+            ra_misses++;
+#endif
         }
 
         iov->iov_base = txn->data + txn->offset;
@@ -599,6 +948,12 @@ static int handle_cached_read(struct user_request* req)
         count += txn->length;
     }
 
+#if USE_READAHEAD
+    /* Queue readahead before blocking on our own flash reads. */
+    if (ra_start < ra_end)
+        update_readahead(req->nsid, ra_start, ra_end, ra_hits, ra_misses);
+#endif
+
     /* Read data from NAND flash before we overlay the cached sectors. */
     r = amu_dispatch(&req->txn_list);
     if (r) goto cleanup;
@@ -702,9 +1057,148 @@ int dc_process_request(struct user_request* req)
     return r;
 }
 
+/* Split the total capacity among the active namespaces. Namespaces with a
+ * configured capacity get it first and the rest is shared evenly by the
+ * others, each of which gets at least DATA_CACHE_NS_MIN_PAGES. Configured
+ * capacities are scaled down if they do not leave that much. */
+static void update_partitions(void)
+{
+    size_t reserved = 0, available, share;
+    unsigned int nr_shared = 0;
+    int i, j;
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        struct ns_cache* ns = &ns_caches[i];
+
+        if (!ns->active) continue;
+
+        if (ns->capacity_override)
+            reserved += ns->capacity_override;
+        else
+            nr_shared++;
+    }
+
+    available = total_capacity_pages - nr_shared * DATA_CACHE_NS_MIN_PAGES;
+    if (nr_shared * DATA_CACHE_NS_MIN_PAGES > total_capacity_pages)
+        available = 0;
+
+    share = total_capacity_pages - min(reserved, available);
+    if (nr_shared) share /= nr_shared;
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        struct ns_cache* ns = &ns_caches[i];
+        size_t shard_capacity;
+
+        if (!ns->active) continue;
+
+        if (!ns->capacity_override)
+            ns->capacity_pages = share;
+        else if (reserved > available)
+            ns->capacity_pages = ns->capacity_override * available / reserved;
+        else
+            ns->capacity_pages = ns->capacity_override;
+
+        /* Every shard needs at least one page to make progress. */
+        shard_capacity = ns->capacity_pages / DATA_CACHE_SHARDS;
+        if (!shard_capacity) shard_capacity = 1;
+
+        for (j = 0; j < DATA_CACHE_SHARDS; j++) {
+            ns->shards[j].capacity_pages = shard_capacity;
+            cache_shrink(&ns->shards[j]);
+        }
+    }
+}
+
 void dc_init(size_t capacity)
 {
-    cache_init(&g_cache, capacity / FLASH_PG_SIZE);
+    int i, j;
+
+    total_capacity_pages = capacity / FLASH_PG_SIZE;
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        struct ns_cache* ns = &ns_caches[i];
+
+        memset(ns, 0, sizeof(*ns));
+        ns->capacity_override = CONFIG_DATA_CACHE_NS_CAPACITY / FLASH_PG_SIZE;
+
+        for (j = 0; j < DATA_CACHE_SHARDS; j++)
+            cache_init(&ns->shards[j]);
+    }
+
+    if (mutex_init(&flusher_mutex, NULL) != 0) {
+        panic("failed to initialize flusher mutex");
+    }
+    if (cond_init(&flusher_cond, NULL) != 0) {
+        panic("failed to initialize flusher condvar");
+    }
+
+    if (mutex_init(&ra_mutex, NULL) != 0) {
+        panic("failed to initialize readahead mutex");
+    }
+    if (cond_init(&ra_cond, NULL) != 0) {
+        panic("failed to initialize readahead condvar");
+    }
+}
+
+/* Give namespace @nsid a data cache partition. */
+void dc_attach_ns(unsigned int nsid)
+{
+    struct ns_cache* ns = get_cache_for_ns(nsid);
+
+    ns->active = TRUE;
+    update_partitions();
+}
+
+/* Write back and release the cached pages of namespace @nsid and return its
+ * partition to the other namespaces. */
+void dc_detach_ns(unsigned int nsid)
+{
+    struct ns_cache* ns = get_cache_for_ns(nsid);
+    int i;
+
+    dc_flush_ns(nsid);
+
+    ns->active = FALSE;
+    ns->capacity_pages = 0;
+    memset(ns->streams, 0, sizeof(ns->streams));
+    for (i = 0; i < DATA_CACHE_SHARDS; i++) {
+        ns->shards[i].capacity_pages = 0;
+        cache_shrink(&ns->shards[i]);
+    }
+
+    update_partitions();
+}
+
+/* Set the data cache capacity of namespace @nsid in bytes. 0 gives the
+ * namespace an even share of the capacity not claimed by others. Fails with
+ * ENOSPC if the configured capacities would leave less than
+ * DATA_CACHE_NS_MIN_PAGES to any namespace without one. */
+int dc_set_ns_capacity(unsigned int nsid, size_t capacity)
+{
+    struct ns_cache* ns = get_cache_for_ns(nsid);
+    size_t pages = capacity / FLASH_PG_SIZE;
+    size_t reserved = pages;
+    unsigned int nr_shared = pages ? 0 : 1;
+    int i;
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        struct ns_cache* other = &ns_caches[i];
+
+        if (other == ns || !other->active) continue;
+
+        if (other->capacity_override)
+            reserved += other->capacity_override;
+        else
+            nr_shared++;
+    }
+
+    if (reserved + nr_shared * DATA_CACHE_NS_MIN_PAGES > total_capacity_pages)
+        return ENOSPC;
+
+    ns->capacity_override = pages;
+    update_partitions();
+
+    return 0;
 }
 
 static unsigned int cache_lookup_range(struct data_cache* cache,
@@ -748,7 +1242,7 @@ static unsigned int cache_lookup_range(struct data_cache* cache,
     return ret;
 }
 
-static void flush_cache_range(struct data_cache* cache, unsigned int nsid,
+static void flush_shard_range(struct data_cache* cache, unsigned int nsid,
                               unsigned int tag, lpa_t start, lpa_t end)
 {
     struct flash_transaction *txn, *tmp;
@@ -816,9 +1310,106 @@ static void flush_cache_range(struct data_cache* cache, unsigned int nsid,
     }
 }
 
-static void start_flush_sync(struct data_cache* cache, unsigned int nsid)
+static void flush_cache_range(struct ns_cache* cache, unsigned int nsid,
+                              unsigned int tag, lpa_t start, lpa_t end)
+{
+    int i;
+
+    for (i = 0; i < DATA_CACHE_SHARDS; i++)
+        flush_shard_range(&cache->shards[i], nsid, tag, start, end);
+}
+
+static unsigned int cache_lookup_discard(struct data_cache* cache,
+                                         unsigned int nsid, lpa_t* offset,
+                                         lpa_t end,
+                                         struct cache_entry** entries,
+                                         unsigned int nr_entries)
+{
+    struct cache_entry *entry, key;
+    struct avl_iter iter;
+    unsigned int ret = 0;
+
+    key.key.nsid = nsid;
+    key.key.lpa = *offset;
+
+    cache_avl_start_iter(cache, &iter, &key, AVL_GREATER_EQUAL);
+    for (entry = cache_avl_get_iter(&iter); entry;) {
+        if ((entry->key.nsid != nsid) || (entry->key.lpa >= end)) break;
+
+        /* Pages still being read ahead have no data yet but will be filled
+         * with what was mapped before the discard. */
+        if (entry->bitmap || entry->prefetching) {
+            entries[ret] = entry;
+            if (++ret == nr_entries) {
+                *offset = entry->key.lpa + 1;
+                return ret;
+            }
+        }
+
+        avl_inc_iter(&iter);
+        entry = cache_avl_get_iter(&iter);
+    }
+
+    *offset = end;
+    return ret;
+}
+
+/* Drop cached data for LPAs [start, end) of a namespace without writing it
+ * back. The entries stay in the cache as empty clean pages at the cold end of
+ * the LRU list so that they are reused first. */
+static void discard_shard_range(struct data_cache* cache, unsigned int nsid,
+                                lpa_t start, lpa_t end)
+{
+    struct cache_entry* pvec[WB_BATCH_SIZE];
+    unsigned int nr_entries;
+    lpa_t index = start;
+    int i;
+
+    while (index < end) {
+        nr_entries = cache_lookup_discard(cache, nsid, &index, end, pvec,
+                                          WB_BATCH_SIZE);
+        if (nr_entries == 0) break;
+
+        for (i = 0; i < nr_entries; i++) {
+            struct cache_entry* entry = pvec[i];
+
+            /* The entry may have been reused for a different LPA while we
+             * were waiting for the previous one. */
+            if ((entry->key.nsid != nsid) || (entry->key.lpa < start) ||
+                (entry->key.lpa >= end))
+                continue;
+
+            /* Waits for readahead of the page to complete. */
+            pin_entry(entry);
+            mutex_lock(&entry->mutex);
+
+            if ((entry->key.nsid == nsid) && (entry->key.lpa >= start) &&
+                (entry->key.lpa < end)) {
+                entry->bitmap = 0;
+                entry->status = CES_CLEAN;
+                entry->prefetched = FALSE;
+            }
+
+            mutex_unlock(&entry->mutex);
+
+            if (--entry->pin_count == 0)
+                list_add_tail(&entry->lru, &cache->lru_list);
+        }
+    }
+}
+
+void dc_discard_range(unsigned int nsid, lpa_t start, lpa_t end)
 {
-    static struct data_cache* flushing = NULL;
+    struct ns_cache* cache = get_cache_for_ns(nsid);
+    int i;
+
+    for (i = 0; i < DATA_CACHE_SHARDS; i++)
+        discard_shard_range(&cache->shards[i], nsid, start, end);
+}
+
+static void start_flush_sync(struct ns_cache* cache, unsigned int nsid)
+{
+    static struct ns_cache* flushing = NULL;
     int i;
 
     mutex_lock(&flusher_mutex);
@@ -850,7 +1441,7 @@ static void start_flush_sync(struct data_cache* cache, unsigned int nsid)
 
 void dc_flush_ns(unsigned int nsid)
 {
-    struct data_cache* cache = get_cache_for_ns(nsid);
+    struct ns_cache* cache = get_cache_for_ns(nsid);
     start_flush_sync(cache, nsid);
 }
 
@@ -880,10 +1471,86 @@ void flusher_main(int index)
     }
 }
 
+void readahead_main(int index)
+{
+    struct ra_request ra;
+
+    local_irq_enable();
+
+    for (;;) {
+        mutex_lock(&ra_mutex);
+        while (ra_queue_head == ra_queue_tail)
+            cond_wait(&ra_cond, &ra_mutex);
+        ra = ra_queue[ra_queue_head++ % RA_QUEUE_SIZE];
+        mutex_unlock(&ra_mutex);
+
+#if USE_READAHEAD
+        do_readahead(ra.nsid, ra.start, ra.end);
+#endif
+    }
+}
+
 void dc_report_stats(void)
 {
+    int i, j;
+
     xil_printf("=============== Data cache ===============\n");
-    xil_printf("  Total read hits: %lu\n", g_cache.stats.total_read_hits);
-    xil_printf("  Total read misses: %lu\n", g_cache.stats.total_read_misses);
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        struct ns_cache* ns = &ns_caches[i];
+        size_t hits = 0, misses = 0, nr_pages = 0;
+        size_t ra_pages = 0, ra_hits = 0, ra_unused = 0;
+
+        for (j = 0; j < DATA_CACHE_SHARDS; j++) {
+            hits += ns->shards[j].stats.total_read_hits;
+            misses += ns->shards[j].stats.total_read_misses;
+            nr_pages += ns->shards[j].nr_pages;
+            ra_pages += ns->shards[j].stats.total_readahead_pages;
+            ra_hits += ns->shards[j].stats.total_readahead_hits;
+            ra_unused += ns->shards[j].stats.total_readahead_unused;
+        }
+
+        if (!ns->active && !hits && !misses) continue;
+
+        xil_printf("Namespace %d:\n", i + 1);
+        xil_printf("  Cached pages: %lu / %lu\n", nr_pages,
+                   ns->capacity_pages);
+        xil_printf("  Total read hits: %lu\n", hits);
+        xil_printf("  Total read misses: %lu\n", misses);
+        if (hits + misses)
+            xil_printf("  Read hit ratio: %lu%%\n",
+                       hits * 100 / (hits + misses));
+        xil_printf("  Pages read ahead: %lu\n", ra_pages);
+        xil_printf("  Readahead hits: %lu\n", ra_hits);
+        xil_printf("  Readahead pages evicted unused: %lu\n", ra_unused);
+    }
+
     xil_printf("==========================================\n");
 }
+
+void dc_command_set_capacity(int argc, const char** argv)
+{
+    unsigned int nsid;
+    size_t capacity;
+
+    if (argc != 3) {
+        printk("Usage: dc_capacity <nsid> <MB, 0 = even share>\n");
+        return;
+    }
+
+    nsid = atoi(argv[1]);
+    capacity = (size_t)atoi(argv[2]) << 20;
+
+    if (nsid == 0 || nsid > NAMESPACE_MAX) {
+        printk("Invalid namespace %d\n", nsid);
+        return;
+    }
+
+    if (dc_set_ns_capacity(nsid, capacity)) {
+        printk("Capacity exceeds what the other namespaces leave\n");
+        return;
+    }
+
+    printk("Data cache capacity of namespace %d: %lu pages\n", nsid,
+           get_cache_for_ns(nsid)->capacity_pages);
+}
@@ -24,6 +24,9 @@
 #define IDX2NSID(idx)  ((idx) + 1)
 #define NSID2IDX(nsid) ((nsid)-1)
 
+/* Flushes may target all namespaces. */
+#define NSID_ALL 0xffffffff
+
 struct namespace_metadata {
     size_t size_blocks;
     size_t capacity_blocks;
@@ -80,6 +83,18 @@ int ftl_get_namespace(unsigned int nsid, struct namespace_info* info)
     return 0;
 }
 
+static inline int namespace_active(unsigned int nsid)
+{
+    return nsid > 0 && nsid <= NAMESPACE_MAX &&
+           GET_BIT(manifest.active_namespace, NSID2IDX(nsid));
+}
+
+static inline size_t namespace_logical_pages(unsigned int nsid)
+{
+    return (manifest.namespaces[NSID2IDX(nsid)].size_blocks << SECTOR_SHIFT) >>
+           FLASH_PG_SHIFT;
+}
+
 static int segment_user_request(struct user_request* req)
 {
     struct flash_transaction *txn, *tmp;
@@ -184,11 +199,82 @@ static int process_io_request(struct user_request* req)
     return r;
 }
 
+/* Drop full flash pages [start, end) of a namespace from the data cache and
+ * the mapping table. No flash page is programmed for the discarded data. */
+static int discard_pages(unsigned int nsid, lpa_t start, lpa_t end)
+{
+    if (!namespace_active(nsid)) return ESRCH;
+    if (start > end || end > namespace_logical_pages(nsid)) return EINVAL;
+
+    dc_discard_range(nsid, start, end);
+    return amu_unmap_range(nsid, start, end);
+}
+
+static int process_deallocate_request(struct user_request* req)
+{
+    lpa_t start, end;
+
+    /* Deallocation is advisory so only whole flash pages are unmapped.
+     * Partially covered pages keep their data. */
+    start =
+        roundup(req->start_lba, SECTORS_PER_FLASH_PG) / SECTORS_PER_FLASH_PG;
+    end = (req->start_lba + req->sector_count) / SECTORS_PER_FLASH_PG;
+
+    if (start >= end) return 0;
+
+    return discard_pages(req->nsid, start, end);
+}
+
+/* Zero sectors [slba, slba + count) through the data cache. */
+static int zero_sectors(struct user_request* req, lha_t slba,
+                        unsigned int count)
+{
+    lha_t orig_slba = req->start_lba;
+    unsigned int orig_count = req->sector_count;
+    int r;
+
+    req->start_lba = slba;
+    req->sector_count = count;
+
+    r = process_io_request(req);
+
+    req->start_lba = orig_slba;
+    req->sector_count = orig_count;
+
+    return r;
+}
+
+static int process_write_zeroes_request(struct user_request* req)
+{
+    lha_t slba = req->start_lba;
+    lha_t elba = req->start_lba + req->sector_count;
+    lha_t first = roundup(slba, SECTORS_PER_FLASH_PG);
+    lha_t last = rounddown(elba, SECTORS_PER_FLASH_PG);
+    int r;
+
+    /* Whole flash pages are zeroed by unmapping them because unmapped pages
+     * read back as zeroes. Only the unaligned head and tail go through the
+     * data cache. */
+    if (first >= last) return process_io_request(req);
+
+    if (slba < first) {
+        r = zero_sectors(req, slba, first - slba);
+        if (r) return r;
+    }
+
+    r = discard_pages(req->nsid, first / SECTORS_PER_FLASH_PG,
+                      last / SECTORS_PER_FLASH_PG);
+    if (r) return r;
+
+    if (last < elba) r = zero_sectors(req, last, elba - last);
+
+    return r;
+}
+
 static int ftl_flush_ns(unsigned int nsid)
 {
     dc_flush_ns(nsid);
-    amu_save_domain(nsid);
-    return 0;
+    return amu_commit_journal(nsid);
 }
 
 static int ftl_flush_data_ns(unsigned int nsid)
@@ -197,6 +283,24 @@ static int ftl_flush_data_ns(unsigned int nsid)
     return 0;
 }
 
+static int process_flush_request(struct user_request* req)
+{
+    int (*flush_ns)(unsigned int) =
+        (req->req_type == IOREQ_FLUSH) ? ftl_flush_ns : ftl_flush_data_ns;
+    int i, r;
+
+    if (req->nsid != NSID_ALL) return flush_ns(req->nsid);
+
+    for (i = 0; i < NAMESPACE_MAX; i++) {
+        if (!GET_BIT(manifest.active_namespace, i)) continue;
+
+        r = flush_ns(IDX2NSID(i));
+        if (r) return r;
+    }
+
+    return 0;
+}
+
 static void ftl_sync(void)
 {
     int i, r;
@@ -211,12 +315,15 @@ static void ftl_sync(void)
         xil_printf("%d...", nsid);
         dc_flush_ns(nsid);
 
-        r = amu_save_domain(nsid);
+        /* Other workers keep updating the mapping meanwhile. Only the journal
+         * pages covered by the checkpoint are truncated. */
+        r = amu_checkpoint_domain(nsid);
         xil_printf("%s", r ? "FAILED " : "OK ");
     }
     xil_printf("\n");
 
     bm_shutdown();
+
     save_manifest();
 }
 
@@ -224,12 +331,18 @@ int ftl_process_request(struct user_request* req)
 {
     int r;
 
+    /* The NSID comes from the host. Reject it before it reaches the data
+     * cache or the mapping. */
+    if (req->req_type != IOREQ_SYNC &&
+        !(req->nsid == NSID_ALL && (req->req_type == IOREQ_FLUSH ||
+                                    req->req_type == IOREQ_FLUSH_DATA)) &&
+        !namespace_active(req->nsid))
+        return ESRCH;
+
     switch (req->req_type) {
     case IOREQ_FLUSH:
-        r = ftl_flush_ns(req->nsid);
-        break;
     case IOREQ_FLUSH_DATA:
-        r = ftl_flush_data_ns(req->nsid);
+        r = process_flush_request(req);
         break;
     case IOREQ_SYNC:
         ftl_sync();
@@ -237,9 +350,14 @@ int ftl_process_request(struct user_request* req)
         break;
     case IOREQ_READ:
     case IOREQ_WRITE:
-    case IOREQ_WRITE_ZEROES:
         r = process_io_request(req);
         break;
+    case IOREQ_WRITE_ZEROES:
+        r = process_write_zeroes_request(req);
+        break;
+    case IOREQ_DEALLOCATE:
+        r = process_deallocate_request(req);
+        break;
     default:
         r = EINVAL;
         break;
@@ -337,6 +455,7 @@ void ftl_init(void)
     int wipe_ssd = FALSE;
     int wipe_mt = FALSE;
     int full_scan = FALSE;
+    int rebuild_mt = FALSE;
 
     FILINFO fno;
     int i, r;
@@ -354,6 +473,10 @@ void ftl_init(void)
     wipe_mt = TRUE;
 #endif
 
+#ifdef REBUILD_MAPPING_TABLE
+    rebuild_mt = TRUE;
+#endif
+
 #ifdef FULL_BAD_BLOCK_SCAN
     full_scan = TRUE;
     wipe_mt = TRUE;
@@ -386,6 +509,7 @@ void ftl_init(void)
 
     dc_init(CONFIG_DATA_CACHE_CAPACITY);
     bm_init(wipe_ssd, full_scan);
+    amu_init();
 
     for (i = 0; i < NAMESPACE_MAX; i++) {
         struct namespace_metadata* ns_meta = &manifest.namespaces[i];
@@ -396,7 +520,14 @@ void ftl_init(void)
             IDX2NSID(i), CONFIG_MAPPING_TABLE_CAPACITY,
             (ns_meta->size_blocks << SECTOR_SHIFT) >> FLASH_PG_SHIFT, wipe_mt);
         if (r) panic("Failed to attach namespace %d\n", IDX2NSID(i));
+
+        dc_attach_ns(IDX2NSID(i));
     }
+
+    amu_rebuild_mappings(rebuild_mt);
+    bm_open_write_frontiers();
+
+    amu_replay_journals();
 }
 
 int ftl_create_namespace(struct namespace_info* info)
@@ -464,6 +595,9 @@ int ftl_attach_namespace(unsigned int nsid)
         (ns_meta->size_blocks << SECTOR_SHIFT) >> FLASH_PG_SHIFT, FALSE);
 
     if (r == 0) {
+        amu_replay_journals();
+        dc_attach_ns(nsid);
+
         SET_BIT(manifest.active_namespace, index);
         save_manifest();
     }
@@ -482,10 +616,15 @@ int ftl_detach_namespace(unsigned int nsid)
 
     if (!GET_BIT(manifest.active_namespace, index)) return ENOENT;
 
+    /* Cached data must reach the mapping before the domain goes away. */
+    dc_detach_ns(nsid);
+
     r = amu_detach_domain(nsid);
     if (r == 0) {
         UNSET_BIT(manifest.active_namespace, index);
         save_manifest();
+    } else {
+        dc_attach_ns(nsid);
     }
 
     return r;
@@ -533,6 +672,7 @@ void ftl_report_stats(void)
     histogram_print(stats.write_command_time_hist, 2);
     xil_printf("===========================================\n\n");
 
+    amu_report_stats();
     dc_report_stats();
     bm_report_stats();
 }
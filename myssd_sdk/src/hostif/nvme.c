@@ -479,6 +479,42 @@ process_storpu_delete_context_command(struct nvme_common_command* cmd,
     return err2statuscode(r);
 }
 
+static int
+process_storpu_register_ring_command(struct nvme_common_command* cmd,
+                                     union nvme_result* result)
+{
+    struct storpu_task task;
+    int r;
+
+    memset(&task, 0, sizeof(task));
+    task.type = SPU_TYPE_REGISTER_RING;
+    task.result_ring.cid = cmd->cdw10;
+    task.result_ring.host_addr = cmd->dptr.prp1;
+    task.result_ring.size = cmd->cdw11;
+
+    r = submit_storpu_task(&task, 0);
+    if (r == 0) result->u32 = task.result_ring.ring_id;
+
+    return err2statuscode(r);
+}
+
+static int
+process_storpu_unregister_ring_command(struct nvme_common_command* cmd,
+                                       union nvme_result* result)
+{
+    struct storpu_task task;
+    int r;
+
+    memset(&task, 0, sizeof(task));
+    task.type = SPU_TYPE_UNREGISTER_RING;
+    task.result_ring.cid = cmd->cdw10;
+    task.result_ring.ring_id = cmd->cdw11;
+
+    r = submit_storpu_task(&task, 0);
+
+    return err2statuscode(r);
+}
+
 static int process_admin_command(struct nvme_command* cmd,
                                  union nvme_result* result)
 {
@@ -509,6 +545,12 @@ static int process_admin_command(struct nvme_command* cmd,
     case nvme_admin_storpu_delete_context:
         status = process_storpu_delete_context_command(&cmd->common, result);
         break;
+    case nvme_admin_storpu_register_ring:
+        status = process_storpu_register_ring_command(&cmd->common, result);
+        break;
+    case nvme_admin_storpu_unregister_ring:
+        status = process_storpu_unregister_ring_command(&cmd->common, result);
+        break;
     default:
         status = NVME_SC_INVALID_OPCODE;
         break;
@@ -569,6 +611,54 @@ static int process_ftl_command(struct nvme_command* cmd,
     return status;
 }
 
+static int process_dsm_command(struct nvme_dsm_cmd* cmd,
+                               union nvme_result* result)
+{
+    struct worker_thread* self = worker_self();
+    struct nvme_dsm_range* ranges;
+    struct user_request req;
+    struct iovec iov;
+    struct iov_iter iter;
+    unsigned int nr_ranges = (cmd->nr & 0xff) + 1;
+    size_t size = nr_ranges * sizeof(*ranges);
+    int i, r;
+
+    /* Integral read/write hints carry no action for us. */
+    if (!(cmd->attributes & NVME_DSMGMT_AD)) return NVME_SC_SUCCESS;
+
+    ranges = (struct nvme_dsm_range*)alloc_vmpages(1, ZONE_ALL);
+    if (!ranges) return err2statuscode(ENOMEM);
+
+    iov.iov_base = ranges;
+    iov.iov_len = size;
+    iov_iter_init(&iter, &iov, 1, size);
+
+    dma_sync_single_for_device(ranges, size, DMA_FROM_DEVICE);
+    r = read_prp_data(&iter, cmd->dptr.prp1, cmd->dptr.prp2, size, size);
+    dma_sync_single_for_cpu(ranges, size, DMA_FROM_DEVICE);
+
+    for (i = 0; r == 0 && i < nr_ranges; i++) {
+        if (!ranges[i].nlb) continue;
+
+        memset(&req, 0, sizeof(req));
+        req.req_type = IOREQ_DEALLOCATE;
+        req.nsid = cmd->nsid;
+        req.start_lba = ranges[i].slba;
+        req.sector_count = ranges[i].nlb;
+        INIT_LIST_HEAD(&req.txn_list);
+
+        self->cur_request = &req;
+        r = ftl_process_request(&req);
+        self->cur_request = NULL;
+
+        if (r) xil_printf("Deallocate error %d\n", r);
+    }
+
+    free_mem(__pa(ranges), ARCH_PG_SIZE);
+
+    return err2statuscode(r);
+}
+
 static int process_storpu_invoke_command(struct nvme_storpu_invoke_command* cmd,
                                          union nvme_result* result)
 {
@@ -587,6 +677,43 @@ static int process_storpu_invoke_command(struct nvme_storpu_invoke_command* cmd,
     return err2statuscode(r);
 }
 
+static int process_storpu_invoke_batch_command(
+    struct nvme_storpu_invoke_batch_command* cmd, union nvme_result* result)
+{
+    struct storpu_task task;
+    struct storpu_invoke_desc* descs;
+    size_t size = cmd->nr_descs * sizeof(struct storpu_invoke_desc);
+    size_t alloc_size = roundup(size, ARCH_PG_SIZE);
+    size_t mapped = size;
+    int r;
+
+    if (cmd->nr_descs == 0 || cmd->nr_descs > STORPU_INVOKE_BATCH_MAX)
+        return NVME_SC_INVALID_FIELD;
+
+    descs = map_scratchpad(cmd->dptr.prp1, &mapped);
+    if (!descs || mapped != size) return NVME_SC_INVALID_FIELD;
+
+    memset(&task, 0, sizeof(task));
+    task.type = SPU_TYPE_INVOKE_BATCH;
+    task.invoke.cid = cmd->cid;
+    task.invoke.nr_descs = cmd->nr_descs;
+
+    /* The host can still write the scratchpad. Run the batch on a copy so
+     * that the descriptors cannot change once they are checked. */
+    task.invoke.descs = alloc_vmpages(alloc_size >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!task.invoke.descs) return err2statuscode(ENOMEM);
+
+    memcpy(task.invoke.descs, descs, size);
+
+    r = submit_storpu_task(&task, 0);
+    if (r == 0) result->u64 = (u64)task.invoke.result;
+
+    memcpy(descs, task.invoke.descs, size);
+    free_mem(__pa(task.invoke.descs), alloc_size);
+
+    return err2statuscode(r);
+}
+
 static int process_io_command(struct nvme_command* cmd,
                               union nvme_result* result)
 {
@@ -596,11 +723,19 @@ static int process_io_command(struct nvme_command* cmd,
     case nvme_cmd_read:
     case nvme_cmd_write:
     case nvme_cmd_flush:
+    case nvme_cmd_write_zeroes:
         status = process_ftl_command(cmd, result);
         break;
+    case nvme_cmd_dsm:
+        status = process_dsm_command(&cmd->dsm, result);
+        break;
     case nvme_cmd_storpu_invoke:
         status = process_storpu_invoke_command(&cmd->storpu_invoke, result);
         break;
+    case nvme_cmd_storpu_invoke_batch:
+        status = process_storpu_invoke_batch_command(&cmd->storpu_invoke_batch,
+                                                     result);
+        break;
     default:
         status = NVME_SC_INVALID_OPCODE;
         break;
@@ -345,6 +345,7 @@ enum nvme_opcode {
     nvme_cmd_resv_acquire = 0x11,
     nvme_cmd_resv_release = 0x15,
     nvme_cmd_storpu_invoke = 0xa0,
+    nvme_cmd_storpu_invoke_batch = 0xa1,
 };
 
 struct nvme_common_command {
@@ -397,6 +398,32 @@ struct nvme_write_zeroes_cmd {
     __le16 appmask;
 };
 
+enum {
+    NVME_DSMGMT_IDR = 1 << 0,
+    NVME_DSMGMT_IDW = 1 << 1,
+    NVME_DSMGMT_AD = 1 << 2,
+};
+
+#define NVME_DSM_MAX_RANGES 256
+
+struct nvme_dsm_cmd {
+    __u8 opcode;
+    __u8 flags;
+    __u16 command_id;
+    __le32 nsid;
+    __u64 rsvd2[2];
+    union nvme_data_ptr dptr;
+    __le32 nr;
+    __le32 attributes;
+    __u32 rsvd12[4];
+};
+
+struct nvme_dsm_range {
+    __le32 cattr;
+    __le32 nlb;
+    __le64 slba;
+};
+
 struct nvme_storpu_invoke_command {
     __u8 opcode;
     __u8 flags;
@@ -411,6 +438,21 @@ struct nvme_storpu_invoke_command {
     __le64 rsvd15;
 };
 
+/* The descriptors (struct storpu_invoke_desc) are staged in the scratchpad at
+ * prp1. */
+struct nvme_storpu_invoke_batch_command {
+    __u8 opcode;
+    __u8 flags;
+    __u16 command_id;
+    __le32 nsid;
+    __u64 rsvd2;
+    __le64 metadata;
+    union nvme_data_ptr dptr;
+    __le32 cid;
+    __le32 nr_descs;
+    __le32 rsvd12[4];
+};
+
 /* Admin commands */
 
 enum nvme_admin_opcode {
@@ -443,6 +485,8 @@ enum nvme_admin_opcode {
     nvme_admin_get_lba_status = 0x86,
     nvme_admin_storpu_create_context = 0xa0,
     nvme_admin_storpu_delete_context = 0xa1,
+    nvme_admin_storpu_register_ring = 0xa2,
+    nvme_admin_storpu_unregister_ring = 0xa3,
 };
 
 enum {
@@ -576,7 +620,9 @@ struct nvme_command {
         struct nvme_create_sq create_sq;
         struct nvme_delete_queue delete_queue;
         struct nvme_write_zeroes_cmd write_zeroes;
+        struct nvme_dsm_cmd dsm;
         struct nvme_storpu_invoke_command storpu_invoke;
+        struct nvme_storpu_invoke_batch_command storpu_invoke_batch;
     };
 };
 
@@ -24,6 +24,8 @@ int nvme_identify_namespace(u32 nsid, u8* data)
         id_ns->nuse = ns_info.util_blocks;
     }
 
+    id_ns->dlfeat = 0x1; /* Deallocated blocks read back as zeroes. */
+
     lbaf = &id_ns->lbaf[0];
     lbaf->ds = SECTOR_SHIFT;
     lbaf->ms = 0;
@@ -66,6 +68,7 @@ void nvme_identify_controller(u8* data)
         NVME_CTRL_OACS_NS_MNGT_SUPP; /* Supports NVMe namespace management. */
 
     id_ctrl->oncs =
+        NVME_CTRL_ONCS_DSM | /* Supports Dataset Management command. */
         NVME_CTRL_ONCS_WRITE_ZEROES; /* Supports Write Zeroes command. */
 
     id_ctrl->vwc = 0x4 | NVME_CTRL_VWC_PRESENT; /* Has volatile write cache.
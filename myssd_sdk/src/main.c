@@ -76,6 +76,16 @@ static inline struct fil_task* get_fil_task(unsigned int offset)
     return (struct fil_task*)(btcm_base + offset);
 }
 
+/* Slots for batched submissions follow the per-thread slots and the dump
+ * slot. */
+#define FIL_BATCH_OFFSET ((NR_FTL_THREADS + 1) * sizeof(struct fil_task))
+
+/* Each readahead thread owns a slice of the batch slots so that their batches
+ * can be in flight at the same time. Other threads only submit batches during
+ * startup, before the readahead threads run, and may use all slots. */
+#define FIL_BATCH_FIRST_THREAD (NR_WORKER_THREADS + NR_FLUSHERS + NR_GC_THREADS)
+#define FIL_BATCH_SLICE (FIL_BATCH_MAX / NR_READAHEAD_THREADS)
+
 static void enqueue_fil_task(unsigned int offset)
 {
     struct fil_task* task = get_fil_task(offset);
@@ -111,6 +121,9 @@ static void poll_fil_responses(void)
             dma_sync_single_for_cpu(task, sizeof(*task), DMA_BIDIRECTIONAL);
         Xil_AssertVoid(task->completed);
 
+        if (offset >= FIL_BATCH_OFFSET)
+            ((struct worker_thread*)task->opaque)->pending_fil_tasks--;
+
         handle_fil_response(task);
     }
 }
@@ -263,6 +276,7 @@ int primary_main(void)
     profile_init();
 
     coro_init();
+
     worker_init(ftl_init);
 
     for (start_cpu = 1; start_cpu < NR_CPUS; start_cpu++) {
@@ -344,14 +358,10 @@ void panic(const char* fmt, ...)
 /* Dummy main function for libc */
 int main(void) { return 0; }
 
-int submit_flash_transaction(struct flash_transaction* txn)
+static void setup_fil_task(struct fil_task* task,
+                           struct flash_transaction* txn)
 {
-    struct worker_thread* self = worker_self();
-    unsigned int offset = self->tid * sizeof(struct fil_task);
-    struct fil_task* task = get_fil_task(offset);
-    int r;
-
-    Xil_AssertNonvoid(txn->type == TXN_ERASE || txn->length > 0);
+    Xil_AssertVoid(txn->type == TXN_ERASE || txn->length > 0);
 
     memset(task, 0, sizeof(*task));
     task->addr = txn->addr;
@@ -367,6 +377,16 @@ int submit_flash_transaction(struct flash_transaction* txn)
 
     task->code_buf = (uint64_t)txn->code_buf;
     task->code_length = txn->code_length;
+}
+
+int submit_flash_transaction(struct flash_transaction* txn)
+{
+    struct worker_thread* self = worker_self();
+    unsigned int offset = self->tid * sizeof(struct fil_task);
+    struct fil_task* task = get_fil_task(offset);
+    int r;
+
+    setup_fil_task(task, txn);
 
     txn->stats.fil_enqueue_time = timer_get_cycles();
     enqueue_fil_task(offset);
@@ -400,6 +420,63 @@ int submit_flash_transaction(struct flash_transaction* txn)
     return task->status == FTS_ERROR ? EIO : 0;
 }
 
+/* Submit up to FIL_BATCH_MAX transactions at once (FIL_BATCH_SLICE for a
+ * readahead thread) and wait for all of them. The per-transaction result is
+ * returned in @status. */
+int submit_flash_transaction_batch(struct flash_transaction** txns,
+                                   unsigned int count, int* status)
+{
+    struct worker_thread* self = worker_self();
+    unsigned int base = FIL_BATCH_OFFSET;
+    unsigned int i, offset;
+    struct fil_task* task;
+    int r = 0;
+
+    Xil_AssertNonvoid(count <= FIL_BATCH_MAX);
+
+    if (self->tid >= FIL_BATCH_FIRST_THREAD &&
+        self->tid < FIL_BATCH_FIRST_THREAD + NR_READAHEAD_THREADS) {
+        Xil_AssertNonvoid(count <= FIL_BATCH_SLICE);
+        base += (self->tid - FIL_BATCH_FIRST_THREAD) * FIL_BATCH_SLICE *
+                sizeof(struct fil_task);
+    }
+
+    Xil_AssertNonvoid(self->pending_fil_tasks == 0);
+    self->pending_fil_tasks = count;
+
+    for (i = 0; i < count; i++) {
+        offset = base + i * sizeof(struct fil_task);
+        setup_fil_task(get_fil_task(offset), txns[i]);
+
+        txns[i]->stats.fil_enqueue_time = timer_get_cycles();
+        enqueue_fil_task(offset);
+    }
+
+    while (self->pending_fil_tasks > 0) {
+        r = worker_wait_timeout(WT_BLOCKED_ON_FIL, 3000);
+        if (r) break;
+    }
+
+    if (r) {
+        xil_printf("Flash batch timeout (%d of %u pending)\n",
+                   self->pending_fil_tasks, count);
+        dump_fil();
+        return r;
+    }
+
+    for (i = 0; i < count; i++) {
+        task = get_fil_task(base + i * sizeof(struct fil_task));
+
+        txns[i]->stats.fil_finish_time = timer_get_cycles();
+        txns[i]->total_xfer_us = task->total_xfer_us;
+        txns[i]->total_exec_us = task->total_exec_us;
+        txns[i]->err_bitmap = task->err_bitmap;
+        status[i] = task->status == FTS_ERROR ? EIO : 0;
+    }
+
+    return 0;
+}
+
 static void dump_fil(void)
 {
     unsigned int offset = NR_FTL_THREADS * sizeof(struct fil_task);
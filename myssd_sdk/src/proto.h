@@ -5,6 +5,7 @@
 
 #include <types.h>
 #include <list.h>
+#include <flash.h>
 
 struct iov_iter;
 struct flash_transaction;
@@ -13,30 +14,63 @@ struct flash_address;
 /* amu.c */
 int amu_attach_domain(unsigned int nsid, size_t capacity_bytes,
                       size_t total_logical_pages, int reset);
+void amu_init(void);
 int amu_submit_transaction(struct flash_transaction* txn);
+int amu_submit_transaction_batch(struct flash_transaction** txns,
+                                 unsigned int count, int* status);
 void amu_shutdown(void);
 int amu_dispatch(struct list_head* txn_list);
+int amu_read_batch(struct flash_transaction** txns, unsigned int count,
+                   int* status);
 int amu_save_domain(unsigned int nsid);
+int amu_commit_journal(unsigned int nsid);
+int amu_checkpoint_domain(unsigned int nsid);
+void amu_replay_journals(void);
+void amu_rebuild_page(unsigned int nsid, lpa_t lpa, int for_mapping,
+                      struct flash_address* addr, uint64_t seq);
+void amu_rebuild_mappings(int force);
 int amu_detach_domain(unsigned int nsid);
 int amu_delete_domain(unsigned int nsid);
+int amu_relocate_page(unsigned int nsid, lpa_t lpa, int for_mapping,
+                      struct flash_address* addr, void* buf);
+int amu_unmap_range(unsigned int nsid, lpa_t start, lpa_t end);
+void amu_report_stats(void);
+
+void checkpoint_main(void);
 
 /* block_mananger.c */
 void bm_init(int wipe, int full_scan);
 void bm_shutdown(void);
-void bm_alloc_page(unsigned int nsid, struct flash_address* addr, int for_gc,
-                   int for_mapping);
+int bm_save_state(void);
+void bm_open_write_frontiers(void);
+int bm_rebuild(uint64_t* max_seq);
+uint64_t bm_get_page_seq(struct flash_address* addr);
+void bm_alloc_page(unsigned int nsid, lpa_t lpa, struct flash_address* addr,
+                   int for_gc, int for_mapping);
 void bm_invalidate_page(struct flash_address* addr);
+void bm_recover_page(unsigned int nsid, lpa_t lpa, struct flash_address* addr,
+                     int for_mapping);
+void bm_steer_plane(struct flash_address* addr);
+void bm_throttle_write(struct flash_address* addr);
 void bm_report_stats(void);
 void bm_command_mark_bad(int argc, const char** argv);
 void bm_command_save_bad(int argc, const char** argv);
 
+void gc_main(int index);
+
 /* data_cache.c */
 void dc_init(size_t capacity);
+void dc_attach_ns(unsigned int nsid);
+void dc_detach_ns(unsigned int nsid);
+int dc_set_ns_capacity(unsigned int nsid, size_t capacity);
 int dc_process_request(struct user_request* req);
 void dc_flush_ns(unsigned int nsid);
+void dc_discard_range(unsigned int nsid, lpa_t start, lpa_t end);
 void dc_report_stats(void);
+void dc_command_set_capacity(int argc, const char** argv);
 
 void flusher_main(int index);
+void readahead_main(int index);
 
 /* ftl.c */
 void ftl_init(void);
@@ -56,6 +90,8 @@ void ipi_clear_status(void);
 /* main.c */
 void panic(const char* fmt, ...);
 int submit_flash_transaction(struct flash_transaction* txn);
+int submit_flash_transaction_batch(struct flash_transaction** txns,
+                                   unsigned int count, int* status);
 int ecc_calculate(const u8* data, size_t data_length, u8* code,
                   size_t code_length, size_t offset);
 int ecc_correct(u8* data, size_t data_length, const u8* code,
@@ -0,0 +1,508 @@
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <types.h>
+#include <const.h>
+#include <utils.h>
+#include <list.h>
+#include <kref.h>
+#include <idr.h>
+#include <slab.h>
+#include <memalloc.h>
+#include <page.h>
+#include <smp.h>
+#include <storpu.h>
+#include <storpu/aio.h>
+#include <storpu/file.h>
+#include <storpu/thread.h>
+#include <storpu/vm.h>
+
+/* Asynchronous flash/host memory I/O for StorPU threads. A thread submits a
+ * batch of I/O control blocks which are forwarded to the FTL core as
+ * storpu_ftl_tasks without blocking. Completions are collected on the
+ * submitting CPU and reaped with sys_aio_getevents(). */
+
+struct aio_kiocb {
+    struct storpu_ftl_task task;
+    struct aio_ctx* ctx;
+    struct list_head list;
+
+    struct spu_iocb* obj;
+    void* data;
+    long res;
+};
+
+struct aio_ctx {
+    spu_aio_context_t id;
+    struct kref kref;
+    struct vm_context* vm_context;
+    struct list_head list;
+
+    spinlock_t lock;
+    int dead;
+    /* Destroyed with its VM context while requests were in flight. The last
+     * of them drops the reference held by the idr. */
+    int orphaned;
+
+    unsigned int nr_events;
+    struct aio_kiocb* reqs;
+
+    struct list_head free_list;
+    struct list_head done_list;
+
+    /* Requests taken from the free list but not completed yet. */
+    unsigned int nr_inflight;
+    /* Completed requests not reaped yet. */
+    unsigned int nr_done;
+
+    struct thread* waiter;
+    unsigned int wait_nr;
+};
+
+static struct idr aio_ctx_idr;
+static DEF_LIST(aio_ctx_list);
+static spinlock_t aio_idr_lock;
+
+void aio_init(void)
+{
+    spinlock_init(&aio_idr_lock);
+    idr_init(&aio_ctx_idr);
+}
+
+static inline size_t aio_reqs_size(unsigned int nr_events)
+{
+    return roundup(nr_events * sizeof(struct aio_kiocb), ARCH_PG_SIZE);
+}
+
+static struct aio_ctx* aio_find_get_ctx(spu_aio_context_t id)
+{
+    struct aio_ctx* ctx;
+
+    spin_lock(&aio_idr_lock);
+
+    ctx = (struct aio_ctx*)idr_find(&aio_ctx_idr, (unsigned long)id);
+    if (ctx && ctx->vm_context == current_thread->vm_context) {
+        kref_get(&ctx->kref);
+    } else {
+        ctx = NULL;
+    }
+
+    spin_unlock(&aio_idr_lock);
+
+    return ctx;
+}
+
+static void release_ctx(struct kref* kref)
+{
+    struct aio_ctx* ctx = list_entry(kref, struct aio_ctx, kref);
+
+    free_mem(__pa(ctx->reqs), aio_reqs_size(ctx->nr_events));
+    vm_put_context(ctx->vm_context);
+    SLABFREE(ctx);
+}
+
+static inline void aio_put_ctx(struct aio_ctx* ctx)
+{
+    kref_put(&ctx->kref, release_ctx);
+}
+
+/* Must be called with ctx->lock held. */
+static void aio_wake_waiter(struct aio_ctx* ctx)
+{
+    if (!ctx->waiter) return;
+
+    if (ctx->nr_done >= ctx->wait_nr || ctx->nr_inflight == 0) {
+        wake_up_thread(ctx->waiter);
+        ctx->waiter = NULL;
+    }
+}
+
+/* Must be called with ctx->lock held. */
+static void aio_wait(struct aio_ctx* ctx, unsigned int wait_nr,
+                     unsigned long* flagsp)
+{
+    ctx->waiter = current_thread;
+    ctx->wait_nr = wait_nr;
+
+    set_current_state(THREAD_BLOCKED);
+    spin_unlock_irqrestore(&ctx->lock, *flagsp);
+
+    schedule();
+
+    spin_lock_irqsave(&ctx->lock, flagsp);
+}
+
+static struct aio_kiocb* aio_get_req(struct aio_ctx* ctx)
+{
+    struct aio_kiocb* req = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&ctx->lock, &flags);
+
+    if (!ctx->dead && !list_empty(&ctx->free_list)) {
+        req = list_entry(ctx->free_list.next, struct aio_kiocb, list);
+        list_del(&req->list);
+        ctx->nr_inflight++;
+    }
+
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    return req;
+}
+
+static void aio_put_req(struct aio_ctx* ctx, struct aio_kiocb* req)
+{
+    unsigned long flags;
+    int release;
+
+    spin_lock_irqsave(&ctx->lock, &flags);
+
+    list_add(&req->list, &ctx->free_list);
+    ctx->nr_inflight--;
+    aio_wake_waiter(ctx);
+    release = ctx->orphaned && ctx->nr_inflight == 0;
+
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    if (release) aio_put_ctx(ctx);
+}
+
+static void aio_finish_req(struct aio_kiocb* req, long res)
+{
+    struct aio_ctx* ctx = req->ctx;
+    unsigned long flags;
+    int release;
+
+    req->res = res;
+
+    spin_lock_irqsave(&ctx->lock, &flags);
+
+    list_add_tail(&req->list, &ctx->done_list);
+    ctx->nr_inflight--;
+    ctx->nr_done++;
+    aio_wake_waiter(ctx);
+    release = ctx->orphaned && ctx->nr_inflight == 0;
+
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    if (release) aio_put_ctx(ctx);
+}
+
+static void aio_complete(struct storpu_ftl_task* task)
+{
+    struct aio_kiocb* req = list_entry(task, struct aio_kiocb, task);
+    long res;
+
+    if (task->retval)
+        res = -task->retval;
+    else if (task->type == FTL_TYPE_FLUSH || task->type == FTL_TYPE_FLUSH_DATA)
+        res = 0;
+    else
+        res = task->count;
+
+    aio_finish_req(req, res);
+}
+
+int sys_aio_setup(unsigned int nr_events, spu_aio_context_t* ctxp)
+{
+    struct aio_ctx* ctx;
+    int i;
+
+    if (nr_events == 0 || nr_events > SPU_AIO_MAX_EVENTS) return EINVAL;
+
+    SLABALLOC(ctx);
+    if (!ctx) return ENOMEM;
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->reqs = alloc_vmpages(aio_reqs_size(nr_events) >> ARCH_PG_SHIFT,
+                              ZONE_PS_DDR);
+    if (!ctx->reqs) {
+        SLABFREE(ctx);
+        return ENOMEM;
+    }
+
+    kref_init(&ctx->kref);
+    spinlock_init(&ctx->lock);
+    ctx->vm_context = vm_get_context(current_thread->vm_context);
+    ctx->nr_events = nr_events;
+
+    INIT_LIST_HEAD(&ctx->free_list);
+    INIT_LIST_HEAD(&ctx->done_list);
+
+    for (i = 0; i < nr_events; i++) {
+        struct aio_kiocb* req = &ctx->reqs[i];
+
+        memset(req, 0, sizeof(*req));
+        req->ctx = ctx;
+        list_add_tail(&req->list, &ctx->free_list);
+    }
+
+    spin_lock(&aio_idr_lock);
+    i = idr_alloc(&aio_ctx_idr, ctx, 1, 0);
+    if (i >= 0) list_add(&ctx->list, &aio_ctx_list);
+    spin_unlock(&aio_idr_lock);
+
+    if (i < 0) {
+        aio_put_ctx(ctx);
+        return ENOMEM;
+    }
+
+    ctx->id = i;
+    *ctxp = ctx->id;
+
+    return 0;
+}
+
+int sys_aio_destroy(spu_aio_context_t ctx_id)
+{
+    struct aio_ctx* ctx;
+    unsigned long flags;
+    int r;
+
+    ctx = aio_find_get_ctx(ctx_id);
+    if (!ctx) return EINVAL;
+
+    spin_lock_irqsave(&ctx->lock, &flags);
+
+    if (ctx->dead || ctx->waiter) {
+        r = ctx->dead ? EINVAL : EBUSY;
+        spin_unlock_irqrestore(&ctx->lock, flags);
+        aio_put_ctx(ctx);
+        return r;
+    }
+
+    ctx->dead = TRUE;
+
+    /* The FTL core still holds references to in-flight requests so wait for
+     * them before releasing the context. Unreaped events are dropped. */
+    while (ctx->nr_inflight > 0)
+        aio_wait(ctx, UINT_MAX, &flags);
+
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    spin_lock(&aio_idr_lock);
+    idr_remove(&aio_ctx_idr, ctx->id);
+    list_del(&ctx->list);
+    spin_unlock(&aio_idr_lock);
+
+    /* Drop both our reference and the one held by the idr. */
+    aio_put_ctx(ctx);
+    aio_put_ctx(ctx);
+
+    return 0;
+}
+
+/* Destroy the AIO contexts a VM context leaves behind. This runs on the StorPU
+ * main thread which cannot wait, so a context with requests in flight is
+ * released by the last completion. Contexts being destroyed by
+ * sys_aio_destroy() are left to it. */
+void aio_destroy_context(struct vm_context* vm_ctx)
+{
+    struct aio_ctx *ctx, *tmp;
+    struct list_head dead;
+    unsigned long flags;
+    int release;
+
+    INIT_LIST_HEAD(&dead);
+
+    spin_lock(&aio_idr_lock);
+
+    list_for_each_entry_safe(ctx, tmp, &aio_ctx_list, list)
+    {
+        if (ctx->vm_context != vm_ctx) continue;
+
+        spin_lock_irqsave(&ctx->lock, &flags);
+        release = !ctx->dead;
+        ctx->dead = TRUE;
+        spin_unlock_irqrestore(&ctx->lock, flags);
+
+        if (!release) continue;
+
+        idr_remove(&aio_ctx_idr, ctx->id);
+        list_del(&ctx->list);
+        list_add(&ctx->list, &dead);
+    }
+
+    spin_unlock(&aio_idr_lock);
+
+    list_for_each_entry_safe(ctx, tmp, &dead, list)
+    {
+        list_del(&ctx->list);
+
+        spin_lock_irqsave(&ctx->lock, &flags);
+        release = ctx->nr_inflight == 0;
+        if (!release) ctx->orphaned = TRUE;
+        spin_unlock_irqrestore(&ctx->lock, flags);
+
+        if (release) aio_put_ctx(ctx);
+    }
+}
+
+static int aio_prep_req(struct aio_kiocb* req, const struct spu_iocb* iocb)
+{
+    struct storpu_ftl_task* task = &req->task;
+    int do_write = FALSE;
+    void* addr;
+    size_t count;
+    int r;
+
+    switch (iocb->opcode) {
+    case SPU_AIO_WRITE:
+        do_write = TRUE;
+        /* fall through */
+    case SPU_AIO_READ:
+        if (iocb->fd == FD_SCRATCHPAD) {
+            count = iocb->count;
+            addr = map_scratchpad(iocb->offset, &count);
+            if (!addr) return -EFAULT;
+
+            if (do_write)
+                memcpy(addr, iocb->buf, count);
+            else
+                memcpy(iocb->buf, addr, count);
+
+            /* Completed inline. */
+            req->res = count;
+            return 1;
+        }
+
+        r = file_init_task(task, iocb->fd, iocb->buf, iocb->count,
+                           iocb->offset, do_write);
+        if (r < 0) return r;
+        break;
+    case SPU_AIO_FSYNC:
+    case SPU_AIO_FDATASYNC:
+        if (iocb->fd < 0) return -EINVAL;
+
+        memset(task, 0, sizeof(*task));
+        task->type = (iocb->opcode == SPU_AIO_FSYNC) ? FTL_TYPE_FLUSH
+                                                     : FTL_TYPE_FLUSH_DATA;
+        task->src_cpu = cpuid;
+        task->nsid = iocb->fd + 1;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    task->complete = aio_complete;
+    task->opaque = req;
+
+    return 0;
+}
+
+long sys_aio_submit(spu_aio_context_t ctx_id, long nr,
+                    struct spu_iocb** iocbpp)
+{
+    struct aio_ctx* ctx;
+    struct storpu_ftl_task *first = NULL, *last = NULL;
+    long i;
+    int r = 0;
+
+    if (nr < 0) return -EINVAL;
+    if (nr == 0) return 0;
+
+    ctx = aio_find_get_ctx(ctx_id);
+    if (!ctx) return -EINVAL;
+
+    for (i = 0; i < nr; i++) {
+        struct spu_iocb* obj = iocbpp[i];
+        struct spu_iocb iocb = *obj;
+        struct aio_kiocb* req;
+
+        req = aio_get_req(ctx);
+        if (!req) {
+            r = -EAGAIN;
+            break;
+        }
+
+        req->obj = obj;
+        req->data = iocb.data;
+
+        r = aio_prep_req(req, &iocb);
+        if (r < 0) {
+            aio_put_req(ctx, req);
+            break;
+        }
+
+        if (r > 0) {
+            aio_finish_req(req, req->res);
+            r = 0;
+            continue;
+        }
+
+        if (last)
+            last->llist.next = &req->task.llist;
+        else
+            first = &req->task;
+        last = &req->task;
+    }
+
+    /* Forward the whole batch to the FTL core with a single IPI. */
+    if (first) enqueue_storpu_ftl_tasks(first, last);
+
+    aio_put_ctx(ctx);
+
+    return i > 0 ? i : r;
+}
+
+long sys_aio_getevents(spu_aio_context_t ctx_id, long min_nr, long nr,
+                       struct spu_io_event* events)
+{
+    struct aio_ctx* ctx;
+    struct aio_kiocb* req;
+    struct list_head reaped;
+    unsigned long flags;
+    long count = 0;
+
+    if (min_nr < 0 || nr < 0 || min_nr > nr) return -EINVAL;
+
+    ctx = aio_find_get_ctx(ctx_id);
+    if (!ctx) return -EINVAL;
+
+    INIT_LIST_HEAD(&reaped);
+
+    spin_lock_irqsave(&ctx->lock, &flags);
+
+    if (ctx->waiter) {
+        count = -EBUSY;
+        goto out_unlock;
+    }
+
+    /* Do not wait for events that can never arrive. */
+    while (ctx->nr_done < min_nr && ctx->nr_inflight > 0)
+        aio_wait(ctx, (unsigned int)min_nr, &flags);
+
+    while (count < nr && !list_empty(&ctx->done_list)) {
+        req = list_entry(ctx->done_list.next, struct aio_kiocb, list);
+        list_del(&req->list);
+        list_add_tail(&req->list, &reaped);
+        ctx->nr_done--;
+        count++;
+    }
+
+out_unlock:
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+    if (count <= 0) goto out;
+
+    /* Copy events out without holding the lock because the user buffer may
+     * page fault. */
+    count = 0;
+    list_for_each_entry(req, &reaped, list)
+    {
+        events[count].data = req->data;
+        events[count].obj = req->obj;
+        events[count].res = req->res;
+        count++;
+    }
+
+    spin_lock_irqsave(&ctx->lock, &flags);
+    list_splice(&reaped, &ctx->free_list);
+    spin_unlock_irqrestore(&ctx->lock, flags);
+
+out:
+    aio_put_ctx(ctx);
+    return count;
+}
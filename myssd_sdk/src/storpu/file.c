@@ -10,10 +10,28 @@
 #include <storpu/vm.h>
 #include <page.h>
 
-static ssize_t file_readwrite(int fd, void* buf, size_t count,
-                              unsigned long offset, int do_write)
+void file_init_task_phys(struct storpu_ftl_task* task, int fd,
+                         phys_addr_t buf_phys, size_t count,
+                         unsigned long offset, int do_write)
+{
+    memset(task, 0, sizeof(*task));
+    if (fd == FD_HOST_MEM)
+        task->type = do_write ? FTL_TYPE_HOST_WRITE : FTL_TYPE_HOST_READ;
+    else
+        task->type = do_write ? FTL_TYPE_FLASH_WRITE : FTL_TYPE_FLASH_READ;
+
+    task->src_cpu = cpuid;
+
+    if (fd >= 0) task->nsid = fd + 1;
+
+    task->buf_phys = buf_phys;
+    task->addr = offset;
+    task->count = count;
+}
+
+int file_init_task(struct storpu_ftl_task* task, int fd, void* buf,
+                   size_t count, unsigned long offset, int do_write)
 {
-    struct storpu_ftl_task task;
     struct vumap_vir vir;
     struct vumap_phys phys;
     int r;
@@ -29,29 +47,44 @@ static ssize_t file_readwrite(int fd, void* buf, size_t count,
     /* The buffer should be physically contiguous. */
     if (r != 1 || phys.size != count) return -EFAULT;
 
-    memset(&task, 0, sizeof(task));
-    if (fd == FD_HOST_MEM)
-        task.type = do_write ? FTL_TYPE_HOST_WRITE : FTL_TYPE_HOST_READ;
-    else
-        task.type = do_write ? FTL_TYPE_FLASH_WRITE : FTL_TYPE_FLASH_READ;
+    file_init_task_phys(task, fd, phys.addr, count, offset, do_write);
 
-    task.src_cpu = cpuid;
-
-    if (fd >= 0) task.nsid = fd + 1;
-
-    task.buf_phys = phys.addr;
-    task.addr = offset;
-    task.count = count;
+    return 0;
+}
 
-    task.opaque = current_thread;
+static ssize_t file_submit_task(struct storpu_ftl_task* task)
+{
+    task->opaque = current_thread;
 
     set_current_state(THREAD_BLOCKED);
-    enqueue_storpu_ftl_task(&task);
+    enqueue_storpu_ftl_task(task);
     schedule();
 
-    if (task.retval) return -task.retval;
+    if (task->retval) return -task->retval;
+
+    return task->count;
+}
+
+static ssize_t file_readwrite(int fd, void* buf, size_t count,
+                              unsigned long offset, int do_write)
+{
+    struct storpu_ftl_task task;
+    int r;
+
+    r = file_init_task(&task, fd, buf, count, offset, do_write);
+    if (r < 0) return r;
+
+    return file_submit_task(&task);
+}
+
+ssize_t file_readwrite_phys(int fd, phys_addr_t buf_phys, size_t count,
+                            unsigned long offset, int do_write)
+{
+    struct storpu_ftl_task task;
+
+    file_init_task_phys(&task, fd, buf_phys, count, offset, do_write);
 
-    return count;
+    return file_submit_task(&task);
 }
 
 ssize_t spu_read(int fd, void* buf, size_t count, unsigned long offset)
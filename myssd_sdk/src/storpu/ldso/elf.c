@@ -75,6 +75,31 @@ int ldso_process_dynamic(struct so_info* si)
             si->chains = si->buckets + si->nbuckets;
             break;
         }
+        case DT_GNU_HASH: {
+            const u32* hash_table = (u32*)(si->relocbase + dp->d_un.d_ptr);
+            unsigned nmaskwords = hash_table[2];
+
+            /* The bloom filter size must be a power of two. */
+            if (hash_table[0] == 0 || nmaskwords == 0 ||
+                (nmaskwords & (nmaskwords - 1)))
+                break;
+
+            si->nbuckets_gnu = hash_table[0];
+            si->symndx_gnu = hash_table[1];
+            si->maskwords_bm_gnu = nmaskwords - 1;
+            si->shift2_gnu = hash_table[3];
+            si->bloom_gnu = (const ElfW(Addr)*)(hash_table + 4);
+            si->buckets_gnu = (const u32*)(si->bloom_gnu + nmaskwords);
+            si->chain_zero_gnu =
+                si->buckets_gnu + si->nbuckets_gnu - si->symndx_gnu;
+            break;
+        }
+        case DT_TEXTREL:
+            si->textrel = TRUE;
+            break;
+        case DT_FLAGS:
+            if (dp->d_un.d_val & DF_TEXTREL) si->textrel = TRUE;
+            break;
         }
     }
 
@@ -39,7 +39,7 @@ static void ldso_call_init_function(struct so_info* si)
     }
 }
 
-int ldso_init_context(struct vm_context* ctx)
+int ldso_init_context(struct vm_context* ctx, int relocated)
 {
     struct so_info* si_main;
 
@@ -61,11 +61,22 @@ int ldso_init_context(struct vm_context* ctx)
 
     ldso_tls_allocate_offset(si_main);
 
-    ldso_relocate_objects(si_main);
+    if (relocated)
+        ldso_relink_objects(si_main);
+    else
+        ldso_relocate_objects(si_main);
 
+    return 0;
+}
+
+void ldso_start_context(struct vm_context* ctx)
+{
     ldso_tls_initial_allocation(ctx);
 
-    ldso_call_init_function(si_main);
+    ldso_call_init_function(ctx->so_info);
+}
 
-    return 0;
+int ldso_can_share_image(struct vm_context* ctx)
+{
+    return !ctx->so_info->textrel;
 }
@@ -12,6 +12,8 @@
 #define ELFW(name) ELF32_##name
 #endif
 
+#define ELF_WORD_BITS (sizeof(ElfW(Addr)) * 8)
+
 #ifdef __i386__
 #define R_TYPE(name) R_386_##name
 #elif defined(__x86_64__)
@@ -51,6 +53,17 @@ struct so_info {
     unsigned nchains;
     int* chains;
 
+    /* DT_GNU_HASH, preferred over DT_HASH when present. */
+    unsigned nbuckets_gnu;
+    unsigned symndx_gnu;
+    unsigned maskwords_bm_gnu;
+    unsigned shift2_gnu;
+    const ElfW(Addr) * bloom_gnu;
+    const u32* buckets_gnu;
+    const u32* chain_zero_gnu;
+
+    int textrel;
+
     size_t tls_index;
     void* tls_init;
     size_t tls_init_size;
@@ -75,12 +88,16 @@ void ldso_die(void);
 int ldso_process_phdr(struct so_info* si, ElfW(Phdr) * phdr, int phnum);
 int ldso_process_dynamic(struct so_info* si);
 
+unsigned long ldso_elf_hash(const char* name);
+u32 ldso_gnu_hash(const char* name);
+
 ElfW(Sym) * ldso_find_sym(struct so_info* si, unsigned long symnum,
                           struct so_info** obj, int in_plt);
 ElfW(Sym) * ldso_find_plt_sym(struct so_info* si, unsigned long symnum,
                               struct so_info** obj);
 
 int ldso_relocate_objects(struct so_info* si);
+int ldso_relink_objects(struct so_info* si);
 
 int ldso_tls_allocate_offset(struct so_info* si);
 void ldso_tls_initial_allocation(struct vm_context* ctx);
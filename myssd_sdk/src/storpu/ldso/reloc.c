@@ -147,6 +147,16 @@ int ldso_relocate_objects(struct so_info* si)
     return 0;
 }
 
+/* Link an object whose relocated image was copied from another context. Only
+ * the GOT entries that point to the context's own so_info need to be
+ * redone. */
+int ldso_relink_objects(struct so_info* si)
+{
+    if (si->pltgot) ldso_setup_pltgot(si);
+
+    return 0;
+}
+
 char* ldso_bind(struct so_info* si, ElfW(Word) reloff)
 {
     ElfW(Rela)* rel = (ElfW(Rela)*)((char*)si->pltrela + reloff);
@@ -22,14 +22,41 @@ static struct sym_def {
 
 #undef _SYM
 
+#define NR_EXPORTED_SYMBOLS \
+    (sizeof(exported_symbols) / sizeof(exported_symbols[0]) - 1)
+
+/* Hash table over the exported symbols, built once by ldso_init(). Entries
+ * hold the index of the symbol plus one so that zero terminates a chain. */
+#define EXPORT_NBUCKETS 128
+
+static unsigned short export_buckets[EXPORT_NBUCKETS];
+static unsigned short export_chains[NR_EXPORTED_SYMBOLS];
+static u32 export_hashes[NR_EXPORTED_SYMBOLS];
+
 static struct so_info si_self;
 
-static ElfW(Sym) * ldso_lookup_exported_symbol(const char* name)
+void ldso_init(void)
+{
+    unsigned int i, bucket;
+
+    for (i = 0; i < NR_EXPORTED_SYMBOLS; i++) {
+        export_hashes[i] = ldso_gnu_hash(exported_symbols[i].name);
+
+        bucket = export_hashes[i] & (EXPORT_NBUCKETS - 1);
+        export_chains[i] = export_buckets[bucket];
+        export_buckets[bucket] = i + 1;
+    }
+}
+
+static ElfW(Sym) * ldso_lookup_exported_symbol(const char* name, u32 hash)
 {
-    struct sym_def* sym;
+    unsigned int i;
 
-    for (sym = exported_symbols; sym->name; sym++) {
-        if (!strcmp(sym->name, name)) return &sym->sym;
+    for (i = export_buckets[hash & (EXPORT_NBUCKETS - 1)]; i != 0;
+         i = export_chains[i - 1]) {
+        if (export_hashes[i - 1] == hash &&
+            !strcmp(exported_symbols[i - 1].name, name))
+            return &exported_symbols[i - 1].sym;
     }
 
     return NULL;
@@ -53,35 +80,87 @@ unsigned long ldso_elf_hash(const char* name)
     return h;
 }
 
-ElfW(Sym) * ldso_lookup_symbol_obj(const char* name, unsigned long hash,
-                                   struct so_info* si, int in_plt)
+u32 ldso_gnu_hash(const char* name)
 {
+    const unsigned char* p = (const unsigned char*)name;
+    u32 h = 5381;
+    unsigned char c;
+
+    for (; (c = *p) != '\0'; p++)
+        h = h * 33 + c;
+
+    return h;
+}
+
+static int ldso_match_sym(const char* name, ElfW(Sym) * sym,
+                          struct so_info* si, int in_plt)
+{
+    if (strcmp(name, si->strtab + sym->st_name)) return FALSE;
+
+    if (sym->st_shndx == SHN_UNDEF &&
+        (in_plt || sym->st_value == 0 ||
+         ELFW(ST_TYPE)(sym->st_info) != STT_FUNC))
+        return FALSE;
+
+    return TRUE;
+}
+
+static ElfW(Sym) * ldso_lookup_symbol_gnu(const char* name, u32 hash,
+                                          struct so_info* si, int in_plt)
+{
+    const u32* hashval;
+    ElfW(Addr) bloom_word;
+    unsigned int h1, h2;
     unsigned long symnum;
 
+    /* Reject most missing symbols with the bloom filter before touching the
+     * buckets. */
+    bloom_word = si->bloom_gnu[(hash / ELF_WORD_BITS) & si->maskwords_bm_gnu];
+    h1 = hash & (ELF_WORD_BITS - 1);
+    h2 = (hash >> si->shift2_gnu) & (ELF_WORD_BITS - 1);
+    if (((bloom_word >> h1) & (bloom_word >> h2) & 1) == 0) return NULL;
+
+    symnum = si->buckets_gnu[hash % si->nbuckets_gnu];
+    if (symnum == 0) return NULL;
+
+    hashval = &si->chain_zero_gnu[symnum];
+    do {
+        if (((*hashval ^ hash) >> 1) == 0) {
+            ElfW(Sym)* sym = si->symtab + (hashval - si->chain_zero_gnu);
+
+            if (ldso_match_sym(name, sym, si, in_plt)) return sym;
+        }
+    } while ((*hashval++ & 1) == 0);
+
+    return NULL;
+}
+
+ElfW(Sym) * ldso_lookup_symbol_obj(const char* name, u32 hash_gnu,
+                                   struct so_info* si, int in_plt)
+{
+    unsigned long symnum, hash;
+
+    if (si->nbuckets_gnu)
+        return ldso_lookup_symbol_gnu(name, hash_gnu, si, in_plt);
+
     if (!si->nbuckets) {
         return NULL;
     }
 
+    hash = ldso_elf_hash(name);
+
     for (symnum = si->buckets[hash % si->nbuckets]; symnum != 0;
          symnum = si->chains[symnum]) {
 
         ElfW(Sym)* sym = si->symtab + symnum;
-        char* str = si->strtab + sym->st_name;
-
-        if (strcmp(name, str)) continue;
-
-        if (sym->st_shndx == SHN_UNDEF &&
-            (in_plt || sym->st_value == 0 ||
-             ELFW(ST_TYPE)(sym->st_info) != STT_FUNC))
-            continue;
 
-        return sym;
+        if (ldso_match_sym(name, sym, si, in_plt)) return sym;
     }
 
     return NULL;
 }
 
-static ElfW(Sym) * ldso_lookup_symbol(const char* name, unsigned long hash,
+static ElfW(Sym) * ldso_lookup_symbol(const char* name, u32 hash,
                                       struct so_info* so, struct so_info** obj,
                                       int in_plt)
 {
@@ -96,7 +175,7 @@ static ElfW(Sym) * ldso_lookup_symbol(const char* name, unsigned long hash,
     }
 
     if (!def || ELFW(ST_BIND)(def->st_info) == STB_WEAK) {
-        sym = ldso_lookup_exported_symbol(name);
+        sym = ldso_lookup_exported_symbol(name, hash);
 
         if (sym) {
             def = sym;
@@ -122,7 +201,7 @@ ElfW(Sym) * ldso_find_sym(struct so_info* si, unsigned long symnum,
     char* name = si->strtab + sym->st_name;
 
     if (ELFW(ST_BIND)(sym->st_info) != STB_LOCAL) {
-        unsigned long hash = ldso_elf_hash(name);
+        u32 hash = ldso_gnu_hash(name);
         def = ldso_lookup_symbol(name, hash, si, &def_obj, in_plt);
     } else {
         def = sym;
@@ -8,10 +8,14 @@
 #include <intr.h>
 #include <barrier.h>
 #include <utils.h>
+#include <timer.h>
 
 #include <storpu/vm.h>
 #include <storpu/thread.h>
+#include <storpu/thread_pool.h>
 #include <storpu/cpu_stop.h>
+#include <storpu/aio.h>
+#include <storpu/result_ring.h>
 
 static LLIST_HEAD(avail_queue);
 static LLIST_HEAD(used_queue);
@@ -33,6 +37,8 @@ struct llist_node* dequeue_storpu_completions(void)
 void enqueue_storpu_completion(struct storpu_task* resp)
 {
     llist_add(&resp->llist, &used_queue);
+    /* Completions are sent to the FTL from the StorPU CPU. */
+    if (cpuid != STORPU_CPU_ID) smp_send_reschedule(STORPU_CPU_ID);
 }
 
 static inline void send_storpu_completion(void)
@@ -69,26 +75,81 @@ static int process_delete_context(struct storpu_task* req)
     ctx = vm_find_get_context(req->delete_context.cid);
     if (!ctx) return ESRCH;
 
+    thread_pool_destroy(ctx);
+    result_ring_destroy_context(ctx);
+    aio_destroy_context(ctx);
     vm_delete_context(ctx);
     vm_put_context(ctx);
 
     return 0;
 }
 
+static int process_register_ring(struct storpu_task* req)
+{
+    struct vm_context* ctx;
+    int r;
+
+    Xil_AssertNonvoid(req->type == SPU_TYPE_REGISTER_RING);
+
+    ctx = vm_find_get_context(req->result_ring.cid);
+    if (!ctx) return ESRCH;
+
+    r = result_ring_register(ctx, req->result_ring.host_addr,
+                             req->result_ring.size, &req->result_ring.ring_id);
+
+    vm_put_context(ctx);
+    return r;
+}
+
+static int process_unregister_ring(struct storpu_task* req)
+{
+    struct vm_context* ctx;
+    int r;
+
+    Xil_AssertNonvoid(req->type == SPU_TYPE_UNREGISTER_RING);
+
+    ctx = vm_find_get_context(req->result_ring.cid);
+    if (!ctx) return ESRCH;
+
+    r = result_ring_unregister(ctx, req->result_ring.ring_id);
+
+    vm_put_context(ctx);
+    return r;
+}
+
+/* Dependencies may only refer to earlier entries. */
+static int check_invoke_batch(struct storpu_task* req)
+{
+    struct storpu_invoke_desc* desc;
+    unsigned int i;
+
+    for (i = 0; i < req->invoke.nr_descs; i++) {
+        desc = &req->invoke.descs[i];
+
+        if ((desc->flags & STORPU_INVOKE_ARG_RESULT) && desc->dep >= i)
+            return EINVAL;
+    }
+
+    return 0;
+}
+
 static int process_invoke_function(struct storpu_task* req)
 {
     struct vm_context* ctx;
-    struct thread* thread;
-    int r = 0;
+    int r;
+
+    Xil_AssertNonvoid(req->type == SPU_TYPE_INVOKE ||
+                      req->type == SPU_TYPE_INVOKE_BATCH);
 
-    Xil_AssertNonvoid(req->type == SPU_TYPE_INVOKE);
+    if (req->type == SPU_TYPE_INVOKE_BATCH) {
+        r = check_invoke_batch(req);
+        if (r) return r;
+    }
 
     ctx = vm_find_get_context(req->invoke.cid);
     if (!ctx) return EINVAL;
 
-    thread = thread_create(ctx, (void*)req, NULL,
-                           ctx->load_base + req->invoke.entry, req->invoke.arg);
-    if (!thread) r = ENOMEM;
+    r = thread_pool_submit(ctx, req);
 
     vm_put_context(ctx);
     return r;
@@ -108,7 +169,9 @@ static void process_request_queue(void)
     llist_for_each_entry_safe(req, req_next, entry, llist)
     {
         if (req->type == SPU_TYPE_CREATE_CONTEXT ||
-            req->type == SPU_TYPE_DELETE_CONTEXT) {
+            req->type == SPU_TYPE_DELETE_CONTEXT ||
+            req->type == SPU_TYPE_REGISTER_RING ||
+            req->type == SPU_TYPE_UNREGISTER_RING) {
             if (prev) {
                 prev->next = &req_next->llist;
             } else {
@@ -122,6 +185,12 @@ static void process_request_queue(void)
             case SPU_TYPE_DELETE_CONTEXT:
                 req->retval = process_delete_context(req);
                 break;
+            case SPU_TYPE_REGISTER_RING:
+                req->retval = process_register_ring(req);
+                break;
+            case SPU_TYPE_UNREGISTER_RING:
+                req->retval = process_unregister_ring(req);
+                break;
             }
 
             enqueue_storpu_completion(req);
@@ -135,7 +204,8 @@ static void process_request_queue(void)
     prev = NULL;
     llist_for_each_entry_safe(req, req_next, entry, llist)
     {
-        if (req->type == SPU_TYPE_INVOKE) {
+        if (req->type == SPU_TYPE_INVOKE ||
+            req->type == SPU_TYPE_INVOKE_BATCH) {
             if (prev) {
                 prev->next = &req_next->llist;
             } else {
@@ -148,7 +218,8 @@ static void process_request_queue(void)
                 req->retval = r;
                 enqueue_storpu_completion(req);
             }
-            /* If there is no error then reply to FTL when the thread exits. */
+            /* If there is no error then reply to FTL when the invocation
+             * returns. */
         } else {
             prev = &req->llist;
         }
@@ -161,6 +232,13 @@ void enqueue_storpu_ftl_task(struct storpu_ftl_task* task)
     if (cpuid != FTL_CPU_ID) smp_send_reschedule(FTL_CPU_ID);
 }
 
+void enqueue_storpu_ftl_tasks(struct storpu_ftl_task* first,
+                              struct storpu_ftl_task* last)
+{
+    llist_add_batch(&first->llist, &last->llist, &ftl_avail_queue);
+    if (cpuid != FTL_CPU_ID) smp_send_reschedule(FTL_CPU_ID);
+}
+
 struct storpu_ftl_task* dequeue_storpu_ftl_task(void)
 {
     struct llist_node* entry = llist_del_first(&ftl_avail_queue);
@@ -176,16 +254,18 @@ void enqueue_storpu_ftl_completion(struct storpu_ftl_task* task)
 void handle_storpu_ftl_completion(void)
 {
     struct llist_node* entry;
-    struct storpu_task* task;
+    struct storpu_ftl_task *task, *tmp;
 
     entry = llist_del_all(get_cpulocal_var_ptr(ftl_used_queue));
     if (!entry) return;
 
-    llist_for_each_entry(task, entry, llist)
+    llist_for_each_entry_safe(task, tmp, entry, llist)
     {
         struct thread* thread = (struct thread*)task->opaque;
 
-        if (thread) {
+        if (task->complete) {
+            task->complete(task);
+        } else if (thread) {
             wake_up_thread(thread);
         }
     }
@@ -196,6 +276,8 @@ void smp_bsp_main(void)
     vm_init();
     thread_init();
     sched_init();
+    aio_init();
+    result_ring_init();
 
     smp_init();
 }
@@ -209,6 +291,8 @@ void finish_bsp_booting(void)
 
     intr_setup_cpu();
     ipi_setup_cpu();
+    /* Ticks wake the loop up to retire idle pool workers. */
+    timer_setup();
 
     sevl();
 
@@ -219,6 +303,8 @@ void finish_bsp_booting(void)
         process_request_queue();
         send_storpu_completion();
 
+        thread_pool_reap_idle();
+
         handle_storpu_ftl_completion();
 
         schedule();
@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <string.h>
+
+#include <types.h>
+#include <const.h>
+#include <utils.h>
+#include <list.h>
+#include <kref.h>
+#include <idr.h>
+#include <slab.h>
+#include <memalloc.h>
+#include <page.h>
+#include <storpu/file.h>
+#include <storpu/result_ring.h>
+#include <storpu/thread.h>
+#include <storpu/vm.h>
+
+/* Result rings stream the output of StorPU functions to the host without a
+ * command per batch. The host registers a ring in its memory with a context
+ * and polls the producer offset in the ring header. Appended records are
+ * staged in device memory and written to the ring in one transfer, after
+ * which the producer offset is published with a second one. The staged
+ * records always map to a contiguous range of the data area so a record that
+ * does not fit before the end of the data area is preceded by a pad record
+ * and the stage is flushed at the wrap point. */
+
+#define RESULT_RING_STAGE_SIZE (64UL << 10)
+
+struct result_ring {
+    spu_result_ring_t id;
+    struct kref kref;
+    struct vm_context* vm_context;
+    struct list_head list;
+
+    mutex_t lock;
+    int closed;
+
+    unsigned long host_addr;
+    size_t size;
+
+    /* Published producer offset and the last consumer offset read back from
+     * the host. */
+    u64 head;
+    u64 tail;
+
+    /* Producer offset including the staged records. */
+    u64 stage_head;
+    void* stage;
+    size_t stage_size;
+    size_t stage_len;
+
+    /* Bounce buffer for the ring offsets, right after the stage. */
+    u64* index_buf;
+};
+
+static struct idr ring_idr;
+static DEF_LIST(ring_list);
+static spinlock_t ring_idr_lock;
+
+void result_ring_init(void)
+{
+    spinlock_init(&ring_idr_lock);
+    idr_init(&ring_idr);
+}
+
+static inline size_t ring_stage_alloc_size(struct result_ring* ring)
+{
+    return ring->stage_size + ARCH_PG_SIZE;
+}
+
+static void release_ring(struct kref* kref)
+{
+    struct result_ring* ring = list_entry(kref, struct result_ring, kref);
+
+    free_mem(__pa(ring->stage), ring_stage_alloc_size(ring));
+    SLABFREE(ring);
+}
+
+static inline void ring_put(struct result_ring* ring)
+{
+    kref_put(&ring->kref, release_ring);
+}
+
+static struct result_ring* ring_find_get(spu_result_ring_t id)
+{
+    struct result_ring* ring;
+
+    spin_lock(&ring_idr_lock);
+
+    ring = (struct result_ring*)idr_find(&ring_idr, (unsigned long)id);
+    if (ring && ring->vm_context == current_thread->vm_context) {
+        kref_get(&ring->kref);
+    } else {
+        ring = NULL;
+    }
+
+    spin_unlock(&ring_idr_lock);
+
+    return ring;
+}
+
+static int ring_write_head(struct result_ring* ring, u64 head)
+{
+    ssize_t n;
+
+    *ring->index_buf = head;
+    n = file_readwrite_phys(
+        FD_HOST_MEM, __pa(ring->index_buf), sizeof(u64),
+        ring->host_addr + offsetof(struct spu_result_ring_header, head), TRUE);
+
+    return n < 0 ? -n : 0;
+}
+
+static int ring_read_tail(struct result_ring* ring)
+{
+    ssize_t n;
+    u64 tail;
+
+    n = file_readwrite_phys(
+        FD_HOST_MEM, __pa(ring->index_buf), sizeof(u64),
+        ring->host_addr + offsetof(struct spu_result_ring_header, tail), FALSE);
+    if (n < 0) return -n;
+
+    tail = *ring->index_buf;
+    if (tail < ring->tail || tail > ring->head) return EIO;
+
+    ring->tail = tail;
+    return 0;
+}
+
+/* Must be called with ring->lock held. */
+static int ring_flush(struct result_ring* ring)
+{
+    unsigned long offset;
+    ssize_t n;
+    int r;
+
+    if (!ring->stage_len) return 0;
+
+    offset = ring->host_addr + SPU_RESULT_RING_DATA_OFFSET +
+             (ring->head & (ring->size - 1));
+
+    /* The records must land before the host sees the new producer offset. */
+    n = file_readwrite_phys(FD_HOST_MEM, __pa(ring->stage), ring->stage_len,
+                            offset, TRUE);
+    if (n < 0) return -n;
+
+    r = ring_write_head(ring, ring->stage_head);
+    if (r) return r;
+
+    ring->head = ring->stage_head;
+    ring->stage_len = 0;
+
+    return 0;
+}
+
+static inline int ring_has_space(struct result_ring* ring, size_t bytes)
+{
+    return ring->stage_head + bytes - ring->tail <= ring->size;
+}
+
+/* Wait until the host has consumed enough of the ring to stage bytes more.
+ * Must be called with ring->lock held. */
+static int ring_reserve(struct result_ring* ring, size_t bytes)
+{
+    int r;
+
+    while (!ring_has_space(ring, bytes)) {
+        /* Publish what is staged so that the host can make progress. */
+        r = ring_flush(ring);
+        if (r) return r;
+
+        r = ring_read_tail(ring);
+        if (r) return r;
+
+        if (!ring_has_space(ring, bytes)) schedule();
+    }
+
+    return 0;
+}
+
+/* Must be called with ring->lock held. */
+static int ring_stage_record(struct result_ring* ring, size_t rec_size,
+                             size_t span, u32 len, u32 flags, const void* buf)
+{
+    struct spu_result_record* rec;
+    int r;
+
+    if (ring->stage_len + rec_size > ring->stage_size) {
+        r = ring_flush(ring);
+        if (r) return r;
+    }
+
+    r = ring_reserve(ring, span);
+    if (r) return r;
+
+    rec = ring->stage + ring->stage_len;
+    rec->len = len;
+    rec->flags = flags;
+    if (len) memcpy(rec + 1, buf, len);
+
+    ring->stage_len += rec_size;
+    ring->stage_head += span;
+
+    return 0;
+}
+
+/* Must be called with ring->lock held. */
+static int ring_append(struct result_ring* ring, const void* buf, size_t len,
+                       u32 flags)
+{
+    size_t rec_size = roundup(sizeof(struct spu_result_record) + len,
+                              SPU_RESULT_RECORD_ALIGN);
+    size_t offset, pad;
+    int r;
+
+    if (rec_size > ring->stage_size) return EMSGSIZE;
+
+    offset = ring->stage_head & (ring->size - 1);
+    if (offset + rec_size > ring->size) {
+        /* Pad to the end of the data area and flush at the wrap point. */
+        pad = ring->size - offset;
+
+        r = ring_stage_record(ring, sizeof(struct spu_result_record), pad,
+                              pad - sizeof(struct spu_result_record),
+                              SPU_RESULT_PAD, NULL);
+        if (r) return r;
+
+        r = ring_flush(ring);
+        if (r) return r;
+    }
+
+    return ring_stage_record(ring, rec_size, rec_size, len, flags, buf);
+}
+
+int result_ring_register(struct vm_context* ctx, unsigned long host_addr,
+                         size_t size, spu_result_ring_t* ringp)
+{
+    struct result_ring* ring;
+    int id;
+
+    if (size < SPU_RESULT_RING_MIN_SIZE || size > SPU_RESULT_RING_MAX_SIZE ||
+        (size & (size - 1)))
+        return EINVAL;
+
+    if (host_addr & (SPU_RESULT_RECORD_ALIGN - 1)) return EINVAL;
+
+    SLABALLOC(ring);
+    if (!ring) return ENOMEM;
+
+    memset(ring, 0, sizeof(*ring));
+
+    ring->stage_size = min(size, RESULT_RING_STAGE_SIZE);
+    ring->stage = alloc_vmpages(ring_stage_alloc_size(ring) >> ARCH_PG_SHIFT,
+                                ZONE_PS_DDR);
+    if (!ring->stage) {
+        SLABFREE(ring);
+        return ENOMEM;
+    }
+    ring->index_buf = ring->stage + ring->stage_size;
+
+    kref_init(&ring->kref);
+    mutex_init(&ring->lock, NULL);
+    ring->vm_context = ctx;
+    ring->host_addr = host_addr;
+    ring->size = size;
+
+    /* The host resets the ring header before registering it. */
+    ring->head = ring->tail = ring->stage_head = 0;
+
+    spin_lock(&ring_idr_lock);
+    id = idr_alloc(&ring_idr, ring, 1, 0);
+    if (id >= 0) list_add(&ring->list, &ring_list);
+    spin_unlock(&ring_idr_lock);
+
+    if (id < 0) {
+        ring_put(ring);
+        return ENOMEM;
+    }
+
+    ring->id = id;
+    *ringp = ring->id;
+
+    return 0;
+}
+
+int result_ring_unregister(struct vm_context* ctx, spu_result_ring_t ring_id)
+{
+    struct result_ring* ring;
+
+    spin_lock(&ring_idr_lock);
+
+    ring = (struct result_ring*)idr_find(&ring_idr, (unsigned long)ring_id);
+    if (ring && ring->vm_context == ctx) {
+        idr_remove(&ring_idr, (unsigned long)ring_id);
+        list_del(&ring->list);
+    } else {
+        ring = NULL;
+    }
+
+    spin_unlock(&ring_idr_lock);
+
+    if (!ring) return EINVAL;
+
+    /* Threads still appending hold their own references. */
+    ring_put(ring);
+
+    return 0;
+}
+
+void result_ring_destroy_context(struct vm_context* ctx)
+{
+    struct result_ring *ring, *tmp;
+    struct list_head dead;
+
+    INIT_LIST_HEAD(&dead);
+
+    spin_lock(&ring_idr_lock);
+
+    list_for_each_entry_safe(ring, tmp, &ring_list, list)
+    {
+        if (ring->vm_context != ctx) continue;
+
+        idr_remove(&ring_idr, (unsigned long)ring->id);
+        list_del(&ring->list);
+        list_add(&ring->list, &dead);
+    }
+
+    spin_unlock(&ring_idr_lock);
+
+    list_for_each_entry_safe(ring, tmp, &dead, list)
+    {
+        list_del(&ring->list);
+        ring_put(ring);
+    }
+}
+
+int sys_result_ring_append(spu_result_ring_t ring_id, const void* buf,
+                           size_t len)
+{
+    struct result_ring* ring;
+    int r;
+
+    ring = ring_find_get(ring_id);
+    if (!ring) return EINVAL;
+
+    mutex_lock(&ring->lock);
+    r = ring->closed ? EPIPE : ring_append(ring, buf, len, 0);
+    mutex_unlock(&ring->lock);
+
+    ring_put(ring);
+
+    return r;
+}
+
+int sys_result_ring_flush(spu_result_ring_t ring_id)
+{
+    struct result_ring* ring;
+    int r;
+
+    ring = ring_find_get(ring_id);
+    if (!ring) return EINVAL;
+
+    mutex_lock(&ring->lock);
+    r = ring_flush(ring);
+    mutex_unlock(&ring->lock);
+
+    ring_put(ring);
+
+    return r;
+}
+
+int sys_result_ring_close(spu_result_ring_t ring_id)
+{
+    struct result_ring* ring;
+    int r;
+
+    ring = ring_find_get(ring_id);
+    if (!ring) return EINVAL;
+
+    mutex_lock(&ring->lock);
+
+    if (ring->closed) {
+        r = EPIPE;
+    } else {
+        r = ring_append(ring, NULL, 0, SPU_RESULT_EOS);
+        if (!r) r = ring_flush(ring);
+        if (!r) ring->closed = TRUE;
+    }
+
+    mutex_unlock(&ring->lock);
+
+    ring_put(ring);
+
+    return r;
+}
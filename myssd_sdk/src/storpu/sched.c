@@ -11,15 +11,32 @@
 #include <storpu/cpu_stop.h>
 #include <storpu/completion.h>
 #include <smp.h>
+#include <timer.h>
 #include <utils.h>
 
+/* Work stealing between the CPUs in STORPU_SCHED_CPU_MASK. A CPU that runs
+ * out of application threads pulls a queued one from the busiest run queue,
+ * and every SCHED_BALANCE_INTERVAL_US it also pulls one if another run queue
+ * is at least SCHED_IMBALANCE_THRESHOLD threads deeper. Only application
+ * threads that are not running, have no pending affinity change and are
+ * allowed on the stealing CPU are moved. */
+#define SCHED_BALANCE_INTERVAL_US 1000
+#define SCHED_IMBALANCE_THRESHOLD 2
+
 struct rq {
     unsigned int cpu;
 
     spinlock_t lock;
     struct list_head queue;
+
+    /* Queued application threads, including the running one. */
+    unsigned int nr_app;
+    u64 last_balance;
 };
 
+/* CPUs that have no application thread to run. */
+static unsigned long idle_cpus;
+
 static DEFINE_CPULOCAL(struct rq, run_queue);
 static DEFINE_CPULOCAL(struct thread*, prev_thread);
 
@@ -30,6 +47,8 @@ static void rq_init(struct rq* rq, unsigned int cpu)
     rq->cpu = cpu;
     spinlock_init(&rq->lock);
     INIT_LIST_HEAD(&rq->queue);
+    rq->nr_app = 0;
+    rq->last_balance = 0;
 }
 
 static inline void rq_lock(struct rq* rq) { spin_lock(&rq->lock); }
@@ -45,14 +64,22 @@ void sched_init(void)
     }
 }
 
+static inline int is_app_thread(struct thread* thread)
+{
+    /* Main, idle and stopper threads have no VM context. */
+    return thread->vm_context != NULL;
+}
+
 static inline void enqueue_thread(struct rq* rq, struct thread* thread)
 {
     list_add_tail(&thread->queue, &rq->queue);
+    if (is_app_thread(thread)) rq->nr_app++;
 }
 
 static inline void dequeue_thread(struct rq* rq, struct thread* thread)
 {
     list_del(&thread->queue);
+    if (is_app_thread(thread)) rq->nr_app--;
 }
 
 static inline void activate_thread(struct rq* rq, struct thread* thread)
@@ -178,6 +205,120 @@ static struct thread* pick_next_thread(struct rq* rq)
     return next;
 }
 
+static inline unsigned int rq_nr_app(struct rq* rq)
+{
+    return __atomic_load_n(&rq->nr_app, __ATOMIC_RELAXED);
+}
+
+static inline int can_steal_thread(struct thread* thread, unsigned int cpu)
+{
+    return is_app_thread(thread) && thread_on_rq_queued(thread) &&
+           !__atomic_load_n(&thread->on_cpu, __ATOMIC_RELAXED) &&
+           !thread->migration_pending && thread->cpus_ptr &&
+           cpumask_test_cpu(thread->cpus_ptr, cpu);
+}
+
+/* Move one stealable thread from the busiest run queue with at least
+ * min_nr_app application threads to this_rq. Must be called with
+ * this_rq->lock held. Other run queues are only trylocked so that two CPUs
+ * stealing from each other cannot deadlock. */
+static struct thread* steal_thread(struct rq* this_rq, unsigned int min_nr_app)
+{
+    struct rq *rq, *busiest = NULL;
+    struct thread *thread, *stolen = NULL;
+    unsigned int max_nr_app = min_nr_app - 1;
+    int cpu;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu == this_rq->cpu || !(STORPU_SCHED_CPU_MASK & (1UL << cpu)))
+            continue;
+
+        rq = get_cpu_var_ptr(cpu, run_queue);
+        if (rq_nr_app(rq) > max_nr_app) {
+            max_nr_app = rq_nr_app(rq);
+            busiest = rq;
+        }
+    }
+
+    if (!busiest || !spin_trylock(&busiest->lock)) return NULL;
+
+    /* The least recently run thread is at the head. */
+    list_for_each_entry(thread, &busiest->queue, queue)
+    {
+        if (can_steal_thread(thread, this_rq->cpu)) {
+            stolen = thread;
+            break;
+        }
+    }
+
+    if (stolen) {
+        /* Both run queues are locked so the thread stays queued. */
+        dequeue_thread(busiest, stolen);
+        __set_thread_cpu(stolen, this_rq->cpu);
+        enqueue_thread(this_rq, stolen);
+    }
+
+    rq_unlock(busiest);
+
+    return stolen;
+}
+
+static struct thread* balance_rq(struct rq* rq, struct thread* next)
+{
+    struct thread* stolen = NULL;
+    u64 now;
+
+    if (!(STORPU_SCHED_CPU_MASK & (1UL << rq->cpu))) return next;
+
+    if (!rq->nr_app) {
+        stolen = steal_thread(rq, 1);
+    } else {
+        now = timer_get_cycles();
+
+        if (timer_cycles_to_ns(now - rq->last_balance) >=
+            SCHED_BALANCE_INTERVAL_US * (NSEC_PER_SEC / USEC_PER_SEC)) {
+            rq->last_balance = now;
+            stolen = steal_thread(rq, rq->nr_app + SCHED_IMBALANCE_THRESHOLD);
+        }
+    }
+
+    /* Run a thread stolen by an idle CPU right away. */
+    if (stolen && (!next || !is_app_thread(next))) next = stolen;
+
+    if (rq->nr_app)
+        __atomic_and_fetch(&idle_cpus, ~(1UL << rq->cpu), __ATOMIC_RELAXED);
+    else
+        __atomic_or_fetch(&idle_cpus, 1UL << rq->cpu, __ATOMIC_RELAXED);
+
+    return next;
+}
+
+/* Kick an idle CPU that can run the thread if it has to wait on its own run
+ * queue. The idle CPU steals it in schedule(). */
+static void kick_idle_cpu(struct rq* rq, struct thread* thread)
+{
+    unsigned long mask;
+    int cpu;
+
+    if (!is_app_thread(thread) || rq->nr_app < 2 || !thread->cpus_ptr)
+        return;
+
+    mask = __atomic_load_n(&idle_cpus, __ATOMIC_RELAXED) &
+           STORPU_SCHED_CPU_MASK & ~(1UL << rq->cpu);
+
+    for (cpu = 0; mask && cpu < NR_CPUS; cpu++) {
+        if (!(mask & (1UL << cpu))) continue;
+
+        if (cpumask_test_cpu(thread->cpus_ptr, cpu) &&
+            cpumask_test_cpu(cpu_online_mask, cpu)) {
+            /* Only kick it once. */
+            __atomic_and_fetch(&idle_cpus, ~(1UL << cpu), __ATOMIC_RELAXED);
+            if (cpu != cpuid) smp_send_reschedule(cpu);
+            return;
+        }
+    }
+}
+
 void schedule(void)
 {
     struct thread *prev, *next;
@@ -194,6 +335,7 @@ void schedule(void)
     if (prev_state != THREAD_RUNNING) deactivate_thread(rq, prev, TRUE);
 
     next = pick_next_thread(rq);
+    next = balance_rq(rq, next);
     if (!next) {
         next = idle;
     }
@@ -231,6 +373,7 @@ void wake_up_new_thread(struct thread* thread)
     rq = __thread_rq_lock(thread, &flags);
 
     activate_thread(rq, thread);
+    kick_idle_cpu(rq, thread);
 
     thread_rq_unlock(rq, thread, flags);
 }
@@ -259,6 +402,7 @@ static void ttwu_queue(struct thread* thread, int cpu)
     activate_thread(rq, thread);
 
     resched_curr(rq);
+    kick_idle_cpu(rq, thread);
     __atomic_store_n(&thread->state, THREAD_RUNNING, __ATOMIC_RELAXED);
     rq_unlock(rq);
 }
@@ -340,6 +484,7 @@ static struct rq* move_queued_thread(struct rq* rq, struct thread* thread,
     rq_lock(rq);
     activate_thread(rq, thread);
     resched_curr(rq);
+    kick_idle_cpu(rq, thread);
 
     return rq;
 }
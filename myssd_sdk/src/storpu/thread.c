@@ -13,6 +13,7 @@
 #include <utils.h>
 #include <storpu.h>
 #include <storpu/rwlock.h>
+#include <storpu/thread_pool.h>
 
 #define MAX_FREE_THREAD 128
 
@@ -305,6 +306,21 @@ static void thread_stop(struct thread* thread)
     }
 }
 
+/* Let the library release its per-thread state while the thread can still run
+ * user code. Only done when the thread exits normally. A thread killed by a
+ * fault may hold library locks or have corrupted its state. Not repeated if
+ * the hook itself exits. */
+static void thread_run_exit_hook(void)
+{
+    struct thread* thread = current_thread;
+    struct vm_context* ctx = thread->vm_context;
+
+    if (ctx && ctx->thread_exit_hook && !thread->exit_hook_called) {
+        thread->exit_hook_called = TRUE;
+        ctx->thread_exit_hook();
+    }
+}
+
 void thread_exit(unsigned long result)
 {
     struct thread* thread = current_thread;
@@ -313,7 +329,9 @@ void thread_exit(unsigned long result)
         return;
     }
 
-    if (thread->task) {
+    if (thread->pool_worker) thread_pool_worker_exiting(thread);
+
+    if (thread->task || thread->pool_worker) {
         thread->result = result;
         thread->state = THREAD_REAPABLE;
     } else {
@@ -359,14 +377,20 @@ void thread_reap(struct thread* thread)
 
     Xil_AssertVoid(thread->state == THREAD_REAPABLE);
     Xil_AssertVoid(thread != current_thread);
-    Xil_AssertVoid(thread->task);
+    Xil_AssertVoid(thread->task || thread->pool_worker);
 
     task = (struct storpu_task*)thread->task;
 
-    task->retval = 0;
-    task->invoke.result = thread->result;
+    if (task) {
+        task->retval = 0;
+        /* A batch keeps the number of entries that completed. */
+        if (task->type != SPU_TYPE_INVOKE_BATCH)
+            task->invoke.result = thread->result;
 
-    enqueue_storpu_completion(task);
+        enqueue_storpu_completion(task);
+    }
+
+    if (thread->pool_worker) thread_pool_worker_exit(thread);
 
     thread_stop(thread);
 }
@@ -379,6 +403,8 @@ static void thread_trampoline(void)
     schedule_tail();
 
     result = (thread->proc)(thread->arg);
+
+    thread_run_exit_hook();
     thread_exit(result);
 }
 
@@ -423,4 +449,10 @@ int sys_sched_setaffinity(thread_id_t tid, size_t cpusetsize,
     return sched_setaffinity(thread, &newmask);
 }
 
-void sys_thread_exit(unsigned long result) { thread_exit(result); }
+int sys_sched_getcpu(void) { return cpuid; }
+
+void sys_thread_exit(unsigned long result)
+{
+    thread_run_exit_hook();
+    thread_exit(result);
+}
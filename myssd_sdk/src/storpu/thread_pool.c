@@ -0,0 +1,439 @@
+#include <errno.h>
+
+#include <config.h>
+#include <types.h>
+#include <const.h>
+#include <utils.h>
+#include <list.h>
+#include <llist.h>
+#include <kref.h>
+#include <slab.h>
+#include <smp.h>
+#include <cpumask.h>
+#include <timer.h>
+#include <storpu.h>
+#include <storpu/thread.h>
+#include <storpu/thread_pool.h>
+#include <storpu/vm.h>
+
+/* Persistent worker threads for StorPU invocations. Each context has a pool
+ * of workers so that an invocation costs a handoff instead of a thread
+ * lifecycle. Idle workers are kept on a LIFO list and the next invocation is
+ * handed to the most recently idle one. Invocations that find no idle worker
+ * spawn a new one until the pool reaches STORPU_POOL_MAX_THREADS and are
+ * queued after that. Workers idle for longer than STORPU_POOL_IDLE_TIMEOUT_MS
+ * are retired down to STORPU_POOL_MIN_THREADS when another worker goes idle,
+ * on submission and periodically from the StorPU main loop. */
+
+struct thread_pool {
+    struct kref kref;
+    struct vm_context* vm_context;
+    struct list_head list;
+
+    mutex_t lock;
+    int dying;
+
+    /* Idle workers, most recently idle first. */
+    struct list_head idle_workers;
+    unsigned int nr_idle;
+    /* Workers that are neither retiring nor exiting. */
+    unsigned int nr_threads;
+
+    /* Invocations waiting for a worker. */
+    struct llist_node* pending_head;
+    struct llist_node* pending_tail;
+
+    unsigned int next_cpu;
+};
+
+struct pool_worker {
+    struct list_head list;
+    struct thread_pool* pool;
+
+    cond_t wakeup;
+    struct storpu_task* task;
+    int retire;
+    u64 idle_since;
+};
+
+/* Pools of live contexts. Pools are only created and destroyed by the StorPU
+ * main thread so the list needs no lock. */
+static DEF_LIST(pool_list);
+static u64 last_reap;
+
+static void release_pool(struct kref* kref)
+{
+    struct thread_pool* pool = list_entry(kref, struct thread_pool, kref);
+
+    SLABFREE(pool);
+}
+
+static inline void pool_put(struct thread_pool* pool)
+{
+    kref_put(&pool->kref, release_pool);
+}
+
+static void pool_reap_idle(struct thread_pool* pool);
+
+static inline unsigned int pool_nr_threads(struct thread_pool* pool)
+{
+    return __atomic_load_n(&pool->nr_threads, __ATOMIC_RELAXED);
+}
+
+/* Spread the workers over the online CPUs in STORPU_POOL_CPU_MASK. */
+static unsigned int pool_next_cpu(struct thread_pool* pool)
+{
+    int i;
+
+    for (i = 0; i < NR_CPUS; i++) {
+        unsigned int cpu = pool->next_cpu;
+
+        pool->next_cpu = (pool->next_cpu + 1) % NR_CPUS;
+
+        if ((STORPU_POOL_CPU_MASK & (1UL << cpu)) &&
+            cpumask_test_cpu(cpu_online_mask, cpu))
+            return cpu;
+    }
+
+    return STORPU_CPU_ID;
+}
+
+/* Must be called with pool->lock held. */
+static void pool_enqueue(struct thread_pool* pool, struct storpu_task* req)
+{
+    req->llist.next = NULL;
+
+    if (pool->pending_tail)
+        pool->pending_tail->next = &req->llist;
+    else
+        pool->pending_head = &req->llist;
+
+    pool->pending_tail = &req->llist;
+}
+
+/* Must be called with pool->lock held. */
+static struct storpu_task* pool_dequeue(struct thread_pool* pool)
+{
+    struct llist_node* node = pool->pending_head;
+
+    if (!node) return NULL;
+
+    pool->pending_head = node->next;
+    if (!pool->pending_head) pool->pending_tail = NULL;
+
+    return llist_entry(node, struct storpu_task, llist);
+}
+
+static inline unsigned long call_function(struct thread* thread,
+                                          unsigned long entry,
+                                          unsigned long arg)
+{
+    unsigned long (*proc)(unsigned long);
+
+    proc = thread->vm_context->load_base + entry;
+
+    return proc(arg);
+}
+
+/* Entries run in order on this worker so a dependency has always completed
+ * before the entry that uses its result. The result of the batch is updated
+ * as entries complete so that thread_reap() can report it if one faults. */
+static void run_batch(struct thread* thread, struct storpu_task* req)
+{
+    struct storpu_invoke_desc* descs = req->invoke.descs;
+    unsigned long arg;
+    unsigned int i;
+
+    for (i = 0; i < req->invoke.nr_descs; i++) {
+        req->invoke.result = i;
+
+        arg = descs[i].arg;
+        if (descs[i].flags & STORPU_INVOKE_ARG_RESULT)
+            arg += descs[descs[i].dep].result;
+
+        descs[i].result = call_function(thread, descs[i].entry, arg);
+
+        if ((descs[i].flags & STORPU_INVOKE_STOP_IF_ZERO) &&
+            !descs[i].result) {
+            i++;
+            break;
+        }
+    }
+
+    req->invoke.result = i;
+}
+
+static void run_invocation(struct storpu_task* req)
+{
+    struct thread* thread = current_thread;
+
+    /* If the function faults or exits, the worker dies and thread_reap()
+     * completes the invocation instead. */
+    thread->task = req;
+    if (req->type == SPU_TYPE_INVOKE_BATCH)
+        run_batch(thread, req);
+    else
+        req->invoke.result =
+            call_function(thread, req->invoke.entry, req->invoke.arg);
+    thread->task = NULL;
+
+    req->retval = 0;
+    enqueue_storpu_completion(req);
+}
+
+static unsigned long pool_worker_main(unsigned long arg)
+{
+    struct pool_worker* worker = (struct pool_worker*)arg;
+    struct thread_pool* pool = worker->pool;
+    struct storpu_task* req;
+
+    mutex_lock(&pool->lock);
+
+    for (;;) {
+        req = worker->task;
+        worker->task = NULL;
+        if (!req) req = pool_dequeue(pool);
+
+        if (req) {
+            mutex_unlock(&pool->lock);
+            run_invocation(req);
+            mutex_lock(&pool->lock);
+            continue;
+        }
+
+        if (worker->retire || pool->dying) break;
+
+        pool_reap_idle(pool);
+
+        worker->idle_since = timer_get_cycles();
+        list_add(&worker->list, &pool->idle_workers);
+        pool->nr_idle++;
+
+        while (!worker->task && !worker->retire)
+            cond_wait(&worker->wakeup, &pool->lock);
+    }
+
+    mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/* Must be called with pool->lock held. */
+static int pool_spawn_worker(struct thread_pool* pool, struct storpu_task* req)
+{
+    struct pool_worker* worker;
+    struct thread* thread;
+    unsigned int cpu = pool_next_cpu(pool);
+
+    SLABALLOC(worker);
+    if (!worker) return ENOMEM;
+
+    worker->pool = pool;
+    worker->task = req;
+    worker->retire = FALSE;
+    cond_init(&worker->wakeup, NULL);
+
+    thread = thread_create_on_cpu(pool->vm_context, NULL, NULL, cpu,
+                                  pool_worker_main, (unsigned long)worker);
+    if (!thread) {
+        SLABFREE(worker);
+        return ENOMEM;
+    }
+
+    /* The worker cannot exit before we drop the pool lock. */
+    thread->pool_worker = worker;
+    kref_get(&pool->kref);
+    __atomic_add_fetch(&pool->nr_threads, 1, __ATOMIC_RELAXED);
+
+    if (cpu != cpuid) smp_send_reschedule(cpu);
+
+    return 0;
+}
+
+/* Must be called with pool->lock held. */
+static void pool_retire_worker(struct thread_pool* pool,
+                               struct pool_worker* worker)
+{
+    list_del(&worker->list);
+    pool->nr_idle--;
+
+    worker->retire = TRUE;
+    __atomic_sub_fetch(&pool->nr_threads, 1, __ATOMIC_RELAXED);
+
+    cond_signal(&worker->wakeup);
+}
+
+/* Must be called with pool->lock held. */
+static void pool_reap_idle(struct thread_pool* pool)
+{
+    struct pool_worker* worker;
+    u64 now = timer_get_cycles();
+
+    while (!list_empty(&pool->idle_workers) &&
+           pool_nr_threads(pool) > STORPU_POOL_MIN_THREADS) {
+        /* The least recently idle worker is at the tail. */
+        worker = list_entry(pool->idle_workers.prev, struct pool_worker, list);
+
+        if (timer_cycles_to_ns(now - worker->idle_since) <
+            STORPU_POOL_IDLE_TIMEOUT_MS * (NSEC_PER_SEC / MSEC_PER_SEC))
+            break;
+
+        pool_retire_worker(pool, worker);
+    }
+}
+
+static struct thread_pool* pool_create(struct vm_context* ctx)
+{
+    struct thread_pool* pool;
+
+    SLABALLOC(pool);
+    if (!pool) return NULL;
+
+    kref_init(&pool->kref);
+    pool->vm_context = ctx;
+    mutex_init(&pool->lock, NULL);
+    pool->dying = FALSE;
+
+    INIT_LIST_HEAD(&pool->idle_workers);
+    pool->nr_idle = 0;
+    pool->nr_threads = 0;
+
+    pool->pending_head = pool->pending_tail = NULL;
+    pool->next_cpu = STORPU_CPU_ID;
+
+    ctx->pool = pool;
+    list_add(&pool->list, &pool_list);
+
+    return pool;
+}
+
+int thread_pool_submit(struct vm_context* ctx, struct storpu_task* req)
+{
+    struct thread_pool* pool = ctx->pool;
+    struct pool_worker* worker;
+    int r = 0;
+
+    if (!pool) {
+        pool = pool_create(ctx);
+        if (!pool) return ENOMEM;
+    }
+
+    mutex_lock(&pool->lock);
+
+    pool_reap_idle(pool);
+
+    if (!list_empty(&pool->idle_workers)) {
+        worker = list_entry(pool->idle_workers.next, struct pool_worker, list);
+        list_del(&worker->list);
+        pool->nr_idle--;
+
+        worker->task = req;
+        cond_signal(&worker->wakeup);
+    } else if (pool_nr_threads(pool) < STORPU_POOL_MAX_THREADS) {
+        r = pool_spawn_worker(pool, req);
+
+        /* Fall back to the queue if some worker can pick it up later. */
+        if (r && pool_nr_threads(pool) > 0) {
+            pool_enqueue(pool, req);
+            r = 0;
+        }
+    } else {
+        pool_enqueue(pool, req);
+    }
+
+    mutex_unlock(&pool->lock);
+
+    return r;
+}
+
+void thread_pool_destroy(struct vm_context* ctx)
+{
+    struct thread_pool* pool = ctx->pool;
+    struct pool_worker *worker, *tmp;
+
+    if (!pool) return;
+
+    ctx->pool = NULL;
+    list_del(&pool->list);
+
+    /* Busy workers exit after the queued invocations are drained. */
+    mutex_lock(&pool->lock);
+    pool->dying = TRUE;
+
+    list_for_each_entry_safe(worker, tmp, &pool->idle_workers, list)
+    {
+        pool_retire_worker(pool, worker);
+    }
+    mutex_unlock(&pool->lock);
+
+    pool_put(pool);
+}
+
+/* Retire the idle workers of all pools. Called by the StorPU main thread so
+ * that workers are retired even if no invocation arrives. */
+void thread_pool_reap_idle(void)
+{
+    struct thread_pool* pool;
+    u64 now = timer_get_cycles();
+
+    if (timer_cycles_to_ns(now - last_reap) <
+        STORPU_POOL_IDLE_TIMEOUT_MS * (NSEC_PER_SEC / MSEC_PER_SEC) / 2)
+        return;
+
+    last_reap = now;
+
+    list_for_each_entry(pool, &pool_list, list)
+    {
+        mutex_lock(&pool->lock);
+        pool_reap_idle(pool);
+        mutex_unlock(&pool->lock);
+    }
+}
+
+/* Must be called with pool->lock held. */
+static void pool_fail_pending(struct thread_pool* pool, int err)
+{
+    struct storpu_task* req;
+
+    while ((req = pool_dequeue(pool)) != NULL) {
+        req->retval = err;
+        enqueue_storpu_completion(req);
+    }
+}
+
+/* Called by a worker from thread_exit(), either after it is retired or
+ * because the function it ran faulted or exited. Queued invocations would
+ * never run if the last worker dies, so a replacement is started or they are
+ * failed. */
+void thread_pool_worker_exiting(struct thread* thread)
+{
+    struct pool_worker* worker = thread->pool_worker;
+    struct thread_pool* pool = worker->pool;
+    int r = ESRCH;
+
+    mutex_lock(&pool->lock);
+
+    if (!worker->retire) {
+        worker->retire = TRUE;
+        __atomic_sub_fetch(&pool->nr_threads, 1, __ATOMIC_RELAXED);
+    }
+
+    if (pool->pending_head && pool_nr_threads(pool) == 0) {
+        if (!pool->dying) r = pool_spawn_worker(pool, NULL);
+        if (r) pool_fail_pending(pool, r);
+    }
+
+    mutex_unlock(&pool->lock);
+}
+
+/* Called from thread_reap() once a worker has exited. */
+void thread_pool_worker_exit(struct thread* thread)
+{
+    struct pool_worker* worker = thread->pool_worker;
+    struct thread_pool* pool = worker->pool;
+
+    thread->pool_worker = NULL;
+    SLABFREE(worker);
+
+    pool_put(pool);
+}
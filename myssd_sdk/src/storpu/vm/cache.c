@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <xil_assert.h>
 
 #include <types.h>
 #include <spinlock.h>
@@ -8,6 +9,9 @@
 #include <storpu/mutex.h>
 #include <slab.h>
 #include <utils.h>
+#include <memalloc.h>
+#include <mmu.h>
+#include <storpu.h>
 
 #include "region.h"
 #include "cache.h"
@@ -21,6 +25,14 @@ struct address_space {
 static struct address_space file_caches[FILE_MAX];
 static struct address_space host_mem_cache;
 
+/* CLOCK list of all cached pages. */
+static spinlock_t lru_lock;
+static struct list_head lru_list;
+static unsigned long lru_nr_entries;
+static unsigned long lru_nr_pages; /* in ARCH_PG_SIZE pages */
+
+spinlock_t page_cache_map_lock;
+
 static struct address_space* cache_get_by_fd(int fd)
 {
     if (fd == FD_HOST_MEM) return &host_mem_cache;
@@ -89,39 +101,68 @@ void page_cache_init(void)
 {
     int i;
 
+    spinlock_init(&lru_lock);
+    INIT_LIST_HEAD(&lru_list);
+    lru_nr_entries = 0;
+    lru_nr_pages = 0;
+
+    spinlock_init(&page_cache_map_lock);
+
     cache_init_one(&host_mem_cache);
 
     for (i = 0; i < FILE_MAX; i++)
         cache_init_one(&file_caches[i]);
 }
 
+static void put_cached_page(struct address_space* cache,
+                            struct cached_page* cp)
+{
+    spin_lock(&cache->tree_lock);
+    cp->refcount--;
+    spin_unlock(&cache->tree_lock);
+}
+
 struct cached_page* find_cached_page(int fd, unsigned long offset, int flags)
 {
     struct address_space* cache = cache_get_by_fd(fd);
     struct cached_page* cp;
+    int r;
 
     if (!cache) return NULL;
 
     spin_lock(&cache->tree_lock);
     cp = cache_lookup(cache, offset);
+    if (cp) {
+        cp->referenced = 1;
+        /* Keep the page from being reclaimed until we hold its lock. */
+        if (flags & (FCP_LOCK | FCP_TRYLOCK)) cp->refcount++;
+    }
     spin_unlock(&cache->tree_lock);
 
     if (!cp) return NULL;
 
-    if (flags & FCP_LOCK) {
+    if (!(flags & (FCP_LOCK | FCP_TRYLOCK))) return cp;
+
+    if (flags & FCP_TRYLOCK) {
+        r = mutex_trylock(&cp->lock);
+    } else {
         lock_cached_page(cp);
+        r = 0;
+    }
+    put_cached_page(cache, cp);
 
-        if (cp->offset != offset) {
-            unlock_cached_page(cp);
-            return NULL;
-        }
+    if (r != 0) return NULL;
+
+    if (cp->offset != offset) {
+        unlock_cached_page(cp);
+        return NULL;
     }
 
     return cp;
 }
 
-int page_cache_add(int fd, unsigned long offset, phys_addr_t phys, int hugepage,
-                   struct cached_page** cpp)
+int page_cache_add(struct vm_context* ctx, int fd, unsigned long offset,
+                   phys_addr_t phys, int hugepage, struct cached_page** cpp)
 {
     struct address_space* cache = cache_get_by_fd(fd);
     struct cached_page *cp, *cp_exist;
@@ -147,6 +188,7 @@ int page_cache_add(int fd, unsigned long offset, phys_addr_t phys, int hugepage,
     cp->fd = fd;
     cp->offset = offset;
     if (hugepage) cp->flags |= CPF_HUGEPAGE;
+    cp->cid = ctx->cid;
     mutex_init(&cp->lock, NULL);
 
     for (i = 0; i < nr_pages; i++) {
@@ -171,6 +213,14 @@ int page_cache_add(int fd, unsigned long offset, phys_addr_t phys, int hugepage,
 
     spin_unlock(&cache->tree_lock);
 
+    spin_lock(&lru_lock);
+    list_add_tail(&cp->lru, &lru_list);
+    lru_nr_entries++;
+    lru_nr_pages += nr_pages;
+    spin_unlock(&lru_lock);
+
+    __sync_add_and_fetch(&ctx->cache_pages, nr_pages);
+
     if (cpp) *cpp = cp;
 
     return 0;
@@ -186,6 +236,24 @@ free_pages:
     return r;
 }
 
+/* Write a dirty cached page back to its file. Called with the page locked. */
+static int writeback_cached_page(struct cached_page* cp)
+{
+    ssize_t err;
+    int i;
+
+    err = spu_write(cp->fd, __va(cp->pages[0]->phys_addr),
+                    thp_nr_pages(cp) << ARCH_PG_SHIFT, cp->offset);
+    if (err < 0) return -err;
+
+    for (i = 0; i < thp_nr_pages(cp); i++) {
+        cp->pages[i]->flags &= ~PFF_DIRTY;
+    }
+    cp->flags &= ~CPF_DIRTY;
+
+    return 0;
+}
+
 static unsigned int pagevec_lookup_range(struct address_space* cache,
                                          unsigned long* offset,
                                          unsigned long end, unsigned int tag,
@@ -209,6 +277,7 @@ static unsigned int pagevec_lookup_range(struct address_space* cache,
         if (cp->offset >= end) break;
         if (!(cp->flags & tag)) continue;
 
+        cp->refcount++;
         pages[ret] = cp;
         if (++ret == nr_pages) {
             *offset = cp->offset + (thp_nr_pages(cp) << ARCH_PG_SHIFT);
@@ -232,7 +301,6 @@ int page_cache_sync_range(int fd, unsigned long start, unsigned long end)
     struct cached_page* pvec[16];
     unsigned long index = start;
     int i, nr_pages;
-    ssize_t err;
     int r = 0;
 
     if (!cache->nrpages) return 0;
@@ -247,6 +315,7 @@ int page_cache_sync_range(int fd, unsigned long start, unsigned long end)
             int j;
 
             lock_cached_page(cp);
+            put_cached_page(cache, cp);
 
             /* Page changed */
             if (!(cp->flags & CPF_DIRTY) ||
@@ -255,26 +324,318 @@ int page_cache_sync_range(int fd, unsigned long start, unsigned long end)
                 continue;
             }
 
-            err = spu_write(fd, __va(cp->pages[0]->phys_addr),
-                            thp_nr_pages(cp) << ARCH_PG_SHIFT, cp->offset);
+            r = writeback_cached_page(cp);
+            unlock_cached_page(cp);
 
-            if (err < 0) {
-                unlock_cached_page(cp);
-                r = -err;
+            if (r) {
+                /* Drop the references to the rest of the batch. */
+                for (j = i + 1; j < nr_pages; j++)
+                    put_cached_page(cache, pvec[j]);
                 goto out;
             }
+        }
 
-            for (j = 0; j < thp_nr_pages(cp); j++) {
-                cp->pages[j]->flags &= ~PFF_DIRTY;
+        schedule();
+    }
+
+out:
+    return r;
+}
+
+/* Replace all mappings of a cached page in ctx with empty pages so that the
+ * next access faults it in again. Called with the cached page locked and the
+ * mmap lock of ctx held. */
+static int unmap_cached_page_ctx(struct cached_page* cp, struct vm_context* ctx)
+{
+    int i, r = 0;
+
+    spin_lock(&page_cache_map_lock);
+
+    for (i = 0; i < thp_nr_pages(cp) && !r; i++) {
+        struct page* page = cp->pages[i];
+        struct phys_region *pr, *tmp;
+
+        list_for_each_entry_safe(pr, tmp, &page->regions, page_link)
+        {
+            struct vm_region* vr = pr->parent;
+            struct page* new_page;
+
+            if (vr->ctx != ctx) continue;
+
+            if (!(new_page = page_new(PHYS_NONE))) {
+                r = ENOMEM;
+                break;
             }
-            cp->flags &= ~CPF_DIRTY;
 
-            unlock_cached_page(cp);
+            /* Writes after the last msync() do not fault again so we cannot
+             * tell whether a writable shared mapping dirtied the page. */
+            if ((vr->flags & (RF_MAP_SHARED | RF_WRITE)) ==
+                (RF_MAP_SHARED | RF_WRITE))
+                cp->flags |= CPF_DIRTY;
+
+            spin_lock(&ctx->pgd_lock);
+            pgd_unmap_memory(&ctx->pgd, vr->vir_addr + pr->offset,
+                             ARCH_PG_SIZE);
+            spin_unlock(&ctx->pgd_lock);
+
+            list_del(&pr->page_link);
+            page->refcount--;
+            page_link(pr, new_page, pr->offset, vr);
+        }
+    }
+
+    spin_unlock(&page_cache_map_lock);
+
+    return r;
+}
+
+static struct vm_context* get_mapping_context(struct cached_page* cp, int* busy)
+{
+    struct vm_context* ctx = NULL;
+    int i;
+
+    *busy = FALSE;
+
+    spin_lock(&page_cache_map_lock);
+
+    for (i = 0; i < thp_nr_pages(cp); i++) {
+        struct phys_region* pr;
+
+        if (list_empty(&cp->pages[i]->regions)) continue;
+
+        pr = list_first_entry(&cp->pages[i]->regions, struct phys_region,
+                              page_link);
+        ctx = pr->parent->ctx;
+
+        /* The context is being torn down and its mappings will be gone
+         * soon. */
+        if (!kref_get_unless_zero(&ctx->kref)) {
+            ctx = NULL;
+            *busy = TRUE;
+        }
+        break;
+    }
+
+    spin_unlock(&page_cache_map_lock);
+
+    return ctx;
+}
+
+static void uncharge_context(unsigned int cid, unsigned long nr_pages)
+{
+    struct vm_context* ctx = vm_find_get_context(cid);
+
+    if (!ctx) return;
+
+    __sync_sub_and_fetch(&ctx->cache_pages, nr_pages);
+    vm_put_context(ctx);
+}
+
+/* Unmap, write back and free a cached page. Called with the page locked and,
+ * if cur_ctx is not NULL, the mmap lock of cur_ctx held. On success the page
+ * is gone; otherwise it is still in the cache and locked. */
+static int evict_cached_page(struct cached_page* cp, struct vm_context* cur_ctx)
+{
+    struct address_space* cache = cache_get_by_fd(cp->fd);
+    struct vm_context* ctx;
+    phys_addr_t phys;
+    int nr_pages = thp_nr_pages(cp);
+    int i, busy, r;
+
+    /* Faults lock the mmap lock before the cached page so only try the mmap
+     * locks of other contexts here. */
+    while ((ctx = get_mapping_context(cp, &busy)) != NULL) {
+        if (ctx != cur_ctx && mutex_trylock(&ctx->mmap_lock) != 0) {
+            vm_put_context(ctx);
+            return EBUSY;
         }
 
+        r = unmap_cached_page_ctx(cp, ctx);
+
+        if (ctx != cur_ctx) mutex_unlock(&ctx->mmap_lock);
+        vm_put_context(ctx);
+
+        if (r) return r;
+    }
+
+    if (busy) return EBUSY;
+
+    flush_tlb_all();
+
+    if (cp->flags & CPF_DIRTY) {
+        r = writeback_cached_page(cp);
+        if (r) return r;
+    }
+
+    spin_lock(&cache->tree_lock);
+    if (cp->refcount) {
+        spin_unlock(&cache->tree_lock);
+        return EBUSY;
+    }
+    avl_erase(&cp->avl, &cache->pages);
+    cache->nrpages--;
+    spin_unlock(&cache->tree_lock);
+
+    spin_lock(&lru_lock);
+    list_del(&cp->lru);
+    lru_nr_entries--;
+    lru_nr_pages -= nr_pages;
+    spin_unlock(&lru_lock);
+
+    unlock_cached_page(cp);
+
+    uncharge_context(cp->cid, nr_pages);
+
+    phys = cp->pages[0]->phys_addr;
+    for (i = 0; i < nr_pages; i++) {
+        Xil_AssertNonvoid(list_empty(&cp->pages[i]->regions));
+        cp->pages[i]->phys_addr = PHYS_NONE;
+        page_free(cp->pages[i]);
+    }
+    free_mem(phys, nr_pages << ARCH_PG_SHIFT);
+
+    SLABFREE(cp);
+
+    return 0;
+}
+
+/* Make room for nr_pages more pages charged to ctx with CLOCK replacement.
+ * Called with the mmap lock of ctx held. The limits are soft: if nothing can
+ * be reclaimed, e.g., because all pages are in use, the cache grows anyway
+ * until the allocation fails. */
+void page_cache_reclaim(struct vm_context* ctx, unsigned long nr_pages)
+{
+    unsigned long budget;
+    int ctx_only;
+
+    spin_lock(&lru_lock);
+    /* Give every page a second chance but stop after two full sweeps. */
+    budget = lru_nr_entries * 2;
+    spin_unlock(&lru_lock);
+
+    while (budget-- > 0) {
+        struct cached_page* cp;
+
+        ctx_only = ctx->cache_pages + nr_pages > ctx->cache_limit;
+        if (!ctx_only && lru_nr_pages + nr_pages <= PAGE_CACHE_MAX_PAGES)
+            break;
+
+        spin_lock(&lru_lock);
+
+        if (list_empty(&lru_list)) {
+            spin_unlock(&lru_lock);
+            break;
+        }
+
+        cp = list_first_entry(&lru_list, struct cached_page, lru);
+        list_del(&cp->lru);
+        list_add_tail(&cp->lru, &lru_list);
+
+        /* Over the per-context limit, only take pages from ourselves. */
+        if (ctx_only && cp->cid != ctx->cid) {
+            spin_unlock(&lru_lock);
+            continue;
+        }
+
+        if (cp->referenced) {
+            cp->referenced = 0;
+            spin_unlock(&lru_lock);
+            continue;
+        }
+
+        if (mutex_trylock(&cp->lock) != 0) {
+            spin_unlock(&lru_lock);
+            continue;
+        }
+
+        spin_unlock(&lru_lock);
+
+        if (evict_cached_page(cp, ctx) != 0) unlock_cached_page(cp);
+
         schedule();
     }
+}
 
-out:
-    return r;
+struct readahead_req {
+    struct storpu_ftl_task task;
+    struct cached_page* cp;
+};
+
+static void readahead_complete(struct storpu_ftl_task* task)
+{
+    struct readahead_req* req = list_entry(task, struct readahead_req, task);
+    struct cached_page* cp = req->cp;
+
+    if (task->retval) cp->flags |= CPF_IOERROR;
+
+    /* Wake up the faults waiting for the page. */
+    unlock_cached_page(cp);
+
+    SLABFREE(req);
+}
+
+/* Start asynchronous reads for the flash pages in [start, start + nr_pages *
+ * FLASH_PG_SIZE) that are not cached yet. The pages are added to the cache
+ * locked and unlocked when the reads complete. The first page read at or
+ * after mark gets CPF_READAHEAD so that accessing it triggers the next
+ * readahead. Returns the number of reads started. */
+int page_cache_readahead(struct vm_context* ctx, int fd, unsigned long start,
+                         unsigned int nr_pages, unsigned long mark)
+{
+    struct storpu_ftl_task *first = NULL, *last = NULL;
+    struct cached_page* cp;
+    struct readahead_req* req;
+    size_t size = HP_NR_PAGES << ARCH_PG_SHIFT;
+    int marked = FALSE;
+    unsigned int i;
+    int nr_reads = 0;
+    int r;
+
+    page_cache_reclaim(ctx, nr_pages * HP_NR_PAGES);
+
+    for (i = 0; i < nr_pages; i++) {
+        unsigned long offset = start + i * size;
+        phys_addr_t buf_phys;
+
+        if (find_cached_page(fd, offset, 0)) continue;
+
+        buf_phys = alloc_pages(HP_NR_PAGES, ZONE_PS_DDR);
+        if (!buf_phys) break;
+
+        SLABALLOC(req);
+        if (!req) {
+            free_mem(buf_phys, size);
+            break;
+        }
+
+        r = page_cache_add(ctx, fd, offset, buf_phys, TRUE, &cp);
+        if (r != 0) {
+            SLABFREE(req);
+            free_mem(buf_phys, size);
+            if (r == EEXIST) continue;
+            break;
+        }
+
+        if (!marked && offset >= mark) {
+            cp->flags |= CPF_READAHEAD;
+            marked = TRUE;
+        }
+
+        req->cp = cp;
+        file_init_task_phys(&req->task, fd, buf_phys, size, offset, FALSE);
+        req->task.complete = readahead_complete;
+
+        if (last)
+            last->llist.next = &req->task.llist;
+        else
+            first = &req->task;
+        last = &req->task;
+
+        nr_reads++;
+    }
+
+    /* Let the FTL spread the whole window over the flash dies at once. */
+    if (first) enqueue_storpu_ftl_tasks(first, last);
+
+    return nr_reads;
 }
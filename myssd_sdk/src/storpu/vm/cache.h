@@ -4,25 +4,41 @@
 #include <const.h>
 #include <avl.h>
 #include <page.h>
+#include <spinlock.h>
+#include <storpu/vm.h>
 #include <storpu/mutex.h>
 
 #define HP_NR_PAGES 4
 
+/* Capacity of the page cache in ARCH_PG_SIZE pages. Each context can use at
+ * most PAGE_CACHE_CTX_MAX_PAGES of it so that one offload cannot push out the
+ * working set of all others. */
+#define PAGE_CACHE_MAX_PAGES     ((256UL << 20) >> ARCH_PG_SHIFT)
+#define PAGE_CACHE_CTX_MAX_PAGES (PAGE_CACHE_MAX_PAGES / 2)
+
 /* Cached page flags */
-#define CPF_HUGEPAGE BIT(0)
-#define CPF_DIRTY    BIT(1)
+#define CPF_HUGEPAGE  BIT(0)
+#define CPF_DIRTY     BIT(1)
+#define CPF_READAHEAD BIT(2) /* start the next readahead on access */
+#define CPF_IOERROR   BIT(3) /* readahead failed, contents are invalid */
 
 /* Find cached page flags */
-#define FCP_LOCK 1
+#define FCP_LOCK    1
+#define FCP_TRYLOCK 2
 
 struct cached_page {
     struct avl_node avl;
+    struct list_head lru;
     mutex_t lock;
 
     int fd;
     unsigned long offset;
     int flags;
 
+    unsigned int refcount; /* lookups in progress, protected by tree_lock */
+    int referenced;        /* accessed since the last CLOCK sweep */
+    unsigned int cid;      /* context charged for the page */
+
     struct page* pages[HP_NR_PAGES];
 };
 
@@ -58,12 +74,20 @@ static inline void mark_cached_page_dirty(struct page* page)
     cp->flags |= CPF_DIRTY;
 }
 
+/* Protects the mapping lists of pages in the page cache. */
+extern spinlock_t page_cache_map_lock;
+
 struct cached_page* find_cached_page(int fd, unsigned long offset, int flags);
-int page_cache_add(int fd, unsigned long offset, phys_addr_t phys, int hugepage,
-                   struct cached_page** cpp);
+int page_cache_add(struct vm_context* ctx, int fd, unsigned long offset,
+                   phys_addr_t phys, int hugepage, struct cached_page** cpp);
 
 int page_cache_sync_range(int fd, unsigned long start, unsigned long end);
 
+void page_cache_reclaim(struct vm_context* ctx, unsigned long nr_pages);
+
+int page_cache_readahead(struct vm_context* ctx, int fd, unsigned long start,
+                         unsigned int nr_pages, unsigned long mark);
+
 void page_cache_init(void);
 
 #endif
@@ -25,6 +25,8 @@ void vm_init(void)
     idr_init(&context_idr);
 
     page_cache_init();
+
+    ldso_init();
 }
 
 struct vm_context* vm_find_get_context(unsigned int cid)
@@ -89,6 +91,8 @@ struct vm_context* vm_create_context(void)
     spinlock_init(&ctx->pgd_lock);
     mutex_init(&ctx->mmap_lock, NULL);
 
+    ctx->cache_limit = PAGE_CACHE_CTX_MAX_PAGES;
+
     r = pgd_new(&ctx->pgd);
     if (r) goto out_free;
 
@@ -370,6 +374,18 @@ int sys_munmap(void* addr, size_t length)
     return vm_unmap(ctx, addr, length);
 }
 
+/* Library constructors run on the StorPU main thread, which has no context of
+ * its own, so the hook is set on the context being loaded. */
+int sys_thread_set_exit_hook(void (*hook)(void))
+{
+    struct vm_context* ctx = get_cpulocal_var(current_ctx);
+
+    if (!ctx) return EINVAL;
+
+    ctx->thread_exit_hook = hook;
+    return 0;
+}
+
 int sys_msync(void* addr, size_t len, int flags)
 {
     struct vm_context* ctx = get_cpulocal_var(current_ctx);
@@ -8,6 +8,8 @@
 
 #include <elf.h>
 
+#include "image_cache.h"
+
 /* #define ELF_DEBUG */
 
 #ifdef __LP64__
@@ -55,6 +57,9 @@ struct exec_info {
     void* phdr;
     unsigned int phnum;
     void* load_base;
+
+    struct exec_segment segments[IMAGE_MAX_SEGMENTS];
+    unsigned int nr_segments;
 };
 
 static int elf_check_header(Elf_Ehdr* elf_hdr)
@@ -75,6 +80,29 @@ static int elf_unpack(char* hdr, Elf_Ehdr** elf_hdr, Elf_Phdr** prog_hdr)
     return 0;
 }
 
+/* Size of the part of the file that is loaded into memory. */
+static size_t elf_load_size(char* hdr)
+{
+    Elf_Ehdr* elf_hdr;
+    Elf_Phdr* prog_hdr;
+    size_t size;
+    int i;
+
+    elf_unpack(hdr, &elf_hdr, &prog_hdr);
+
+    size = elf_hdr->e_phoff + elf_hdr->e_phnum * sizeof(Elf_Phdr);
+
+    for (i = 0; i < elf_hdr->e_phnum; i++) {
+        Elf_Phdr* phdr = &prog_hdr[i];
+
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) continue;
+
+        size = max(size, (size_t)(phdr->p_offset + phdr->p_filesz));
+    }
+
+    return size;
+}
+
 int vm_exec_elf(struct exec_info* execi)
 {
     Elf_Ehdr* elf_hdr;
@@ -191,6 +219,16 @@ int vm_exec_elf(struct exec_info* execi)
 static int do_allocmem(struct exec_info* execi, void* vaddr, size_t len,
                        unsigned int prot_flags)
 {
+    /* Remember the segments for the image cache. */
+    if (execi->nr_segments < IMAGE_MAX_SEGMENTS) {
+        struct exec_segment* seg = &execi->segments[execi->nr_segments];
+
+        seg->vaddr = (unsigned long)vaddr;
+        seg->len = len;
+        seg->prot_flags = prot_flags;
+    }
+    execi->nr_segments++;
+
     return vm_map(execi->ctx, vaddr, len, prot_flags | PROT_WRITE,
                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0, NULL);
 }
@@ -219,11 +257,38 @@ static int do_clearmem(struct exec_info* execi, void* vaddr, size_t len)
     return 0;
 }
 
+static int vm_exec_cached(struct vm_context* ctx, struct exec_image* image)
+{
+    int ret;
+
+    ret = image_cache_map(ctx, image, &ctx->load_base);
+    if (ret) return ret;
+
+    Xil_ICacheInvalidate();
+
+    ret = ldso_init_context(ctx, TRUE);
+    if (ret) return ret;
+
+    ldso_start_context(ctx);
+
+    return 0;
+}
+
 int vm_exec(struct vm_context* ctx, void* elf_base)
 {
     struct exec_info execi;
+    struct exec_image* image;
+    struct image_key key;
     int ret;
 
+    if ((ret = elf_check_header((Elf_Ehdr*)elf_base)) != 0) return ret;
+
+    /* Libraries loaded before are set up from their relocated images. */
+    image_cache_key(elf_base, elf_load_size(elf_base), &key);
+
+    image = image_cache_lookup(&key, elf_base);
+    if (image) return vm_exec_cached(ctx, image);
+
     memset(&execi, 0, sizeof(execi));
 
     execi.ctx = ctx;
@@ -250,5 +315,14 @@ int vm_exec(struct vm_context* ctx, void* elf_base)
 
     ctx->load_base = execi.load_base;
 
-    return ldso_init_context(ctx);
+    ret = ldso_init_context(ctx, FALSE);
+    if (ret) return ret;
+
+    if (ldso_can_share_image(ctx))
+        image_cache_add(ctx, &key, elf_base, execi.load_base, execi.segments,
+                        execi.nr_segments);
+
+    ldso_start_context(ctx);
+
+    return 0;
 }
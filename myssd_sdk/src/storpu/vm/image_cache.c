@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <string.h>
+
+#include <types.h>
+#include <const.h>
+#include <list.h>
+#include <slab.h>
+#include <memalloc.h>
+#include <page.h>
+#include <storpu/vm.h>
+
+#include "region.h"
+#include "image_cache.h"
+
+/* Relocated images of recently loaded libraries. All libraries are loaded at
+ * VM_USER_START so a relocated image is the same in every context except for
+ * the GOT entries that point to the context's so_info, which the loader redoes
+ * for each context. Segments that are not writable are never relocated
+ * (libraries with text relocations are not cached) so their pages are shared
+ * read-only by all contexts that load the library. Writable segments are
+ * copied after relocation, before the init functions run, and the copy is
+ * installed in each new context.
+ *
+ * Images are only added and mapped by the StorPU main thread while it creates
+ * contexts so the cache needs no lock. */
+
+struct image_segment {
+    unsigned long vaddr;
+    size_t len;
+    unsigned int prot_flags;
+
+    /* Pages of a read-only segment. The cache holds a reference to each page
+     * through its own phys_region. */
+    struct phys_region** prs;
+    /* Contents of a writable segment after relocation. */
+    void* data;
+};
+
+struct exec_image {
+    struct list_head list;
+    struct image_key key;
+    /* Copy of the loaded part of the ELF file. A hash match is only a hit if
+     * the library is identical. */
+    void* elf;
+    void* load_base;
+
+    unsigned int nr_segments;
+    struct image_segment segments[IMAGE_MAX_SEGMENTS];
+};
+
+static DEF_LIST(image_list); /* most recently used first */
+static unsigned int nr_images;
+
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME        0x100000001b3ULL
+
+void image_cache_key(const void* buf, size_t size, struct image_key* key)
+{
+    const u64* wp = buf;
+    const u8* bp;
+    u64 h = FNV64_OFFSET_BASIS;
+    size_t i;
+
+    /* FNV-1a over 64-bit words. Libraries are read from the scratchpad so
+     * hashing byte by byte would be much slower than loading them. */
+    for (i = 0; i < size / sizeof(u64); i++) {
+        h ^= wp[i];
+        h *= FNV64_PRIME;
+    }
+
+    for (bp = (const u8*)&wp[i]; bp < (const u8*)buf + size; bp++) {
+        h ^= *bp;
+        h *= FNV64_PRIME;
+    }
+
+    key->hash = h;
+    key->size = size;
+}
+
+static inline size_t image_elf_size(const struct exec_image* image)
+{
+    return roundup(image->key.size, ARCH_PG_SIZE);
+}
+
+static inline size_t segment_prs_size(const struct image_segment* seg)
+{
+    return roundup((seg->len >> ARCH_PG_SHIFT) * sizeof(struct phys_region*),
+                   ARCH_PG_SIZE);
+}
+
+static void image_free(struct exec_image* image)
+{
+    struct image_segment* seg;
+    struct phys_region* pr;
+    unsigned long i;
+
+    for (seg = image->segments; seg < image->segments + image->nr_segments;
+         seg++) {
+        if (seg->prs) {
+            for (i = 0; i < (seg->len >> ARCH_PG_SHIFT); i++) {
+                if (!(pr = seg->prs[i])) continue;
+
+                /* The page is freed once no context maps it either. */
+                page_unreference(NULL, pr, FALSE);
+                SLABFREE(pr);
+            }
+
+            free_mem(__pa(seg->prs), segment_prs_size(seg));
+        }
+
+        if (seg->data) free_mem(__pa(seg->data), seg->len);
+    }
+
+    if (image->elf) free_mem(__pa(image->elf), image_elf_size(image));
+
+    SLABFREE(image);
+}
+
+struct exec_image* image_cache_lookup(const struct image_key* key,
+                                      const void* buf)
+{
+    struct exec_image* image;
+
+    list_for_each_entry(image, &image_list, list)
+    {
+        if (image->key.hash == key->hash && image->key.size == key->size &&
+            !memcmp(image->elf, buf, key->size)) {
+            list_del(&image->list);
+            list_add(&image->list, &image_list);
+            return image;
+        }
+    }
+
+    return NULL;
+}
+
+static int map_shared_segment(struct vm_context* ctx,
+                              const struct image_segment* seg)
+{
+    struct vm_region* vr;
+    struct phys_region* pr;
+    unsigned long off;
+    int r = 0;
+
+    mutex_lock(&ctx->mmap_lock);
+
+    if (region_unmap_range(ctx, seg->vaddr, seg->len)) {
+        r = ENOMEM;
+        goto out;
+    }
+
+    vr = region_map(ctx, seg->vaddr, 0, seg->len,
+                    region_get_prot_bits(seg->prot_flags) | RF_ANON, 0,
+                    &anon_map_ops);
+    if (!vr) {
+        r = ENOMEM;
+        goto out;
+    }
+
+    for (off = 0; off < seg->len; off += ARCH_PG_SIZE) {
+        pr = page_reference(seg->prs[off >> ARCH_PG_SHIFT]->page, off, vr,
+                            &anon_map_ops);
+        if (!pr) {
+            r = ENOMEM;
+            break;
+        }
+
+        /* The page has more than one reference so it is mapped read-only. */
+        if ((r = region_write_map_page(ctx, vr, pr)) != 0) break;
+    }
+
+out:
+    mutex_unlock(&ctx->mmap_lock);
+
+    return r;
+}
+
+static int map_private_segment(struct vm_context* ctx,
+                               const struct image_segment* seg)
+{
+    int r;
+
+    r = vm_map(ctx, (void*)seg->vaddr, seg->len, seg->prot_flags | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0, NULL);
+    if (r) return r;
+
+    memcpy((void*)seg->vaddr, seg->data, seg->len);
+
+    return 0;
+}
+
+/* Install a cached image in ctx, which must be the current context. */
+int image_cache_map(struct vm_context* ctx, struct exec_image* image,
+                    void** load_base)
+{
+    struct image_segment* seg;
+    int r;
+
+    for (seg = image->segments; seg < image->segments + image->nr_segments;
+         seg++) {
+        if (seg->prs)
+            r = map_shared_segment(ctx, seg);
+        else
+            r = map_private_segment(ctx, seg);
+
+        if (r) return r;
+    }
+
+    *load_base = image->load_base;
+
+    return 0;
+}
+
+static int share_segment(struct vm_context* ctx, struct image_segment* seg)
+{
+    struct vm_region* vr;
+    struct phys_region *pr, *cpr;
+    unsigned long off;
+    int r = 0;
+
+    seg->prs = alloc_vmpages(segment_prs_size(seg) >> ARCH_PG_SHIFT,
+                             ZONE_PS_DDR);
+    if (!seg->prs) return ENOMEM;
+
+    memset(seg->prs, 0, segment_prs_size(seg));
+
+    mutex_lock(&ctx->mmap_lock);
+
+    /* The segment must still be mapped by exactly one region, i.e. it does
+     * not share pages with its neighbours. */
+    vr = region_lookup(ctx, seg->vaddr);
+    if (!vr || vr->vir_addr != seg->vaddr || vr->length != seg->len) {
+        r = EINVAL;
+        goto out;
+    }
+
+    for (off = 0; off < seg->len; off += ARCH_PG_SIZE) {
+        pr = phys_region_get(vr, off);
+        if (!pr || pr->page->phys_addr == PHYS_NONE) {
+            r = EINVAL;
+            goto out;
+        }
+
+        SLABALLOC(cpr);
+        if (!cpr) {
+            r = ENOMEM;
+            goto out;
+        }
+
+        memset(cpr, 0, sizeof(*cpr));
+        cpr->rops = &anon_map_ops;
+        page_link(cpr, pr->page, off, NULL);
+
+        seg->prs[off >> ARCH_PG_SHIFT] = cpr;
+    }
+
+    /* The segment was made writable only for loading. Now that its pages are
+     * shared, map them read-only in this context as well. */
+    vr->flags &= ~RF_WRITE;
+    r = region_write_map_range(ctx, vr, 0, vr->length);
+
+out:
+    mutex_unlock(&ctx->mmap_lock);
+
+    return r;
+}
+
+static int copy_segment(struct image_segment* seg)
+{
+    seg->data = alloc_vmpages(seg->len >> ARCH_PG_SHIFT, ZONE_PS_DDR);
+    if (!seg->data) return ENOMEM;
+
+    memcpy(seg->data, (void*)seg->vaddr, seg->len);
+
+    return 0;
+}
+
+/* Add the image that has just been loaded and relocated in ctx, which must be
+ * the current context. Failures are not reported because the context itself
+ * is already set up. */
+void image_cache_add(struct vm_context* ctx, const struct image_key* key,
+                     const void* buf, void* load_base,
+                     const struct exec_segment* segs, unsigned int nr_segments)
+{
+    struct exec_image* image;
+    struct image_segment* seg;
+    unsigned int i;
+    int r = 0;
+
+    if (nr_segments == 0 || nr_segments > IMAGE_MAX_SEGMENTS) return;
+
+    SLABALLOC(image);
+    if (!image) return;
+
+    memset(image, 0, sizeof(*image));
+    image->key = *key;
+    image->load_base = load_base;
+
+    image->elf = alloc_vmpages(image_elf_size(image) >> ARCH_PG_SHIFT,
+                               ZONE_PS_DDR);
+    if (!image->elf) {
+        SLABFREE(image);
+        return;
+    }
+
+    memcpy(image->elf, buf, key->size);
+
+    for (i = 0; i < nr_segments && !r; i++) {
+        seg = &image->segments[image->nr_segments++];
+        seg->vaddr = segs[i].vaddr;
+        seg->len = segs[i].len;
+        seg->prot_flags = segs[i].prot_flags;
+
+        if (seg->prot_flags & PROT_WRITE)
+            r = copy_segment(seg);
+        else
+            r = share_segment(ctx, seg);
+    }
+
+    if (r) {
+        image_free(image);
+        return;
+    }
+
+    list_add(&image->list, &image_list);
+
+    if (++nr_images > IMAGE_CACHE_MAX_IMAGES) {
+        image = list_entry(image_list.prev, struct exec_image, list);
+        list_del(&image->list);
+        nr_images--;
+
+        image_free(image);
+    }
+}
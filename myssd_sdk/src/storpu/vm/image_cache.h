@@ -0,0 +1,36 @@
+#ifndef _VM_IMAGE_CACHE_H_
+#define _VM_IMAGE_CACHE_H_
+
+#include <types.h>
+#include <storpu/vm.h>
+
+/* Number of relocated library images kept for new contexts. */
+#define IMAGE_CACHE_MAX_IMAGES 4
+
+/* Loadable segments of an image. Images with more segments are not cached. */
+#define IMAGE_MAX_SEGMENTS 8
+
+struct image_key {
+    u64 hash;
+    size_t size;
+};
+
+struct exec_segment {
+    unsigned long vaddr;
+    size_t len;
+    unsigned int prot_flags;
+};
+
+struct exec_image;
+
+void image_cache_key(const void* buf, size_t size, struct image_key* key);
+
+struct exec_image* image_cache_lookup(const struct image_key* key,
+                                      const void* buf);
+int image_cache_map(struct vm_context* ctx, struct exec_image* image,
+                    void** load_base);
+void image_cache_add(struct vm_context* ctx, const struct image_key* key,
+                     const void* buf, void* load_base,
+                     const struct exec_segment* segs, unsigned int nr_segments);
+
+#endif
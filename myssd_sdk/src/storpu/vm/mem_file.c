@@ -29,6 +29,97 @@ static inline void fault_dirty_shared_page(struct vm_region* vr,
     if (page->flags & PFF_INCACHE) mark_cached_page_dirty(page);
 }
 
+/* Readahead window sizes in flash pages. */
+#define RA_INIT_PAGES 4
+#define RA_MAX_PAGES  64
+
+/* Map cached pages in an aligned window around the faulting page. */
+#define FAULT_AROUND_BYTES (16 * ARCH_PG_SIZE)
+
+/* Called on a cache miss or when the readahead marker is reached with the
+ * mmap lock held. Grows the window for sequential accesses, shrinks it for
+ * random accesses or when pages read ahead were reclaimed before use, and
+ * starts the reads for the next window. */
+static void file_map_readahead(struct vm_context* ctx, struct vm_region* vr,
+                               unsigned long offset, int hit_marker)
+{
+    struct file_ra_state* ra = &vr->param.file.ra;
+    unsigned long max_size = RA_MAX_PAGES * FLASH_PG_SIZE;
+    unsigned long init_size = RA_INIT_PAGES * FLASH_PG_SIZE;
+
+    if (hit_marker) {
+        /* Stay ahead of the stream: the next window starts where the
+         * current one ends. */
+        ra->start += ra->size;
+        ra->size = min(ra->size * 2, max_size);
+    } else if (ra->size && offset >= ra->start &&
+               offset < ra->start + ra->size) {
+        /* Missed inside the window, i.e., the pages read ahead were
+         * reclaimed before use. Read less ahead. */
+        ra->start = offset + FLASH_PG_SIZE;
+        ra->size = max(ra->size / 2, init_size);
+    } else if (offset == ra->prev_offset + FLASH_PG_SIZE) {
+        ra->start = offset + FLASH_PG_SIZE;
+        ra->size = ra->size ? min(ra->size * 2, max_size) : init_size;
+    } else {
+        ra->size /= 2;
+        if (ra->size < init_size) ra->size = 0;
+        return;
+    }
+
+    /* Start the next window when half of this one is consumed. */
+    ra->async_start = ra->start + ra->size / 2;
+
+    page_cache_readahead(ctx, vr->param.file.fd, ra->start,
+                         ra->size / FLASH_PG_SIZE, ra->async_start);
+}
+
+/* Map the pages around the faulting one that are already in the cache
+ * without blocking so that a scan does not fault on every page. */
+static void file_map_fault_around(struct vm_context* ctx, struct vm_region* vr,
+                                  unsigned long fault_offset)
+{
+    int fd = vr->param.file.fd;
+    unsigned long start = rounddown(fault_offset, FAULT_AROUND_BYTES);
+    unsigned long end = min(start + FAULT_AROUND_BYTES, vr->length);
+    size_t allocsize = (fd != FD_HOST_MEM) ? FLASH_PG_SIZE : ARCH_PG_SIZE;
+    unsigned long off;
+
+    for (off = start; off < end; off += ARCH_PG_SIZE) {
+        unsigned long fd_offset = vr->param.file.offset + off;
+        struct phys_region* pr = phys_region_get(vr, off);
+        struct cached_page* cp;
+        struct page* page;
+
+        if (off == fault_offset) continue;
+        if (pr && pr->page->phys_addr != PHYS_NONE) continue;
+
+        cp = find_cached_page(fd, rounddown(fd_offset, allocsize),
+                              FCP_TRYLOCK);
+        if (!cp) continue;
+
+        /* Leave the readahead marker to be faulted on. */
+        if (cp->flags & (CPF_READAHEAD | CPF_IOERROR)) {
+            unlock_cached_page(cp);
+            continue;
+        }
+
+        page = find_subpage(cp, fd_offset);
+
+        if (pr) {
+            page_unreference(vr, pr, FALSE);
+            page_link(pr, page, off, vr);
+        } else if (!(pr = page_reference(page, off, vr, vr->rops))) {
+            unlock_cached_page(cp);
+            break;
+        }
+
+        unlock_cached_page(cp);
+
+        if (region_write_map_page(ctx, vr, pr) != 0) break;
+    }
+}
+
 static int file_map_page_fault(struct vm_context* ctx, struct vm_region* vr,
                                struct phys_region* pr, unsigned int flags)
 {
@@ -42,6 +133,7 @@ static int file_map_page_fault(struct vm_context* ctx, struct vm_region* vr,
     if (pr->page->phys_addr == PHYS_NONE) {
         struct cached_page* cp;
         int use_hugepage;
+        int async_readahead = FALSE;
         size_t allocsize;
         ssize_t nbytes;
         unsigned long fd_offset = vr->param.file.offset + pr->offset;
@@ -54,7 +146,10 @@ static int file_map_page_fault(struct vm_context* ctx, struct vm_region* vr,
         ref_offset = rounddown(fd_offset, allocsize);
 
     retry:
-        cp = find_cached_page(fd, ref_offset, FCP_LOCK);
+        /* Pages being read ahead stay locked until the read completes. */
+        cp = find_cached_page(fd, ref_offset,
+                              (flags & FAULT_FLAG_INTERRUPTIBLE) ? FCP_LOCK
+                                                                 : FCP_TRYLOCK);
 
         if (!cp) {
             phys_addr_t buf_phys;
@@ -62,6 +157,12 @@ static int file_map_page_fault(struct vm_context* ctx, struct vm_region* vr,
             /* Need to block now. */
             if (!(flags & FAULT_FLAG_INTERRUPTIBLE)) return EFAULT;
 
+            /* Get the reads of the window going before we block on this
+             * page. */
+            if (use_hugepage) file_map_readahead(ctx, vr, ref_offset, FALSE);
+
+            page_cache_reclaim(ctx, allocsize >> ARCH_PG_SHIFT);
+
             buf_phys = alloc_pages(allocsize >> ARCH_PG_SHIFT, ZONE_PS_DDR);
             if (!buf_phys) return ENOMEM;
 
@@ -71,12 +172,30 @@ static int file_map_page_fault(struct vm_context* ctx, struct vm_region* vr,
                 return EFAULT;
             }
 
-            r = page_cache_add(fd, ref_offset, buf_phys, use_hugepage, &cp);
+            r = page_cache_add(ctx, fd, ref_offset, buf_phys, use_hugepage,
+                               &cp);
             if (r != 0) {
                 free_mem(buf_phys, allocsize);
                 if (r == EEXIST) goto retry;
                 return r;
             }
+        } else {
+            if (cp->flags & CPF_IOERROR) {
+                /* Readahead failed. Try again synchronously. */
+                nbytes = spu_read(fd, __va(cp->pages[0]->phys_addr),
+                                  allocsize, ref_offset);
+                if (nbytes != allocsize) {
+                    unlock_cached_page(cp);
+                    return EFAULT;
+                }
+
+                cp->flags &= ~CPF_IOERROR;
+            }
+
+            if (cp->flags & CPF_READAHEAD) {
+                cp->flags &= ~CPF_READAHEAD;
+                async_readahead = TRUE;
+            }
         }
 
         /* Page must be in cache and locked by now. */
@@ -87,10 +206,17 @@ static int file_map_page_fault(struct vm_context* ctx, struct vm_region* vr,
 
         unlock_cached_page(cp);
 
+        if (async_readahead && (flags & FAULT_FLAG_INTERRUPTIBLE))
+            file_map_readahead(ctx, vr, ref_offset, TRUE);
+
+        vr->param.file.ra.prev_offset = ref_offset;
+
         if ((flags & FAULT_FLAG_WRITE) && (vr->flags & RF_MAP_SHARED)) {
             fault_dirty_shared_page(vr, pr, flags);
         }
 
+        file_map_fault_around(ctx, vr, pr->offset);
+
         return 0;
     }
 
@@ -194,5 +320,8 @@ int file_map_set_file(struct vm_context* ctx, struct vm_region* vr, int fd,
     vr->param.file.offset = offset;
     vr->param.file.inited = TRUE;
 
+    memset(&vr->param.file.ra, 0, sizeof(vr->param.file.ra));
+    vr->param.file.ra.prev_offset = (unsigned long)-1;
+
     return 0;
 }
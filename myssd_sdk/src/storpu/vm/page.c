@@ -9,6 +9,7 @@
 #include <utils.h>
 
 #include "region.h"
+#include "cache.h"
 
 struct page* page_new(phys_addr_t phys)
 {
@@ -37,11 +38,17 @@ void page_free(struct page* page)
 void page_link(struct phys_region* pr, struct page* page, unsigned long offset,
                struct vm_region* parent)
 {
+    int incache = page->flags & PFF_INCACHE;
+
     pr->offset = offset;
     pr->page = page;
     pr->parent = parent;
+
+    /* Cached pages can be unmapped from other contexts on reclaim. */
+    if (incache) spin_lock(&page_cache_map_lock);
     list_add(&pr->page_link, &page->regions);
     page->refcount++;
+    if (incache) spin_unlock(&page_cache_map_lock);
 }
 
 struct phys_region* page_reference(struct page* page, unsigned long offset,
@@ -64,14 +71,19 @@ struct phys_region* page_reference(struct page* page, unsigned long offset,
 void page_unreference(struct vm_region* vr, struct phys_region* pr, int remove)
 {
     struct page* page = pr->page;
+    int incache = page->flags & PFF_INCACHE;
     int retval;
 
+    if (incache) spin_lock(&page_cache_map_lock);
+
     Xil_AssertVoid(page->refcount > 0);
     page->refcount--;
 
     Xil_AssertVoid(!list_empty(&pr->page_link));
     list_del(&pr->page_link);
 
+    if (incache) spin_unlock(&page_cache_map_lock);
+
     if (page->refcount == 0) {
         Xil_AssertVoid(list_empty(&page->regions));
 
@@ -52,6 +52,14 @@ struct region_operations {
                           unsigned long end);
 };
 
+/* Readahead state of a file mapping. All offsets are in the file. */
+struct file_ra_state {
+    unsigned long start;       /* current window */
+    unsigned long size;        /* window size in bytes, 0 if disabled */
+    unsigned long async_start; /* marker where the next window is started */
+    unsigned long prev_offset; /* last faulted page */
+};
+
 struct vm_region {
     struct list_head list;
     struct avl_node avl;
@@ -72,6 +80,7 @@ struct vm_region {
             int fd;
             unsigned long offset;
             int inited;
+            struct file_ra_state ra;
         } file;
     } param;
 };
@@ -121,6 +130,8 @@ void region_avl_dec_iter(struct avl_iter* iter);
 
 struct vm_region* region_lookup(struct vm_context* ctx, unsigned long addr);
 
+int region_write_map_page(struct vm_context* ctx, struct vm_region* vr,
+                          struct phys_region* pr);
 int region_write_map_range(struct vm_context* ctx, struct vm_region* vr,
                            unsigned long start, unsigned long end);
 
@@ -46,6 +46,9 @@ struct worker_thread {
     int rq_error;
     int rc_error;
 
+    /* Tasks of the FIL batch in flight. */
+    int pending_fil_tasks;
+
     void* opaque;
 };
 
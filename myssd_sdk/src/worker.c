@@ -239,8 +239,15 @@ static void* worker_main(void* arg)
 
     if (self->tid < NR_WORKER_THREADS) {
         nvme_worker_main();
-    } else {
+    } else if (self->tid < NR_WORKER_THREADS + NR_FLUSHERS) {
         flusher_main(self->tid - NR_WORKER_THREADS);
+    } else if (self->tid < NR_WORKER_THREADS + NR_FLUSHERS + NR_GC_THREADS) {
+        gc_main(self->tid - NR_WORKER_THREADS - NR_FLUSHERS);
+    } else if (self->tid < NR_FTL_THREADS - 1) {
+        readahead_main(self->tid - NR_WORKER_THREADS - NR_FLUSHERS -
+                       NR_GC_THREADS);
+    } else {
+        checkpoint_main();
     }
 
     return NULL;
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -24,6 +25,9 @@
 #include <ublksrv.h>
 #include <ublksrv_aio.h>
 
+/* Each page in the backing file is followed by its OOB metadata. */
+#define UM_PG_STRIDE (FLASH_PG_SIZE + FLASH_PG_META_SIZE)
+
 static int backing_fd = -1;
 static struct ublksrv_aio_ctx* aio_ctx = NULL;
 static struct ublksrv_ctrl_dev* this_dev;
@@ -205,7 +209,7 @@ static void myssd_set_parameters(struct ublksrv_ctrl_dev* cdev,
 {
     struct ublksrv_ctrl_dev_info* info = &cdev->dev_info;
     struct ublk_params p = {
-        .types = UBLK_PARAM_TYPE_BASIC,
+        .types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_DISCARD,
         .basic =
             {
                 .attrs = UBLK_ATTR_VOLATILE_CACHE,
@@ -216,6 +220,13 @@ static void myssd_set_parameters(struct ublksrv_ctrl_dev* cdev,
                 .max_sectors = info->max_io_buf_bytes >> 9,
                 .dev_sectors = dev->tgt.dev_size >> 9,
             },
+        .discard =
+            {
+                .discard_granularity = FLASH_PG_SIZE,
+                .max_discard_sectors = UINT_MAX >> 9,
+                .max_write_zeroes_sectors = UINT_MAX >> 9,
+                .max_discard_segments = 1,
+            },
     };
     int ret;
 
@@ -395,12 +406,12 @@ static int submit_async_io(struct fil_task* task)
     case TXN_READ:
         io_uring_prep_read(sqe, backing_fd, (void*)task->data + task->offset,
                            task->length,
-                           (off_t)ppa * FLASH_PG_SIZE + task->offset);
+                           (off_t)ppa * UM_PG_STRIDE + task->offset);
         break;
     case TXN_WRITE:
         io_uring_prep_write(sqe, backing_fd, (void*)task->data + task->offset,
                             task->length,
-                            (off_t)ppa * FLASH_PG_SIZE + task->offset);
+                            (off_t)ppa * UM_PG_STRIDE + task->offset);
         break;
     }
 
@@ -443,6 +454,21 @@ int submit_flash_transaction(struct flash_transaction* txn)
     return task.status == FTS_ERROR ? EIO : 0;
 }
 
+int submit_flash_transaction_batch(struct flash_transaction** txns,
+                                   unsigned int count, int* status)
+{
+    unsigned int i;
+    int r;
+
+    for (i = 0; i < count; i++) {
+        r = submit_flash_transaction(txns[i]);
+        if (r == ETIMEDOUT) return r;
+        status[i] = r;
+    }
+
+    return 0;
+}
+
 static int reap_uring(struct ublksrv_aio_ctx* ctx, int* got_efd)
 {
     struct io_uring* ring = (struct io_uring*)ctx->ctx_data;
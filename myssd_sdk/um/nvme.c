@@ -59,6 +59,12 @@ static int process_io_command(struct ublksrv_aio* aio)
     case UBLK_IO_OP_FLUSH:
         req.req_type = IOREQ_FLUSH;
         break;
+    case UBLK_IO_OP_DISCARD:
+        req.req_type = IOREQ_DEALLOCATE;
+        break;
+    case UBLK_IO_OP_WRITE_ZEROES:
+        req.req_type = IOREQ_WRITE_ZEROES;
+        break;
     default:
         return -EINVAL;
     }
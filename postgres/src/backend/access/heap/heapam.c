@@ -77,6 +77,7 @@
 
 #ifdef USE_STORPU
 #include <storpu_interface.h>
+/* Initial size of the result buffers of a pipelined in-storage scan. */
 #define SPU_SCAN_BUFSIZE (0x10000)
 #endif
 
@@ -384,17 +385,30 @@ initscan(HeapScanDesc scan, ScanKey key, bool keep_startblock)
 		}
 
 		if (use_storpu) {
-			int max_tuples = (int) (SPU_SCAN_BUFSIZE / (SizeofHeapTupleHeader + sizeof(uint16_t)));
+			/* Compact tuples can be as short as one null bitmap byte. */
+			int max_tuples = (int) (SPU_SCAN_BUFSIZE / (1 + sizeof(uint16_t)));
 
 			if (scan->rs_spu_scan) {
 				storpu_table_endscan(scan->rs_spu_scan);
 				scan->rs_spu_scan = NULL;
 			}
 
-			scan->rs_spu_scan = storpu_table_beginscan(scan->rs_base.rs_rd->storpu_handle, skey, skey ? scan->rs_base.rs_nkeys : 0);
-			scan->rs_spu_buf = (char*)palloc(SPU_SCAN_BUFSIZE);
-			scan->rs_spu_vistuples = (OffsetNumber*)palloc(max_tuples * sizeof(OffsetNumber));
-			scan->rs_spu_max_tuples = max_tuples;
+			if (scan->rs_spu_skey)
+				pfree(scan->rs_spu_skey);
+
+			/*
+			 * The in-storage scan is started at the first fetch so that the
+			 * caller can still set up the projection.
+			 */
+			scan->rs_spu_skey = skey;
+			scan->rs_spu_nkeys = skey ? scan->rs_base.rs_nkeys : 0;
+
+			if (!scan->rs_spu_enabled) {
+				scan->rs_spu_buf = NULL;
+				scan->rs_spu_vistuples = (uint32*)palloc(max_tuples * sizeof(uint32));
+				scan->rs_spu_max_tuples = max_tuples;
+				scan->rs_spu_enabled = true;
+			}
 		}
 	}
 #endif
@@ -580,17 +594,39 @@ heapgetpage_storpu(TableScanDesc sscan)
 	bool		all_visible;
 	off_t offset;
 	size_t count;
+	const char *buf;
+	int			max_tuples;
 
 	snapshot = scan->rs_base.rs_snapshot;
 
-	count = storpu_table_getnext(scan->rs_spu_scan, scan->rs_spu_buf, SPU_SCAN_BUFSIZE);
+	if (!scan->rs_spu_scan)
+		scan->rs_spu_scan = storpu_table_beginscan(scan->rs_base.rs_rd->storpu_handle,
+												   scan->rs_spu_skey, scan->rs_spu_nkeys,
+												   (const uint16_t*)scan->rs_spu_proj,
+												   scan->rs_spu_nproj);
+
+	/*
+	 * The device keeps filling the next buffers while we go through this
+	 * one, and the buffer size follows the selectivity of the scan.
+	 */
+	count = storpu_table_getnext_pipelined(scan->rs_spu_scan, &buf);
 	if (count == (size_t)-1)
 		ereport(ERROR,
 				(errcode(ERRCODE_INTERNAL_ERROR),
 				 errmsg_internal("in-storage table access method returns error")));
 
+	scan->rs_spu_buf = (char *) buf;
 	dp = scan->rs_spu_buf;
 
+	/* Compact tuples can be as short as one null bitmap byte. */
+	max_tuples = (int) (count / (1 + sizeof(uint16_t)));
+	if (max_tuples > scan->rs_spu_max_tuples)
+	{
+		scan->rs_spu_vistuples = (uint32 *) repalloc(scan->rs_spu_vistuples,
+													 max_tuples * sizeof(uint32));
+		scan->rs_spu_max_tuples = max_tuples;
+	}
+
 	ntup = 0;
 	offset = 0;
 
@@ -609,7 +645,8 @@ heapgetpage_storpu(TableScanDesc sscan)
 		loctup.t_len = tlen;
 		ItemPointerSet(&(loctup.t_self), 0, 0);
 
-		if (all_visible)
+		/* Compact tuples have no header and are always visible. */
+		if (all_visible || scan->rs_spu_nproj > 0)
 				valid = true;
 		else
 				valid = HeapTupleSatisfiesVisibility(&loctup, snapshot, InvalidBuffer);
@@ -618,7 +655,7 @@ heapgetpage_storpu(TableScanDesc sscan)
 		/*										&loctup, buffer, snapshot); */
 
 		if (valid)
-				scan->rs_spu_vistuples[ntup++] = (OffsetNumber)offset;
+				scan->rs_spu_vistuples[ntup++] = (uint32)offset;
 
 		offset += 2 + tlen;
 	}
@@ -626,6 +663,68 @@ heapgetpage_storpu(TableScanDesc sscan)
 	Assert(ntup <= scan->rs_spu_max_tuples);
 	scan->rs_spu_ntuples = ntup;
 }
+
+/*
+ * Rebuild a compact tuple returned by a projected in-storage scan into the
+ * slot. Attributes that are not projected are set to NULL.
+ */
+static void
+heap_storpu_store_projected(HeapScanDesc scan, TupleTableSlot *slot)
+{
+	TupleDesc	tupdesc = RelationGetDescr(scan->rs_base.rs_rd);
+	bits8	   *bp = (bits8 *) scan->rs_ctup.t_data;
+	char	   *tp = (char *) bp + BITMAPLEN(scan->rs_spu_nproj);
+	int			i;
+
+	ExecClearTuple(slot);
+
+	memset(slot->tts_isnull, true, tupdesc->natts * sizeof(bool));
+
+	for (i = 0; i < scan->rs_spu_nproj; i++)
+	{
+		AttrNumber	attnum = scan->rs_spu_proj[i];
+		Form_pg_attribute thisatt = TupleDescAttr(tupdesc, attnum - 1);
+
+		if (att_isnull(i, bp))
+			continue;
+
+		/* Attribute data is not aligned in compact tuples. */
+		slot->tts_values[attnum - 1] = fetchatt(thisatt, tp);
+		slot->tts_isnull[attnum - 1] = false;
+		tp = att_addlength_pointer(tp, thisatt->attlen, tp);
+	}
+
+	ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * heap_storpu_set_projection - only fetch the given attributes from an
+ * offloaded scan
+ *
+ * Must be called before the first tuple is fetched.
+ */
+void
+heap_storpu_set_projection(TableScanDesc sscan, const AttrNumber *attrs,
+						   int nattrs)
+{
+	HeapScanDesc scan = (HeapScanDesc) sscan;
+
+	if (!scan->rs_spu_enabled || scan->rs_spu_scan != NULL)
+		return;
+
+	if (scan->rs_spu_proj)
+		pfree(scan->rs_spu_proj);
+
+	scan->rs_spu_proj = NULL;
+	scan->rs_spu_nproj = 0;
+
+	if (nattrs > 0)
+	{
+		scan->rs_spu_proj = (AttrNumber *) palloc(nattrs * sizeof(AttrNumber));
+		memcpy(scan->rs_spu_proj, attrs, nattrs * sizeof(AttrNumber));
+		scan->rs_spu_nproj = nattrs;
+	}
+}
 #endif
 
 /* ----------------
@@ -1379,7 +1478,7 @@ heapgettup_storpu(HeapScanDesc scan)
 	Page		dp;
 	int			lines;
 	int			lineindex;
-	OffsetNumber lineoff;
+	uint32		lineoff;
 	int			linesleft;
 
 	/*
@@ -1597,7 +1696,12 @@ heap_beginscan(Relation relation, Snapshot snapshot,
 #endif
 
 #ifdef USE_STORPU
+	scan->rs_spu_enabled = false;
 	scan->rs_spu_scan = NULL;
+	scan->rs_spu_skey = NULL;
+	scan->rs_spu_nkeys = 0;
+	scan->rs_spu_proj = NULL;
+	scan->rs_spu_nproj = 0;
 #endif
 
 	initscan(scan, key, false);
@@ -1678,10 +1782,14 @@ heap_endscan(TableScanDesc sscan)
 #endif
 
 #ifdef USE_STORPU
-	if (scan->rs_spu_scan) {
-		pfree(scan->rs_spu_buf);
+	if (scan->rs_spu_enabled) {
 		pfree(scan->rs_spu_vistuples);
-		storpu_table_endscan(scan->rs_spu_scan);
+		if (scan->rs_spu_skey)
+			pfree(scan->rs_spu_skey);
+		if (scan->rs_spu_proj)
+			pfree(scan->rs_spu_proj);
+		if (scan->rs_spu_scan)
+			storpu_table_endscan(scan->rs_spu_scan);
 	}
 #endif
 
@@ -1750,7 +1858,7 @@ heap_getnextslot(TableScanDesc sscan, ScanDirection direction, TupleTableSlot *s
 	/* Note: no locking manipulations needed */
 
 #ifdef USE_STORPU
-	if (scan->rs_spu_scan && (direction == ForwardScanDirection)) {
+	if (scan->rs_spu_enabled && (direction == ForwardScanDirection)) {
 		heapgettup_storpu(scan);
 		use_storpu = true;
 	} else
@@ -1773,6 +1881,11 @@ heap_getnextslot(TableScanDesc sscan, ScanDirection direction, TupleTableSlot *s
 
 	pgstat_count_heap_getnext(scan->rs_base.rs_rd);
 
+#ifdef USE_STORPU
+	if (use_storpu && scan->rs_spu_nproj > 0)
+		heap_storpu_store_projected(scan, slot);
+	else
+#endif
 	ExecStoreBufferHeapTuple(&scan->rs_ctup, slot,
 							 scan->rs_cbuf);
 
@@ -33,9 +33,14 @@
 #include "executor/execdebug.h"
 #include "executor/nodeSeqscan.h"
 #include "nodes/nodeFuncs.h"
+#include "optimizer/optimizer.h"
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
 
+#ifdef USE_STORPU
+#include "access/heapam.h"
+#endif
+
 static TupleTableSlot *SeqNext(SeqScanState *node);
 
 /* ----------------------------------------------------------------
@@ -75,6 +80,13 @@ SeqNext(SeqScanState *node)
 								   estate->es_snapshot,
 								   node->sss_NumScanKeys, node->sss_ScanKeys);
 		node->ss.ss_currentScanDesc = scandesc;
+
+#ifdef USE_STORPU
+		if (node->sss_NumProjAttrs > 0 &&
+			scandesc->rs_rd->rd_tableam == GetHeapamTableAmRoutine())
+			heap_storpu_set_projection(scandesc, node->sss_ProjAttrs,
+									   node->sss_NumProjAttrs);
+#endif
 	}
 
 	/*
@@ -215,6 +227,58 @@ ExecTableBuildScanKeys(PlanState *planstate, Relation table,
 	return quals;
 }
 
+/*
+ * Collect the user attributes referenced by the target list and the quals
+ * that are not evaluated in storage. Nothing is projected if a whole-row or
+ * system attribute is referenced.
+ */
+static void
+ExecTableBuildProjection(SeqScan *node, Relation table,
+						 AttrNumber **projAttrs, int *numProjAttrs)
+{
+	Bitmapset  *attrs = NULL;
+	AttrNumber *proj;
+	int			nproj = 0;
+	int			x = -1;
+
+	*projAttrs = NULL;
+	*numProjAttrs = 0;
+
+	pull_varattnos((Node *) node->plan.targetlist, node->scanrelid, &attrs);
+	pull_varattnos((Node *) node->plan.qual, node->scanrelid, &attrs);
+
+	if (bms_is_empty(attrs))
+		return;
+
+	proj = (AttrNumber *) palloc(bms_num_members(attrs) * sizeof(AttrNumber));
+
+	while ((x = bms_next_member(attrs, x)) >= 0)
+	{
+		AttrNumber	attnum = x + FirstLowInvalidHeapAttributeNumber;
+
+		if (attnum <= 0 || attnum > RelationGetNumberOfAttributes(table))
+		{
+			pfree(proj);
+			bms_free(attrs);
+			return;
+		}
+
+		proj[nproj++] = attnum;
+	}
+
+	bms_free(attrs);
+
+	/* Nothing to gain if every attribute is needed. */
+	if (nproj == RelationGetNumberOfAttributes(table))
+	{
+		pfree(proj);
+		return;
+	}
+
+	*projAttrs = proj;
+	*numProjAttrs = nproj;
+}
+
 /* ----------------------------------------------------------------
  *		ExecInitSeqScan
  * ----------------------------------------------------------------
@@ -271,6 +335,10 @@ ExecInitSeqScan(SeqScan *node, EState *estate, int eflags)
 							   &scanstate->sss_ScanKeys,
 							   &scanstate->sss_NumScanKeys);
 
+	ExecTableBuildProjection(node, scanstate->ss.ss_currentRelation,
+							 &scanstate->sss_ProjAttrs,
+							 &scanstate->sss_NumProjAttrs);
+
 	/*
 	 * initialize child expressions
 	 */
@@ -71,11 +71,16 @@ typedef struct HeapScanDescData
 #endif
 
 #ifdef USE_STORPU
-	struct storpu_tablescan* rs_spu_scan;
-	char* rs_spu_buf;
+	bool rs_spu_enabled;	/* scan is offloaded to StorPU */
+	struct storpu_tablescan* rs_spu_scan;	/* started at the first fetch */
+	struct storpu_scankey* rs_spu_skey;
+	int rs_spu_nkeys;
+	AttrNumber* rs_spu_proj;	/* projected attributes, or NULL */
+	int rs_spu_nproj;
+	char* rs_spu_buf;	/* owned by the in-storage scan */
 	int rs_spu_ntuples;
 	int rs_spu_max_tuples;
-	OffsetNumber* rs_spu_vistuples;
+	uint32* rs_spu_vistuples;	/* offsets into rs_spu_buf */
 #endif
 
 	/*
@@ -140,6 +145,10 @@ extern void heap_endscan(TableScanDesc scan);
 extern HeapTuple heap_getnext(TableScanDesc scan, ScanDirection direction);
 extern bool heap_getnextslot(TableScanDesc sscan,
 							 ScanDirection direction, struct TupleTableSlot *slot);
+#ifdef USE_STORPU
+extern void heap_storpu_set_projection(TableScanDesc sscan,
+									   const AttrNumber *attrs, int nattrs);
+#endif
 extern void heap_set_tidrange(TableScanDesc sscan, ItemPointer mintid,
 							  ItemPointer maxtid);
 extern bool heap_getnextslot_tidrange(TableScanDesc sscan,
@@ -1390,6 +1390,8 @@ typedef struct SeqScanState
 	Size		pscan_len;		/* size of parallel heap scan descriptor */
 	struct ScanKeyData *sss_ScanKeys;
 	int			sss_NumScanKeys;
+	AttrNumber *sss_ProjAttrs;	/* attributes used above the scan */
+	int			sss_NumProjAttrs;
 } SeqScanState;
 
 /* ----------------
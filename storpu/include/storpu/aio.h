@@ -0,0 +1,55 @@
+#ifndef _STORPU_AIO_H_
+#define _STORPU_AIO_H_
+
+#include <stddef.h>
+
+#define SPU_AIO_READ      0
+#define SPU_AIO_WRITE     1
+#define SPU_AIO_FSYNC     2
+#define SPU_AIO_FDATASYNC 3
+
+#define SPU_AIO_MAX_EVENTS 1024
+
+typedef unsigned int spu_aio_context_t;
+
+struct spu_iocb {
+    void* data; /* Returned in the completion event as-is. */
+    int opcode;
+    int fd;
+    void* buf;
+    size_t count;
+    unsigned long offset;
+};
+
+struct spu_io_event {
+    void* data;
+    struct spu_iocb* obj;
+    long res; /* Bytes transferred or -errno. */
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /* Returns 0 or a positive error code. */
+    int spu_aio_setup(unsigned int nr_events, spu_aio_context_t* ctxp)
+        __attribute__((weak));
+    int spu_aio_destroy(spu_aio_context_t ctx) __attribute__((weak));
+
+    /* Returns the number of I/O control blocks submitted or -errno if none was
+     * submitted. Buffers must be physically contiguous, i.e., mapped with
+     * MAP_CONTIG. */
+    long spu_aio_submit(spu_aio_context_t ctx, long nr,
+                        struct spu_iocb** iocbpp) __attribute__((weak));
+
+    /* Reap up to nr completion events, waiting for at least min_nr of them
+     * (min_nr = 0 polls). Returns the number of events or -errno. */
+    long spu_aio_getevents(spu_aio_context_t ctx, long min_nr, long nr,
+                           struct spu_io_event* events) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _STORPU_MALLOC_H_
+#define _STORPU_MALLOC_H_
+
+#include <stdint.h>
+
+/* Allocator statistics. Must match NVMeDriver::MallocStats in libunvme.
+ * Counters of the thread caches are folded in when a thread cache exchanges
+ * objects with its CPU arena, so they lag behind by at most a few batches. */
+struct spu_malloc_stats {
+    uint64_t system_bytes;   /* Memory the central heap got from the system. */
+    uint64_t central_in_use; /* Allocated from the central heap, including
+                                objects held in the caches. */
+    uint64_t arena_cached;   /* Free objects in the per-CPU arenas. */
+    uint64_t thread_cached;  /* Free objects in thread caches. */
+
+    uint64_t nr_malloc;
+    uint64_t nr_free;
+    uint64_t nr_large; /* Allocations served by the central heap directly. */
+
+    uint64_t nr_arena_transfers;   /* Thread cache <-> CPU arena batches. */
+    uint64_t nr_central_transfers; /* CPU arena <-> central heap batches. */
+};
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /* Returns 0 or a positive error code. */
+    int spu_malloc_get_stats(struct spu_malloc_stats* stats);
+
+    /* Invoked by the host to write the statistics to the scratchpad at
+     * offset. */
+    unsigned long spu_malloc_stats(unsigned long offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _STORPU_RESULT_RING_H_
+#define _STORPU_RESULT_RING_H_
+
+#include <stddef.h>
+
+/* A result ring is registered by the host in its memory (see
+ * NVMeDriver::ResultRing) and its ID passed to the function that produces the
+ * results. Records are delivered to the host in the order they are appended
+ * and become visible after a flush, which also happens implicitly when the
+ * staging buffer fills up. */
+
+typedef unsigned int spu_result_ring_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /* All functions return 0 or a positive error code. Append blocks while
+     * the ring is full until the host consumes enough records. */
+    int spu_result_ring_append(spu_result_ring_t ring, const void* buf,
+                               size_t len) __attribute__((weak));
+    int spu_result_ring_flush(spu_result_ring_t ring) __attribute__((weak));
+    /* Flush and mark the end of the stream. */
+    int spu_result_ring_close(spu_result_ring_t ring) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,15 +18,22 @@
 #include <string.h>
 #include <storpu.h>
 #include <storpu/file.h>
+#include <storpu/thread.h>
 
 #define roundup(x, align) \
     (((x) % align == 0) ? (x) : (((x) + align) - ((x) % align)))
 
 struct tablescan_state {
+    /* The host may keep several getnext calls in flight. */
+    spu_mutex_t lock;
     TableScanDesc scan;
     SnapshotData snapshot;
     ScanKey scankey;
     unsigned int nscankey;
+    AttrNumber* proj_attrs;
+    unsigned int nproj_attrs;
+    Datum* values;
+    bool* is_null;
     void* buf;
     size_t buf_size;
     size_t total_count;
@@ -156,16 +163,81 @@ struct tablescan_state* storpu_table_beginscan(unsigned long arg)
         state->scankey = NULL;
     }
 
+    if (tbsa.num_proj_attrs > 0) {
+        TupleDesc desc = ((Relation)tbsa.relation)->rd_att;
+
+        state->nproj_attrs = tbsa.num_proj_attrs;
+        state->proj_attrs = malloc(sizeof(AttrNumber) * state->nproj_attrs);
+        spu_read(FD_SCRATCHPAD, state->proj_attrs,
+                 sizeof(AttrNumber) * state->nproj_attrs,
+                 arg + sizeof(tbsa) +
+                     tbsa.num_scankeys * sizeof(struct storpu_scankey));
+
+        state->values = malloc(sizeof(Datum) * desc->natts);
+        state->is_null = malloc(sizeof(bool) * desc->natts);
+    }
+
     state->scan = heap_beginscan(tbsa.relation, &state->snapshot,
                                  state->nscankey, state->scankey);
     heap_rescan(state->scan, NULL);
 
+    spu_mutex_init(&state->lock, NULL);
+
     state->finished = false;
     state->total_count = 0;
 
     return state;
 }
 
+/* Compact tuples only contain the projected attributes: a null bitmap
+ * followed by the unaligned data of non-null attributes. */
+static size_t compact_tuple_size(struct tablescan_state* state)
+{
+    TupleDesc desc = state->scan->rs_rd->rd_att;
+    size_t size = BITMAPLEN(state->nproj_attrs);
+    int i;
+
+    for (i = 0; i < state->nproj_attrs; i++) {
+        AttrNumber attnum = state->proj_attrs[i];
+        Form_pg_attribute attr = TupleDescAttr(desc, attnum - 1);
+
+        if (state->is_null[attnum - 1]) continue;
+
+        size = att_addlength_datum(size, attr->attlen,
+                                   state->values[attnum - 1]);
+    }
+
+    return size;
+}
+
+static void fill_compact_tuple(struct tablescan_state* state, char* data)
+{
+    TupleDesc desc = state->scan->rs_rd->rd_att;
+    uint8_t* bitmap = (uint8_t*)data;
+    int i;
+
+    memset(bitmap, 0, BITMAPLEN(state->nproj_attrs));
+    data += BITMAPLEN(state->nproj_attrs);
+
+    for (i = 0; i < state->nproj_attrs; i++) {
+        AttrNumber attnum = state->proj_attrs[i];
+        Form_pg_attribute attr = TupleDescAttr(desc, attnum - 1);
+        Datum value = state->values[attnum - 1];
+        size_t len;
+
+        if (state->is_null[attnum - 1]) continue;
+
+        bitmap[i >> 3] |= 1 << (i & 0x07);
+
+        len = att_addlength_datum(0, attr->attlen, value);
+        if (attr->attbyval)
+            memcpy(data, &value, len);
+        else
+            memcpy(data, (void*)value, len);
+        data += len;
+    }
+}
+
 size_t storpu_table_getnext(unsigned long arg)
 {
     struct storpu_table_getnext_arg tga;
@@ -174,7 +246,10 @@ size_t storpu_table_getnext(unsigned long arg)
     spu_read(FD_SCRATCHPAD, &tga, sizeof(tga), arg);
     state = (struct tablescan_state*)tga.scan_state;
 
-    if ((state->buf == NULL) || (state->buf_size != tga.buf_size)) {
+    spu_mutex_lock(&state->lock);
+
+    /* Buffer sizes may vary between calls so only grow the staging buffer. */
+    if ((state->buf == NULL) || (state->buf_size < tga.buf_size)) {
         if (state->buf) munmap(state->buf, state->buf_size);
 
         state->buf = mmap(
@@ -183,7 +258,10 @@ size_t storpu_table_getnext(unsigned long arg)
         state->buf_size = tga.buf_size;
     }
 
-    if (state->finished) return 0;
+    if (state->finished) {
+        spu_mutex_unlock(&state->lock);
+        return 0;
+    }
 
     size_t count = 0;
 
@@ -198,17 +276,37 @@ size_t storpu_table_getnext(unsigned long arg)
             break;
         }
 
-        if (count + 2 + htup->t_len > tga.buf_size) {
-            heap_getnext(state->scan, BackwardScanDirection);
-            break;
-        }
+        if (state->nproj_attrs > 0) {
+            size_t len;
 
-        state->total_count++;
+            heap_deform_tuple(htup, state->scan->rs_rd->rd_att, state->values,
+                              state->is_null);
+            len = compact_tuple_size(state);
 
-        *(uint16_t*)(state->buf + count) = htup->t_len;
-        count += 2;
-        memcpy(state->buf + count, htup->t_data, htup->t_len);
-        count += htup->t_len;
+            if (count + 2 + len > tga.buf_size) {
+                heap_getnext(state->scan, BackwardScanDirection);
+                break;
+            }
+
+            state->total_count++;
+
+            *(uint16_t*)(state->buf + count) = len;
+            count += 2;
+            fill_compact_tuple(state, state->buf + count);
+            count += len;
+        } else {
+            if (count + 2 + htup->t_len > tga.buf_size) {
+                heap_getnext(state->scan, BackwardScanDirection);
+                break;
+            }
+
+            state->total_count++;
+
+            *(uint16_t*)(state->buf + count) = htup->t_len;
+            count += 2;
+            memcpy(state->buf + count, htup->t_data, htup->t_len);
+            count += htup->t_len;
+        }
 
         if (count >= tga.buf_size) break;
     }
@@ -216,10 +314,12 @@ size_t storpu_table_getnext(unsigned long arg)
     if (count > 0) {
         size_t copy_count = roundup(count, 64);
 
-        if (copy_count > state->buf_size) copy_count = state->buf_size;
+        if (copy_count > tga.buf_size) copy_count = tga.buf_size;
         spu_write(FD_HOST_MEM, state->buf, copy_count, tga.buf);
     }
 
+    spu_mutex_unlock(&state->lock);
+
     return count;
 }
 
@@ -236,6 +336,10 @@ void storpu_table_endscan(unsigned long arg)
     }
     free(state->scankey);
 
+    free(state->proj_attrs);
+    free(state->values);
+    free(state->is_null);
+
     if (state->buf) munmap(state->buf, state->buf_size);
     free(state);
 }
@@ -255,6 +359,7 @@ struct aggregate_state* storpu_aggregate_init(unsigned long arg)
     struct aggregate_state* state;
     struct tablescan_state* scan;
     AggregateDesc desc;
+    AttrNumber* group_cols = NULL;
     int i;
 
     spu_read(FD_SCRATCHPAD, &aia, sizeof(aia), arg);
@@ -277,10 +382,25 @@ struct aggregate_state* storpu_aggregate_init(unsigned long arg)
         desc[i].attnum = aggdesc[i].attnum;
     }
 
-    state->agg = agg_init(scan->scan, desc, aia.num_aggs, aia.group_size);
+    if (aia.num_group_cols > 0) {
+        group_cols = malloc(aia.num_group_cols * sizeof(AttrNumber));
+        spu_read(FD_SCRATCHPAD, group_cols,
+                 aia.num_group_cols * sizeof(AttrNumber),
+                 arg + sizeof(aia) +
+                     aia.num_aggs * sizeof(struct storpu_aggdesc));
+    }
+
+    state->agg = agg_init(scan->scan, desc, aia.num_aggs, aia.group_size,
+                          group_cols, aia.num_group_cols);
 
     free(aggdesc);
     free(desc);
+    free(group_cols);
+
+    if (!state->agg) {
+        free(state);
+        return NULL;
+    }
 
     return state;
 }
@@ -302,7 +422,7 @@ size_t storpu_aggregate_getnext(unsigned long arg)
         state->buf_size = aga.buf_size;
     }
 
-    if (state->finished) return 0;
+    if (state->finished) return state->agg->error ? STORPU_AGG_ERROR : 0;
 
     size_t count = 0;
     while (true) {
@@ -367,6 +487,8 @@ size_t storpu_aggregate_getnext(unsigned long arg)
 
     if (count > 0) {
         spu_write(FD_HOST_MEM, state->buf, (count > 64) ? count : 64, aga.buf);
+    } else if (state->agg->error) {
+        return STORPU_AGG_ERROR;
     }
 
     return count;
@@ -1,6 +1,7 @@
 #include "catalog.h"
 #include "aggregate.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -33,7 +34,8 @@ static void build_pertrans_for_aggref(AggStatePerTrans pertrans,
 }
 
 AggState* agg_init(TableScanDesc scan, AggregateDesc aggs, int num_aggs,
-                   size_t group_size)
+                   size_t group_size, const AttrNumber* group_cols,
+                   int num_group_cols)
 {
     AggState* aggstate;
     AggStatePerAgg peraggs;
@@ -41,8 +43,14 @@ AggState* agg_init(TableScanDesc scan, AggregateDesc aggs, int num_aggs,
     AggStatePerGroup pergroups;
     int num_trans = num_aggs;
     AttrNumber max_attnum;
+    TupleDesc rel_desc = scan->rs_rd->rd_att;
+    int natts;
     int i;
 
+    for (i = 0; i < num_group_cols; i++) {
+        if (group_cols[i] < 1 || group_cols[i] > rel_desc->natts) return NULL;
+    }
+
     aggstate = malloc(sizeof(AggState));
     memset(aggstate, 0, sizeof(*aggstate));
     aggstate->scan = scan;
@@ -101,7 +109,12 @@ AggState* agg_init(TableScanDesc scan, AggregateDesc aggs, int num_aggs,
         (AggStatePerGroup)malloc(sizeof(AggStatePerGroupData) * num_aggs);
     aggstate->pergroups = pergroups;
 
-    max_attnum = scan->rs_rd->rd_att->natts;
+    for (i = 0; i < num_aggs; i++) {
+        pergroups[i].transValueIsNull = true;
+        pergroups[i].noTransValue = true;
+    }
+
+    max_attnum = rel_desc->natts;
 
     aggstate->max_attnum = max_attnum;
     aggstate->values = malloc(sizeof(Datum) * max_attnum);
@@ -110,13 +123,34 @@ AggState* agg_init(TableScanDesc scan, AggregateDesc aggs, int num_aggs,
     aggstate->aggvalues = malloc(sizeof(Datum) * num_aggs);
     aggstate->aggnulls = malloc(sizeof(bool) * num_aggs);
 
+    if (num_group_cols > 0) {
+        aggstate->num_group_cols = num_group_cols;
+        aggstate->group_cols = malloc(sizeof(AttrNumber) * num_group_cols);
+        memcpy(aggstate->group_cols, group_cols,
+               sizeof(AttrNumber) * num_group_cols);
+
+        aggstate->nbuckets = AGG_HASH_INIT_BUCKETS;
+        aggstate->buckets = calloc(aggstate->nbuckets, sizeof(AggHashEntry));
+    }
+
+    /* Result tuples: grouping columns followed by the aggregates. */
+    natts = num_group_cols + num_aggs;
     aggstate->ResultTupleDesc =
         (TupleDesc)malloc(offsetof(struct TupleDescData, attrs) +
-                          num_aggs * sizeof(FormData_pg_attribute));
-    aggstate->ResultTupleDesc->natts = num_aggs;
+                          natts * sizeof(FormData_pg_attribute));
+    memset(aggstate->ResultTupleDesc, 0,
+           offsetof(struct TupleDescData, attrs) +
+               natts * sizeof(FormData_pg_attribute));
+    aggstate->ResultTupleDesc->natts = natts;
+
+    for (i = 0; i < num_group_cols; i++) {
+        aggstate->ResultTupleDesc->attrs[i] =
+            *TupleDescAttr(rel_desc, group_cols[i] - 1);
+    }
 
     for (i = 0; i < num_aggs; i++) {
-        Form_pg_attribute attr = &aggstate->ResultTupleDesc->attrs[i];
+        Form_pg_attribute attr =
+            &aggstate->ResultTupleDesc->attrs[num_group_cols + i];
         attr->attbyval = peraggs[i].resulttypeByVal;
         attr->attlen = peraggs[i].resulttypeLen;
     }
@@ -210,12 +244,11 @@ static void advance_transition_function(AggState* aggstate,
     pergroupstate->transValueIsNull = fcinfo->isnull;
 }
 
-static void advance_aggregates(AggState* aggstate)
+static void advance_aggregates(AggState* aggstate, AggStatePerGroup pergroups)
 {
     int transno;
     int numTrans = aggstate->numtrans;
     AggStatePerTrans transstates = aggstate->pertrans;
-    AggStatePerGroup pergroups = aggstate->pergroups;
 
     for (transno = 0; transno < numTrans; transno++) {
         AggStatePerTrans pertrans = &transstates[transno];
@@ -277,13 +310,21 @@ static void finalize_aggregates(AggState* aggstate, AggStatePerAgg peraggs,
 
 TupleTableSlot* project_aggregates(AggState* aggstate)
 {
+    int ngrp = aggstate->num_group_cols;
     int i;
 
     ExecClearTuple(aggstate->ResultTupleSlot);
 
+    for (i = 0; i < ngrp; i++) {
+        aggstate->ResultTupleSlot->tts_values[i] = aggstate->grpvalues[i];
+        aggstate->ResultTupleSlot->tts_isnull[i] = aggstate->grpnulls[i];
+    }
+
     for (i = 0; i < aggstate->numaggs; i++) {
-        aggstate->ResultTupleSlot->tts_values[i] = aggstate->aggvalues[i];
-        aggstate->ResultTupleSlot->tts_isnull[i] = aggstate->aggnulls[i];
+        aggstate->ResultTupleSlot->tts_values[ngrp + i] =
+            aggstate->aggvalues[i];
+        aggstate->ResultTupleSlot->tts_isnull[ngrp + i] =
+            aggstate->aggnulls[i];
     }
 
     ExecMaterializeSlot(aggstate->ResultTupleSlot);
@@ -298,12 +339,325 @@ TupleTableSlot* project_aggregates(AggState* aggstate)
     return aggstate->ResultTupleSlot;
 }
 
+static uint32_t hash_bytes(uint32_t hash, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+
+    /* FNV-1a */
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static size_t group_key_size(Form_pg_attribute attr, Datum value)
+{
+    if (attr->attlen == -1) return VARSIZE_ANY(value);
+    if (attr->attlen == -2) return strlen((char*)value) + 1;
+    return attr->attlen;
+}
+
+static uint32_t hash_group_key(AggState* aggstate)
+{
+    TupleDesc desc = aggstate->scan->rs_rd->rd_att;
+    uint32_t hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < aggstate->num_group_cols; i++) {
+        AttrNumber attnum = aggstate->group_cols[i];
+        Form_pg_attribute attr = TupleDescAttr(desc, attnum - 1);
+        Datum value = aggstate->values[attnum - 1];
+
+        if (aggstate->is_null[attnum - 1]) {
+            hash = hash_bytes(hash, &attnum, sizeof(attnum));
+        } else if (attr->attbyval) {
+            hash = hash_bytes(hash, &value, sizeof(value));
+        } else if (attr->attlen == -1) {
+            hash = hash_bytes(hash, VARDATA_ANY(value),
+                              VARSIZE_ANY_EXHDR(value));
+        } else {
+            hash = hash_bytes(hash, (void*)value, group_key_size(attr, value));
+        }
+    }
+
+    return hash;
+}
+
+static bool group_key_equal(AggState* aggstate, AggHashEntry entry)
+{
+    TupleDesc desc = aggstate->scan->rs_rd->rd_att;
+    int i;
+
+    for (i = 0; i < aggstate->num_group_cols; i++) {
+        AttrNumber attnum = aggstate->group_cols[i];
+        Form_pg_attribute attr = TupleDescAttr(desc, attnum - 1);
+        Datum value = aggstate->values[attnum - 1];
+        Datum key = entry->keyvalues[i];
+        bool isnull = aggstate->is_null[attnum - 1];
+
+        if (isnull != entry->keynulls[i]) return false;
+        if (isnull) continue;
+
+        if (attr->attbyval) {
+            if (value != key) return false;
+        } else if (attr->attlen == -1) {
+            size_t len = VARSIZE_ANY_EXHDR(value);
+
+            if (len != VARSIZE_ANY_EXHDR(key) ||
+                memcmp(VARDATA_ANY(value), VARDATA_ANY(key), len) != 0)
+                return false;
+        } else {
+            size_t len = group_key_size(attr, value);
+
+            if (len != group_key_size(attr, key) ||
+                memcmp((void*)value, (void*)key, len) != 0)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static AggHashEntry create_hash_entry(AggState* aggstate, uint32_t hash)
+{
+    TupleDesc desc = aggstate->scan->rs_rd->rd_att;
+    int ngrp = aggstate->num_group_cols;
+    size_t pergroup_size =
+        MAXALIGN(offsetof(AggHashEntryData, pergroup) +
+                 aggstate->numtrans * sizeof(AggStatePerGroupData));
+    size_t size = pergroup_size + ngrp * (sizeof(Datum) + sizeof(bool));
+    AggHashEntry entry;
+    int i;
+
+    entry = malloc(size);
+    if (!entry) return NULL;
+
+    entry->hash = hash;
+    entry->keyvalues = (Datum*)((char*)entry + pergroup_size);
+    entry->keynulls = (bool*)(entry->keyvalues + ngrp);
+
+    for (i = 0; i < ngrp; i++) {
+        AttrNumber attnum = aggstate->group_cols[i];
+        Form_pg_attribute attr = TupleDescAttr(desc, attnum - 1);
+        Datum value = aggstate->values[attnum - 1];
+
+        entry->keynulls[i] = aggstate->is_null[attnum - 1];
+        if (entry->keynulls[i]) {
+            entry->keyvalues[i] = 0;
+            continue;
+        }
+
+        if (!attr->attbyval) size += group_key_size(attr, value);
+        entry->keyvalues[i] = datumCopy(value, attr->attbyval, attr->attlen);
+    }
+
+    initialize_aggregates(aggstate, entry->pergroup);
+
+    aggstate->hash_mem_used += size;
+
+    return entry;
+}
+
+static void free_hash_entry(AggState* aggstate, AggHashEntry entry)
+{
+    TupleDesc desc = aggstate->scan->rs_rd->rd_att;
+    int i;
+
+    for (i = 0; i < aggstate->num_group_cols; i++) {
+        Form_pg_attribute attr =
+            TupleDescAttr(desc, aggstate->group_cols[i] - 1);
+
+        if (!attr->attbyval && !entry->keynulls[i])
+            free((void*)entry->keyvalues[i]);
+    }
+
+    for (i = 0; i < aggstate->numtrans; i++) {
+        AggStatePerTrans pertrans = &aggstate->pertrans[i];
+        AggStatePerGroup pergroup = &entry->pergroup[i];
+
+        if (pertrans->transtypeByVal && !pergroup->transValueIsNull)
+            free((void*)pergroup->transValue);
+    }
+
+    free(entry);
+}
+
+static void grow_hash_table(AggState* aggstate)
+{
+    size_t nbuckets = aggstate->nbuckets << 1;
+    AggHashEntry* buckets;
+    AggHashEntry entry;
+
+    buckets = calloc(nbuckets, sizeof(AggHashEntry));
+    if (!buckets) return;
+
+    for (entry = aggstate->groups; entry; entry = entry->next_group) {
+        size_t bucket = entry->hash & (nbuckets - 1);
+
+        entry->next = buckets[bucket];
+        buckets[bucket] = entry;
+    }
+
+    free(aggstate->buckets);
+    aggstate->buckets = buckets;
+    aggstate->nbuckets = nbuckets;
+}
+
+static void reset_hash_table(AggState* aggstate)
+{
+    AggHashEntry entry, next;
+
+    for (entry = aggstate->groups; entry; entry = next) {
+        next = entry->next_group;
+        free_hash_entry(aggstate, entry);
+    }
+
+    memset(aggstate->buckets, 0, sizeof(AggHashEntry) * aggstate->nbuckets);
+    aggstate->groups = NULL;
+    aggstate->next_output = NULL;
+    aggstate->ngroups = 0;
+    aggstate->hash_mem_used = 0;
+    aggstate->table_filled = false;
+}
+
+/* Find the group of the current input tuple or create one. Returns NULL if
+ * the group does not exist and the table is full. */
+static AggHashEntry lookup_hash_entry(AggState* aggstate)
+{
+    uint32_t hash = hash_group_key(aggstate);
+    size_t bucket = hash & (aggstate->nbuckets - 1);
+    AggHashEntry entry;
+
+    for (entry = aggstate->buckets[bucket]; entry; entry = entry->next) {
+        if (entry->hash == hash && group_key_equal(aggstate, entry))
+            return entry;
+    }
+
+    if (aggstate->ngroups > 0 && aggstate->hash_mem_used >= AGG_HASH_MEM_LIMIT)
+        return NULL;
+
+    entry = create_hash_entry(aggstate, hash);
+    if (!entry) return NULL;
+
+    entry->next = aggstate->buckets[bucket];
+    aggstate->buckets[bucket] = entry;
+    entry->next_group = aggstate->groups;
+    aggstate->groups = entry;
+
+    if (++aggstate->ngroups > aggstate->nbuckets) grow_hash_table(aggstate);
+
+    return entry;
+}
+
+/* Returns ENOMEM if a group cannot be created even in an empty table. */
+static int agg_fill_hash_table(AggState* aggstate)
+{
+    TupleDesc desc = aggstate->scan->rs_rd->rd_att;
+    AggHashEntry entry;
+    HeapTuple htup;
+
+    /* The tuple that did not fit into the table in the last pass goes first.
+     * The table is empty now. */
+    if (aggstate->grp_firstTuple) {
+        heap_deform_tuple(aggstate->grp_firstTuple, desc, aggstate->values,
+                          aggstate->is_null);
+
+        entry = lookup_hash_entry(aggstate);
+        if (!entry) return ENOMEM;
+
+        advance_aggregates(aggstate, entry->pergroup);
+
+        free(aggstate->grp_firstTuple);
+        aggstate->grp_firstTuple = NULL;
+    }
+
+    while ((htup = heap_getnext(aggstate->scan, ForwardScanDirection)) !=
+           NULL) {
+        heap_deform_tuple(htup, desc, aggstate->values, aggstate->is_null);
+
+        entry = lookup_hash_entry(aggstate);
+
+        if (!entry) {
+            if (aggstate->ngroups == 0) return ENOMEM;
+
+            /* Out of memory. Emit the groups collected so far and continue
+             * with an empty table. */
+            aggstate->grp_firstTuple = heap_copytuple(htup);
+            break;
+        }
+
+        advance_aggregates(aggstate, entry->pergroup);
+    }
+
+    if (!htup) aggstate->input_done = true;
+
+    aggstate->table_filled = true;
+    aggstate->next_output = aggstate->groups;
+
+    return 0;
+}
+
+static TupleTableSlot* agg_retrieve_hash_table(AggState* aggstate)
+{
+    AggHashEntry entry = aggstate->next_output;
+    TupleTableSlot* result;
+
+    if (!entry) return NULL;
+
+    aggstate->next_output = entry->next_group;
+
+    finalize_aggregates(aggstate, aggstate->peragg, aggstate->pertrans,
+                        entry->pergroup);
+
+    aggstate->grpvalues = entry->keyvalues;
+    aggstate->grpnulls = entry->keynulls;
+
+    result = project_aggregates(aggstate);
+
+    aggstate->grpvalues = NULL;
+    aggstate->grpnulls = NULL;
+
+    return result;
+}
+
+static TupleTableSlot* agg_getnext_hashed(AggState* aggstate)
+{
+    TupleTableSlot* result;
+    int r;
+
+    while (!aggstate->agg_done) {
+        if (!aggstate->table_filled) {
+            r = agg_fill_hash_table(aggstate);
+            if (r) {
+                aggstate->error = r;
+                aggstate->agg_done = true;
+                break;
+            }
+        }
+
+        result = agg_retrieve_hash_table(aggstate);
+        if (result) return result;
+
+        /* All groups in the table are emitted. */
+        reset_hash_table(aggstate);
+
+        if (aggstate->input_done && !aggstate->grp_firstTuple)
+            aggstate->agg_done = true;
+    }
+
+    return NULL;
+}
+
 TupleTableSlot* agg_getnext(AggState* aggstate)
 {
     AggStatePerAgg peragg;
     AggStatePerGroup pergroups;
     TupleTableSlot* result;
 
+    if (aggstate->num_group_cols > 0) return agg_getnext_hashed(aggstate);
+
     peragg = aggstate->peragg;
     pergroups = aggstate->pergroups;
 
@@ -331,7 +685,7 @@ TupleTableSlot* agg_getnext(AggState* aggstate)
         for (i = 0; i < aggstate->group_size; i++) {
             HeapTuple htup;
 
-            advance_aggregates(aggstate);
+            advance_aggregates(aggstate, pergroups);
 
             if (aggstate->grp_firstTuple) {
                 free(aggstate->grp_firstTuple);
@@ -374,6 +728,12 @@ void agg_end(AggState* aggstate)
         free(pertrans->transfn_fcinfo);
     }
 
+    if (aggstate->num_group_cols > 0) {
+        reset_hash_table(aggstate);
+        free(aggstate->buckets);
+        free(aggstate->group_cols);
+    }
+
     free(aggstate->peragg);
     free(aggstate->pertrans);
     free(aggstate->pergroups);
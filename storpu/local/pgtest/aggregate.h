@@ -51,6 +51,23 @@ typedef struct AggStatePerGroupData {
     bool noTransValue; /* true if transValue not set yet */
 } AggStatePerGroupData;
 
+/* Memory budget for the groups held in the hash table. When exceeded, all
+ * groups are emitted and the table is reset so the same group may be returned
+ * more than once. */
+#define AGG_HASH_MEM_LIMIT    (16UL << 20)
+#define AGG_HASH_INIT_BUCKETS 256
+
+typedef struct AggHashEntryData {
+    struct AggHashEntryData* next; /* next entry in the bucket */
+    struct AggHashEntryData* next_group;
+    uint32_t hash;
+    Datum* keyvalues;
+    bool* keynulls;
+    AggStatePerGroupData pergroup[];
+} AggHashEntryData;
+
+typedef AggHashEntryData* AggHashEntry;
+
 typedef AggStatePerTransData* AggStatePerTrans;
 typedef AggStatePerAggData* AggStatePerAgg;
 typedef AggStatePerGroupData* AggStatePerGroup;
@@ -74,14 +91,35 @@ typedef struct AggState {
     Datum* aggvalues;
     bool* aggnulls;
 
+    /* Hash aggregation, used if there are grouping columns. */
+    int num_group_cols;
+    AttrNumber* group_cols;
+    AggHashEntry* buckets;
+    size_t nbuckets;
+    size_t ngroups;
+    size_t hash_mem_used;
+    AggHashEntry groups;      /* all groups in the table */
+    AggHashEntry next_output; /* next group to be emitted */
+    bool table_filled;
+    Datum* grpvalues; /* grouping columns of the group being projected */
+    bool* grpnulls;
+
     TupleDesc ResultTupleDesc;
     TupleTableSlot* ResultTupleSlot;
+
+    int error; /* set if agg_getnext() stopped because of an error */
 } AggState;
 
 __BEGIN_DECLS
 
+/* If num_group_cols > 0, one tuple (grouping columns followed by the
+ * aggregates) is returned per group and group_size is ignored. Otherwise
+ * every group_size input tuples are aggregated into one result tuple. */
 AggState* agg_init(TableScanDesc scan, AggregateDesc aggs, int num_aggs,
-                   size_t group_size);
+                   size_t group_size, const AttrNumber* group_cols,
+                   int num_group_cols);
+/* Returns NULL at the end of the input or if aggregation fails, in which case
+ * aggstate->error is set. */
 TupleTableSlot* agg_getnext(AggState* aggstate);
 void agg_end(AggState* aggstate);
 
@@ -98,6 +98,8 @@ typedef HeapTupleHeaderData* HeapTupleHeader;
 #define HeapTupleHasVarWidth(tuple) \
     (((tuple)->t_data->t_infomask & HEAP_HASVARWIDTH) != 0)
 
+#define BITMAPLEN(NATTS) (((int)(NATTS) + 7) / 8)
+
 #define HeapTupleAllFixed(tuple) \
     (!((tuple)->t_data->t_infomask & HEAP_HASVARWIDTH))
 
@@ -144,7 +144,7 @@ int main()
         AggState* agg;
         AggregateDescData agg_desc = {.agg_id = 2803, .attnum = 6};
 
-        agg = agg_init(scan, &agg_desc, 1, (size_t)-1);
+        agg = agg_init(scan, &agg_desc, 1, (size_t)-1, NULL, 0);
 
         TupleTableSlot* slot;
 
@@ -7,6 +7,7 @@
 #include <storpu/thread.h>
 #include <storpu/sched.h>
 #include <storpu/file.h>
+#include <storpu/aio.h>
 
 #include <arm_neon.h>
 
@@ -14,6 +15,7 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 #define BLOCK_SIZE (64 << 10UL)
+#define NR_IO_BUFS 4
 
 #define FD_STATS 13
 #define FD_KNN   14
@@ -53,6 +55,15 @@ static void do_stats(int bits, const uint8_t* buf, size_t count, uint64_t* sump,
     *minp = min;
 }
 
+static void prep_read_block(struct spu_iocb* iocb, int fd, unsigned long pos,
+                            unsigned long end)
+{
+    iocb->opcode = SPU_AIO_READ;
+    iocb->fd = fd;
+    iocb->offset = pos;
+    iocb->count = MIN(BLOCK_SIZE, end - pos);
+}
+
 unsigned long stats_workload(unsigned long arg)
 {
     size_t pos;
@@ -61,6 +72,12 @@ unsigned long stats_workload(unsigned long arg)
     uint64_t max;
     uint64_t min;
     cpu_set_t cpuset;
+    spu_aio_context_t aio_ctx;
+    struct spu_iocb iocbs[NR_IO_BUFS];
+    struct spu_iocb* iocbps[NR_IO_BUFS];
+    struct spu_io_event event;
+    long inflight;
+    int i;
 
     struct {
         unsigned long start_offset;
@@ -77,28 +94,54 @@ unsigned long stats_workload(unsigned long arg)
 
     spu_printf("Starting thread %d\n", stats_arg.tid);
     io_buf =
-        mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE,
+        mmap(NULL, BLOCK_SIZE * NR_IO_BUFS, PROT_READ | PROT_WRITE,
              MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_CONTIG, -1, 0);
 
+    if (spu_aio_setup(NR_IO_BUFS, &aio_ctx) != 0) {
+        munmap(io_buf, BLOCK_SIZE * NR_IO_BUFS);
+        return 1;
+    }
+
     sum = 0;
     max = 0;
     min = UINT64_MAX;
 
-    for (pos = stats_arg.start_offset; pos < stats_arg.end_offset;
-         pos += BLOCK_SIZE) {
-        size_t chunk = MIN(BLOCK_SIZE, stats_arg.end_offset - pos);
+    /* Keep NR_IO_BUFS reads in flight and compute on whichever block
+     * completes first. */
+    pos = stats_arg.start_offset;
+    for (i = 0; i < NR_IO_BUFS && pos < stats_arg.end_offset;
+         i++, pos += BLOCK_SIZE) {
+        iocbs[i].buf = io_buf + i * BLOCK_SIZE;
+        prep_read_block(&iocbs[i], FD_STATS, pos, stats_arg.end_offset);
+        iocbps[i] = &iocbs[i];
+    }
 
-        if (pos > stats_arg.start_offset && pos % 0x40000000 == 0)
-            spu_printf("Pos@%d: %lx\n", stats_arg.tid, pos);
+    inflight = i > 0 ? spu_aio_submit(aio_ctx, i, iocbps) : 0;
+
+    while (inflight > 0) {
+        struct spu_iocb* iocb;
 
-        spu_read(FD_STATS, io_buf, chunk, pos);
+        if (spu_aio_getevents(aio_ctx, 1, 1, &event) != 1) break;
+        inflight--;
 
-        do_stats(stats_arg.bits, io_buf, chunk, &sum, &max, &min);
+        iocb = event.obj;
+        if (event.res > 0)
+            do_stats(stats_arg.bits, iocb->buf, event.res, &sum, &max, &min);
+
+        if (pos < stats_arg.end_offset) {
+            if (pos > stats_arg.start_offset && pos % 0x40000000 == 0)
+                spu_printf("Pos@%d: %lx\n", stats_arg.tid, pos);
+
+            prep_read_block(iocb, FD_STATS, pos, stats_arg.end_offset);
+            if (spu_aio_submit(aio_ctx, 1, &iocb) == 1) inflight++;
+            pos += BLOCK_SIZE;
+        }
     }
 
     spu_printf("%lx %lx %lx\n", sum, min, max);
 
-    munmap(io_buf, BLOCK_SIZE);
+    spu_aio_destroy(aio_ctx);
+    munmap(io_buf, BLOCK_SIZE * NR_IO_BUFS);
 
     return 0;
 }
@@ -229,6 +229,10 @@
 #ifdef __STORPU__
 #include <storpu.h>
 
+/* malloc() and friends are provided by the thread caches in tcache.c, which
+ * use this allocator as their central heap. */
+#define USE_DL_PREFIX
+
 #define LACKS_SYS_MMAN_H
 
 #define malloc_getpagesize (4096)
@@ -4680,6 +4684,18 @@ struct mallinfo mALLINFo()
     return mi;
 }
 
+#ifdef __STORPU__
+/* Memory obtained from the system and the part of it that is allocated. */
+void dlmalloc_usage(size_t* system_bytes, size_t* in_use)
+{
+    mstate av = get_malloc_state();
+    struct mallinfo mi = mALLINFo();
+
+    *system_bytes = av->sbrked_mem + av->mmapped_mem;
+    *in_use = av->sbrked_mem - (unsigned int)mi.fordblks + av->mmapped_mem;
+}
+#endif
+
 /*
   ------------------------------ malloc_stats ------------------------------
 */
@@ -0,0 +1,471 @@
+#include <sys/types.h>
+#include <storpu.h>
+#include <storpu/file.h>
+#include <storpu/malloc.h>
+#include <storpu/thread.h>
+#include <errno.h>
+#include <string.h>
+
+/* Thread-caching front end of malloc. Small requests are rounded up to a size
+ * class and served from free lists in a per-thread cache without locking.
+ * Thread caches refill from and spill to per-CPU arenas in batches and the
+ * arenas move batches of objects to and from the central heap (dlmalloc in
+ * malloc.c), so the global heap lock is taken once per batch instead of once
+ * per call. Large requests go to the central heap directly.
+ *
+ * Every object is a dlmalloc chunk of at least its class size, so free() finds
+ * the class of any pointer from the chunk size. This also lets chunks that
+ * were not allocated through a size class, e.g. by memalign(), be recycled
+ * through the caches. */
+
+extern int spu_sched_getcpu(void) __attribute__((weak));
+extern int spu_thread_set_exit_hook(void (*hook)(void)) __attribute__((weak));
+
+void* dlmalloc(size_t);
+void dlfree(void*);
+void* dlrealloc(void*, size_t);
+void* dlmemalign(size_t, size_t);
+size_t dlmalloc_usable_size(void*);
+int dlmalloc_trim(size_t);
+void dlmalloc_usage(size_t* system_bytes, size_t* in_use);
+
+#define NR_SIZE_CLASSES 24
+#define MAX_SMALL_SIZE  2048
+
+/* dlmalloc never pads a request by this much or more. */
+#define CHUNK_SLACK 16
+
+#define MIN_ALIGNMENT 16
+
+/* Matches NR_CPUS of the device. */
+#define NR_ARENAS 4
+
+/* A thread cache keeps up to THREAD_CACHE_BATCHES batches of a class and a
+ * CPU arena up to ARENA_MAX_BATCHES, after which it returns all but
+ * ARENA_KEEP_BATCHES to the central heap. */
+#define THREAD_CACHE_BATCHES 2
+#define ARENA_MAX_BATCHES    8
+#define ARENA_KEEP_BATCHES   4
+
+static const unsigned short class_sizes[NR_SIZE_CLASSES] = {
+    16,  32,  48,  64,  80,  96,   112,  128,  160,  192,  224,  256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+struct free_list {
+    void* head;
+    unsigned int count;
+};
+
+struct thread_cache {
+    struct free_list lists[NR_SIZE_CLASSES];
+    size_t size;
+
+    /* Not yet folded into the arena statistics. */
+    unsigned long nr_malloc;
+    unsigned long nr_free;
+    size_t reported_size;
+};
+
+struct cpu_arena {
+    spu_mutex_t lock;
+    struct free_list lists[NR_SIZE_CLASSES];
+    size_t size;
+
+    unsigned long nr_malloc;
+    unsigned long nr_free;
+    unsigned long nr_transfers;
+    /* Change of the thread cache sizes reported through this arena. Only the
+     * sum over all arenas is meaningful as threads migrate. */
+    size_t thread_cached;
+} __attribute__((aligned(64)));
+
+static __thread struct thread_cache tcache;
+
+/* Library constructors run on the StorPU main thread, which has no thread
+ * pointer to locate TLS through. Its allocations bypass the thread cache. */
+static inline struct thread_cache* current_thread_cache(void)
+{
+    return __builtin_thread_pointer() ? &tcache : NULL;
+}
+
+static struct cpu_arena arenas[NR_ARENAS];
+
+static spu_mutex_t central_lock;
+static unsigned long central_nr_large;
+static unsigned long central_nr_free;
+static unsigned long central_nr_transfers;
+
+/* Smallest class that holds size bytes. Classes are 16 bytes apart up to 128
+ * bytes and then four per power of two. */
+static inline unsigned int size_to_class(size_t size)
+{
+    unsigned int shift;
+
+    if (size <= 128) return size ? (size - 1) >> 4 : 0;
+
+    shift = 63 - __builtin_clzl(size - 1);
+    return 8 + (shift - 7) * 4 + (((size - 1) >> (shift - 2)) & 3);
+}
+
+/* Largest class that fits in a chunk with usable bytes. */
+static inline unsigned int usable_to_class(size_t usable)
+{
+    unsigned int class;
+
+    if (usable >= MAX_SMALL_SIZE) return NR_SIZE_CLASSES - 1;
+
+    class = size_to_class(usable);
+    return class_sizes[class] > usable ? class - 1 : class;
+}
+
+static inline unsigned int class_batch(unsigned int class)
+{
+    unsigned int batch = 4096 / class_sizes[class];
+
+    return batch < 4 ? 4 : batch > 32 ? 32 : batch;
+}
+
+static inline void* list_pop(struct free_list* list)
+{
+    void* p = list->head;
+
+    list->head = *(void**)p;
+    list->count--;
+
+    return p;
+}
+
+static inline void list_push(struct free_list* list, void* p)
+{
+    *(void**)p = list->head;
+    list->head = p;
+    list->count++;
+}
+
+static unsigned int list_move(struct free_list* dst, struct free_list* src,
+                              unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count && src->head; i++)
+        list_push(dst, list_pop(src));
+
+    return i;
+}
+
+static inline struct cpu_arena* current_arena(void)
+{
+    int cpu = spu_sched_getcpu ? spu_sched_getcpu() : 0;
+
+    return &arenas[cpu & (NR_ARENAS - 1)];
+}
+
+/* Must be called with arena->lock held. */
+static unsigned int central_alloc_batch(struct cpu_arena* arena,
+                                        unsigned int class, unsigned int count)
+{
+    unsigned int i;
+    void* p;
+
+    spu_mutex_lock(&central_lock);
+
+    for (i = 0; i < count; i++) {
+        if (!(p = dlmalloc(class_sizes[class]))) break;
+
+        list_push(&arena->lists[class], p);
+    }
+
+    central_nr_transfers++;
+
+    spu_mutex_unlock(&central_lock);
+
+    arena->size += i * class_sizes[class];
+
+    return i;
+}
+
+/* Must be called with arena->lock held. */
+static void central_free_batch(struct cpu_arena* arena, unsigned int class,
+                               unsigned int count)
+{
+    unsigned int i;
+
+    spu_mutex_lock(&central_lock);
+
+    for (i = 0; i < count && arena->lists[class].head; i++)
+        dlfree(list_pop(&arena->lists[class]));
+
+    central_nr_transfers++;
+
+    spu_mutex_unlock(&central_lock);
+
+    arena->size -= i * class_sizes[class];
+}
+
+/* Must be called with arena->lock held. */
+static void fold_thread_stats(struct thread_cache* tc, struct cpu_arena* arena)
+{
+    arena->nr_malloc += tc->nr_malloc;
+    arena->nr_free += tc->nr_free;
+    arena->thread_cached += tc->size - tc->reported_size;
+
+    tc->nr_malloc = tc->nr_free = 0;
+    tc->reported_size = tc->size;
+}
+
+static int thread_cache_refill(struct thread_cache* tc, unsigned int class)
+{
+    struct cpu_arena* arena = current_arena();
+    unsigned int batch = class_batch(class);
+    unsigned int count;
+
+    spu_mutex_lock(&arena->lock);
+
+    if (arena->lists[class].count < batch)
+        central_alloc_batch(arena, class, batch - arena->lists[class].count);
+
+    count = list_move(&tc->lists[class], &arena->lists[class], batch);
+    arena->size -= count * class_sizes[class];
+    tc->size += count * class_sizes[class];
+    arena->nr_transfers++;
+
+    fold_thread_stats(tc, arena);
+
+    spu_mutex_unlock(&arena->lock);
+
+    return count ? 0 : ENOMEM;
+}
+
+static void thread_cache_release(struct thread_cache* tc, unsigned int class,
+                                 unsigned int count)
+{
+    struct cpu_arena* arena = current_arena();
+    unsigned int batch = class_batch(class);
+
+    spu_mutex_lock(&arena->lock);
+
+    count = list_move(&arena->lists[class], &tc->lists[class], count);
+    tc->size -= count * class_sizes[class];
+    arena->size += count * class_sizes[class];
+    arena->nr_transfers++;
+
+    if (arena->lists[class].count > ARENA_MAX_BATCHES * batch)
+        central_free_batch(arena, class,
+                           arena->lists[class].count -
+                               ARENA_KEEP_BATCHES * batch);
+
+    fold_thread_stats(tc, arena);
+
+    spu_mutex_unlock(&arena->lock);
+}
+
+/* Return the cache of an exiting thread to its CPU arena. */
+static void thread_cache_exit(void)
+{
+    struct thread_cache* tc = &tcache;
+    unsigned int class;
+
+    for (class = 0; class < NR_SIZE_CLASSES; class++) {
+        if (tc->lists[class].count)
+            thread_cache_release(tc, class, tc->lists[class].count);
+    }
+}
+
+__attribute__((constructor(101))) static void malloc_init(void)
+{
+    int i;
+
+    spu_mutex_init(&central_lock, NULL);
+
+    for (i = 0; i < NR_ARENAS; i++)
+        spu_mutex_init(&arenas[i].lock, NULL);
+
+    if (spu_thread_set_exit_hook) spu_thread_set_exit_hook(thread_cache_exit);
+}
+
+static void* large_alloc(size_t size, size_t alignment)
+{
+    void* p;
+
+    spu_mutex_lock(&central_lock);
+    p = alignment ? dlmemalign(alignment, size) : dlmalloc(size);
+    if (p) central_nr_large++;
+    spu_mutex_unlock(&central_lock);
+
+    return p;
+}
+
+static void large_free(void* p)
+{
+    spu_mutex_lock(&central_lock);
+    dlfree(p);
+    central_nr_free++;
+    spu_mutex_unlock(&central_lock);
+}
+
+void* malloc(size_t size)
+{
+    struct thread_cache* tc = current_thread_cache();
+    unsigned int class;
+    void* p;
+
+    if (size > MAX_SMALL_SIZE || !tc) return large_alloc(size, 0);
+
+    class = size_to_class(size);
+
+    if (!tc->lists[class].head && thread_cache_refill(tc, class)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    p = list_pop(&tc->lists[class]);
+    tc->size -= class_sizes[class];
+    tc->nr_malloc++;
+
+    return p;
+}
+
+void free(void* p)
+{
+    struct thread_cache* tc = current_thread_cache();
+    unsigned int class;
+    size_t usable;
+
+    if (!p) return;
+
+    usable = dlmalloc_usable_size(p);
+    if (usable >= MAX_SMALL_SIZE + CHUNK_SLACK || !tc) {
+        large_free(p);
+        return;
+    }
+
+    class = usable_to_class(usable);
+
+    list_push(&tc->lists[class], p);
+    tc->size += class_sizes[class];
+    tc->nr_free++;
+
+    if (tc->lists[class].count > THREAD_CACHE_BATCHES * class_batch(class))
+        thread_cache_release(tc, class, class_batch(class));
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    size_t total;
+    void* p;
+
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    p = malloc(total);
+    if (p) memset(p, 0, total);
+
+    return p;
+}
+
+void* realloc(void* p, size_t size)
+{
+    size_t usable;
+    void* q;
+
+    if (!p) return malloc(size);
+
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+
+    usable = dlmalloc_usable_size(p);
+
+    /* Keep the object if it fits without wasting more than half of it. */
+    if (size <= usable && size > usable / 2) return p;
+
+    /* Large chunks may be resized in place. */
+    if (usable >= MAX_SMALL_SIZE + CHUNK_SLACK && size > MAX_SMALL_SIZE) {
+        spu_mutex_lock(&central_lock);
+        q = dlrealloc(p, size);
+        spu_mutex_unlock(&central_lock);
+
+        return q;
+    }
+
+    q = malloc(size);
+    if (!q) return NULL;
+
+    memcpy(q, p, usable < size ? usable : size);
+    free(p);
+
+    return q;
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    if (alignment <= MIN_ALIGNMENT) return malloc(size);
+
+    return large_alloc(size, alignment);
+}
+
+size_t malloc_usable_size(void* p) { return p ? dlmalloc_usable_size(p) : 0; }
+
+int malloc_trim(size_t pad)
+{
+    int r;
+
+    spu_mutex_lock(&central_lock);
+    r = dlmalloc_trim(pad);
+    spu_mutex_unlock(&central_lock);
+
+    return r;
+}
+
+int spu_malloc_get_stats(struct spu_malloc_stats* stats)
+{
+    struct cpu_arena* arena;
+    size_t system_bytes, in_use;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (arena = arenas; arena < arenas + NR_ARENAS; arena++) {
+        spu_mutex_lock(&arena->lock);
+
+        stats->arena_cached += arena->size;
+        stats->thread_cached += arena->thread_cached;
+        stats->nr_malloc += arena->nr_malloc;
+        stats->nr_free += arena->nr_free;
+        stats->nr_arena_transfers += arena->nr_transfers;
+
+        spu_mutex_unlock(&arena->lock);
+    }
+
+    spu_mutex_lock(&central_lock);
+
+    dlmalloc_usage(&system_bytes, &in_use);
+    stats->system_bytes = system_bytes;
+    stats->central_in_use = in_use;
+    stats->nr_large = central_nr_large;
+    stats->nr_malloc += central_nr_large;
+    stats->nr_free += central_nr_free;
+    stats->nr_central_transfers = central_nr_transfers;
+
+    spu_mutex_unlock(&central_lock);
+
+    return 0;
+}
+
+unsigned long spu_malloc_stats(unsigned long offset)
+{
+    struct spu_malloc_stats stats;
+    ssize_t n;
+    int r;
+
+    r = spu_malloc_get_stats(&stats);
+    if (r) return r;
+
+    n = spu_write(FD_SCRATCHPAD, &stats, sizeof(stats), offset);
+    if (n < 0) return -n;
+
+    return n == sizeof(stats) ? 0 : EFAULT;
+}